@@ -0,0 +1,3954 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "raylib.h"
+#include "raymath.h"
+#include <omp.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define BOIDS_X86 1
+#endif
+
+#include "boids.h"
+#include "hugealloc.h"
+#include "philox.h"
+#include "simparams.h"
+#include "timeit.h"
+#include "workpool.h"
+
+#define WORLD_SIZE 10000
+
+#define MIN_VELOCITY 10
+#define MAX_VELOCITY 30
+#define MAX_ACCELERATION 1
+
+#define PERCEPTION_RADIUS 50
+#define GRID_RESOLUTION 50
+
+#define ALIGNMENT_WEIGHT 0.1f
+#define COHESION_WEIGHT 0.03f
+#define SEPARATION_WEIGHT 50
+#define WANDER_WEIGHT 0
+
+static const char *gridWrapNames[] = {"modulo", "mask", "table"};
+
+static const char *flockKernelNames[] = {"scalar", "soa", "sse", "avx2", "avx512", "q16", "q32"};
+
+typedef struct {
+    Vector2 position;
+    Vector2 velocity;
+} Boid;
+
+typedef struct {
+    Vector2 velocitiesSum;
+    Vector2 positionsSum;
+    Vector2 oppositeDirectionsSum;
+    int size;
+} LocalFlock;
+
+typedef struct {
+    int *boids;
+    int size;
+} GridCell;
+
+typedef struct {
+    int *cellStart;       // gridHeight * gridWidth + 1 offsets into cellBoids, a cell may fill up to the next start
+    int *cellEnd;         // end of the occupied part of each cell, the next start when there is no slack
+    int *cellBoids;       // boid indices grouped by cell, each cell is a slice
+    int *boidCell;        // cell index of each boid, filled by the histogram pass
+    int *threadCounts;    // per-thread cell histograms, turned into scatter cursors
+    int *blockSums;       // per-thread sums of a block of cells, used by the prefix sum
+    // incremental maintenance, only allocated with cellSlack > 0
+    int *boidSlot;        // position of each boid in cellBoids
+    int *migrations;      // boids that left their cell, thread t writes from its first boid on
+    int *migrationCells;  // the cell they moved to
+    int *migrationCounts; // per-thread number of migrations
+    int overflow;         // some cell ran out of slack during an update
+    long fallbackRebuilds;
+    int cellSlack;        // free slots every cell gets on top of migrationLimit of its size
+    float migrationLimit; // fraction of the boids that may change cell before BoidGridUpdate rebuilds instead
+    int canonical;        // BoidGridUpdate puts the cells it touched back in index order, like BoidGridBuild
+    int *neighborCells;   // GRID_WRAP_TABLE only, the 9 cells around every cell in GetLocalFlock order
+    GridWrap wrap;
+    long cellBoidsCapacity;
+    int maxThreads;
+    int boidCapacity;
+    int gridResolution;
+    int gridHeight;
+    int gridWidth;
+} BoidGrid;
+
+/**
+ * @param cellSlack 0 for a packed grid that can only be rebuilt, otherwise the number of spare slots
+ * per cell that BoidGridUpdate fills before it falls back to a full rebuild.
+ * @param migrationLimit the fraction of the boids that may change cell in a BoidGridUpdate, every cell also
+ * gets that fraction of its size as slack.
+ */
+BoidGrid BoidGridAlloc(int resolution, int height, int width, int boidCapacity, int maxThreads, int cellSlack,
+                       float migrationLimit, HugePageMode *hugePages) {
+    const size_t cellCount = (size_t) height * width;
+    const long cellBoidsCapacity = cellSlack > 0 ? boidCapacity + (long) (boidCapacity * (double) migrationLimit) +
+                                                   (long) cellCount * cellSlack
+                                                 : boidCapacity;
+    BoidGrid grid = {
+        .cellStart = malloc((cellCount + 1) * sizeof(int)),
+        .cellEnd = malloc(cellCount * sizeof(int)),
+        .cellBoids = HugeAlloc(cellBoidsCapacity * sizeof(int), hugePages),
+        .boidCell = HugeAlloc(boidCapacity * sizeof(int), hugePages),
+        .threadCounts = malloc(maxThreads * cellCount * sizeof(int)),
+        .blockSums = malloc(maxThreads * sizeof(int)),
+        .cellSlack = cellSlack,
+        .migrationLimit = migrationLimit,
+        .cellBoidsCapacity = cellBoidsCapacity,
+        .maxThreads = maxThreads,
+        .boidCapacity = boidCapacity,
+        .gridResolution = resolution,
+        .gridHeight = height,
+        .gridWidth = width
+    };
+    int incrementalFailed = 0;
+    if (cellSlack > 0) {
+        grid.boidSlot = HugeAlloc(boidCapacity * sizeof(int), hugePages);
+        grid.migrations = HugeAlloc(boidCapacity * sizeof(int), hugePages);
+        grid.migrationCells = HugeAlloc(boidCapacity * sizeof(int), hugePages);
+        grid.migrationCounts = malloc(maxThreads * sizeof(int));
+        incrementalFailed = grid.boidSlot == NULL || grid.migrations == NULL || grid.migrationCells == NULL ||
+                            grid.migrationCounts == NULL;
+    }
+
+    if (grid.cellStart == NULL || grid.cellEnd == NULL || grid.cellBoids == NULL || grid.boidCell == NULL ||
+        grid.threadCounts == NULL || grid.blockSums == NULL || incrementalFailed) {
+        perror("Failed to allocate grid");
+        free(grid.cellStart);
+        free(grid.cellEnd);
+        HugeFree(grid.cellBoids, cellBoidsCapacity * sizeof(int));
+        HugeFree(grid.boidCell, boidCapacity * sizeof(int));
+        free(grid.threadCounts);
+        free(grid.blockSums);
+        HugeFree(grid.boidSlot, boidCapacity * sizeof(int));
+        HugeFree(grid.migrations, boidCapacity * sizeof(int));
+        HugeFree(grid.migrationCells, boidCapacity * sizeof(int));
+        free(grid.migrationCounts);
+        return (BoidGrid){.cellStart = NULL};
+    }
+
+    // an empty grid until the first build
+    memset(grid.cellStart, 0, (cellCount + 1) * sizeof(int));
+    memset(grid.cellEnd, 0, cellCount * sizeof(int));
+
+    return grid;
+}
+
+void BoidGridFree(BoidGrid *grid) {
+    if (grid == NULL || grid->cellStart == NULL) return;
+
+    free(grid->cellStart);
+    free(grid->cellEnd);
+    HugeFree(grid->cellBoids, grid->cellBoidsCapacity * sizeof(int));
+    HugeFree(grid->boidCell, grid->boidCapacity * sizeof(int));
+    free(grid->threadCounts);
+    free(grid->blockSums);
+    HugeFree(grid->boidSlot, grid->boidCapacity * sizeof(int));
+    HugeFree(grid->migrations, grid->boidCapacity * sizeof(int));
+    HugeFree(grid->migrationCells, grid->boidCapacity * sizeof(int));
+    free(grid->migrationCounts);
+    free(grid->neighborCells);
+
+    grid->cellStart = NULL;
+}
+
+static inline int IsPowerOfTwo(int value) {
+    return value > 0 && (value & (value - 1)) == 0;
+}
+
+/**
+ * @return the fastest wrap for the grid: masks for power of two dimensions, the neighbour table otherwise.
+ */
+GridWrap BoidGridDefaultWrap(const BoidGrid *grid) {
+    return IsPowerOfTwo(grid->gridHeight) && IsPowerOfTwo(grid->gridWidth) ? GRID_WRAP_MASK : GRID_WRAP_TABLE;
+}
+
+/**
+ * @brief Parses a wrap name, "auto" is -1 for BoidGridDefaultWrap.
+ * @return the wrap, -1 for auto, or -2 if the name is unknown.
+ */
+int GridWrapParse(const char *name) {
+    if (strcmp(name, "auto") == 0) return -1;
+    for (int wrap = GRID_WRAP_MODULO; wrap <= GRID_WRAP_TABLE; wrap++) {
+        if (strcmp(name, gridWrapNames[wrap]) == 0) return wrap;
+    }
+    return -2;
+}
+
+/**
+ * @brief Selects how the neighbour searches wrap around the world, building the neighbour table if needed.
+ * @return 0, or -1 if the grid can't use the wrap.
+ */
+int BoidGridSetWrap(BoidGrid *grid, GridWrap wrap) {
+    const int height = grid->gridHeight, width = grid->gridWidth;
+    if (wrap == GRID_WRAP_MASK && (!IsPowerOfTwo(height) || !IsPowerOfTwo(width))) {
+        fprintf(stderr, "Wrapping with masks needs a power of two number of cells per side, not %dx%d\n",
+                height, width);
+        return -1;
+    }
+
+    if (wrap == GRID_WRAP_TABLE && grid->neighborCells == NULL) {
+        grid->neighborCells = malloc((size_t) height * width * 9 * sizeof(int));
+        if (grid->neighborCells == NULL) {
+            perror("Failed to allocate neighbour table");
+            return -1;
+        }
+        for (int row = 0; row < height; row++) {
+            for (int col = 0; col < width; col++) {
+                int *cells = grid->neighborCells + (size_t) (row * width + col) * 9;
+                for (int dcol = -1; dcol <= 1; dcol++) {
+                    for (int drow = -1; drow <= 1; drow++) {
+                        *cells++ = (row + drow + height) % height * width + (col + dcol + width) % width;
+                    }
+                }
+            }
+        }
+    }
+    grid->wrap = wrap;
+    return 0;
+}
+
+static inline int BoidGridCellIndex(const BoidGrid *grid, Vector2 position) {
+    int row = (int) (position.x / grid->gridResolution) % grid->gridHeight;
+    int col = (int) (position.y / grid->gridResolution) % grid->gridWidth;
+    return row * grid->gridWidth + col;
+}
+
+static inline GridCell BoidGridCellAt(const BoidGrid *grid, int cell) {
+    return (GridCell){
+        .boids = grid->cellBoids + grid->cellStart[cell],
+        .size = grid->cellEnd[cell] - grid->cellStart[cell]
+    };
+}
+
+static inline GridCell BoidGridGetCell(const BoidGrid *grid, int row, int col) {
+    return BoidGridCellAt(grid, row * grid->gridWidth + col);
+}
+
+/**
+ * @brief Index of the cell drow, dcol away from (row, col), wrapped around the world. neighbors is the
+ * table row of the home cell for GRID_WRAP_TABLE, k the position in the 3x3 neighbourhood. wrap is a
+ * constant in the specialised kernels, so only one branch survives.
+ */
+static inline __attribute__((always_inline)) int BoidGridWrapCell(const BoidGrid *grid, int row, int col,
+                                                                  int drow, int dcol, GridWrap wrap,
+                                                                  const int *neighbors, int k) {
+    if (wrap == GRID_WRAP_TABLE) {
+        return neighbors[k];
+    } else if (wrap == GRID_WRAP_MASK) {
+        return ((row + drow) & (grid->gridHeight - 1)) * grid->gridWidth + ((col + dcol) & (grid->gridWidth - 1));
+    }
+
+    // if gridRol > gridHeight we get a segfault, so we wrap the grid
+    int gridRow = (row + drow) % grid->gridHeight;
+    if (gridRow < 0) gridRow += grid->gridHeight;
+
+    int gridCol = (col + dcol) % grid->gridWidth;
+    if (gridCol < 0) gridCol += grid->gridWidth;
+
+    return gridRow * grid->gridWidth + gridCol;
+}
+
+/**
+ * @return the neighbour table row of the cell holding (row, col). A boid sitting exactly on the far
+ * edge of the world is one row or col past the grid, which wraps to the first one.
+ */
+static inline const int *BoidGridNeighborTable(const BoidGrid *grid, int row, int col) {
+    if (row >= grid->gridHeight) row -= grid->gridHeight;
+    if (col >= grid->gridWidth) col -= grid->gridWidth;
+    return grid->neighborCells + (size_t) (row * grid->gridWidth + col) * 9;
+}
+
+static inline int BoidGridCellCapacity(const BoidGrid *grid, int size) {
+    return grid->cellSlack > 0 ? size + (int) (size * grid->migrationLimit) + grid->cellSlack : size;
+}
+
+/**
+ * @brief Rebuilds the grid from scratch with a parallel counting sort.
+ *
+ * Must be reached by every thread of the enclosing parallel region or worker pool. Each
+ * thread histograms the cells of a static slice of the boids, a two-level prefix sum over
+ * the histograms gives every thread its own write cursor per cell, and the same
+ * slices are then scattered into cellBoids. Boids inside a cell stay in index order
+ * and cells have no capacity limit, so no boid is ever dropped. The scatter is only
+ * visible to the other threads after the caller's next barrier.
+ */
+static void BoidGridBuildNowait(BoidGrid *grid, const Boid *boids, int boidCount) {
+    const int cellCount = grid->gridHeight * grid->gridWidth;
+    const int threadId = TeamThreadNum();
+    const int threadCount = TeamNumThreads();
+    assert(threadCount <= grid->maxThreads && boidCount <= grid->boidCapacity);
+
+    const int first = (int) ((long) boidCount * threadId / threadCount);
+    const int last = (int) ((long) boidCount * (threadId + 1) / threadCount);
+    const int firstCell = (int) ((long) cellCount * threadId / threadCount);
+    const int lastCell = (int) ((long) cellCount * (threadId + 1) / threadCount);
+    int *counts = grid->threadCounts + (size_t) threadId * cellCount;
+
+    // 1. per-thread histogram of the cells
+    PROFILE_SCOPE("histogram") {
+        memset(counts, 0, cellCount * sizeof(int));
+        for (int i = first; i < last; i++) {
+            int cell = BoidGridCellIndex(grid, boids[i].position);
+            grid->boidCell[i] = cell;
+            counts[cell]++;
+        }
+    }
+    TeamBarrier();
+
+    // 2. exclusive scan of the cell capacities, first inside each thread's block of cells...
+    int blockSum = 0;
+    for (int cell = firstCell; cell < lastCell; cell++) {
+        int size = 0;
+        for (int t = 0; t < threadCount; t++) {
+            size += grid->threadCounts[(size_t) t * cellCount + cell];
+        }
+        grid->cellStart[cell] = blockSum;
+        blockSum += BoidGridCellCapacity(grid, size);
+    }
+    grid->blockSums[threadId] = blockSum;
+    TeamBarrier();
+
+    // ...then offset by the preceding blocks and split each cell between the threads
+    int blockOffset = 0;
+    for (int t = 0; t < threadId; t++) {
+        blockOffset += grid->blockSums[t];
+    }
+    for (int cell = firstCell; cell < lastCell; cell++) {
+        int cursor = grid->cellStart[cell] + blockOffset;
+        grid->cellStart[cell] = cursor;
+        for (int t = 0; t < threadCount; t++) {
+            int *count = &grid->threadCounts[(size_t) t * cellCount + cell];
+            int size = *count;
+            *count = cursor;
+            cursor += size;
+        }
+        grid->cellEnd[cell] = cursor;
+    }
+    if (threadId == threadCount - 1) {
+        grid->cellStart[cellCount] = blockOffset + blockSum;
+    }
+    TeamBarrier();
+
+    // 3. scatter, the cursors already account for the threads before us
+    PROFILE_SCOPE("scatter") {
+        for (int i = first; i < last; i++) {
+            int slot = counts[grid->boidCell[i]]++;
+            grid->cellBoids[slot] = i;
+            if (grid->boidSlot != NULL) grid->boidSlot[i] = slot;
+        }
+    }
+}
+
+/**
+ * @brief BoidGridBuildNowait and the barrier that publishes its scatter.
+ */
+void BoidGridBuild(BoidGrid *grid, const Boid *boids, int boidCount) {
+    BoidGridBuildNowait(grid, boids, boidCount);
+    TeamBarrier();
+}
+
+/**
+ * @brief Puts the boids of a cell back in index order. Insertion sort, only a few boids of a cell move per frame.
+ */
+static void BoidGridSortCell(BoidGrid *grid, int cell) {
+    int *cellBoids = grid->cellBoids;
+    for (int j = grid->cellStart[cell] + 1; j < grid->cellEnd[cell]; j++) {
+        const int boid = cellBoids[j];
+        int k = j;
+        for (; k > grid->cellStart[cell] && cellBoids[k - 1] > boid; k--) {
+            cellBoids[k] = cellBoids[k - 1];
+            grid->boidSlot[cellBoids[k]] = k;
+        }
+        cellBoids[k] = boid;
+        grid->boidSlot[boid] = k;
+    }
+}
+
+/**
+ * @brief Brings a grid allocated with slack up to date by moving only the boids that changed cell.
+ *
+ * Every thread collects the migrations of its static slice of boids. Each thread then owns a block
+ * of cells: first it removes the leaving boids from its cells (swapping the last boid into the
+ * hole), then, after a barrier, it appends the arriving ones. Falls back to BoidGridBuild when more
+ * than migrationLimit of the boids moved or a cell runs out of slack. A canonical grid sorts the cells it
+ * touched afterwards, so it ends up the same as a rebuild. Must be reached by every thread.
+ *
+ * Only pays off for slow flocks. On one thread it takes about as long as a rebuild once a tenth of the
+ * boids change cell, which is where the default limit of an eighth sits. At the default speeds more
+ * than a third of the boids change cell every frame, the update loses even without falling back.
+ *
+ * @return the number of boids that changed cell, the same on every thread.
+ */
+int BoidGridUpdate(BoidGrid *grid, const Boid *boids, int boidCount) {
+    const int cellCount = grid->gridHeight * grid->gridWidth;
+    const int threadId = omp_get_thread_num();
+    const int threadCount = omp_get_num_threads();
+    assert(grid->cellSlack > 0);
+
+    const int first = (int) ((long) boidCount * threadId / threadCount);
+    const int last = (int) ((long) boidCount * (threadId + 1) / threadCount);
+    const int firstCell = (int) ((long) cellCount * threadId / threadCount);
+    const int lastCell = (int) ((long) cellCount * (threadId + 1) / threadCount);
+
+    // 1. per-thread migration buffers, each a part of the shared arrays starting at the thread's first boid
+    int count = 0;
+    for (int i = first; i < last; i++) {
+        int cell = BoidGridCellIndex(grid, boids[i].position);
+        if (cell != grid->boidCell[i]) {
+            grid->migrations[first + count] = i;
+            grid->migrationCells[first + count] = cell;
+            count++;
+        }
+    }
+    grid->migrationCounts[threadId] = count;
+    grid->overflow = 0;
+#pragma omp barrier
+
+    int total = 0;
+    for (int t = 0; t < threadCount; t++) {
+        total += grid->migrationCounts[t];
+    }
+    if (total > (double) boidCount * grid->migrationLimit) {
+        if (threadId == 0) grid->fallbackRebuilds++;
+        BoidGridBuild(grid, boids, boidCount);
+        return total;
+    }
+
+    // 2. removals from the cells we own, in boid order so the result doesn't depend on the thread count
+    for (int t = 0; t < threadCount; t++) {
+        const int base = (int) ((long) boidCount * t / threadCount);
+        for (int k = base; k < base + grid->migrationCounts[t]; k++) {
+            const int boid = grid->migrations[k];
+            const int cell = grid->boidCell[boid];
+            if (cell < firstCell || cell >= lastCell) continue;
+
+            const int moved = grid->cellBoids[--grid->cellEnd[cell]];
+            grid->cellBoids[grid->boidSlot[boid]] = moved;
+            grid->boidSlot[moved] = grid->boidSlot[boid];
+        }
+    }
+    for (int t = 0; grid->canonical && t < threadCount; t++) {
+        const int base = (int) ((long) boidCount * t / threadCount);
+        for (int k = base; k < base + grid->migrationCounts[t]; k++) {
+            const int cell = grid->boidCell[grid->migrations[k]];
+            if (cell >= firstCell && cell < lastCell) BoidGridSortCell(grid, cell);
+        }
+    }
+#pragma omp barrier
+
+    // 3. insertions into the cells we own
+    for (int t = 0; t < threadCount; t++) {
+        const int base = (int) ((long) boidCount * t / threadCount);
+        for (int k = base; k < base + grid->migrationCounts[t]; k++) {
+            const int boid = grid->migrations[k];
+            const int cell = grid->migrationCells[k];
+            if (cell < firstCell || cell >= lastCell) continue;
+
+            if (grid->cellEnd[cell] == grid->cellStart[cell + 1]) {
+                PROFILE_COUNT("cell_overflows", 1);
+                grid->overflow = 1;
+                continue;
+            }
+            grid->boidSlot[boid] = grid->cellEnd[cell]++;
+            grid->cellBoids[grid->boidSlot[boid]] = boid;
+            grid->boidCell[boid] = cell;
+            if (grid->canonical) BoidGridSortCell(grid, cell);
+        }
+    }
+#pragma omp barrier
+
+    if (grid->overflow) {
+        if (threadId == 0) grid->fallbackRebuilds++;
+        BoidGridBuild(grid, boids, boidCount);
+    }
+    return total;
+}
+
+void UpdateBoid(const SimParams *params, Boid *boid, Vector2 acceleration) {
+    boid->position = Vector2Add(boid->position, boid->velocity);
+    boid->position.x = Wrap(boid->position.x, 0, params->worldSize);
+    boid->position.y = Wrap(boid->position.y, 0, params->worldSize);
+    boid->velocity = Vector2Add(boid->velocity, acceleration);
+    //boid->velocity = Vector2ClampValue(boid->velocity, -MAX_VELOCITY, MAX_VELOCITY);
+    float speedSqr = Vector2LengthSqr(boid->velocity);
+    if (speedSqr > params->maxVelocity * params->maxVelocity) {
+        boid->velocity = Vector2Scale(Vector2Normalize(boid->velocity), params->maxVelocity);
+    } else if (speedSqr < params->minVelocity * params->minVelocity) {
+        boid->velocity = Vector2Scale(Vector2Normalize(boid->velocity), params->minVelocity);
+    }
+}
+
+/**
+ * @brief Adds the candidates within radius of boid current to its flock, boid k is the state at
+ * states + k * stride. The boid arrays pass BOIDS_STATE_FLOATS, BoidsFlockAccumulate any record.
+ * separation is a constant of every caller, the loop is compiled for one rule only.
+ */
+static inline __attribute__((always_inline)) void LocalFlockAccumulateStrided(const float *states, size_t stride,
+                                                                              int current, const int *candidates,
+                                                                              int count, LocalFlock *flock,
+                                                                              float radius,
+                                                                              BoidsSeparation separation) {
+    const Vector2 position = {states[current * stride], states[current * stride + 1]};
+    for (int i = 0; i < count; i++) {
+        const float *other = states + candidates[i] * stride;
+        const Vector2 otherPosition = {other[0], other[1]};
+        float dist = Vector2DistanceSqr(otherPosition, position);
+        if (dist < radius * radius && current != candidates[i]) {
+            flock->velocitiesSum = Vector2Add(flock->velocitiesSum, (Vector2){other[2], other[3]});
+            flock->positionsSum = Vector2Add(flock->positionsSum, otherPosition);
+            Vector2 oppositeDirection = Vector2Subtract(position, otherPosition);
+            if (separation == BOIDS_SEPARATION_SERIAL) {
+                if (dist > 0.0001f) {
+                    oppositeDirection = Vector2Scale(oppositeDirection, 1.0f / dist);
+                    flock->oppositeDirectionsSum = Vector2Add(flock->oppositeDirectionsSum, oppositeDirection);
+                }
+            } else if (dist > 0.01f) {
+                oppositeDirection = Vector2Scale(oppositeDirection, 1.0 / pow(Vector2Length(oppositeDirection), 2));
+                flock->oppositeDirectionsSum = Vector2Add(flock->oppositeDirectionsSum, oppositeDirection);
+            }
+            flock->size++;
+        }
+    }
+}
+
+static inline __attribute__((always_inline)) void LocalFlockAccumulate(const Boid *boids, int current,
+                                                                       const int *candidates, int count,
+                                                                       LocalFlock *flock, float radius) {
+    LocalFlockAccumulateStrided((const float *) boids, BOIDS_STATE_FLOATS, current, candidates, count, flock,
+                                radius, BOIDS_SEPARATION_PARALLEL);
+}
+
+static inline __attribute__((always_inline)) void GetLocalFlockWrapped(Boid *boids, int current, BoidGrid *grid,
+                                                                       int range, LocalFlock *flock, float radius,
+                                                                       GridWrap wrap, BoidsSeparation separation) {
+    const Vector2 position = boids[current].position;
+    const int row = position.x / grid->gridResolution;
+    const int col = position.y / grid->gridResolution;
+    const int *neighbors = wrap == GRID_WRAP_TABLE ? BoidGridNeighborTable(grid, row, col) : NULL;
+    flock->positionsSum = (Vector2){0, 0};
+    flock->velocitiesSum = (Vector2){0, 0};
+    flock->oppositeDirectionsSum = (Vector2){0, 0};
+    flock->size = 0;
+
+    int k = 0;
+    for (int dcol = -range; dcol <= range; dcol++) {
+        for (int drow = -range; drow <= range; drow++, k++) {
+            GridCell cell = BoidGridCellAt(grid, BoidGridWrapCell(grid, row, col, drow, dcol, wrap, neighbors, k));
+            PROFILE_COUNT("neighbor_candidates", cell.size);
+            LocalFlockAccumulateStrided((const float *) boids, BOIDS_STATE_FLOATS, current, cell.boids, cell.size,
+                                        flock, radius, separation);
+        }
+    }
+    PROFILE_COUNT("neighbors_accepted", flock->size);
+}
+
+/**
+ * @brief Generic neighbour search, works for any grid and range.
+ */
+void GetLocalFlock(Boid *boids, int current, BoidGrid *grid, int range, LocalFlock *flock, float radius) {
+    GetLocalFlockWrapped(boids, current, grid, range, flock, radius, GRID_WRAP_MODULO, BOIDS_SEPARATION_PARALLEL);
+}
+
+/**
+ * @brief GetLocalFlock with the separation rule of the old serial main, on the wrap it used.
+ */
+static void GetLocalFlockSerial(Boid *boids, int current, BoidGrid *grid, int range, LocalFlock *flock,
+                                float radius) {
+    GetLocalFlockWrapped(boids, current, grid, range, flock, radius, GRID_WRAP_MODULO, BOIDS_SEPARATION_SERIAL);
+}
+
+// the specialisations visit the same cells in the same order, so the sums are identical
+static void GetLocalFlockMask(Boid *boids, int current, BoidGrid *grid, int range, LocalFlock *flock,
+                              float radius) {
+    GetLocalFlockWrapped(boids, current, grid, range, flock, radius, GRID_WRAP_MASK, BOIDS_SEPARATION_PARALLEL);
+}
+
+static void GetLocalFlockMaskRange1(Boid *boids, int current, BoidGrid *grid, int range, LocalFlock *flock,
+                                    float radius) {
+    (void) range;
+    GetLocalFlockWrapped(boids, current, grid, 1, flock, radius, GRID_WRAP_MASK, BOIDS_SEPARATION_PARALLEL);
+}
+
+static void GetLocalFlockTableRange1(Boid *boids, int current, BoidGrid *grid, int range, LocalFlock *flock,
+                                     float radius) {
+    (void) range;
+    GetLocalFlockWrapped(boids, current, grid, 1, flock, radius, GRID_WRAP_TABLE, BOIDS_SEPARATION_PARALLEL);
+}
+
+typedef void (*LocalFlockFunction)(Boid *boids, int current, BoidGrid *grid, int range, LocalFlock *flock,
+                                   float radius);
+
+/**
+ * @return the GetLocalFlock specialised for the separation rule, the wrap of the grid and the range, or the
+ * generic one.
+ */
+LocalFlockFunction LocalFlockFunctionFor(const BoidGrid *grid, int range, BoidsSeparation separation) {
+    if (separation == BOIDS_SEPARATION_SERIAL) {
+        return GetLocalFlockSerial;
+    }
+    if (grid->wrap == GRID_WRAP_MASK) {
+        return range == 1 ? GetLocalFlockMaskRange1 : GetLocalFlockMask;
+    }
+    if (grid->wrap == GRID_WRAP_TABLE && range == 1) {
+        return GetLocalFlockTableRange1;
+    }
+    return GetLocalFlock;
+}
+
+/**
+ * Second level of the grid for clustered flocks. Every frame the cells holding more than threshold
+ * boids are split into split x split subcells, so a boid in a dense cluster only scans the subcells
+ * that touch its perception circle instead of nine whole cells.
+ */
+typedef struct {
+    unsigned char *cellSplit;  // subcells per side of every grid cell, 0 if the cell is not split
+    int *cellFirst;            // where the split + 1 subcell offsets of a split cell start in subcellStart
+    int *subcellStart;         // offsets into fineBoids, each split cell uses the same slots as in cellBoids
+    int *fineBoids;            // boids of the split cells grouped by subcell, in index order inside a subcell
+    int *splitCells;           // the cells split this frame
+    int splitCount;
+    int subcellCapacity;
+    int threshold;
+    int cellCount;
+    long fineBoidsCapacity;
+    long splitTotal;           // split cells summed over the frames
+    long unsplitFrames;        // frames left unsplit because subcellStart could not grow
+} FineGrid;
+
+#define FINE_GRID_MAX_SPLIT 8
+
+FineGrid FineGridAlloc(const BoidGrid *grid, int threshold, HugePageMode *hugePages) {
+    const int cellCount = grid->gridHeight * grid->gridWidth;
+    FineGrid fine = {
+        .cellSplit = calloc(cellCount, 1),
+        .cellFirst = malloc(cellCount * sizeof(int)),
+        .subcellStart = NULL,
+        .fineBoids = HugeAlloc(grid->cellBoidsCapacity * sizeof(int), hugePages),
+        .splitCells = malloc(cellCount * sizeof(int)),
+        .threshold = threshold,
+        .cellCount = cellCount,
+        .fineBoidsCapacity = grid->cellBoidsCapacity
+    };
+    if (fine.cellSplit == NULL || fine.cellFirst == NULL || fine.fineBoids == NULL || fine.splitCells == NULL) {
+        perror("Failed to allocate two-level grid");
+        free(fine.cellSplit);
+        free(fine.cellFirst);
+        HugeFree(fine.fineBoids, grid->cellBoidsCapacity * sizeof(int));
+        free(fine.splitCells);
+        return (FineGrid){.cellSplit = NULL};
+    }
+    return fine;
+}
+
+void FineGridFree(FineGrid *fine) {
+    if (fine == NULL || fine->cellSplit == NULL) return;
+
+    free(fine->cellSplit);
+    free(fine->cellFirst);
+    free(fine->subcellStart);
+    HugeFree(fine->fineBoids, fine->fineBoidsCapacity * sizeof(int));
+    free(fine->splitCells);
+
+    fine->cellSplit = NULL;
+}
+
+static inline int FineGridSubcell(const BoidGrid *grid, int cell, int split, Vector2 position) {
+    const float resolution = grid->gridResolution;
+    const int row = cell / grid->gridWidth;
+    const int col = cell % grid->gridWidth;
+    int subRow = (int) ((position.x - row * resolution) * split / resolution);
+    int subCol = (int) ((position.y - col * resolution) * split / resolution);
+    subRow = subRow < 0 ? 0 : subRow >= split ? split - 1 : subRow;
+    subCol = subCol < 0 ? 0 : subCol >= split ? split - 1 : subCol;
+    return subRow * split + subCol;
+}
+
+/**
+ * @brief Splits the dense cells of a freshly built grid. Cells of the first row and col are never
+ * split: a boid sitting exactly on the far edge of the world is stored there, away from the subcells
+ * its position says. When the subcells don't fit in memory no cell is split, the frame walks whole cells
+ * like the plain grid. Must be reached by every thread of the enclosing parallel region.
+ */
+void FineGridBuild(FineGrid *fine, const Boid *boids, const BoidGrid *grid) {
+#pragma omp single
+    {
+        int count = 0;
+        int subcells = 0;
+        for (int cell = 0; cell < fine->cellCount; cell++) {
+            const int size = grid->cellEnd[cell] - grid->cellStart[cell];
+            const int edge = cell < grid->gridWidth || cell % grid->gridWidth == 0;
+            if (size <= fine->threshold || edge) {
+                fine->cellSplit[cell] = 0;
+                continue;
+            }
+            // about 8 boids per subcell
+            int split = (int) ceilf(sqrtf(size / 8.0f));
+            split = split < 2 ? 2 : split > FINE_GRID_MAX_SPLIT ? FINE_GRID_MAX_SPLIT : split;
+            fine->cellSplit[cell] = (unsigned char) split;
+            fine->cellFirst[cell] = subcells;
+            subcells += split * split + 1;
+            fine->splitCells[count++] = cell;
+        }
+        if (subcells > fine->subcellCapacity) {
+            free(fine->subcellStart);
+            fine->subcellCapacity = subcells + subcells / 2;
+            fine->subcellStart = malloc(fine->subcellCapacity * sizeof(int));
+            if (fine->subcellStart == NULL) {
+                if (fine->unsplitFrames++ == 0) perror("Failed to grow the two-level grid, leaving cells unsplit");
+                fine->subcellCapacity = 0;
+                for (int k = 0; k < count; k++) {
+                    fine->cellSplit[fine->splitCells[k]] = 0;
+                }
+                count = 0;
+            }
+        }
+        fine->splitCount = count;
+        fine->splitTotal += count;
+    } // implicit barrier
+
+    // counting sort of every split cell into its subcells
+#pragma omp for schedule(dynamic, 8)
+    for (int k = 0; k < fine->splitCount; k++) {
+        const int cell = fine->splitCells[k];
+        const int split = fine->cellSplit[cell];
+        int *start = fine->subcellStart + fine->cellFirst[cell];
+        int counts[FINE_GRID_MAX_SPLIT * FINE_GRID_MAX_SPLIT] = {0};
+
+        for (int j = grid->cellStart[cell]; j < grid->cellEnd[cell]; j++) {
+            counts[FineGridSubcell(grid, cell, split, boids[grid->cellBoids[j]].position)]++;
+        }
+        int cursor = grid->cellStart[cell];
+        for (int sub = 0; sub < split * split; sub++) {
+            start[sub] = cursor;
+            cursor += counts[sub];
+            counts[sub] = start[sub];
+        }
+        start[split * split] = cursor;
+        for (int j = grid->cellStart[cell]; j < grid->cellEnd[cell]; j++) {
+            const int boid = grid->cellBoids[j];
+            fine->fineBoids[counts[FineGridSubcell(grid, cell, split, boids[boid].position)]++] = boid;
+        }
+    } // implicit barrier
+}
+
+/**
+ * @brief GetLocalFlock over the two-level grid. Finds the same neighbours, but the split cells are
+ * summed subcell by subcell, so the sums are rounded differently.
+ */
+void GetLocalFlockTwoLevel(Boid *boids, int current, BoidGrid *grid, const FineGrid *fine, LocalFlock *flock,
+                           float radius) {
+    const Vector2 position = boids[current].position;
+    const int row = position.x / grid->gridResolution;
+    const int col = position.y / grid->gridResolution;
+    const float resolution = grid->gridResolution;
+    // subcell boxes are widened a bit, so FineGridSubcell rounding a boid into the next subcell can't hide it
+    const float reach = radius + 0.01f * resolution;
+    *flock = (LocalFlock){0};
+
+    for (int dcol = -1; dcol <= 1; dcol++) {
+        for (int drow = -1; drow <= 1; drow++) {
+            const int cell = BoidGridWrapCell(grid, row, col, drow, dcol, GRID_WRAP_MODULO, NULL, 0);
+            const int split = fine->cellSplit[cell];
+            if (split == 0) {
+                const GridCell whole = BoidGridCellAt(grid, cell);
+                PROFILE_COUNT("neighbor_candidates", whole.size);
+                LocalFlockAccumulate(boids, current, whole.boids, whole.size, flock, radius);
+                continue;
+            }
+
+            // the subcells overlapping the bounding box of the perception circle
+            const float cellX = (float) (cell / grid->gridWidth) * resolution;
+            const float cellY = (float) (cell % grid->gridWidth) * resolution;
+            const float side = resolution / split;
+            const int firstRow = (int) fmaxf(0, floorf((position.x - reach - cellX) / side));
+            const int lastRow = (int) fminf(split - 1, floorf((position.x + reach - cellX) / side));
+            const int firstCol = (int) fmaxf(0, floorf((position.y - reach - cellY) / side));
+            const int lastCol = (int) fminf(split - 1, floorf((position.y + reach - cellY) / side));
+            const int *start = fine->subcellStart + fine->cellFirst[cell];
+
+            for (int subRow = firstRow; subRow <= lastRow; subRow++) {
+                const float nearestX = fminf(fmaxf(position.x, cellX + subRow * side), cellX + (subRow + 1) * side);
+                for (int subCol = firstCol; subCol <= lastCol; subCol++) {
+                    const float nearestY = fminf(fmaxf(position.y, cellY + subCol * side), cellY + (subCol + 1) * side);
+                    const float dx = nearestX - position.x, dy = nearestY - position.y;
+                    if (dx * dx + dy * dy >= reach * reach) continue;
+
+                    const int sub = subRow * split + subCol;
+                    PROFILE_COUNT("neighbor_candidates", start[sub + 1] - start[sub]);
+                    LocalFlockAccumulate(boids, current, fine->fineBoids + start[sub], start[sub + 1] - start[sub],
+                                         flock, radius);
+                }
+            }
+        }
+    }
+    PROFILE_COUNT("neighbors_accepted", flock->size);
+}
+
+/**
+ * Sparse alternative to BoidGrid for huge, mostly empty worlds, where one int per cell no longer fits
+ * in memory. Only occupied cells exist: the (cell key, boid) pairs are sorted by key with a parallel
+ * radix sort, every run of equal keys is a cell, and an open addressing table maps a key to its run.
+ * Memory is proportional to the number of boids, whatever the size of the world.
+ */
+typedef struct {
+    uint64_t *pairs;       // cell key << 32 | boid index
+    uint64_t *scratch;     // the other buffer of the radix sort
+    int *cellBoids;        // boid indices in key order, each run of equal keys is a cell
+    int *runStart;         // runCount + 1 offsets into cellBoids
+    int *runSlot;          // table slot of each run, so the next build only clears those
+    uint32_t *tableKeys;   // cell key + 1, 0 for an empty slot
+    int *tableRuns;        // run of the key in the same slot
+    int *threadCounts;     // per-thread digit histograms of the radix sort
+    int *blockSums;        // per-thread number of runs
+    int runCount;
+    int keyBits;           // significant bits of a cell key, the radix sort skips the others
+    int tableBits;
+    int maxThreads;
+    int boidCapacity;
+    int gridResolution;
+    int gridHeight;
+    int gridWidth;
+    long runTotal;         // occupied cells summed over the frames
+} HashGrid;
+
+#define HASH_GRID_RADIX_BITS 11
+#define HASH_GRID_RADIX (1 << HASH_GRID_RADIX_BITS)
+
+static inline size_t HashGridTableSize(const HashGrid *grid) {
+    return (size_t) 1 << grid->tableBits;
+}
+
+HashGrid HashGridAlloc(int resolution, int height, int width, int boidCapacity, int maxThreads,
+                       HugePageMode *hugePages) {
+    const uint64_t cellCount = (uint64_t) height * width;
+    if (cellCount >= UINT32_MAX) {
+        fprintf(stderr, "The hashed grid supports up to 2^32 - 1 cells, not %llu\n", (unsigned long long) cellCount);
+        return (HashGrid){.pairs = NULL};
+    }
+    HashGrid grid = {
+        .maxThreads = maxThreads,
+        .boidCapacity = boidCapacity,
+        .gridResolution = resolution,
+        .gridHeight = height,
+        .gridWidth = width
+    };
+    while (grid.keyBits < 32 && (cellCount - 1) >> grid.keyBits != 0) grid.keyBits++;
+    // at most one run per boid, so the table is never more than half full
+    grid.tableBits = 1;
+    while (HashGridTableSize(&grid) < 2 * (size_t) boidCapacity) grid.tableBits++;
+
+    const size_t tableSize = HashGridTableSize(&grid);
+    grid.pairs = HugeAlloc(boidCapacity * sizeof(uint64_t), hugePages);
+    grid.scratch = HugeAlloc(boidCapacity * sizeof(uint64_t), hugePages);
+    grid.cellBoids = HugeAlloc(boidCapacity * sizeof(int), hugePages);
+    grid.runStart = HugeAlloc((boidCapacity + 1) * sizeof(int), hugePages);
+    grid.runSlot = HugeAlloc(boidCapacity * sizeof(int), hugePages);
+    // fresh anonymous pages, so every slot is empty
+    grid.tableKeys = HugeAlloc(tableSize * sizeof(uint32_t), hugePages);
+    grid.tableRuns = HugeAlloc(tableSize * sizeof(int), hugePages);
+    grid.threadCounts = malloc((size_t) maxThreads * HASH_GRID_RADIX * sizeof(int));
+    grid.blockSums = malloc(maxThreads * sizeof(int));
+
+    if (grid.pairs == NULL || grid.scratch == NULL || grid.cellBoids == NULL || grid.runStart == NULL ||
+        grid.runSlot == NULL || grid.tableKeys == NULL || grid.tableRuns == NULL || grid.threadCounts == NULL ||
+        grid.blockSums == NULL) {
+        perror("Failed to allocate hashed grid");
+        HugeFree(grid.pairs, boidCapacity * sizeof(uint64_t));
+        HugeFree(grid.scratch, boidCapacity * sizeof(uint64_t));
+        HugeFree(grid.cellBoids, boidCapacity * sizeof(int));
+        HugeFree(grid.runStart, (boidCapacity + 1) * sizeof(int));
+        HugeFree(grid.runSlot, boidCapacity * sizeof(int));
+        HugeFree(grid.tableKeys, tableSize * sizeof(uint32_t));
+        HugeFree(grid.tableRuns, tableSize * sizeof(int));
+        free(grid.threadCounts);
+        free(grid.blockSums);
+        return (HashGrid){.pairs = NULL};
+    }
+    return grid;
+}
+
+void HashGridFree(HashGrid *grid) {
+    if (grid == NULL || grid->pairs == NULL) return;
+
+    const size_t tableSize = HashGridTableSize(grid);
+    HugeFree(grid->pairs, grid->boidCapacity * sizeof(uint64_t));
+    HugeFree(grid->scratch, grid->boidCapacity * sizeof(uint64_t));
+    HugeFree(grid->cellBoids, grid->boidCapacity * sizeof(int));
+    HugeFree(grid->runStart, (grid->boidCapacity + 1) * sizeof(int));
+    HugeFree(grid->runSlot, grid->boidCapacity * sizeof(int));
+    HugeFree(grid->tableKeys, tableSize * sizeof(uint32_t));
+    HugeFree(grid->tableRuns, tableSize * sizeof(int));
+    free(grid->threadCounts);
+    free(grid->blockSums);
+
+    grid->pairs = NULL;
+}
+
+/**
+ * @return the bytes allocated by the hashed grid, to compare with the gridHeight * gridWidth ints of BoidGrid.
+ */
+size_t HashGridBytes(const HashGrid *grid) {
+    return grid->boidCapacity * (2 * sizeof(uint64_t) + 3 * sizeof(int)) + sizeof(int) +
+           HashGridTableSize(grid) * (sizeof(uint32_t) + sizeof(int)) +
+           grid->maxThreads * (HASH_GRID_RADIX + 1) * sizeof(int);
+}
+
+static inline size_t HashGridSlot(const HashGrid *grid, uint32_t key) {
+    // Fibonacci hashing, neighbouring cells land far apart
+    return (size_t) ((key * 0x9E3779B97F4A7C15ull) >> (64 - grid->tableBits));
+}
+
+static inline uint32_t HashGridCellKey(const HashGrid *grid, Vector2 position) {
+    int row = (int) (position.x / grid->gridResolution) % grid->gridHeight;
+    int col = (int) (position.y / grid->gridResolution) % grid->gridWidth;
+    return (uint32_t) row * grid->gridWidth + col;
+}
+
+/**
+ * @brief Rebuilds the hashed grid from scratch. Must be reached by every thread of the enclosing parallel region.
+ *
+ * Each thread writes the pairs of a static slice of the boids, then every pass of the radix sort
+ * histograms the slices, derives per-thread cursors from all the histograms and scatters the slices,
+ * like BoidGridBuild does for the cells. The sort is stable and starts in index order, so boids inside
+ * a cell stay in index order and GetLocalFlockHashed sums them like GetLocalFlock. The runs are then
+ * numbered with a prefix sum over the threads and inserted into the table with a compare and swap.
+ */
+void HashGridBuild(HashGrid *grid, const Boid *boids, int boidCount) {
+    const int threadId = omp_get_thread_num();
+    const int threadCount = omp_get_num_threads();
+    assert(threadCount <= grid->maxThreads && boidCount <= grid->boidCapacity);
+
+    const int first = (int) ((long) boidCount * threadId / threadCount);
+    const int last = (int) ((long) boidCount * (threadId + 1) / threadCount);
+    int *counts = grid->threadCounts + (size_t) threadId * HASH_GRID_RADIX;
+    const size_t tableMask = HashGridTableSize(grid) - 1;
+
+    // 0. empty the slots of the previous frame, clearing the whole table would cost more than the build
+#pragma omp for schedule(static)
+    for (int run = 0; run < grid->runCount; run++) {
+        grid->tableKeys[grid->runSlot[run]] = 0;
+    } // implicit barrier
+
+    // 1. keys
+    for (int i = first; i < last; i++) {
+        grid->pairs[i] = (uint64_t) HashGridCellKey(grid, boids[i].position) << 32 | (uint32_t) i;
+    }
+
+    // 2. LSD radix sort on the key bits only
+    uint64_t *source = grid->pairs;
+    uint64_t *target = grid->scratch;
+    PROFILE_SCOPE("sort") {
+        for (int shift = 32; shift < 32 + grid->keyBits; shift += HASH_GRID_RADIX_BITS) {
+            memset(counts, 0, HASH_GRID_RADIX * sizeof(int));
+            for (int i = first; i < last; i++) {
+                counts[(source[i] >> shift) & (HASH_GRID_RADIX - 1)]++;
+            }
+#pragma omp barrier
+
+            // digits in order, and inside a digit the threads in order
+            int cursors[HASH_GRID_RADIX];
+            int cursor = 0;
+            for (int digit = 0; digit < HASH_GRID_RADIX; digit++) {
+                for (int t = 0; t < threadCount; t++) {
+                    if (t == threadId) cursors[digit] = cursor;
+                    cursor += grid->threadCounts[(size_t) t * HASH_GRID_RADIX + digit];
+                }
+            }
+            for (int i = first; i < last; i++) {
+                target[cursors[(source[i] >> shift) & (HASH_GRID_RADIX - 1)]++] = source[i];
+            }
+#pragma omp barrier
+
+            uint64_t *swap = source;
+            source = target;
+            target = swap;
+        }
+    }
+
+    // 3. every run of equal keys is an occupied cell
+    int runs = 0;
+    for (int i = first; i < last; i++) {
+        grid->cellBoids[i] = (int) (uint32_t) source[i];
+        if (i == 0 || source[i] >> 32 != source[i - 1] >> 32) runs++;
+    }
+    grid->blockSums[threadId] = runs;
+#pragma omp barrier
+
+    int run = 0;
+    for (int t = 0; t < threadId; t++) {
+        run += grid->blockSums[t];
+    }
+    for (int i = first; i < last; i++) {
+        if (i == 0 || source[i] >> 32 != source[i - 1] >> 32) grid->runStart[run++] = i;
+    }
+    if (threadId == threadCount - 1) {
+        grid->runStart[run] = boidCount;
+        grid->runCount = run;
+        grid->runTotal += run;
+    }
+#pragma omp barrier
+
+    // 4. keys are unique, so a slot claimed by the compare and swap belongs to this run for the frame
+    PROFILE_SCOPE("insert") {
+#pragma omp for schedule(static)
+        for (int r = 0; r < grid->runCount; r++) {
+            const uint32_t key = (uint32_t) (source[grid->runStart[r]] >> 32) + 1;
+            size_t slot = HashGridSlot(grid, key - 1);
+            uint32_t expected = 0;
+            while (!__atomic_compare_exchange_n(&grid->tableKeys[slot], &expected, key, 0, __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED)) {
+                expected = 0;
+                slot = (slot + 1) & tableMask;
+            }
+            grid->tableRuns[slot] = r;
+            grid->runSlot[r] = slot;
+        } // implicit barrier
+    }
+}
+
+/**
+ * @return the boids of the cell with the given key, an empty cell if no boid is in it.
+ */
+static inline GridCell HashGridGetCell(const HashGrid *grid, uint32_t key) {
+    const size_t mask = HashGridTableSize(grid) - 1;
+    for (size_t slot = HashGridSlot(grid, key);; slot = (slot + 1) & mask) {
+        const uint32_t stored = grid->tableKeys[slot];
+        if (stored == 0) {
+            return (GridCell){.boids = NULL, .size = 0};
+        }
+        if (stored == key + 1) {
+            const int run = grid->tableRuns[slot];
+            return (GridCell){
+                .boids = grid->cellBoids + grid->runStart[run],
+                .size = grid->runStart[run + 1] - grid->runStart[run]
+            };
+        }
+    }
+}
+
+/**
+ * @brief GetLocalFlock over the hashed grid. Visits the same cells in the same order, so the sums are identical.
+ */
+void GetLocalFlockHashed(Boid *boids, int current, const HashGrid *grid, LocalFlock *flock, float radius) {
+    const Vector2 position = boids[current].position;
+    const int row = position.x / grid->gridResolution;
+    const int col = position.y / grid->gridResolution;
+    *flock = (LocalFlock){0};
+
+    for (int dcol = -1; dcol <= 1; dcol++) {
+        for (int drow = -1; drow <= 1; drow++) {
+            int gridRow = (row + drow) % grid->gridHeight;
+            if (gridRow < 0) gridRow += grid->gridHeight;
+
+            int gridCol = (col + dcol) % grid->gridWidth;
+            if (gridCol < 0) gridCol += grid->gridWidth;
+
+            const GridCell cell = HashGridGetCell(grid, (uint32_t) gridRow * grid->gridWidth + gridCol);
+            PROFILE_COUNT("neighbor_candidates", cell.size);
+            LocalFlockAccumulate(boids, current, cell.boids, cell.size, flock, radius);
+        }
+    }
+    PROFILE_COUNT("neighbors_accepted", flock->size);
+}
+
+// x, y in fixed point from the corner of the cell of the boid, vx, vy as half floats
+typedef struct {
+    uint16_t x, y;
+    uint16_t vx, vy;
+} BoidQ16;
+
+typedef struct {
+    uint32_t x, y;
+    uint16_t vx, vy;
+} BoidQ32;
+
+typedef struct {
+    float *positionX;
+    float *positionY;
+    float *velocityX;
+    float *velocityY;
+    BoidQ16 *q16;      // FLOCK_KERNEL_Q16 only, instead of the float arrays
+    BoidQ32 *q32;      // FLOCK_KERNEL_Q32 only, instead of the float arrays
+    Vector2 *corners;  // quantized kernels only, the corner of every cell the offsets are taken from
+    float cellSize;    // of the grid, the range of the fixed point offsets
+    int cellCount;
+    int capacity;
+} BoidSoA;
+
+typedef void (*FlockSoAFunction)(const BoidSoA *soa, const int *cellStart, const int *cells, int cellCount,
+                                 int self, float radius, LocalFlock *flock);
+
+/**
+ * @brief Allocates the cell ordered copy the kernel reads: four float arrays, or the quantized boids of
+ * FLOCK_KERNEL_Q16 and FLOCK_KERNEL_Q32.
+ */
+BoidSoA BoidSoAAlloc(int capacity, FlockKernel kernel, const BoidGrid *grid, HugePageMode *hugePages) {
+    // page aligned, and first touched by the static gather loop
+    const size_t bytes = capacity * sizeof(float);
+    const int quantized = kernel == FLOCK_KERNEL_Q16 || kernel == FLOCK_KERNEL_Q32;
+    BoidSoA soa = {
+        .cellSize = (float) grid->gridResolution,
+        .cellCount = grid->gridHeight * grid->gridWidth,
+        .capacity = capacity
+    };
+    if (quantized) {
+        if (kernel == FLOCK_KERNEL_Q16) {
+            soa.q16 = HugeAlloc(capacity * sizeof(BoidQ16), hugePages);
+        } else {
+            soa.q32 = HugeAlloc(capacity * sizeof(BoidQ32), hugePages);
+        }
+        // a table instead of a division per neighbour cell
+        soa.corners = malloc(soa.cellCount * sizeof(Vector2));
+        for (int cell = 0; soa.corners != NULL && cell < soa.cellCount; cell++) {
+            soa.corners[cell] = (Vector2){
+                (float) (cell / grid->gridWidth) * soa.cellSize, (float) (cell % grid->gridWidth) * soa.cellSize
+            };
+        }
+    } else {
+        soa.positionX = HugeAlloc(bytes, hugePages);
+        soa.positionY = HugeAlloc(bytes, hugePages);
+        soa.velocityX = HugeAlloc(bytes, hugePages);
+        soa.velocityY = HugeAlloc(bytes, hugePages);
+    }
+
+    if (quantized ? (soa.q16 == NULL && soa.q32 == NULL) || soa.corners == NULL
+                  : soa.positionX == NULL || soa.positionY == NULL || soa.velocityX == NULL || soa.velocityY == NULL) {
+        perror("Failed to allocate SoA boid storage");
+        HugeFree(soa.positionX, bytes);
+        HugeFree(soa.positionY, bytes);
+        HugeFree(soa.velocityX, bytes);
+        HugeFree(soa.velocityY, bytes);
+        HugeFree(soa.q16, capacity * sizeof(BoidQ16));
+        HugeFree(soa.q32, capacity * sizeof(BoidQ32));
+        free(soa.corners);
+        return (BoidSoA){.positionX = NULL};
+    }
+    return soa;
+}
+
+static inline int BoidSoAAllocated(const BoidSoA *soa) {
+    return soa->positionX != NULL || soa->q16 != NULL || soa->q32 != NULL;
+}
+
+void BoidSoAFree(BoidSoA *soa) {
+    if (soa == NULL || !BoidSoAAllocated(soa)) return;
+
+    const size_t bytes = soa->capacity * sizeof(float);
+    HugeFree(soa->positionX, bytes);
+    HugeFree(soa->positionY, bytes);
+    HugeFree(soa->velocityX, bytes);
+    HugeFree(soa->velocityY, bytes);
+    HugeFree(soa->q16, soa->capacity * sizeof(BoidQ16));
+    HugeFree(soa->q32, soa->capacity * sizeof(BoidQ32));
+    free(soa->corners);
+
+    soa->positionX = NULL;
+    soa->q16 = NULL;
+    soa->q32 = NULL;
+    soa->corners = NULL;
+}
+
+/**
+ * @return the nearest half float, rounding to even. Overflows to infinity, nan isn't kept.
+ */
+static inline uint16_t HalfFromFloat(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint16_t sign = (bits >> 16) & 0x8000;
+    const int exponent = (int) ((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+    if (exponent >= 31) return sign | 0x7c00;
+    if (exponent <= 0) {
+        // subnormal, the implicit one shifts into the mantissa
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) half++;
+        return sign | half;
+    }
+
+    // rounds without a branch, the velocities are too random to predict it. A carry out of the mantissa
+    // correctly bumps the exponent, up to infinity
+    const uint32_t rounded = mantissa + 0xfff + ((mantissa >> 13) & 1);
+    return sign | (((uint32_t) exponent << 10) + (rounded >> 13));
+}
+
+// exact for every finite half: the bits land in a float 2^112 too small, whose subnormals are the half ones
+static inline float HalfToFloat(uint16_t half) {
+    const uint32_t bits = (uint32_t) (half & 0x7fff) << 13;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    value *= 0x1p112f;
+    return half & 0x8000 ? -value : value;
+}
+
+// steps of a fixed point offset over a cell
+static inline double QuantizedSteps(int bits) {
+    return bits == 16 ? 65536.0 : 4294967296.0;
+}
+
+/**
+ * @param scale steps of the fixed point per unit of length
+ * @return offset from the corner of a cell in fixed point, rounded, clamped to the cell.
+ */
+static inline uint32_t QuantizeOffset(float offset, double scale, int bits) {
+    const double scaled = offset * scale + 0.5, top = QuantizedSteps(bits) - 1;
+    return scaled <= 0 ? 0 : scaled >= top ? (uint32_t) top : (uint32_t) scaled;
+}
+
+/**
+ * @brief BoidSoAGather of the quantized kernels.
+ */
+static void BoidSoAGatherQuantized(BoidSoA *soa, const Boid *boids, const BoidGrid *grid, int boidCount) {
+    const int bits = soa->q16 != NULL ? 16 : 32;
+    const double scale = QuantizedSteps(bits) / soa->cellSize;
+#pragma omp for schedule(static)
+    for (int slot = 0; slot < boidCount; slot++) {
+        const Boid *boid = &boids[grid->cellBoids[slot]];
+        // the cell of BoidGridCellIndex, the wrap of a boid on the far edge without the divisions of %
+        int row = (int) (boid->position.x / grid->gridResolution);
+        int col = (int) (boid->position.y / grid->gridResolution);
+        if (row >= grid->gridHeight) row -= grid->gridHeight;
+        if (col >= grid->gridWidth) col -= grid->gridWidth;
+        const Vector2 corner = soa->corners[row * grid->gridWidth + col];
+
+        const uint32_t x = QuantizeOffset(boid->position.x - corner.x, scale, bits);
+        const uint32_t y = QuantizeOffset(boid->position.y - corner.y, scale, bits);
+        const uint16_t vx = HalfFromFloat(boid->velocity.x), vy = HalfFromFloat(boid->velocity.y);
+        if (bits == 16) {
+            soa->q16[slot] = (BoidQ16){(uint16_t) x, (uint16_t) y, vx, vy};
+        } else {
+            soa->q32[slot] = (BoidQ32){x, y, vx, vy};
+        }
+    }
+}
+
+/**
+ * @brief Copies the boids into the SoA arrays in grid order, so every cell is a contiguous range
+ * [cellStart[cell], cellStart[cell + 1]) of each array. Worksharing loop, call from a parallel region.
+ */
+void BoidSoAGather(BoidSoA *soa, const Boid *boids, const BoidGrid *grid, int boidCount) {
+    if (soa->q16 != NULL || soa->q32 != NULL) {
+        BoidSoAGatherQuantized(soa, boids, grid, boidCount);
+        return;
+    }
+#pragma omp for schedule(static)
+    for (int slot = 0; slot < boidCount; slot++) {
+        const Boid *boid = &boids[grid->cellBoids[slot]];
+        soa->positionX[slot] = boid->position.x;
+        soa->positionY[slot] = boid->position.y;
+        soa->velocityX[slot] = boid->velocity.x;
+        soa->velocityY[slot] = boid->velocity.y;
+    }
+}
+
+/**
+ * @brief Collects the indices of the cells within range of position, in the same order GetLocalFlock visits them.
+ * @return the number of cells written, (2 * range + 1)^2.
+ */
+int BoidGridNeighborCells(const BoidGrid *grid, Vector2 position, int range, int *cells) {
+    const int row = position.x / grid->gridResolution;
+    const int col = position.y / grid->gridResolution;
+    if (grid->wrap == GRID_WRAP_TABLE && range == 1) {
+        memcpy(cells, BoidGridNeighborTable(grid, row, col), 9 * sizeof(int));
+        return 9;
+    }
+
+    const GridWrap wrap = grid->wrap == GRID_WRAP_MASK ? GRID_WRAP_MASK : GRID_WRAP_MODULO;
+    int count = 0;
+    for (int dcol = -range; dcol <= range; dcol++) {
+        for (int drow = -range; drow <= range; drow++, count++) {
+            cells[count] = BoidGridWrapCell(grid, row, col, drow, dcol, wrap, NULL, count);
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Same sums as GetLocalFlock, but over the cell ordered SoA copy. self is the slot of the
+ * current boid in the SoA arrays. Portable reference for the SIMD kernels below.
+ */
+void GetLocalFlockSoA(const BoidSoA *soa, const int *cellStart, const int *cells, int cellCount,
+                      int self, float radius, LocalFlock *flock) {
+    const float px = soa->positionX[self];
+    const float py = soa->positionY[self];
+    const float radiusSqr = radius * radius;
+    *flock = (LocalFlock){0};
+
+    for (int c = 0; c < cellCount; c++) {
+        const int last = cellStart[cells[c] + 1];
+        for (int j = cellStart[cells[c]]; j < last; j++) {
+            float dx = soa->positionX[j] - px;
+            float dy = soa->positionY[j] - py;
+            float dist = dx * dx + dy * dy;
+            if (dist < radiusSqr && j != self) {
+                flock->velocitiesSum.x += soa->velocityX[j];
+                flock->velocitiesSum.y += soa->velocityY[j];
+                flock->positionsSum.x += soa->positionX[j];
+                flock->positionsSum.y += soa->positionY[j];
+                if (dist > 0.01f) {
+                    float inverse = 1.0f / dist;
+                    flock->oppositeDirectionsSum.x -= dx * inverse;
+                    flock->oppositeDirectionsSum.y -= dy * inverse;
+                }
+                flock->size++;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Same sums as GetLocalFlockSoA over the quantized boids of bits bits: every cell's offsets are
+ * expanded around its corner, velocities from half floats, and the maths runs in float. The home cell of
+ * the current boid is the middle one of cells, GetLocalFlock visits the neighbourhood column by column.
+ */
+static inline __attribute__((always_inline)) void GetLocalFlockQuantized(const BoidSoA *soa, const int *cellStart,
+                                                                         const int *cells, int cellCount, int self,
+                                                                         float radius, LocalFlock *flock, int bits) {
+    const float step = soa->cellSize / (float) QuantizedSteps(bits);
+    const Vector2 home = soa->corners[cells[cellCount / 2]];
+    const float px = home.x + (float) (bits == 16 ? soa->q16[self].x : soa->q32[self].x) * step;
+    const float py = home.y + (float) (bits == 16 ? soa->q16[self].y : soa->q32[self].y) * step;
+    const float radiusSqr = radius * radius;
+    *flock = (LocalFlock){0};
+
+    for (int c = 0; c < cellCount; c++) {
+        // corner of the cell relative to the boid, a neighbour is one multiply and add away
+        const float cornerX = soa->corners[cells[c]].x - px;
+        const float cornerY = soa->corners[cells[c]].y - py;
+        const int last = cellStart[cells[c] + 1];
+        for (int j = cellStart[cells[c]]; j < last; j++) {
+            float dx = cornerX + (float) (bits == 16 ? soa->q16[j].x : soa->q32[j].x) * step;
+            float dy = cornerY + (float) (bits == 16 ? soa->q16[j].y : soa->q32[j].y) * step;
+            float dist = dx * dx + dy * dy;
+            if (dist < radiusSqr && j != self) {
+                flock->velocitiesSum.x += HalfToFloat(bits == 16 ? soa->q16[j].vx : soa->q32[j].vx);
+                flock->velocitiesSum.y += HalfToFloat(bits == 16 ? soa->q16[j].vy : soa->q32[j].vy);
+                flock->positionsSum.x += px + dx;
+                flock->positionsSum.y += py + dy;
+                if (dist > 0.01f) {
+                    float inverse = 1.0f / dist;
+                    flock->oppositeDirectionsSum.x -= dx * inverse;
+                    flock->oppositeDirectionsSum.y -= dy * inverse;
+                }
+                flock->size++;
+            }
+        }
+    }
+}
+
+void GetLocalFlockQ16(const BoidSoA *soa, const int *cellStart, const int *cells, int cellCount,
+                      int self, float radius, LocalFlock *flock) {
+    GetLocalFlockQuantized(soa, cellStart, cells, cellCount, self, radius, flock, 16);
+}
+
+void GetLocalFlockQ32(const BoidSoA *soa, const int *cellStart, const int *cells, int cellCount,
+                      int self, float radius, LocalFlock *flock) {
+    GetLocalFlockQuantized(soa, cellStart, cells, cellCount, self, radius, flock, 32);
+}
+
+#ifdef BOIDS_X86
+static inline float HorizontalSum128(__m128 v) {
+    __m128 sum = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+
+void GetLocalFlockSSE(const BoidSoA *soa, const int *cellStart, const int *cells, int cellCount,
+                      int self, float radius, LocalFlock *flock) {
+    const __m128 px = _mm_set1_ps(soa->positionX[self]);
+    const __m128 py = _mm_set1_ps(soa->positionY[self]);
+    const __m128 radiusSqr = _mm_set1_ps(radius * radius);
+    const __m128 minDist = _mm_set1_ps(0.01f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 sumVx = _mm_setzero_ps(), sumVy = _mm_setzero_ps();
+    __m128 sumPx = _mm_setzero_ps(), sumPy = _mm_setzero_ps();
+    __m128 sumOx = _mm_setzero_ps(), sumOy = _mm_setzero_ps();
+    LocalFlock tail = {0};
+    int size = 0;
+
+    for (int c = 0; c < cellCount; c++) {
+        const int first = cellStart[cells[c]];
+        const int last = cellStart[cells[c] + 1];
+        int j = first;
+        for (; j + 4 <= last; j += 4) {
+            __m128 ox = _mm_loadu_ps(soa->positionX + j);
+            __m128 oy = _mm_loadu_ps(soa->positionY + j);
+            __m128 dx = _mm_sub_ps(ox, px);
+            __m128 dy = _mm_sub_ps(oy, py);
+            __m128 dist = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+            int lanes = _mm_movemask_ps(_mm_cmplt_ps(dist, radiusSqr));
+            if (self >= j && self < j + 4) lanes &= ~(1 << (self - j));
+            if (lanes == 0) continue;
+
+            const __m128 inRange = _mm_castsi128_ps(_mm_cmpeq_epi32(
+                _mm_and_si128(_mm_set1_epi32(lanes), _mm_setr_epi32(1, 2, 4, 8)), _mm_setr_epi32(1, 2, 4, 8)));
+            sumVx = _mm_add_ps(sumVx, _mm_and_ps(_mm_loadu_ps(soa->velocityX + j), inRange));
+            sumVy = _mm_add_ps(sumVy, _mm_and_ps(_mm_loadu_ps(soa->velocityY + j), inRange));
+            sumPx = _mm_add_ps(sumPx, _mm_and_ps(ox, inRange));
+            sumPy = _mm_add_ps(sumPy, _mm_and_ps(oy, inRange));
+
+            const __m128 separate = _mm_and_ps(inRange, _mm_cmpgt_ps(dist, minDist));
+            const __m128 inverse = _mm_div_ps(one, dist);
+            sumOx = _mm_sub_ps(sumOx, _mm_and_ps(_mm_mul_ps(dx, inverse), separate));
+            sumOy = _mm_sub_ps(sumOy, _mm_and_ps(_mm_mul_ps(dy, inverse), separate));
+            size += __builtin_popcount(lanes);
+        }
+        for (; j < last; j++) {
+            float dx = soa->positionX[j] - soa->positionX[self];
+            float dy = soa->positionY[j] - soa->positionY[self];
+            float dist = dx * dx + dy * dy;
+            if (dist < radius * radius && j != self) {
+                tail.velocitiesSum = Vector2Add(tail.velocitiesSum, (Vector2){soa->velocityX[j], soa->velocityY[j]});
+                tail.positionsSum = Vector2Add(tail.positionsSum, (Vector2){soa->positionX[j], soa->positionY[j]});
+                if (dist > 0.01f) {
+                    float inverse = 1.0f / dist;
+                    tail.oppositeDirectionsSum.x -= dx * inverse;
+                    tail.oppositeDirectionsSum.y -= dy * inverse;
+                }
+                tail.size++;
+            }
+        }
+    }
+
+    flock->velocitiesSum = (Vector2){
+        HorizontalSum128(sumVx) + tail.velocitiesSum.x, HorizontalSum128(sumVy) + tail.velocitiesSum.y
+    };
+    flock->positionsSum = (Vector2){
+        HorizontalSum128(sumPx) + tail.positionsSum.x, HorizontalSum128(sumPy) + tail.positionsSum.y
+    };
+    flock->oppositeDirectionsSum = (Vector2){
+        HorizontalSum128(sumOx) + tail.oppositeDirectionsSum.x, HorizontalSum128(sumOy) + tail.oppositeDirectionsSum.y
+    };
+    flock->size = size + tail.size;
+}
+
+__attribute__((target("avx2")))
+static inline float HorizontalSum256(__m256 v) {
+    return HorizontalSum128(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+__attribute__((target("avx2")))
+void GetLocalFlockAVX2(const BoidSoA *soa, const int *cellStart, const int *cells, int cellCount,
+                       int self, float radius, LocalFlock *flock) {
+    const __m256 px = _mm256_set1_ps(soa->positionX[self]);
+    const __m256 py = _mm256_set1_ps(soa->positionY[self]);
+    const __m256 radiusSqr = _mm256_set1_ps(radius * radius);
+    const __m256 minDist = _mm256_set1_ps(0.01f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i selfIndex = _mm256_set1_epi32(self);
+    __m256 sumVx = _mm256_setzero_ps(), sumVy = _mm256_setzero_ps();
+    __m256 sumPx = _mm256_setzero_ps(), sumPy = _mm256_setzero_ps();
+    __m256 sumOx = _mm256_setzero_ps(), sumOy = _mm256_setzero_ps();
+    __m256i size = _mm256_setzero_si256();
+
+    for (int c = 0; c < cellCount; c++) {
+        const int first = cellStart[cells[c]];
+        const __m256i last = _mm256_set1_epi32(cellStart[cells[c] + 1]);
+        for (int j = first; j < cellStart[cells[c] + 1]; j += 8) {
+            const __m256i index = _mm256_add_epi32(_mm256_set1_epi32(j), laneIndex);
+            // lanes past the end of the cell are neither loaded nor counted
+            const __m256i loaded = _mm256_cmpgt_epi32(last, index);
+            const __m256i valid = _mm256_andnot_si256(_mm256_cmpeq_epi32(index, selfIndex), loaded);
+            __m256 ox = _mm256_maskload_ps(soa->positionX + j, loaded);
+            __m256 oy = _mm256_maskload_ps(soa->positionY + j, loaded);
+            __m256 dx = _mm256_sub_ps(ox, px);
+            __m256 dy = _mm256_sub_ps(oy, py);
+            __m256 dist = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+            __m256 inRange = _mm256_and_ps(_mm256_cmp_ps(dist, radiusSqr, _CMP_LT_OQ), _mm256_castsi256_ps(valid));
+            if (_mm256_testz_ps(inRange, inRange)) continue;
+
+            sumVx = _mm256_add_ps(sumVx, _mm256_and_ps(_mm256_maskload_ps(soa->velocityX + j, loaded), inRange));
+            sumVy = _mm256_add_ps(sumVy, _mm256_and_ps(_mm256_maskload_ps(soa->velocityY + j, loaded), inRange));
+            sumPx = _mm256_add_ps(sumPx, _mm256_and_ps(ox, inRange));
+            sumPy = _mm256_add_ps(sumPy, _mm256_and_ps(oy, inRange));
+
+            const __m256 separate = _mm256_and_ps(inRange, _mm256_cmp_ps(dist, minDist, _CMP_GT_OQ));
+            const __m256 inverse = _mm256_div_ps(one, dist);
+            sumOx = _mm256_sub_ps(sumOx, _mm256_and_ps(_mm256_mul_ps(dx, inverse), separate));
+            sumOy = _mm256_sub_ps(sumOy, _mm256_and_ps(_mm256_mul_ps(dy, inverse), separate));
+            // true lanes are -1
+            size = _mm256_sub_epi32(size, _mm256_castps_si256(inRange));
+        }
+    }
+
+    flock->velocitiesSum = (Vector2){HorizontalSum256(sumVx), HorizontalSum256(sumVy)};
+    flock->positionsSum = (Vector2){HorizontalSum256(sumPx), HorizontalSum256(sumPy)};
+    flock->oppositeDirectionsSum = (Vector2){HorizontalSum256(sumOx), HorizontalSum256(sumOy)};
+    __m128i size128 = _mm_add_epi32(_mm256_castsi256_si128(size), _mm256_extracti128_si256(size, 1));
+    size128 = _mm_add_epi32(size128, _mm_shuffle_epi32(size128, _MM_SHUFFLE(1, 0, 3, 2)));
+    size128 = _mm_add_epi32(size128, _mm_shuffle_epi32(size128, _MM_SHUFFLE(2, 3, 0, 1)));
+    flock->size = _mm_cvtsi128_si32(size128);
+}
+
+__attribute__((target("avx512f")))
+void GetLocalFlockAVX512(const BoidSoA *soa, const int *cellStart, const int *cells, int cellCount,
+                         int self, float radius, LocalFlock *flock) {
+    const __m512 px = _mm512_set1_ps(soa->positionX[self]);
+    const __m512 py = _mm512_set1_ps(soa->positionY[self]);
+    const __m512 radiusSqr = _mm512_set1_ps(radius * radius);
+    const __m512 minDist = _mm512_set1_ps(0.01f);
+    const __m512 one = _mm512_set1_ps(1.0f);
+    __m512 sumVx = _mm512_setzero_ps(), sumVy = _mm512_setzero_ps();
+    __m512 sumPx = _mm512_setzero_ps(), sumPy = _mm512_setzero_ps();
+    __m512 sumOx = _mm512_setzero_ps(), sumOy = _mm512_setzero_ps();
+    int size = 0;
+
+    for (int c = 0; c < cellCount; c++) {
+        const int first = cellStart[cells[c]];
+        const int last = cellStart[cells[c] + 1];
+        for (int j = first; j < last; j += 16) {
+            __mmask16 loaded = last - j >= 16 ? 0xFFFF : (__mmask16) ((1u << (last - j)) - 1);
+            __mmask16 valid = loaded;
+            if (self >= j && self < j + 16) valid &= (__mmask16) ~(1u << (self - j));
+
+            __m512 ox = _mm512_maskz_loadu_ps(loaded, soa->positionX + j);
+            __m512 oy = _mm512_maskz_loadu_ps(loaded, soa->positionY + j);
+            __m512 dx = _mm512_sub_ps(ox, px);
+            __m512 dy = _mm512_sub_ps(oy, py);
+            __m512 dist = _mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy));
+            __mmask16 inRange = _mm512_mask_cmp_ps_mask(valid, dist, radiusSqr, _CMP_LT_OQ);
+            if (inRange == 0) continue;
+
+            sumVx = _mm512_mask_add_ps(sumVx, inRange, sumVx, _mm512_maskz_loadu_ps(inRange, soa->velocityX + j));
+            sumVy = _mm512_mask_add_ps(sumVy, inRange, sumVy, _mm512_maskz_loadu_ps(inRange, soa->velocityY + j));
+            sumPx = _mm512_mask_add_ps(sumPx, inRange, sumPx, ox);
+            sumPy = _mm512_mask_add_ps(sumPy, inRange, sumPy, oy);
+
+            __mmask16 separate = _mm512_mask_cmp_ps_mask(inRange, dist, minDist, _CMP_GT_OQ);
+            __m512 inverse = _mm512_maskz_div_ps(separate, one, dist);
+            sumOx = _mm512_mask_sub_ps(sumOx, separate, sumOx, _mm512_mul_ps(dx, inverse));
+            sumOy = _mm512_mask_sub_ps(sumOy, separate, sumOy, _mm512_mul_ps(dy, inverse));
+            size += __builtin_popcount(inRange);
+        }
+    }
+
+    flock->velocitiesSum = (Vector2){_mm512_reduce_add_ps(sumVx), _mm512_reduce_add_ps(sumVy)};
+    flock->positionsSum = (Vector2){_mm512_reduce_add_ps(sumPx), _mm512_reduce_add_ps(sumPy)};
+    flock->oppositeDirectionsSum = (Vector2){_mm512_reduce_add_ps(sumOx), _mm512_reduce_add_ps(sumOy)};
+    flock->size = size;
+}
+#endif
+
+int FlockKernelSupported(FlockKernel kernel) {
+    switch (kernel) {
+        case FLOCK_KERNEL_SCALAR:
+        case FLOCK_KERNEL_SOA:
+        case FLOCK_KERNEL_Q16:
+        case FLOCK_KERNEL_Q32:
+            return 1;
+#ifdef BOIDS_X86
+        case FLOCK_KERNEL_SSE:
+            return 1;
+        case FLOCK_KERNEL_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case FLOCK_KERNEL_AVX512:
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Parses a kernel name, "auto" picks the widest kernel the cpu supports.
+ * @return the kernel, or -1 if the name is unknown or the kernel can't run here.
+ */
+int FlockKernelParse(const char *name) {
+    if (strcmp(name, "auto") == 0) {
+        for (int kernel = FLOCK_KERNEL_AVX512; kernel > FLOCK_KERNEL_SOA; kernel--) {
+            if (FlockKernelSupported(kernel)) return kernel;
+        }
+        return FLOCK_KERNEL_SOA;
+    }
+    for (int kernel = FLOCK_KERNEL_SCALAR; kernel <= FLOCK_KERNEL_Q32; kernel++) {
+        if (strcmp(name, flockKernelNames[kernel]) == 0) {
+            return FlockKernelSupported(kernel) ? kernel : -1;
+        }
+    }
+    return -1;
+}
+
+const char *FlockKernelName(FlockKernel kernel) {
+    return flockKernelNames[kernel];
+}
+
+FlockSoAFunction FlockKernelFunction(FlockKernel kernel) {
+    switch (kernel) {
+        case FLOCK_KERNEL_Q16:
+            return GetLocalFlockQ16;
+        case FLOCK_KERNEL_Q32:
+            return GetLocalFlockQ32;
+#ifdef BOIDS_X86
+        case FLOCK_KERNEL_SSE:
+            return GetLocalFlockSSE;
+        case FLOCK_KERNEL_AVX2:
+            return GetLocalFlockAVX2;
+        case FLOCK_KERNEL_AVX512:
+            return GetLocalFlockAVX512;
+#endif
+        default:
+            return GetLocalFlockSoA;
+    }
+}
+
+Vector2 GetBoidAlignmentForce(const SimParams *params, Boid *boid, LocalFlock *localFlock, float weight) {
+    Vector2 averageVelocity = localFlock->velocitiesSum;
+    if (localFlock->size > 0) {
+        averageVelocity = Vector2Scale(averageVelocity, 1.0 / localFlock->size);
+        averageVelocity = Vector2Subtract(averageVelocity, boid->velocity);
+        averageVelocity = Vector2Scale(averageVelocity, weight);
+        averageVelocity = Vector2ClampValue(averageVelocity, -params->maxAcceleration, params->maxAcceleration);
+    }
+    return averageVelocity;
+}
+
+Vector2 GetBoidCohesionForce(const SimParams *params, Boid *boid, LocalFlock *localFlock, float weight) {
+    Vector2 averagePosition = localFlock->positionsSum;
+    if (localFlock->size > 0) {
+        averagePosition = Vector2Scale(averagePosition, 1.0 / localFlock->size);
+        // get the vector from boid -> averagePosition
+        averagePosition = Vector2Subtract(averagePosition, boid->position);
+        // scale it
+        averagePosition = Vector2Scale(averagePosition, weight);
+        averagePosition = Vector2ClampValue(averagePosition, -params->maxAcceleration, params->maxAcceleration);
+    }
+    return averagePosition;
+}
+
+Vector2 GetBoidSeparationForce(const SimParams *params, Boid *boid, LocalFlock *localFlock, float weight) {
+    Vector2 averageOppositeDirection = localFlock->oppositeDirectionsSum;
+    if (localFlock->size > 0) {
+        averageOppositeDirection = Vector2Scale(averageOppositeDirection, 1.0 / localFlock->size);
+        averageOppositeDirection = Vector2Scale(averageOppositeDirection, weight);
+        averageOppositeDirection = Vector2ClampValue(averageOppositeDirection, -params->maxAcceleration,
+                                                     params->maxAcceleration);
+    }
+    return averageOppositeDirection;
+}
+
+static inline int BoidId(const int *boidIds, int slot) {
+    return boidIds != NULL ? boidIds[slot] : slot;
+}
+
+/**
+ * @return the wander noise of the boid with the given id at a frame, the same whichever thread draws it.
+ */
+Vector2 GetBoidWanderForce(uint64_t seed, int id, int frame, float weight) {
+    const PhiloxBlock bits = PhiloxDraw(seed, id, frame, PHILOX_STREAM_WANDER);
+    return (Vector2){PhiloxFloat(bits.v[0], -weight, weight), PhiloxFloat(bits.v[1], -weight, weight)};
+}
+
+/**
+ * @brief The acceleration of a boid from its flock under params, seed keys the wander noise.
+ */
+Vector2 GetBoidAcceleration(const SimParams *params, uint64_t seed, Boid *boid, LocalFlock *localFlock, int id,
+                            int frame) {
+    Vector2 allignmentForce = GetBoidAlignmentForce(params, boid, localFlock, params->alignmentWeight);
+    Vector2 cohesionForce = GetBoidCohesionForce(params, boid, localFlock, params->cohesionWeight);
+    Vector2 separationForce = GetBoidSeparationForce(params, boid, localFlock, params->separationWeight);
+    Vector2 acceleration = Vector2Add(Vector2Add(allignmentForce, cohesionForce), separationForce);
+    if (params->wanderWeight > 0) {
+        acceleration = Vector2Add(acceleration, GetBoidWanderForce(seed, id, frame, params->wanderWeight));
+    }
+    return acceleration;
+}
+
+/**
+ * @brief Either integrates boid i straight into the next buffer (fused mode) or stores its
+ * acceleration for the update loop.
+ */
+static inline void ApplyAcceleration(const SimParams *params, const Boid *boids, Boid *nextBoids,
+                                     Vector2 *accelerations, int i, Vector2 acceleration) {
+    if (nextBoids != NULL) {
+        nextBoids[i] = boids[i];
+        UpdateBoid(params, &nextBoids[i], acceleration);
+    } else {
+        accelerations[i] = acceleration;
+    }
+}
+
+/**
+ * @brief Largest difference between two flocks, relative to the magnitude of the sums.
+ */
+float LocalFlockDifference(const LocalFlock *a, const LocalFlock *b) {
+    if (a->size != b->size) return INFINITY;
+    float difference = 0;
+    const Vector2 pairs[3][2] = {
+        {a->velocitiesSum, b->velocitiesSum},
+        {a->positionsSum, b->positionsSum},
+        {a->oppositeDirectionsSum, b->oppositeDirectionsSum}
+    };
+    for (int k = 0; k < 3; k++) {
+        float error = Vector2Length(Vector2Subtract(pairs[k][0], pairs[k][1]));
+        difference = fmaxf(difference, error / fmaxf(1.0f, Vector2Length(pairs[k][0])));
+    }
+    return difference;
+}
+
+typedef struct {
+    LocalFlock *flocks;  // per boid sums, filled from both sides of each pair
+    int *colorStart;     // colorCount + 1 offsets into colorCells
+    int *colorCells;     // cells grouped by color, cells of one color never write the same boids
+    int colorCount;
+    int boidCapacity;
+} HalfStencil;
+
+// self is handled separately, these are the forward half of the 3x3 neighbourhood
+static const int halfStencilOffsets[4][2] = {{0, 1}, {1, -1}, {1, 0}, {1, 1}};
+
+/**
+ * @brief Allocates the per boid flocks and colors the grid for the half stencil engine.
+ *
+ * Processing a cell writes to the boids of rows [row, row + 1] and cols [col - 1, col + 1], so
+ * rows alternate between two colors and cols cycle through three. When the grid doesn't divide
+ * evenly the leftover rows and cols get colors of their own, so the wrap around stays race free.
+ */
+HalfStencil HalfStencilAlloc(const BoidGrid *grid, int boidCapacity, HugePageMode *hugePages) {
+    const int height = grid->gridHeight, width = grid->gridWidth;
+    if (height < 3 || width < 3) {
+        fprintf(stderr, "The half stencil engine needs a grid of at least 3x3 cells\n");
+        return (HalfStencil){.flocks = NULL};
+    }
+
+    const int rowColors = height % 2 == 0 ? 2 : 3;
+    const int colColors = 3 + width % 3;
+    HalfStencil stencil = {
+        .flocks = HugeAlloc(boidCapacity * sizeof(LocalFlock), hugePages),
+        .colorStart = calloc(rowColors * colColors + 1, sizeof(int)),
+        .colorCells = malloc(height * width * sizeof(int)),
+        .colorCount = rowColors * colColors,
+        .boidCapacity = boidCapacity
+    };
+    if (stencil.flocks == NULL || stencil.colorStart == NULL || stencil.colorCells == NULL) {
+        perror("Failed to allocate half stencil");
+        HugeFree(stencil.flocks, boidCapacity * sizeof(LocalFlock));
+        free(stencil.colorStart);
+        free(stencil.colorCells);
+        return (HalfStencil){.flocks = NULL};
+    }
+
+    // counting sort of the cells by color
+    for (int pass = 0; pass < 2; pass++) {
+        for (int row = 0; row < height; row++) {
+            for (int col = 0; col < width; col++) {
+                int rowColor = row < height - height % 2 ? row % 2 : 2;
+                int colColor = col < width - width % 3 ? col % 3 : 3 + col - (width - width % 3);
+                int color = rowColor * colColors + colColor;
+                if (pass == 0) {
+                    stencil.colorStart[color + 1]++;
+                } else {
+                    stencil.colorCells[stencil.colorStart[color]++] = row * width + col;
+                }
+            }
+        }
+        if (pass == 0) {
+            for (int color = 0; color < stencil.colorCount; color++) {
+                stencil.colorStart[color + 1] += stencil.colorStart[color];
+            }
+        } else {
+            // the scatter advanced every start to the next color's start
+            memmove(stencil.colorStart + 1, stencil.colorStart, stencil.colorCount * sizeof(int));
+            stencil.colorStart[0] = 0;
+        }
+    }
+
+    return stencil;
+}
+
+void HalfStencilFree(HalfStencil *stencil) {
+    if (stencil == NULL || stencil->flocks == NULL) return;
+
+    HugeFree(stencil->flocks, stencil->boidCapacity * sizeof(LocalFlock));
+    free(stencil->colorStart);
+    free(stencil->colorCells);
+
+    stencil->flocks = NULL;
+}
+
+static inline void AccumulatePair(const Boid *boids, LocalFlock *flocks, int a, int b, float radius) {
+    const Boid *boidA = &boids[a];
+    const Boid *boidB = &boids[b];
+    float dist = Vector2DistanceSqr(boidB->position, boidA->position);
+    if (dist >= radius * radius) return;
+
+    LocalFlock *flockA = &flocks[a];
+    LocalFlock *flockB = &flocks[b];
+    flockA->velocitiesSum = Vector2Add(flockA->velocitiesSum, boidB->velocity);
+    flockB->velocitiesSum = Vector2Add(flockB->velocitiesSum, boidA->velocity);
+    flockA->positionsSum = Vector2Add(flockA->positionsSum, boidB->position);
+    flockB->positionsSum = Vector2Add(flockB->positionsSum, boidA->position);
+    if (dist > 0.01f) {
+        // the separation term is antisymmetric, b gets the same vector pointing the other way
+        Vector2 oppositeDirection = Vector2Subtract(boidA->position, boidB->position);
+        oppositeDirection = Vector2Scale(oppositeDirection, 1.0 / pow(Vector2Length(oppositeDirection), 2));
+        flockA->oppositeDirectionsSum = Vector2Add(flockA->oppositeDirectionsSum, oppositeDirection);
+        flockB->oppositeDirectionsSum = Vector2Subtract(flockB->oppositeDirectionsSum, oppositeDirection);
+    }
+    flockA->size++;
+    flockB->size++;
+}
+
+/**
+ * @brief Fills stencil->flocks with the same sums GetLocalFlock computes, visiting each pair of
+ * cells and each pair of boids once.
+ *
+ * Every cell is paired with itself and its 4 forward neighbours. Colors run one after the other,
+ * the cells of a color in parallel. The flocks must be zero on entry, whoever consumes them
+ * should clear them for the next frame. Must be reached by every thread of the parallel region.
+ */
+void HalfStencilAccumulate(HalfStencil *stencil, const Boid *boids, const BoidGrid *grid, float radius) {
+    for (int color = 0; color < stencil->colorCount; color++) {
+#pragma omp for schedule(dynamic, 16)
+        for (int k = stencil->colorStart[color]; k < stencil->colorStart[color + 1]; k++) {
+            const int cell = stencil->colorCells[k];
+            const int row = cell / grid->gridWidth;
+            const int col = cell % grid->gridWidth;
+            const int first = grid->cellStart[cell];
+            const int last = grid->cellEnd[cell];
+
+            for (int i = first; i < last; i++) {
+                for (int j = i + 1; j < last; j++) {
+                    AccumulatePair(boids, stencil->flocks, grid->cellBoids[i], grid->cellBoids[j], radius);
+                }
+            }
+
+            for (int n = 0; n < 4; n++) {
+                const int neighborRow = (row + halfStencilOffsets[n][0] + grid->gridHeight) % grid->gridHeight;
+                const int neighborCol = (col + halfStencilOffsets[n][1] + grid->gridWidth) % grid->gridWidth;
+                const GridCell neighbor = BoidGridGetCell(grid, neighborRow, neighborCol);
+                for (int i = first; i < last; i++) {
+                    for (int j = 0; j < neighbor.size; j++) {
+                        AccumulatePair(boids, stencil->flocks, grid->cellBoids[i], neighbor.boids[j], radius);
+                    }
+                }
+            }
+        } // implicit barrier, the next color may touch the same boids
+    }
+}
+
+typedef struct {
+    long *neighborStart;       // boidCapacity + 1 offsets into neighbors
+    int *neighbors;            // CSR lists of the boids within radius + skin at the last build
+    long neighborCapacity;
+    Vector2 *buildPositions;   // positions at the last build
+    long *threadSums;          // scratch for the parallel scan of the list lengths
+    float *threadDisplacement; // scratch for the max displacement
+    float skin;
+    int boidCapacity;
+    int failed;                // the last build could not grow neighbors, the lists are unusable
+    long rebuilds;
+} VerletList;
+
+VerletList VerletListAlloc(int boidCapacity, float skin, int maxThreads, HugePageMode *hugePages) {
+    VerletList list = {
+        .neighborStart = HugeAlloc((boidCapacity + 1) * sizeof(long), hugePages),
+        .neighbors = NULL,
+        .neighborCapacity = 0,
+        .buildPositions = HugeAlloc(boidCapacity * sizeof(Vector2), hugePages),
+        .threadSums = malloc(maxThreads * sizeof(long)),
+        .threadDisplacement = malloc(maxThreads * sizeof(float)),
+        .skin = skin,
+        .boidCapacity = boidCapacity,
+        .rebuilds = 0
+    };
+    if (list.neighborStart == NULL || list.buildPositions == NULL || list.threadSums == NULL ||
+        list.threadDisplacement == NULL) {
+        perror("Failed to allocate verlet lists");
+        HugeFree(list.neighborStart, (boidCapacity + 1) * sizeof(long));
+        HugeFree(list.buildPositions, boidCapacity * sizeof(Vector2));
+        free(list.threadSums);
+        free(list.threadDisplacement);
+        return (VerletList){.neighborStart = NULL};
+    }
+    return list;
+}
+
+void VerletListFree(VerletList *list) {
+    if (list == NULL || list->neighborStart == NULL) return;
+
+    HugeFree(list->neighborStart, (list->boidCapacity + 1) * sizeof(long));
+    HugeFree(list->neighbors, list->neighborCapacity * sizeof(int));
+    HugeFree(list->buildPositions, list->boidCapacity * sizeof(Vector2));
+    free(list->threadSums);
+    free(list->threadDisplacement);
+
+    list->neighborStart = NULL;
+}
+
+// shortest signed distance between two coordinates of the toroidal world
+static inline float WrapDelta(float delta, int worldSize) {
+    if (delta > worldSize / 2.0f) return delta - worldSize;
+    if (delta < -worldSize / 2.0f) return delta + worldSize;
+    return delta;
+}
+
+/**
+ * @brief Whether some boid moved more than skin / 2 since the last build, so a pair now within the
+ * radius may be missing from the lists. Uses the wrapped distance, so crossing the world edge
+ * doesn't count as a jump. Must be reached by every thread, all of them get the same answer.
+ */
+int VerletListExpired(VerletList *list, const Boid *boids, int boidCount, int worldSize) {
+    const int threadId = omp_get_thread_num();
+    float maxDisplacementSqr = 0;
+
+#pragma omp for schedule(static)
+    for (int i = 0; i < boidCount; i++) {
+        float dx = WrapDelta(boids[i].position.x - list->buildPositions[i].x, worldSize);
+        float dy = WrapDelta(boids[i].position.y - list->buildPositions[i].y, worldSize);
+        maxDisplacementSqr = fmaxf(maxDisplacementSqr, dx * dx + dy * dy);
+    }
+    list->threadDisplacement[threadId] = maxDisplacementSqr;
+#pragma omp barrier
+
+    for (int t = 0; t < omp_get_num_threads(); t++) {
+        maxDisplacementSqr = fmaxf(maxDisplacementSqr, list->threadDisplacement[t]);
+    }
+    // nobody may overwrite the slots before everyone has read them
+#pragma omp barrier
+    return list->rebuilds == 0 || list->failed || maxDisplacementSqr > list->skin * list->skin / 4;
+}
+
+/**
+ * @brief Collects the boids within cutoff of boid current, wrapped distance. Only counts them when
+ * out is NULL.
+ */
+static int VerletCandidates(const Boid *boids, const BoidGrid *grid, int current, int range, float cutoff,
+                            int worldSize, int *out) {
+    const Vector2 position = boids[current].position;
+    int cells[(2 * range + 1) * (2 * range + 1)];
+    int cellCount = BoidGridNeighborCells(grid, position, range, cells);
+    int count = 0;
+
+    for (int c = 0; c < cellCount; c++) {
+        for (int j = grid->cellStart[cells[c]]; j < grid->cellEnd[cells[c]]; j++) {
+            const int other = grid->cellBoids[j];
+            float dx = WrapDelta(boids[other].position.x - position.x, worldSize);
+            float dy = WrapDelta(boids[other].position.y - position.y, worldSize);
+            if (dx * dx + dy * dy < cutoff * cutoff && other != current) {
+                if (out != NULL) out[count] = other;
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Rebuilds the lists at the perception radius of params + skin from a freshly built grid: count, scan,
+ * fill. Must be reached by every thread of the enclosing parallel region.
+ * @return 0, or -1 on every thread if the lists could not grow, then they must be rebuilt before any use.
+ */
+int VerletListBuild(VerletList *list, const Boid *boids, const BoidGrid *grid, int boidCount, const SimParams *params,
+                    HugePageMode *hugePages) {
+    const float cutoff = params->perceptionRadius + list->skin;
+    const int worldSize = params->worldSize;
+    const int range = (int) ceilf(cutoff / grid->gridResolution);
+    // BoidsConfigCheck rejects wider stencils, they would visit some cells twice
+    assert(2 * range + 1 <= grid->gridHeight && 2 * range + 1 <= grid->gridWidth);
+
+#pragma omp for schedule(dynamic, 64)
+    for (int i = 0; i < boidCount; i++) {
+        list->neighborStart[i + 1] = VerletCandidates(boids, grid, i, range, cutoff, worldSize, NULL);
+        list->buildPositions[i] = boids[i].position;
+    } // implicit barrier
+
+    // inclusive scan of the counts, per thread block first
+    const int threadId = omp_get_thread_num();
+    const int threadCount = omp_get_num_threads();
+    const int first = (int) ((long) boidCount * threadId / threadCount) + 1;
+    const int last = (int) ((long) boidCount * (threadId + 1) / threadCount) + 1;
+    long blockSum = 0;
+    for (int i = first; i < last; i++) {
+        blockSum += list->neighborStart[i];
+        list->neighborStart[i] = blockSum;
+    }
+    list->threadSums[threadId] = blockSum;
+#pragma omp barrier
+    long blockOffset = 0;
+    for (int t = 0; t < threadId; t++) {
+        blockOffset += list->threadSums[t];
+    }
+    for (int i = first; i < last; i++) {
+        list->neighborStart[i] += blockOffset;
+    }
+#pragma omp barrier
+
+#pragma omp single
+    {
+        list->neighborStart[0] = 0;
+        const long total = list->neighborStart[boidCount];
+        list->failed = 0;
+        if (total > list->neighborCapacity) {
+            HugeFree(list->neighbors, list->neighborCapacity * sizeof(int));
+            list->neighborCapacity = total + total / 2;
+            list->neighbors = HugeAlloc(list->neighborCapacity * sizeof(int), hugePages);
+            if (list->neighbors == NULL) {
+                list->neighborCapacity = 0;
+                list->failed = 1;
+            }
+        }
+        if (!list->failed) list->rebuilds++;
+    } // implicit barrier
+    if (list->failed) return -1;
+
+#pragma omp for schedule(dynamic, 64)
+    for (int i = 0; i < boidCount; i++) {
+        VerletCandidates(boids, grid, i, range, cutoff, worldSize, list->neighbors + list->neighborStart[i]);
+    } // implicit barrier
+    return 0;
+}
+
+/**
+ * @brief Same sums as GetLocalFlock, over the boid's verlet list instead of the grid.
+ */
+void GetLocalFlockVerlet(const Boid *boids, const VerletList *list, int current, LocalFlock *flock, float radius) {
+    const Vector2 position = boids[current].position;
+    *flock = (LocalFlock){0};
+
+    for (long k = list->neighborStart[current]; k < list->neighborStart[current + 1]; k++) {
+        const Boid *other = &boids[list->neighbors[k]];
+        float dist = Vector2DistanceSqr(other->position, position);
+        if (dist < radius * radius) {
+            flock->velocitiesSum = Vector2Add(flock->velocitiesSum, other->velocity);
+            flock->positionsSum = Vector2Add(flock->positionsSum, other->position);
+            Vector2 oppositeDirection = Vector2Subtract(position, other->position);
+            if (dist > 0.01f) {
+                oppositeDirection = Vector2Scale(oppositeDirection, 1.0 / pow(Vector2Length(oppositeDirection), 2));
+                flock->oppositeDirectionsSum = Vector2Add(flock->oppositeDirectionsSum, oppositeDirection);
+            }
+            flock->size++;
+        }
+    }
+}
+
+/**
+ * Cost-model scheduler of the scalar gather loop, over blocks of cells instead of boids. Every frame
+ * the cells are split into blocksPerThread blocks per thread, contiguous and of about the same cost,
+ * the cost of a cell being the neighbour candidates its boids had the last time it was walked. Thread
+ * t owns the run of blocks from t * blocksPerThread on and walks it in order, so it keeps one compact
+ * strip of the world. A thread that runs out steals single blocks from the far end of another's run.
+ */
+typedef struct {
+    long *cellCost;        // candidates of the boids of each cell when it was last walked, plus one for the cell
+    long *threadSums;      // per-thread cost of a chunk of cells, used by the scan
+    int *blockStart;       // maxThreads * blocksPerThread + 1 first cells, of the blocks of this frame
+    uint64_t *deques;      // per thread, next << 32 | end of its blocks left, CELL_DEQUE_STRIDE apart
+    int blocksPerThread;
+    int cellCount;
+    int maxThreads;
+    long steals;
+} CellScheduler;
+
+// one deque per cache line, so taking a block never invalidates the line of another thread's deque
+#define CELL_DEQUE_STRIDE 8
+
+CellScheduler CellSchedulerAlloc(const BoidGrid *grid, int maxThreads, int blocksPerThread) {
+    const int cellCount = grid->gridHeight * grid->gridWidth;
+    CellScheduler scheduler = {
+        .cellCost = malloc(cellCount * sizeof(long)),
+        .threadSums = malloc(maxThreads * sizeof(long)),
+        .blockStart = malloc(((size_t) maxThreads * blocksPerThread + 1) * sizeof(int)),
+        .deques = aligned_alloc(64, (size_t) maxThreads * CELL_DEQUE_STRIDE * sizeof(uint64_t)),
+        .blocksPerThread = blocksPerThread,
+        .cellCount = cellCount,
+        .maxThreads = maxThreads
+    };
+    if (scheduler.cellCost == NULL || scheduler.threadSums == NULL || scheduler.blockStart == NULL ||
+        scheduler.deques == NULL) {
+        perror("Failed to allocate cell scheduler");
+        free(scheduler.cellCost);
+        free(scheduler.threadSums);
+        free(scheduler.blockStart);
+        free(scheduler.deques);
+        return (CellScheduler){.cellCost = NULL};
+    }
+
+    // until a cell was walked once, every cell costs the same
+    for (int cell = 0; cell < cellCount; cell++) {
+        scheduler.cellCost[cell] = 1;
+    }
+    return scheduler;
+}
+
+void CellSchedulerFree(CellScheduler *scheduler) {
+    if (scheduler == NULL || scheduler->cellCost == NULL) return;
+
+    free(scheduler->cellCost);
+    free(scheduler->threadSums);
+    free(scheduler->blockStart);
+    free(scheduler->deques);
+
+    scheduler->cellCost = NULL;
+}
+
+/**
+ * @brief First half of CellSchedulerPlan: the cost of the calling thread's chunk of cells. Its sum is read
+ * by every thread in CellSchedulerSplit, after a barrier.
+ */
+static void CellSchedulerSum(CellScheduler *scheduler) {
+    const int threadId = TeamThreadNum();
+    const int threadCount = TeamNumThreads();
+    const int first = (int) ((long) scheduler->cellCount * threadId / threadCount);
+    const int last = (int) ((long) scheduler->cellCount * (threadId + 1) / threadCount);
+    assert(threadCount <= scheduler->maxThreads);
+
+    long chunkSum = 0;
+    for (int cell = first; cell < last; cell++) {
+        chunkSum += scheduler->cellCost[cell];
+    }
+    scheduler->threadSums[threadId] = chunkSum;
+}
+
+/**
+ * @brief Second half of CellSchedulerPlan. Block b starts at the first cell whose preceding cells cost at
+ * least total * b / blockCount, the scan over the chunk sums tells every thread which of those targets fall
+ * into its chunk. The blocks can be taken after the next barrier.
+ */
+static void CellSchedulerSplit(CellScheduler *scheduler) {
+    const int threadId = TeamThreadNum();
+    const int threadCount = TeamNumThreads();
+    const int blockCount = threadCount * scheduler->blocksPerThread;
+    const int first = (int) ((long) scheduler->cellCount * threadId / threadCount);
+    const int last = (int) ((long) scheduler->cellCount * (threadId + 1) / threadCount);
+
+    long offset = 0, total = 0;
+    for (int t = 0; t < threadCount; t++) {
+        if (t < threadId) offset += scheduler->threadSums[t];
+        total += scheduler->threadSums[t];
+    }
+    const long chunkSum = scheduler->threadSums[threadId];
+
+    // this chunk places the blocks whose target lies in (offset, offset + chunkSum], the first one also those at 0
+    int block = threadId == 0 ? 0 : (int) (offset * blockCount / total);
+    while (threadId > 0 && block < blockCount && total * block / blockCount <= offset) block++;
+    long prefix = offset;
+    for (int cell = first; cell < last && block < blockCount; cell++) {
+        while (block < blockCount && total * block / blockCount <= prefix) {
+            scheduler->blockStart[block++] = cell;
+        }
+        prefix += scheduler->cellCost[cell];
+    }
+    // targets reached by the last cell of the chunk start right after it
+    while (block < blockCount && total * block / blockCount <= offset + chunkSum) {
+        scheduler->blockStart[block++] = last;
+    }
+    if (threadId == threadCount - 1) scheduler->blockStart[blockCount] = scheduler->cellCount;
+
+    const uint64_t firstBlock = (uint64_t) threadId * scheduler->blocksPerThread;
+    scheduler->deques[(size_t) threadId * CELL_DEQUE_STRIDE] = firstBlock << 32 | (firstBlock +
+                                                                                  scheduler->blocksPerThread);
+}
+
+/**
+ * @brief Splits the cells into the blocks of this frame and hands every thread its run of them.
+ *
+ * The cells are only walked once, in parallel, a chunk per thread. Must be reached by every thread, ends
+ * with a barrier.
+ */
+void CellSchedulerPlan(CellScheduler *scheduler) {
+    CellSchedulerSum(scheduler);
+    TeamBarrier();
+    CellSchedulerSplit(scheduler);
+    TeamBarrier();
+}
+
+/**
+ * @return the next block of the calling thread: the front of its own run, or else the back of the run
+ * of the nearest thread that has blocks left, counting the steal. -1 once every block was taken.
+ */
+int CellSchedulerNext(CellScheduler *scheduler, int threadId, int threadCount, int *steals) {
+    for (int k = 0; k < threadCount; k++) {
+        const int victim = (threadId + k) % threadCount;
+        uint64_t *deque = &scheduler->deques[(size_t) victim * CELL_DEQUE_STRIDE];
+        uint64_t blocks = __atomic_load_n(deque, __ATOMIC_ACQUIRE);
+        for (;;) {
+            const uint32_t next = (uint32_t) (blocks >> 32), end = (uint32_t) blocks;
+            if (next >= end) break;
+
+            // owner and thieves take from opposite ends, so they only meet over the last block
+            const uint64_t left = k == 0 ? (uint64_t) (next + 1) << 32 | end : (uint64_t) next << 32 | (end - 1);
+            if (__atomic_compare_exchange_n(deque, &blocks, left, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                if (k > 0) (*steals)++;
+                return k == 0 ? (int) next : (int) end - 1;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * @return the boids in the 3x3 cells around a cell, the candidates of each of its own boids.
+ */
+static long BoidGridNeighborhoodSize(const BoidGrid *grid, int cell) {
+    const int row = cell / grid->gridWidth;
+    const int col = cell % grid->gridWidth;
+    long size = 0;
+    int k = 0;
+    for (int dcol = -1; dcol <= 1; dcol++) {
+        for (int drow = -1; drow <= 1; drow++, k++) {
+            size += BoidGridCellAt(grid, BoidGridWrapCell(grid, row, col, drow, dcol, GRID_WRAP_MODULO, NULL, k)).size;
+        }
+    }
+    return size;
+}
+
+/**
+ * @brief Gathers the flock of boid i on the index of the scalar kernel and applies its acceleration.
+ * @return the difference from GetLocalFlock when checking the two-level index, otherwise 0.
+ */
+static inline float GatherBoid(Boid *boids, Boid *nextBoids, Vector2 *accelerations, int i, BoidGrid *boidGrid,
+                               const FineGrid *fineGrid, const HashGrid *hashGrid,
+                               LocalFlockFunction localFlockFunction, int checkKernel, const int *boidIds, int frame,
+                               const SimParams *params, uint64_t seed) {
+    const float perceptionRadius = params->perceptionRadius;
+    LocalFlock threadLocalFlock;
+    float error = 0;
+
+    if (fineGrid != NULL) {
+        GetLocalFlockTwoLevel(boids, i, boidGrid, fineGrid, &threadLocalFlock, perceptionRadius);
+        if (checkKernel) {
+            LocalFlock reference;
+            GetLocalFlock(boids, i, boidGrid, 1, &reference, perceptionRadius);
+            error = LocalFlockDifference(&reference, &threadLocalFlock);
+        }
+    } else if (hashGrid != NULL) {
+        GetLocalFlockHashed(boids, i, hashGrid, &threadLocalFlock, perceptionRadius);
+    } else {
+        localFlockFunction(boids, i, boidGrid, 1, &threadLocalFlock, perceptionRadius);
+    }
+
+    Vector2 acceleration = GetBoidAcceleration(params, seed, &boids[i], &threadLocalFlock, BoidId(boidIds, i), frame);
+    ApplyAcceleration(params, boids, nextBoids, accelerations, i, acceleration);
+    return error;
+}
+
+/**
+ * @brief Gathers the flocks of the boids in every block the calling thread gets from the plan of this frame,
+ * and measures the cost of their cells for the next one.
+ * @return the largest difference GatherBoid found.
+ */
+static float CellSchedulerGather(CellScheduler *scheduler, Boid *boids, Boid *nextBoids, Vector2 *accelerations,
+                                 BoidGrid *boidGrid, const FineGrid *fineGrid, LocalFlockFunction localFlockFunction,
+                                 int checkKernel, const int *boidIds, int frame, const SimParams *params,
+                                 uint64_t seed) {
+    const int threadId = TeamThreadNum();
+    const int threadCount = TeamNumThreads();
+    float error = 0;
+    int steals = 0;
+    for (int block; (block = CellSchedulerNext(scheduler, threadId, threadCount, &steals)) >= 0;) {
+        for (int cell = scheduler->blockStart[block]; cell < scheduler->blockStart[block + 1]; cell++) {
+            const GridCell boidsOfCell = BoidGridCellAt(boidGrid, cell);
+            for (int j = 0; j < boidsOfCell.size; j++) {
+                error = fmaxf(error, GatherBoid(boids, nextBoids, accelerations, boidsOfCell.boids[j], boidGrid,
+                                                fineGrid, NULL, localFlockFunction, checkKernel, boidIds, frame,
+                                                params, seed));
+            }
+            // a cell costs what its boids walked, the next frame balances on it
+            scheduler->cellCost[cell] = boidsOfCell.size > 0 ? 1 + boidsOfCell.size *
+                                                                   BoidGridNeighborhoodSize(boidGrid, cell) : 1;
+        }
+    }
+    if (steals > 0) __atomic_fetch_add(&scheduler->steals, steals, __ATOMIC_RELAXED);
+    return error;
+}
+
+typedef struct {
+    int *cellOrder;    // grid cells sorted along the curve
+    int *cellTarget;   // first slot of each cell in the reordered array, by curve position
+    int *boidIds;      // boidIds[slot] is the id of the boid stored in boids[slot]
+    int *boidSlots;    // inverse of boidIds, where the boid with a given id currently lives
+    int *scratchIds;
+    Boid *scratch;
+    int cellCount;
+    int boidCapacity;
+} BoidOrdering;
+
+static uint32_t MortonKey(uint32_t x, uint32_t y) {
+    uint32_t key = 0;
+    for (int bit = 0; bit < 16; bit++) {
+        key |= ((x >> bit) & 1u) << (2 * bit) | ((y >> bit) & 1u) << (2 * bit + 1);
+    }
+    return key;
+}
+
+/**
+ * @brief Distance of (x, y) along the Hilbert curve filling an n x n square, n a power of two.
+ */
+static uint32_t HilbertKey(uint32_t n, uint32_t x, uint32_t y) {
+    uint32_t key = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        key += s * s * ((3 * rx) ^ ry);
+        // rotate the quadrant so the sub-curve has the canonical orientation
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            uint32_t t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return key;
+}
+
+static int CompareCurveKeys(const void *a, const void *b) {
+    uint64_t ka = *(const uint64_t *) a, kb = *(const uint64_t *) b;
+    return (ka > kb) - (ka < kb);
+}
+
+BoidOrdering BoidOrderingAlloc(const BoidGrid *grid, int boidCount, SpaceFillingCurve curve,
+                               HugePageMode *hugePages) {
+    const int cellCount = grid->gridHeight * grid->gridWidth;
+    BoidOrdering ordering = {
+        .cellOrder = malloc(cellCount * sizeof(int)),
+        .cellTarget = malloc(cellCount * sizeof(int)),
+        .boidIds = HugeAlloc(boidCount * sizeof(int), hugePages),
+        .boidSlots = HugeAlloc(boidCount * sizeof(int), hugePages),
+        .scratchIds = HugeAlloc(boidCount * sizeof(int), hugePages),
+        .scratch = HugeAlloc(boidCount * sizeof(Boid), hugePages),
+        .cellCount = cellCount,
+        .boidCapacity = boidCount
+    };
+    uint64_t *keys = malloc(cellCount * sizeof(uint64_t));
+
+    if (ordering.cellOrder == NULL || ordering.cellTarget == NULL || ordering.boidIds == NULL ||
+        ordering.boidSlots == NULL || ordering.scratchIds == NULL || ordering.scratch == NULL || keys == NULL) {
+        perror("Failed to allocate boid ordering");
+        free(ordering.cellOrder);
+        free(ordering.cellTarget);
+        HugeFree(ordering.boidIds, boidCount * sizeof(int));
+        HugeFree(ordering.boidSlots, boidCount * sizeof(int));
+        HugeFree(ordering.scratchIds, boidCount * sizeof(int));
+        HugeFree(ordering.scratch, boidCount * sizeof(Boid));
+        free(keys);
+        return (BoidOrdering){.cellOrder = NULL};
+    }
+
+    uint32_t side = 1;
+    while (side < (uint32_t) grid->gridHeight || side < (uint32_t) grid->gridWidth) side *= 2;
+
+    for (int row = 0; row < grid->gridHeight; row++) {
+        for (int col = 0; col < grid->gridWidth; col++) {
+            const int cell = row * grid->gridWidth + col;
+            uint64_t key = curve == CURVE_HILBERT ? HilbertKey(side, row, col) : MortonKey(row, col);
+            keys[cell] = key << 32 | (uint32_t) cell;
+        }
+    }
+    qsort(keys, cellCount, sizeof(uint64_t), CompareCurveKeys);
+    for (int k = 0; k < cellCount; k++) {
+        ordering.cellOrder[k] = (int) (keys[k] & 0xFFFFFFFFu);
+    }
+    free(keys);
+
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < boidCount; i++) {
+        ordering.boidIds[i] = i;
+        ordering.boidSlots[i] = i;
+    }
+
+    return ordering;
+}
+
+void BoidOrderingFree(BoidOrdering *ordering) {
+    if (ordering == NULL || ordering->cellOrder == NULL) return;
+
+    free(ordering->cellOrder);
+    free(ordering->cellTarget);
+    HugeFree(ordering->boidIds, ordering->boidCapacity * sizeof(int));
+    HugeFree(ordering->boidSlots, ordering->boidCapacity * sizeof(int));
+    HugeFree(ordering->scratchIds, ordering->boidCapacity * sizeof(int));
+    HugeFree(ordering->scratch, ordering->boidCapacity * sizeof(Boid));
+
+    ordering->cellOrder = NULL;
+}
+
+/**
+ * @brief Permutes boids so that cells are laid out along the space-filling curve, keeping the
+ * id tables in sync. Needs a freshly built grid and leaves it stale, so rebuild it afterwards.
+ * Must be reached by every thread of the enclosing parallel region.
+ */
+void BoidOrderingApply(BoidOrdering *ordering, Boid *boids, const BoidGrid *grid, int boidCount) {
+#pragma omp single
+    {
+        int slot = 0;
+        for (int k = 0; k < ordering->cellCount; k++) {
+            const int cell = ordering->cellOrder[k];
+            ordering->cellTarget[k] = slot;
+            slot += grid->cellEnd[cell] - grid->cellStart[cell];
+        }
+    } // implicit barrier
+
+#pragma omp for schedule(dynamic, 64)
+    for (int k = 0; k < ordering->cellCount; k++) {
+        const int cell = ordering->cellOrder[k];
+        int target = ordering->cellTarget[k];
+        for (int j = grid->cellStart[cell]; j < grid->cellEnd[cell]; j++, target++) {
+            const int source = grid->cellBoids[j];
+            ordering->scratch[target] = boids[source];
+            ordering->scratchIds[target] = ordering->boidIds[source];
+        }
+    } // implicit barrier
+
+#pragma omp for schedule(static)
+    for (int slot = 0; slot < boidCount; slot++) {
+        boids[slot] = ordering->scratch[slot];
+        ordering->boidIds[slot] = ordering->scratchIds[slot];
+        ordering->boidSlots[ordering->boidIds[slot]] = slot;
+    } // implicit barrier
+}
+
+float RandomFloat(float min, float max) {
+    // Calculate the range size
+    float range = max - min;
+
+    // Scale the result of rand() (0 to RAND_MAX) to the desired range (0 to range)
+    // and then offset by min.
+    // We cast rand() to float to ensure floating-point division.
+    return min + ((float) rand() / RAND_MAX) * range;
+}
+
+Vector2 RandomVector2(float min, float max) {
+    return (Vector2){
+        .x = RandomFloat(min, max),
+        .y = RandomFloat(min, max)
+    };
+}
+
+/**
+ * @return the initial state of the boid with the given id drawn with Philox, independent of the other boids.
+ */
+Boid RandomBoid(const SimParams *params, uint64_t seed, int id) {
+    const PhiloxBlock bits = PhiloxDraw(seed, id, 0, PHILOX_STREAM_INIT);
+    return (Boid){
+        .position = {PhiloxFloat(bits.v[0], 0, params->worldSize), PhiloxFloat(bits.v[1], 0, params->worldSize)},
+        .velocity = {PhiloxFloat(bits.v[2], -params->maxVelocity, params->maxVelocity),
+                     PhiloxFloat(bits.v[3], -params->maxVelocity, params->maxVelocity)}
+    };
+}
+
+struct BoidsWorld {
+    BoidsConfig config;
+    Boid *boids;
+    Boid *nextBoids;         // fused mode integrates frame N from boids into it and swaps them
+    BoidsStorage storage;    // the caller's array one of the two may be, states NULL once released or if none
+    Vector2 *accelerations;  // otherwise the force loop leaves the accelerations for the update loop
+    BoidGrid grid;
+    FineGrid fineGrid;
+    HashGrid hashGrid;
+    BoidSoA soa;
+    HalfStencil halfStencil;
+    VerletList verletList;
+    BoidOrdering ordering;
+    CellScheduler scheduler;
+    double *forceTimes;      // per thread, force loop time of the last frame
+    HugePageMode hugePages;  // of config, HugeAlloc turns explicit into transparent when there are none
+    LocalFlockFunction localFlockFunction;
+    FlockSoAFunction flockFunction;
+    BoidsFrameHook frameStart;
+    BoidsFrameHook frameEnd;
+    void *hookData;
+    BoidsStats stats;        // the counters of the structures freed so far, see BoidsWorldStats
+    int count;
+    int capacity;
+    int maxThreads;
+    int frame;
+    int gridBuilt;           // the incremental grid holds the boids, it can be updated instead of rebuilt
+    int gridCurrent;         // a query indexed the current boids, the next frame uses that index as is
+    int indexMigrations;     // what the update of that index returned, for the stats of the next frame
+    int listsStale;          // boids were added or removed after the verlet lists were built
+    double imbalanceSum;     // forceImbalance summed over the frames, for the mean of BoidsWorldStats
+    WorkPool *pool;          // BOIDS_BACKEND_POOL only, maxThreads workers stepping the world
+    Profile *profile;        // per-phase times of its frames, NULL unless built with BOIDS_PROFILE
+};
+
+
+BoidsConfig BoidsConfigDefault(void) {
+    return (BoidsConfig){
+        .params = {
+            .worldSize = WORLD_SIZE,
+            .gridResolution = GRID_RESOLUTION,
+            .perceptionRadius = PERCEPTION_RADIUS,
+            .minVelocity = MIN_VELOCITY,
+            .maxVelocity = MAX_VELOCITY,
+            .maxAcceleration = MAX_ACCELERATION,
+            .alignmentWeight = ALIGNMENT_WEIGHT,
+            .cohesionWeight = COHESION_WEIGHT,
+            .separationWeight = SEPARATION_WEIGHT,
+            .wanderWeight = WANDER_WEIGHT
+        },
+        .rng = BOID_RNG_LIBC,
+        .engine = FORCE_ENGINE_GATHER,
+        .kernel = FLOCK_KERNEL_SCALAR,
+        .index = BOIDS_INDEX_GRID,
+        .splitThreshold = 64,
+        .gridWrap = -1,
+        .curve = CURVE_HILBERT,
+        .verletSkin = 20,
+        .migrationLimit = 0.125f,
+        .hugePages = HUGE_PAGES_TRANSPARENT
+    };
+}
+
+int BoidsConfigCheck(const BoidsConfig *config) {
+    const int gather = config->engine == FORCE_ENGINE_GATHER, scalar = config->kernel == FLOCK_KERNEL_SCALAR;
+    if (!gather && !scalar) {
+        fprintf(stderr, "--kernel only applies to the gather engine\n");
+        return -1;
+    }
+    if (config->incrementalGrid && !scalar) {
+        fprintf(stderr, "The SIMD kernels need a packed grid, they can't run with --incremental-grid\n");
+        return -1;
+    }
+    if (config->index == BOIDS_INDEX_TWO_LEVEL && (!gather || !scalar)) {
+        fprintf(stderr, "--index=two-level only applies to the gather engine with the scalar kernel\n");
+        return -1;
+    }
+    if (config->index == BOIDS_INDEX_HASHED && (!gather || !scalar || config->incrementalGrid ||
+                                                config->reorderInterval > 0 || config->checkKernel)) {
+        fprintf(stderr, "--index=hashed only applies to the gather engine with the scalar kernel, without "
+                        "--incremental-grid, --reorder or --check-kernel\n");
+        return -1;
+    }
+    // the other engines and kernels find the same neighbours, but add them up in another order
+    if (config->deterministic && (!gather || !scalar || config->index == BOIDS_INDEX_TWO_LEVEL ||
+                                  config->reorderInterval > 0)) {
+        fprintf(stderr, "--deterministic needs the gather engine with the scalar kernel and the grid or hashed "
+                        "index, without --reorder\n");
+        return -1;
+    }
+    if (config->cellBlocks < 0) {
+        fprintf(stderr, "The blocks per thread must not be negative\n");
+        return -1;
+    }
+    if (config->cellBlocks > 0 && (!gather || !scalar || config->index == BOIDS_INDEX_HASHED)) {
+        fprintf(stderr, "--schedule=cells only applies to the gather engine with the scalar kernel and a dense "
+                        "index\n");
+        return -1;
+    }
+    if (config->backend == BOIDS_BACKEND_POOL && (!gather || !scalar || config->index != BOIDS_INDEX_GRID ||
+                                                  config->incrementalGrid || config->reorderInterval > 0)) {
+        fprintf(stderr, "--backend=pool only runs the gather engine with the scalar kernel on the grid index, "
+                        "without --incremental-grid or --reorder\n");
+        return -1;
+    }
+    if (config->threads < 0) {
+        fprintf(stderr, "The thread count must not be negative\n");
+        return -1;
+    }
+    if (config->separation == BOIDS_SEPARATION_SERIAL &&
+        (!gather || !scalar || config->index != BOIDS_INDEX_GRID || config->checkKernel || config->deterministic)) {
+        fprintf(stderr, "The separation rule of main only runs on the gather engine with the scalar kernel and the "
+                        "grid index, without --check-kernel or --deterministic\n");
+        return -1;
+    }
+    if (config->migrationLimit < 0 || config->migrationLimit > 1) {
+        fprintf(stderr, "The migration limit is a fraction of the boids, between 0 and 1\n");
+        return -1;
+    }
+    if (config->verletSkin < 0) {
+        fprintf(stderr, "The verlet skin must not be negative\n");
+        return -1;
+    }
+    if (SimParamsCheck(&config->params) < 0) {
+        return -1;
+    }
+    // the verlet lists are built from the cells within radius + skin, every one of them visited once
+    const SimParams *params = &config->params;
+    const int gridSize = params->worldSize / params->gridResolution;
+    const int stencil = 2 * (int) ceilf((params->perceptionRadius + config->verletSkin) / params->gridResolution) + 1;
+    if (config->engine == FORCE_ENGINE_VERLET && stencil > gridSize) {
+        fprintf(stderr, "The verlet lists of radius + skin need %d x %d cells, more than the %d x %d of the grid\n",
+                stencil, stencil, gridSize, gridSize);
+        return -1;
+    }
+    return 0;
+}
+
+// frees a boid array of the world, or hands the adopted one back to its owner
+static void BoidsWorldFreeBoids(BoidsWorld *world, Boid *boids) {
+    if (boids != NULL && boids == (Boid *) world->storage.states) {
+        if (world->storage.release != NULL) world->storage.release(world->storage.context);
+        world->storage.states = NULL;
+    } else {
+        HugeFree(boids, world->capacity * sizeof(Boid));
+    }
+}
+
+/**
+ * @brief Frees everything BoidsWorldAllocEngine allocated, keeping the counters of the structures.
+ */
+static void BoidsWorldFreeEngine(BoidsWorld *world) {
+    world->stats.fallbackRebuilds += world->grid.fallbackRebuilds;
+    world->stats.verletRebuilds += world->verletList.rebuilds;
+    world->stats.splitCells += world->fineGrid.splitTotal;
+    world->stats.hashedCells += world->hashGrid.runTotal;
+    world->stats.steals += world->scheduler.steals;
+
+    BoidGridFree(&world->grid);
+    FineGridFree(&world->fineGrid);
+    HashGridFree(&world->hashGrid);
+    BoidSoAFree(&world->soa);
+    HalfStencilFree(&world->halfStencil);
+    VerletListFree(&world->verletList);
+    BoidOrderingFree(&world->ordering);
+    CellSchedulerFree(&world->scheduler);
+    free(world->forceTimes);
+    BoidsWorldFreeBoids(world, world->nextBoids);
+    HugeFree(world->accelerations, world->capacity * sizeof(Vector2));
+}
+
+/**
+ * @brief Allocates every structure the options of the world need for capacity boids, except the boids
+ * themselves. Overwrites the old ones without freeing them.
+ * @return 0, or -1 after freeing whatever was allocated.
+ */
+static int BoidsWorldAllocEngine(BoidsWorld *world, int capacity) {
+    const BoidsConfig *config = &world->config;
+    const int gridSize = config->params.worldSize / config->params.gridResolution;
+    world->grid = (BoidGrid){.cellStart = NULL};
+    world->fineGrid = (FineGrid){.cellSplit = NULL};
+    world->hashGrid = (HashGrid){.pairs = NULL};
+    world->soa = (BoidSoA){.positionX = NULL};
+    world->halfStencil = (HalfStencil){.flocks = NULL};
+    world->verletList = (VerletList){.neighborStart = NULL};
+    world->ordering = (BoidOrdering){.cellOrder = NULL};
+    world->scheduler = (CellScheduler){.cellCost = NULL};
+    world->forceTimes = malloc(world->maxThreads * sizeof(double));
+    world->nextBoids = NULL;
+    world->accelerations = NULL;
+    world->capacity = capacity;
+
+    // the hashed grid replaces the dense one, which would need an int per cell
+    int failed = world->forceTimes == NULL;
+    if (failed) {
+        perror("Failed to allocate force loop times");
+    } else if (config->index == BOIDS_INDEX_HASHED) {
+        world->hashGrid = HashGridAlloc(config->params.gridResolution, gridSize, gridSize, capacity,
+                                        world->maxThreads, &world->hugePages);
+        failed = world->hashGrid.pairs == NULL;
+    } else {
+        world->grid = BoidGridAlloc(config->params.gridResolution, gridSize, gridSize, capacity, world->maxThreads,
+                                    config->incrementalGrid ? 8 : 0, config->migrationLimit, &world->hugePages);
+        failed = world->grid.cellStart == NULL ||
+                 BoidGridSetWrap(&world->grid, config->gridWrap >= 0 ? (GridWrap) config->gridWrap
+                                                                     : BoidGridDefaultWrap(&world->grid)) < 0;
+        world->grid.canonical = config->deterministic;
+    }
+    world->localFlockFunction = LocalFlockFunctionFor(&world->grid, 1, config->separation);
+    world->flockFunction = FlockKernelFunction(config->kernel);
+    if (!failed && config->index == BOIDS_INDEX_TWO_LEVEL) {
+        world->fineGrid = FineGridAlloc(&world->grid, config->splitThreshold, &world->hugePages);
+        failed = world->fineGrid.cellSplit == NULL;
+    }
+    if (!failed && config->kernel != FLOCK_KERNEL_SCALAR) {
+        world->soa = BoidSoAAlloc(capacity, config->kernel, &world->grid, &world->hugePages);
+        failed = !BoidSoAAllocated(&world->soa);
+    }
+    if (!failed && config->engine == FORCE_ENGINE_HALF_STENCIL) {
+        world->halfStencil = HalfStencilAlloc(&world->grid, capacity, &world->hugePages);
+        failed = world->halfStencil.flocks == NULL;
+    }
+    if (!failed && config->engine == FORCE_ENGINE_VERLET) {
+        world->verletList = VerletListAlloc(capacity, config->verletSkin, world->maxThreads, &world->hugePages);
+        failed = world->verletList.neighborStart == NULL;
+    }
+    if (!failed && config->reorderInterval > 0) {
+        world->ordering = BoidOrderingAlloc(&world->grid, capacity, config->curve, &world->hugePages);
+        failed = world->ordering.cellOrder == NULL;
+    }
+    if (!failed && config->cellBlocks > 0) {
+        world->scheduler = CellSchedulerAlloc(&world->grid, world->maxThreads, config->cellBlocks);
+        failed = world->scheduler.cellCost == NULL;
+    }
+    if (!failed && config->fusedUpdate) {
+        world->nextBoids = HugeAlloc(capacity * sizeof(Boid), &world->hugePages);
+        failed = world->nextBoids == NULL;
+    } else if (!failed) {
+        world->accelerations = HugeAlloc(capacity * sizeof(Vector2), &world->hugePages);
+        failed = world->accelerations == NULL;
+    }
+    if (failed) {
+        BoidsWorldFreeEngine(world);
+        return -1;
+    }
+
+    // first touch with the static partition of the update loop, so each thread's part sits on its NUMA node
+    Boid *nextBoids = world->nextBoids;
+    Vector2 *accelerations = world->accelerations;
+#pragma omp parallel for schedule(static) num_threads(world->maxThreads)
+    for (int i = 0; i < capacity; i++) {
+        if (nextBoids != NULL) {
+            nextBoids[i] = (Boid){0};
+        } else {
+            accelerations[i] = (Vector2){0};
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Creates a world of count boids copied from states, drawn, or adopted from storage when it isn't NULL.
+ */
+static BoidsWorld *BoidsWorldCreateIn(const BoidsConfig *config, const float *states, int count,
+                                      const BoidsStorage *storage) {
+    static_assert(sizeof(Boid) == BOIDS_STATE_FLOATS * sizeof(float), "states are used as boids");
+    if (BoidsConfigCheck(config) < 0) {
+        return NULL;
+    }
+    if (count < 0) {
+        fprintf(stderr, "The boid count must not be negative\n");
+        return NULL;
+    }
+    BoidsWorld *world = calloc(1, sizeof(BoidsWorld));
+    if (world == NULL) {
+        perror("Failed to allocate world");
+        if (storage != NULL && storage->release != NULL) storage->release(storage->context);
+        return NULL;
+    }
+    world->config = *config;
+    if (storage != NULL) world->storage = *storage;
+    world->count = count;
+    world->maxThreads = config->threads > 0 ? config->threads : omp_get_max_threads();
+    world->frame = config->startFrame;
+    world->hugePages = (HugePageMode) config->hugePages;
+
+    const int capacity = count > 0 ? count : 1;
+    world->boids = storage != NULL ? (Boid *) storage->states : HugeAlloc(capacity * sizeof(Boid), &world->hugePages);
+    if (world->boids == NULL || BoidsWorldAllocEngine(world, capacity) < 0) {
+        world->capacity = capacity;
+        BoidsWorldFreeBoids(world, world->boids);
+        free(world);
+        return NULL;
+    }
+    // without explicit huge pages HugeAlloc fell back to transparent ones, the world keeps it that way
+    world->config.hugePages = world->hugePages;
+    if (config->backend == BOIDS_BACKEND_POOL && (world->pool = WorkPoolCreate(world->maxThreads)) == NULL) {
+        BoidsWorldDestroy(world);
+        return NULL;
+    }
+
+    // a slot for each of its threads, so worlds stepped side by side don't mix their frames. Without the
+    // memory for it the world just runs unprofiled
+    world->profile = PROFILE_CREATE(world->maxThreads);
+
+    // adopted boids are already where they belong, mapped pages are read in as the first frame touches them
+    if (storage != NULL) {
+        return world;
+    }
+
+    // first touch like above. Philox draws the flock right here, rand() still has to run serially,
+    // but by then the pages are already placed
+    Boid *boids = world->boids;
+    const Boid *source = (const Boid *) states;
+    const BoidRng rng = config->rng;
+    const SimParams *params = &world->config.params;
+#pragma omp parallel for schedule(static) num_threads(world->maxThreads)
+    for (int i = 0; i < count; i++) {
+        if (source != NULL) {
+            boids[i] = source[i];
+        } else {
+            boids[i] = rng == BOID_RNG_PHILOX ? RandomBoid(params, config->seed, i) : (Boid){0};
+        }
+    }
+
+    if (source == NULL && rng == BOID_RNG_LIBC) {
+        srand(config->seed);
+        for (int i = 0; i < count; i++) {
+            boids[i] = (Boid){
+                .position = RandomVector2(0, params->worldSize),
+                .velocity = RandomVector2(-params->maxVelocity, params->maxVelocity)
+            };
+        }
+    }
+    return world;
+}
+
+BoidsWorld *BoidsWorldCreate(const BoidsConfig *config, const float *states, int count) {
+    return BoidsWorldCreateIn(config, states, count, NULL);
+}
+
+BoidsWorld *BoidsWorldAdopt(const BoidsConfig *config, BoidsStorage storage, int count) {
+    // the checks of BoidsWorldCreateIn first, so every failure releases the storage
+    const int invalid = BoidsConfigCheck(config) < 0;
+    if (!invalid && (count <= 0 || storage.states == NULL)) {
+        fprintf(stderr, "An adopted world needs at least one boid\n");
+    }
+    if (invalid || count <= 0 || storage.states == NULL) {
+        if (storage.release != NULL) storage.release(storage.context);
+        return NULL;
+    }
+    return BoidsWorldCreateIn(config, NULL, count, &storage);
+}
+
+void BoidsWorldDestroy(BoidsWorld *world) {
+    if (world == NULL) return;
+
+    WorkPoolFree(world->pool);
+    PROFILE_FREE(world->profile);
+    BoidsWorldFreeEngine(world);
+    BoidsWorldFreeBoids(world, world->boids);
+    free(world);
+}
+
+void BoidsWorldSetHooks(BoidsWorld *world, BoidsFrameHook frameStart, BoidsFrameHook frameEnd, void *data) {
+    world->frameStart = frameStart;
+    world->frameEnd = frameEnd;
+    world->hookData = data;
+}
+
+/**
+ * @brief Catches the world up with a step. step holds the counters of the step, with forceImbalance summed
+ * over its frames, and the latest kernelError and forceImbalanceMax.
+ */
+static void BoidsWorldStepDone(BoidsWorld *world, const BoidsStats *step) {
+    // the threads swapped private copies, catch up with them
+    if (world->config.fusedUpdate && step->frames % 2 == 1) {
+        Boid *swap = world->boids;
+        world->boids = world->nextBoids;
+        world->nextBoids = swap;
+    }
+    world->frame += (int) step->frames;
+    world->gridCurrent = 0;
+    world->listsStale = 0;
+    world->stats.frames += step->frames;
+    world->stats.migrations += step->migrations;
+    world->stats.gridUpdates += step->gridUpdates;
+    world->stats.verletCandidates += step->verletCandidates;
+    world->stats.verletAccepted += step->verletAccepted;
+    world->stats.kernelError = step->kernelError;
+    world->stats.kernelMismatches += step->kernelMismatches;
+    world->stats.forceImbalanceMax = step->forceImbalanceMax;
+    world->imbalanceSum += step->forceImbalance;
+}
+
+typedef struct {
+    BoidsWorld *world;
+    int frames;
+    double imbalanceSum;
+    float imbalanceMax;
+} PoolStep;
+
+/**
+ * @brief Worker 0 only, between the barrier behind the forces and the next one: the imbalance of the force
+ * loop, also added to the step.
+ */
+static float PoolFrameImbalance(const BoidsWorld *world, int threadCount, PoolStep *step) {
+    double slowest = 0, timeSum = 0;
+    for (int t = 0; t < threadCount; t++) {
+        slowest = fmax(slowest, world->forceTimes[t]);
+        timeSum += world->forceTimes[t];
+    }
+    const float forceImbalance = timeSum > 0 ? (float) (slowest * threadCount / timeSum) : 1;
+    step->imbalanceSum += forceImbalance;
+    step->imbalanceMax = fmaxf(step->imbalanceMax, forceImbalance);
+    return forceImbalance;
+}
+
+/**
+ * @brief Worker 0 only, once every boid of the frame is updated: the frame end hook.
+ */
+static void PoolFrameEnd(const BoidsWorld *world, BoidsFrame *info, const Boid *boids) {
+    if (world->frameEnd != NULL) PROFILE_SCOPE("frame_end") {
+        info->states = (const float *) boids;
+        world->frameEnd(info, world->hookData);
+    }
+}
+
+/**
+ * @brief The frames of BoidsWorldStep on the worker pool, run by every worker.
+ *
+ * The same frame as the OpenMP step for the scalar gather engine, with the barriers that only separate
+ * independent work merged away, five per frame whatever the options. The update of a frame runs on the
+ * static slice the histogram of the next grid reads, right before it. The cost scan of the cell blocks
+ * runs next to the histogram and their split next to the scatter. Worker 0 runs the hooks between the
+ * scatter and the forces, when every boid is updated and nothing writes them, so a frame ends in the next
+ * one. Without cell blocks the forces walk equal slices of the boids in grid order, nothing to schedule.
+ */
+static void BoidsWorldPoolFrames(void *data) {
+    PoolStep *step = data;
+    BoidsWorld *world = step->world;
+    const int threadId = TeamThreadNum();
+    const int threadCount = TeamNumThreads();
+    PROFILE_BIND(world->profile, threadId);
+
+    Boid *boids = world->boids;
+    Boid *nextBoids = world->nextBoids;
+    Vector2 *accelerations = world->accelerations;
+    BoidGrid *boidGrid = &world->grid;
+    CellScheduler *scheduler = world->config.cellBlocks > 0 ? &world->scheduler : NULL;
+    const int boidCount = world->count;
+    const int firstFrame = world->frame;
+    const int fusedUpdate = world->config.fusedUpdate;
+    const int checkKernel = world->config.checkKernel;
+    const SimParams *params = &world->config.params;
+    const uint64_t seed = world->config.seed;
+    const int first = (int) ((long) boidCount * threadId / threadCount);
+    const int last = (int) ((long) boidCount * (threadId + 1) / threadCount);
+    int gridCurrent = world->gridCurrent;
+    BoidsFrame info = {.frame = -1};
+
+    for (int frame = firstFrame; frame < firstFrame + step->frames; frame++) {
+        const double startTime = omp_get_wtime();
+
+        // the previous frame's update, only this thread reads the slice before the histogram barrier
+        if (!fusedUpdate && frame > firstFrame) PROFILE_SCOPE("update") {
+            for (int i = first; i < last; i++) {
+                UpdateBoid(params, &boids[i], accelerations[i]);
+            }
+        }
+
+        // unless a query between the steps already indexed these boids
+        if (scheduler != NULL) CellSchedulerSum(scheduler);
+        if (gridCurrent) {
+            TeamBarrier();
+        } else PROFILE_SCOPE("grid") {
+            BoidGridBuildNowait(boidGrid, boids, boidCount); // its first barrier publishes the sums
+        }
+        gridCurrent = 0;
+        if (scheduler != NULL) CellSchedulerSplit(scheduler);
+
+        if (threadId == 0) {
+            if (info.frame >= 0) PoolFrameEnd(world, &info, boids);
+            info = (BoidsFrame){
+                .world = world,
+                .frame = frame,
+                .startTime = startTime,
+                .count = boidCount,
+                .migrations = -1
+            };
+            if (world->frameStart != NULL) PROFILE_SCOPE("frame_start") {
+                info.states = (const float *) boids;
+                world->frameStart(&info, world->hookData);
+            }
+        }
+        TeamBarrier();
+
+        const double forcesStart = omp_get_wtime();
+        PROFILE_SCOPE("forces") {
+            if (scheduler != NULL) {
+                CellSchedulerGather(scheduler, boids, nextBoids, accelerations, boidGrid, NULL,
+                                    world->localFlockFunction, checkKernel, NULL, frame, params, seed);
+            } else {
+                for (int slot = first; slot < last; slot++) {
+                    GatherBoid(boids, nextBoids, accelerations, boidGrid->cellBoids[slot], boidGrid, NULL, NULL,
+                               world->localFlockFunction, checkKernel, NULL, frame, params, seed);
+                }
+            }
+        }
+        world->forceTimes[threadId] = omp_get_wtime() - forcesStart;
+        TeamBarrier();
+
+        if (fusedUpdate) {
+            Boid *swap = boids;
+            boids = nextBoids;
+            nextBoids = swap;
+        }
+        if (threadId == 0) info.forceImbalance = PoolFrameImbalance(world, threadCount, step);
+
+#ifdef BOIDS_PROFILE
+        TeamBarrier();
+        if (threadId == 0) ProfileFrameEnd(world->profile);
+        TeamBarrier();
+#endif
+    }
+
+    // the last update, and the end of the last frame once every slice is done
+    if (!fusedUpdate) PROFILE_SCOPE("update") {
+        for (int i = first; i < last; i++) {
+            UpdateBoid(params, &boids[i], accelerations[i]);
+        }
+    }
+    TeamBarrier();
+    if (threadId == 0) PoolFrameEnd(world, &info, boids);
+    PROFILE_BIND(NULL, 0);
+}
+
+int BoidsWorldStep(BoidsWorld *world, int frames) {
+    if (frames <= 0) return 0;
+
+    if (world->pool != NULL) {
+        PoolStep step = {.world = world, .frames = frames, .imbalanceMax = world->stats.forceImbalanceMax};
+        WorkPoolRun(world->pool, BoidsWorldPoolFrames, &step);
+        const BoidsStats done = {
+            .frames = frames,
+            .kernelError = world->stats.kernelError,
+            .forceImbalance = step.imbalanceSum,
+            .forceImbalanceMax = step.imbalanceMax
+        };
+        BoidsWorldStepDone(world, &done);
+        return 0;
+    }
+
+    Boid *boids = world->boids;
+    Boid *nextBoids = world->nextBoids;
+    Vector2 *accelerations = world->accelerations;
+    BoidGrid *boidGrid = &world->grid;
+    FineGrid *fineGrid = world->config.index == BOIDS_INDEX_TWO_LEVEL ? &world->fineGrid : NULL;
+    HashGrid *hashGrid = world->config.index == BOIDS_INDEX_HASHED ? &world->hashGrid : NULL;
+    BoidSoA *boidSoA = &world->soa;
+    HalfStencil *halfStencil = &world->halfStencil;
+    VerletList *verletList = &world->verletList;
+    BoidOrdering *ordering = &world->ordering;
+    CellScheduler *scheduler = world->config.cellBlocks > 0 ? &world->scheduler : NULL;
+    double *forceTimes = world->forceTimes;
+    const int boidCount = world->count;
+    const int firstFrame = world->frame;
+    const int lastFrame = world->frame + frames;
+    const ForceEngine forceEngine = world->config.engine;
+    const FlockKernel flockKernel = world->config.kernel;
+    const FlockSoAFunction flockFunction = world->flockFunction;
+    const LocalFlockFunction localFlockFunction = world->localFlockFunction;
+    const int checkKernel = world->config.checkKernel;
+    const int reorderInterval = world->config.reorderInterval;
+    const int fusedUpdate = world->config.fusedUpdate;
+    const int incrementalGrid = world->config.incrementalGrid;
+    const SimParams *params = &world->config.params;
+    const uint64_t seed = world->config.seed;
+    const int worldSize = params->worldSize;
+    const float perceptionRadius = params->perceptionRadius;
+    const BoidsFrameHook frameStart = world->frameStart;
+    const BoidsFrameHook frameEnd = world->frameEnd;
+    void *hookData = world->hookData;
+    int gridBuilt = world->gridBuilt;
+    int gridCurrent = world->gridCurrent;
+    const int indexMigrations = world->indexMigrations;
+    int listsStale = world->listsStale;
+    float kernelError = world->stats.kernelError;
+    long kernelMismatches = 0;
+    long verletCandidates = 0;
+    long verletAccepted = 0;
+    long totalMigrations = 0;
+    long gridUpdates = 0;
+    double imbalanceSum = 0;
+    float imbalanceMax = world->stats.forceImbalanceMax;
+    int framesDone = frames;
+
+    // boids and nextBoids are private so every thread can swap its own copy without synchronising
+#pragma omp parallel num_threads(world->maxThreads) default(none) shared(world, kernelError, kernelMismatches, \
+    verletCandidates, verletAccepted, totalMigrations, gridUpdates, imbalanceSum, imbalanceMax, framesDone) \
+    firstprivate(boids, nextBoids, accelerations, boidGrid, fineGrid, hashGrid, boidSoA, halfStencil, verletList, \
+    ordering, scheduler, forceTimes, boidCount, firstFrame, lastFrame, forceEngine, flockKernel, flockFunction, \
+    localFlockFunction, checkKernel, reorderInterval, fusedUpdate, incrementalGrid, params, seed, worldSize, \
+    perceptionRadius, frameStart, frameEnd, hookData, gridBuilt, gridCurrent, indexMigrations, listsStale)
+    {
+        PROFILE_BIND(world->profile, omp_get_thread_num());
+        // the wander noise follows the boid, not its slot
+        const int *boidIds = reorderInterval > 0 ? ordering->boidIds : NULL;
+        const int *boidSlots = reorderInterval > 0 ? ordering->boidSlots : NULL;
+        const int threadId = omp_get_thread_num();
+        const int threadCount = omp_get_num_threads();
+
+        for (int frame = firstFrame; frame < lastFrame; frame++) {
+            BoidsFrame info = {
+                .world = world,
+                .frame = frame,
+                .startTime = omp_get_wtime(),
+                .ids = boidIds,
+                .slots = boidSlots,
+                .count = boidCount,
+                .migrations = -1
+            };
+
+            if (frameStart != NULL) PROFILE_SCOPE("frame_start") {
+                info.states = (const float *) boids;
+                frameStart(&info, hookData);
+            }
+
+            // the verlet engine only needs the grid to rebuild its lists, reordering invalidates them
+            const int reordered = reorderInterval > 0 && frame % reorderInterval == 0;
+            const int rebuildLists = forceEngine == FORCE_ENGINE_VERLET &&
+                                     (reordered || listsStale ||
+                                      VerletListExpired(verletList, boids, boidCount, worldSize));
+            listsStale = 0;
+            // unless a query between the steps already indexed these boids
+            const int indexBoids = !gridCurrent &&
+                                   (forceEngine != FORCE_ENGINE_VERLET || rebuildLists || reordered || checkKernel);
+            int migrations = gridCurrent ? indexMigrations : -1;
+            gridCurrent = 0;
+            if (indexBoids) PROFILE_SCOPE("grid") {
+                if (hashGrid != NULL) {
+                    HashGridBuild(hashGrid, boids, boidCount); // ends with a barrier
+                } else if (incrementalGrid && gridBuilt) {
+                    migrations = BoidGridUpdate(boidGrid, boids, boidCount); // ends with a barrier
+                } else {
+                    BoidGridBuild(boidGrid, boids, boidCount); // ends with a barrier
+                    gridBuilt = 1;
+                }
+            }
+
+            if (reordered) PROFILE_SCOPE("reorder") {
+                BoidOrderingApply(ordering, boids, boidGrid, boidCount); // ends with a barrier
+                BoidGridBuild(boidGrid, boids, boidCount);
+            }
+
+            if (fineGrid != NULL) PROFILE_SCOPE("refine") {
+                FineGridBuild(fineGrid, boids, boidGrid); // ends with a barrier
+            }
+
+            if (forceEngine == FORCE_ENGINE_HALF_STENCIL) {
+                PROFILE_SCOPE("half_stencil") {
+                    HalfStencilAccumulate(halfStencil, boids, boidGrid, perceptionRadius); // ends with a barrier
+                }
+
+                // the barrier stays out of the scope, so the profile sees how unevenly the work was spread
+                const double forcesStart = omp_get_wtime();
+                PROFILE_SCOPE("forces") {
+#pragma omp for schedule(static) reduction(max:kernelError) nowait
+                    for (int i = 0; i < boidCount; i++) {
+                        LocalFlock *flock = &halfStencil->flocks[i];
+
+                        if (checkKernel) {
+                            LocalFlock reference;
+                            GetLocalFlock(boids, i, boidGrid, 1, &reference, perceptionRadius);
+                            kernelError = fmaxf(kernelError, LocalFlockDifference(&reference, flock));
+                        }
+
+                        Vector2 acceleration = GetBoidAcceleration(params, seed, &boids[i], flock, BoidId(boidIds, i),
+                                                                   frame);
+                        ApplyAcceleration(params, boids, nextBoids, accelerations, i, acceleration);
+                        *flock = (LocalFlock){0};
+                    }
+                }
+                forceTimes[threadId] = omp_get_wtime() - forcesStart;
+#pragma omp barrier
+            } else if (forceEngine == FORCE_ENGINE_VERLET) {
+                int listsFailed = 0;
+                if (rebuildLists) PROFILE_SCOPE("verlet_build") {
+                    listsFailed = VerletListBuild(verletList, boids, boidGrid, boidCount, params,
+                                                  &world->hugePages) < 0;
+                }
+                // every thread got the same answer, the frame stops before any boid moved
+                if (listsFailed) {
+#pragma omp masked
+                    framesDone = frame - firstFrame;
+                    break;
+                }
+
+                const double forcesStart = omp_get_wtime();
+                PROFILE_SCOPE("forces") {
+#pragma omp for schedule(runtime) reduction(max:kernelError) reduction(+:verletCandidates, verletAccepted) nowait
+                    for (int i = 0; i < boidCount; i++) {
+                        LocalFlock threadLocalFlock;
+
+                        GetLocalFlockVerlet(boids, verletList, i, &threadLocalFlock, perceptionRadius);
+                        verletCandidates += verletList->neighborStart[i + 1] - verletList->neighborStart[i];
+                        verletAccepted += threadLocalFlock.size;
+
+                        if (checkKernel) {
+                            LocalFlock reference;
+                            GetLocalFlock(boids, i, boidGrid, 1, &reference, perceptionRadius);
+                            kernelError = fmaxf(kernelError, LocalFlockDifference(&reference, &threadLocalFlock));
+                        }
+
+                        Vector2 acceleration = GetBoidAcceleration(params, seed, &boids[i], &threadLocalFlock,
+                                                                   BoidId(boidIds, i), frame);
+                        ApplyAcceleration(params, boids, nextBoids, accelerations, i, acceleration);
+                    }
+                }
+                forceTimes[threadId] = omp_get_wtime() - forcesStart;
+#pragma omp barrier
+            } else if (flockKernel == FLOCK_KERNEL_SCALAR) {
+                if (scheduler != NULL) PROFILE_SCOPE("schedule") {
+                    CellSchedulerPlan(scheduler); // ends with a barrier
+                }
+
+                const double forcesStart = omp_get_wtime();
+                PROFILE_SCOPE("forces") {
+                    if (scheduler != NULL) {
+                        const float threadError = CellSchedulerGather(scheduler, boids, nextBoids, accelerations,
+                                                                      boidGrid, fineGrid, localFlockFunction,
+                                                                      checkKernel, boidIds, frame, params, seed);
+                        if (checkKernel) {
+#pragma omp critical(BoidsKernelError)
+                            kernelError = fmaxf(kernelError, threadError);
+                        }
+                    } else {
+#pragma omp for schedule(runtime) reduction(max:kernelError) nowait
+                        for (int i = 0; i < boidCount; i++) {
+                            kernelError = fmaxf(kernelError, GatherBoid(boids, nextBoids, accelerations, i, boidGrid,
+                                                                        fineGrid, hashGrid, localFlockFunction,
+                                                                        checkKernel, boidIds, frame, params,
+                                                                        seed));
+                        }
+                    }
+                }
+                forceTimes[threadId] = omp_get_wtime() - forcesStart;
+#pragma omp barrier
+            } else {
+                PROFILE_SCOPE("soa_gather") {
+                    BoidSoAGather(boidSoA, boids, boidGrid, boidCount); // implicit barrier
+                }
+
+                // boids within a quantization step of the radius are routinely found by only one of the kernels
+                const int quantized = flockKernel == FLOCK_KERNEL_Q16 || flockKernel == FLOCK_KERNEL_Q32;
+
+                // walk the boids in grid order, so neighbouring slots share their neighbour cells
+                const double forcesStart = omp_get_wtime();
+                PROFILE_SCOPE("forces") {
+#pragma omp for schedule(runtime) reduction(max:kernelError) reduction(+:kernelMismatches) nowait
+                    for (int slot = 0; slot < boidCount; slot++) {
+                        const int i = boidGrid->cellBoids[slot];
+                        LocalFlock threadLocalFlock;
+                        int cells[9];
+
+                        int cellCount = BoidGridNeighborCells(boidGrid, boids[i].position, 1, cells);
+                        flockFunction(boidSoA, boidGrid->cellStart, cells, cellCount, slot, perceptionRadius,
+                                      &threadLocalFlock);
+
+                        if (checkKernel) {
+                            LocalFlock reference;
+                            GetLocalFlock(boids, i, boidGrid, 1, &reference, perceptionRadius);
+                            if (quantized && reference.size != threadLocalFlock.size) {
+                                kernelMismatches++;
+                            } else {
+                                kernelError = fmaxf(kernelError,
+                                                    LocalFlockDifference(&reference, &threadLocalFlock));
+                            }
+                        }
+
+                        Vector2 acceleration = GetBoidAcceleration(params, seed, &boids[i], &threadLocalFlock,
+                                                                   BoidId(boidIds, i), frame);
+                        ApplyAcceleration(params, boids, nextBoids, accelerations, i, acceleration);
+                    }
+                }
+                forceTimes[threadId] = omp_get_wtime() - forcesStart;
+#pragma omp barrier
+            }
+
+            // after the barrier of the forces, the times are only written again after the next grid or list check
+            double slowest = 0, timeSum = 0;
+            for (int t = 0; t < threadCount; t++) {
+                slowest = fmax(slowest, forceTimes[t]);
+                timeSum += forceTimes[t];
+            }
+            const float forceImbalance = timeSum > 0 ? (float) (slowest * threadCount / timeSum) : 1;
+
+            if (fusedUpdate) {
+                // nobody reads frame N any more, the barrier above already published frame N + 1
+                Boid *swap = boids;
+                boids = nextBoids;
+                nextBoids = swap;
+            } else {
+                // static, so every thread updates the boids it first touched
+                PROFILE_SCOPE("update") {
+#pragma omp for schedule(static) nowait
+                    for (int i = 0; i < boidCount; i++) {
+                        UpdateBoid(params, &boids[i], accelerations[i]);
+                    }
+                }
+#pragma omp barrier
+            }
+
+            // after the barrier of the update, and nobody writes boids before the next one
+            if (frameEnd != NULL) PROFILE_SCOPE("frame_end") {
+                info.states = (const float *) boids;
+                info.reordered = reordered;
+                info.migrations = migrations;
+                info.forceImbalance = forceImbalance;
+                frameEnd(&info, hookData);
+            }
+
+            PROFILE_FRAME_END(world->profile)
+
+#pragma omp masked
+            {
+                if (migrations >= 0) {
+                    totalMigrations += migrations;
+                    gridUpdates++;
+                }
+                imbalanceSum += forceImbalance;
+                imbalanceMax = fmaxf(imbalanceMax, forceImbalance);
+            }
+        }
+
+#pragma omp masked
+        world->gridBuilt = gridBuilt;
+        PROFILE_BIND(NULL, 0);
+    }
+
+    const BoidsStats step = {
+        .frames = framesDone,
+        .migrations = totalMigrations,
+        .gridUpdates = gridUpdates,
+        .verletCandidates = verletCandidates,
+        .verletAccepted = verletAccepted,
+        .kernelError = kernelError,
+        .kernelMismatches = kernelMismatches,
+        .forceImbalance = imbalanceSum,
+        .forceImbalanceMax = imbalanceMax
+    };
+    BoidsWorldStepDone(world, &step);
+    if (framesDone < frames) {
+        fprintf(stderr, "Failed to grow the verlet lists, stopped at frame %d\n", world->frame);
+        return -1;
+    }
+    return 0;
+}
+
+BoidsView BoidsWorldPositions(const BoidsWorld *world) {
+    const float *states = (const float *) world->boids;
+    return (BoidsView){.x = states, .y = states + 1, .stride = BOIDS_STATE_FLOATS, .count = world->count};
+}
+
+BoidsView BoidsWorldVelocities(const BoidsWorld *world) {
+    const float *states = (const float *) world->boids;
+    return (BoidsView){.x = states + 2, .y = states + 3, .stride = BOIDS_STATE_FLOATS, .count = world->count};
+}
+
+const int *BoidsWorldIds(const BoidsWorld *world) {
+    return world->config.reorderInterval > 0 ? world->ordering.boidIds : NULL;
+}
+
+int BoidsWorldCount(const BoidsWorld *world) {
+    return world->count;
+}
+
+int BoidsWorldFrame(const BoidsWorld *world) {
+    return world->frame;
+}
+
+BoidsStats BoidsWorldStats(const BoidsWorld *world) {
+    BoidsStats stats = world->stats;
+    stats.fallbackRebuilds += world->grid.fallbackRebuilds;
+    stats.verletRebuilds += world->verletList.rebuilds;
+    stats.splitCells += world->fineGrid.splitTotal;
+    stats.hashedCells += world->hashGrid.runTotal;
+    stats.hashedBytes = world->hashGrid.pairs != NULL ? HashGridBytes(&world->hashGrid) : 0;
+    stats.steals += world->scheduler.steals;
+    stats.forceImbalance = stats.frames > 0 ? world->imbalanceSum / stats.frames : 0;
+    return stats;
+}
+
+// the grid and the verlet lists describe boids that moved, the next frame builds them from scratch
+static void BoidsWorldInvalidate(BoidsWorld *world) {
+    world->gridBuilt = 0;
+    world->gridCurrent = 0;
+    world->listsStale = 1;
+}
+
+/**
+ * @brief Moves the world into structures for capacity boids, keeping the boids and their ids.
+ * @return 0, or -1 if the memory could not be allocated, in which case the world is unchanged.
+ */
+static int BoidsWorldReserve(BoidsWorld *world, int capacity) {
+    const int count = world->count;
+    Boid *boids = HugeAlloc(capacity * sizeof(Boid), &world->hugePages);
+    int *ids = world->config.reorderInterval > 0 ? malloc(count * sizeof(int)) : NULL;
+    BoidsWorld grown = *world;
+    if (boids == NULL || (world->config.reorderInterval > 0 && ids == NULL) ||
+        BoidsWorldAllocEngine(&grown, capacity) < 0) {
+        perror("Failed to grow world");
+        HugeFree(boids, capacity * sizeof(Boid));
+        free(ids);
+        return -1;
+    }
+
+    const Boid *old = world->boids;
+#pragma omp parallel for schedule(static) num_threads(world->maxThreads)
+    for (int i = 0; i < count; i++) {
+        boids[i] = old[i];
+    }
+    if (ids != NULL) memcpy(ids, world->ordering.boidIds, count * sizeof(int));
+
+    BoidsWorldFreeEngine(world);
+    BoidsWorldFreeBoids(world, world->boids);
+    grown.stats = world->stats;
+    grown.storage = world->storage;
+    grown.boids = boids;
+    *world = grown;
+
+    for (int slot = 0; ids != NULL && slot < count; slot++) {
+        world->ordering.boidIds[slot] = ids[slot];
+        world->ordering.boidSlots[ids[slot]] = slot;
+    }
+    free(ids);
+    return 0;
+}
+
+int BoidsWorldAdd(BoidsWorld *world, const float *states, int count) {
+    if (count <= 0) return 0;
+    if (count > INT_MAX - world->count) {
+        fprintf(stderr, "A world holds at most %d boids\n", INT_MAX);
+        return -1;
+    }
+    const int total = world->count + count;
+    if (total > world->capacity) {
+        // grow geometrically, so adding boids one batch at a time stays linear
+        const int capacity = world->capacity > INT_MAX / 2 || 2 * world->capacity < total ? total
+                                                                                          : 2 * world->capacity;
+        if (BoidsWorldReserve(world, capacity) < 0) return -1;
+    }
+
+    // the new boids get the next ids, and as they go to the end of the array slots stay ids
+    memcpy(world->boids + world->count, states, count * sizeof(Boid));
+    for (int slot = world->count; world->config.reorderInterval > 0 && slot < total; slot++) {
+        world->ordering.boidIds[slot] = slot;
+        world->ordering.boidSlots[slot] = slot;
+    }
+    world->count = total;
+    BoidsWorldInvalidate(world);
+    return 0;
+}
+
+int BoidsWorldRemove(BoidsWorld *world, const int *ids, int count) {
+    if (count <= 0) return 0;
+    int *newIds = malloc(world->count * sizeof(int));
+    if (newIds == NULL) {
+        perror("Failed to allocate id map");
+        return -1;
+    }
+    memset(newIds, 0, world->count * sizeof(int));
+    for (int k = 0; k < count; k++) {
+        if (ids[k] < 0 || ids[k] >= world->count) {
+            fprintf(stderr, "No boid with id %d\n", ids[k]);
+            free(newIds);
+            return -1;
+        }
+        newIds[ids[k]] = -1;
+    }
+    int nextId = 0;
+    for (int id = 0; id < world->count; id++) {
+        if (newIds[id] >= 0) newIds[id] = nextId++;
+    }
+
+    // compact the slots in order, the survivors take the ids of their rank
+    int *boidIds = world->config.reorderInterval > 0 ? world->ordering.boidIds : NULL;
+    int kept = 0;
+    for (int slot = 0; slot < world->count; slot++) {
+        const int id = BoidId(boidIds, slot);
+        if (newIds[id] < 0) continue;
+        world->boids[kept] = world->boids[slot];
+        if (boidIds != NULL) boidIds[kept] = newIds[id];
+        kept++;
+    }
+    for (int slot = 0; boidIds != NULL && slot < kept; slot++) {
+        world->ordering.boidSlots[boidIds[slot]] = slot;
+    }
+    free(newIds);
+    world->count = kept;
+    BoidsWorldInvalidate(world);
+    return 0;
+}
+
+int BoidsWorldSetIds(BoidsWorld *world, const int *ids) {
+    const int count = world->count;
+    int *slots = malloc((count > 0 ? count : 1) * sizeof(int));
+    if (slots == NULL) {
+        perror("Failed to allocate id map");
+        return -1;
+    }
+    for (int id = 0; id < count; id++) slots[id] = -1;
+    for (int slot = 0; slot < count; slot++) {
+        if (ids[slot] < 0 || ids[slot] >= count || slots[ids[slot]] >= 0) {
+            fprintf(stderr, "The ids are not a permutation of the %d boids\n", count);
+            free(slots);
+            return -1;
+        }
+        slots[ids[slot]] = slot;
+    }
+
+    if (world->config.reorderInterval > 0) {
+        memcpy(world->ordering.boidIds, ids, count * sizeof(int));
+        memcpy(world->ordering.boidSlots, slots, count * sizeof(int));
+    } else {
+        Boid *sorted = HugeAlloc((count > 0 ? count : 1) * sizeof(Boid), &world->hugePages);
+        if (sorted == NULL) {
+            perror("Failed to allocate boids in id order");
+            free(slots);
+            return -1;
+        }
+        const Boid *boids = world->boids;
+        for (int id = 0; id < count; id++) sorted[id] = boids[slots[id]];
+        memcpy(world->boids, sorted, count * sizeof(Boid));
+        HugeFree(sorted, (count > 0 ? count : 1) * sizeof(Boid));
+    }
+    free(slots);
+    BoidsWorldInvalidate(world);
+    return 0;
+}
+
+/**
+ * @brief Indexes the current boids the way the next frame would, unless a query already did, so that
+ * frame can skip its own build. Must be reached by every thread of a region of at most maxThreads.
+ */
+static void BoidsWorldIndex(BoidsWorld *world) {
+    if (world->gridCurrent) return;
+
+    int migrations = -1;
+    if (world->config.index == BOIDS_INDEX_HASHED) {
+        HashGridBuild(&world->hashGrid, world->boids, world->count); // ends with a barrier
+    } else if (world->config.incrementalGrid && world->gridBuilt) {
+        migrations = BoidGridUpdate(&world->grid, world->boids, world->count); // ends with a barrier
+    } else {
+        BoidGridBuild(&world->grid, world->boids, world->count); // ends with a barrier
+    }
+
+    // everyone read gridCurrent before the barriers of the build
+#pragma omp masked
+    {
+        world->gridBuilt = 1;
+        world->gridCurrent = 1;
+        world->indexMigrations = migrations;
+    }
+#pragma omp barrier
+}
+
+// the dense or the hashed index of a world, seen as rows and cols of cells
+typedef struct {
+    const BoidGrid *grid;        // NULL with the hashed index
+    const HashGrid *hashGrid;
+    int gridResolution;
+    int gridHeight;
+    int gridWidth;
+    int worldSize;
+} QueryIndex;
+
+static QueryIndex QueryIndexOf(const BoidsWorld *world) {
+    if (world->config.index == BOIDS_INDEX_HASHED) {
+        const HashGrid *grid = &world->hashGrid;
+        return (QueryIndex){NULL, grid, grid->gridResolution, grid->gridHeight, grid->gridWidth,
+                            world->config.params.worldSize};
+    }
+    const BoidGrid *grid = &world->grid;
+    return (QueryIndex){grid, NULL, grid->gridResolution, grid->gridHeight, grid->gridWidth,
+                        world->config.params.worldSize};
+}
+
+/**
+ * @return the boids of the cell at (row, col), wrapped around the world.
+ */
+static inline GridCell QueryIndexCell(const QueryIndex *index, int row, int col) {
+    row %= index->gridHeight;
+    if (row < 0) row += index->gridHeight;
+    col %= index->gridWidth;
+    if (col < 0) col += index->gridWidth;
+
+    const int cell = row * index->gridWidth + col;
+    return index->grid != NULL ? BoidGridCellAt(index->grid, cell) : HashGridGetCell(index->hashGrid, (uint32_t) cell);
+}
+
+/**
+ * @brief Finds the boids within radius of point, wrapped distance, and writes their ids and distances
+ * from out on. Only counts them when ids is NULL.
+ * @return the number of boids found.
+ */
+static long QueryRadius(const QueryIndex *index, const Boid *boids, const int *boidIds, Vector2 point,
+                        float radius, int *ids, float *distances) {
+    if (!(radius > 0)) return 0;
+
+    const int row = point.x / index->gridResolution;
+    const int col = point.y / index->gridResolution;
+    const int range = (int) ceilf(radius / index->gridResolution);
+    // a radius as wide as the world visits every row or col once instead of some of them twice
+    const int rows = 2 * range + 1 < index->gridHeight ? 2 * range + 1 : index->gridHeight;
+    const int cols = 2 * range + 1 < index->gridWidth ? 2 * range + 1 : index->gridWidth;
+    long count = 0;
+
+    for (int dcol = 0; dcol < cols; dcol++) {
+        for (int drow = 0; drow < rows; drow++) {
+            const GridCell cell = QueryIndexCell(index, row - range + drow, col - range + dcol);
+            for (int j = 0; j < cell.size; j++) {
+                const int other = cell.boids[j];
+                float dx = WrapDelta(boids[other].position.x - point.x, index->worldSize);
+                float dy = WrapDelta(boids[other].position.y - point.y, index->worldSize);
+                float dist = dx * dx + dy * dy;
+                if (dist < radius * radius) {
+                    if (ids != NULL) {
+                        ids[count] = BoidId(boidIds, other);
+                        distances[count] = sqrtf(dist);
+                    }
+                    count++;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+// queries may come from anywhere, the grid only covers the world once
+static inline Vector2 QueryPointWrap(Vector2 point, int worldSize) {
+    return (Vector2){Wrap(point.x, 0, worldSize), Wrap(point.y, 0, worldSize)};
+}
+
+// a comes before b in the nearest order: closer, or as close with a smaller id
+static inline int NearestBefore(float distA, int idA, float distB, int idB) {
+    return distA < distB || (distA == distB && idA < idB);
+}
+
+/**
+ * @brief Restores the max-heap of the nearest order below node, the root being the last of the nearest.
+ */
+static void NearestSiftDown(int *ids, float *dists, int size, int node) {
+    for (;;) {
+        int last = node;
+        for (int child = 2 * node + 1; child <= 2 * node + 2 && child < size; child++) {
+            if (NearestBefore(dists[last], ids[last], dists[child], ids[child])) last = child;
+        }
+        if (last == node) return;
+
+        const int id = ids[node];
+        const float dist = dists[node];
+        ids[node] = ids[last];
+        dists[node] = dists[last];
+        ids[last] = id;
+        dists[last] = dist;
+        node = last;
+    }
+}
+
+/**
+ * @brief Offers the boids of a cell to the heap of the k nearest found so far, squared distances.
+ */
+static void NearestVisitCell(GridCell cell, const Boid *boids, const int *boidIds, Vector2 point, int worldSize,
+                             int k, int *ids, float *dists, int *found) {
+    for (int j = 0; j < cell.size; j++) {
+        const int other = cell.boids[j];
+        const int id = BoidId(boidIds, other);
+        float dx = WrapDelta(boids[other].position.x - point.x, worldSize);
+        float dy = WrapDelta(boids[other].position.y - point.y, worldSize);
+        float dist = dx * dx + dy * dy;
+
+        if (*found < k) {
+            // sift up
+            int node = (*found)++;
+            while (node > 0 && NearestBefore(dists[(node - 1) / 2], ids[(node - 1) / 2], dist, id)) {
+                ids[node] = ids[(node - 1) / 2];
+                dists[node] = dists[(node - 1) / 2];
+                node = (node - 1) / 2;
+            }
+            ids[node] = id;
+            dists[node] = dist;
+        } else if (NearestBefore(dist, id, dists[0], ids[0])) {
+            ids[0] = id;
+            dists[0] = dist;
+            NearestSiftDown(ids, dists, k, 0);
+        }
+    }
+}
+
+/**
+ * @brief Finds the k boids nearest to point, wrapped distance, and writes their ids and distances from
+ * out on, closest first. Walks rings of cells around the cell of the point until the boids of the next
+ * ring can't be closer than the k-th found, or every cell was visited.
+ * @return the number of boids found, k unless the world has fewer.
+ */
+static int QueryNearest(const QueryIndex *index, const Boid *boids, const int *boidIds, Vector2 point, int k,
+                        int *ids, float *distances) {
+    if (k <= 0) return 0;
+
+    const int row = point.x / index->gridResolution;
+    const int col = point.y / index->gridResolution;
+    // offsets reaching every row and col exactly once, the other way round the world is not shorter
+    const int rowLow = -((index->gridHeight - 1) / 2), rowHigh = index->gridHeight / 2;
+    const int colLow = -((index->gridWidth - 1) / 2), colHigh = index->gridWidth / 2;
+    const int lastRing = rowHigh > colHigh ? rowHigh : colHigh;
+    int found = 0;
+
+    for (int ring = 0; ring <= lastRing; ring++) {
+        // a boid in this ring is at least ring - 1 cells away from the point
+        const float bound = (float) (ring - 1) * index->gridResolution;
+        if (found == k && ring > 0 && distances[0] < bound * bound) break;
+
+        const int firstCol = -ring > colLow ? -ring : colLow, lastCol = ring < colHigh ? ring : colHigh;
+        const int firstRow = -ring > rowLow ? -ring : rowLow, lastRow = ring < rowHigh ? ring : rowHigh;
+        for (int dcol = firstCol; dcol <= lastCol; dcol++) {
+            if (dcol == -ring || dcol == ring) {
+                for (int drow = firstRow; drow <= lastRow; drow++) {
+                    NearestVisitCell(QueryIndexCell(index, row + drow, col + dcol), boids, boidIds, point,
+                                     index->worldSize, k, ids, distances, &found);
+                }
+            } else {
+                if (-ring >= rowLow) {
+                    NearestVisitCell(QueryIndexCell(index, row - ring, col + dcol), boids, boidIds, point,
+                                     index->worldSize, k, ids, distances, &found);
+                }
+                if (ring <= rowHigh) {
+                    NearestVisitCell(QueryIndexCell(index, row + ring, col + dcol), boids, boidIds, point,
+                                     index->worldSize, k, ids, distances, &found);
+                }
+            }
+        }
+    }
+
+    // heap sort, the root goes to the back
+    for (int size = found - 1; size > 0; size--) {
+        const int id = ids[0];
+        const float dist = distances[0];
+        ids[0] = ids[size];
+        distances[0] = distances[size];
+        ids[size] = id;
+        distances[size] = dist;
+        NearestSiftDown(ids, distances, size, 0);
+    }
+    for (int i = 0; i < found; i++) {
+        distances[i] = sqrtf(distances[i]);
+    }
+    return found;
+}
+
+#define QUERY_TILES 64  // a batch is walked tile by tile of a QUERY_TILES x QUERY_TILES split of the world
+
+/**
+ * @brief Grows the arrays of a result to hold the offsets of queries queries and hits results.
+ * @return 0, or -1 if the memory could not be allocated, in which case the arrays keep their contents.
+ */
+static int BoidsQueryResultReserve(BoidsQueryResult *result, int queries, long hits) {
+    if (queries + 1 > result->startCapacity) {
+        long *start = realloc(result->start, (queries + 1) * sizeof(long));
+        if (start != NULL) result->start = start;
+        int *order = start != NULL ? realloc(result->order, (queries + 1) * sizeof(int)) : NULL;
+        if (order == NULL) {
+            perror("Failed to allocate query offsets");
+            return -1;
+        }
+        result->order = order;
+        result->startCapacity = queries + 1;
+    }
+    if (hits > result->capacity) {
+        // grow geometrically, the next batch likely finds about as many
+        const long capacity = hits + hits / 2;
+        int *ids = realloc(result->ids, capacity * sizeof(int));
+        if (ids != NULL) result->ids = ids;
+        float *distances = ids != NULL ? realloc(result->distances, capacity * sizeof(float)) : NULL;
+        if (distances == NULL) {
+            perror("Failed to allocate query results");
+            return -1;
+        }
+        result->distances = distances;
+        result->capacity = capacity;
+    }
+    return 0;
+}
+
+static inline int QueryTile(Vector2 point, int worldSize) {
+    // a point wrapped to exactly worldSize belongs to the last tile
+    const int tileX = fminf(point.x * QUERY_TILES / worldSize, QUERY_TILES - 1);
+    const int tileY = fminf(point.y * QUERY_TILES / worldSize, QUERY_TILES - 1);
+    return tileX * QUERY_TILES + tileY;
+}
+
+/**
+ * @brief Runs a batch of radius queries, or of nearest queries when radii is NULL.
+ *
+ * One parallel region indexes the boids, sorts the queries by tile with a counting sort, so queries
+ * walked one after the other share their cells in cache whatever order they came in, and counts the
+ * results of every query. A scan turns the counts into offsets, and a second region writes the results
+ * in place.
+ */
+static int BoidsWorldQuery(BoidsWorld *world, const float *points, const float *radii, const int *k, int count,
+                           BoidsQueryResult *result) {
+    if (count < 0) count = 0;
+    int *tileCounts = malloc((size_t) world->maxThreads * QUERY_TILES * QUERY_TILES * sizeof(int));
+    if (tileCounts == NULL || BoidsQueryResultReserve(result, count, 0) < 0) {
+        if (tileCounts == NULL) perror("Failed to allocate query tiles");
+        free(tileCounts);
+        return -1;
+    }
+
+    const Vector2 *queryPoints = (const Vector2 *) points;
+    const int worldSize = world->config.params.worldSize;
+    long *start = result->start;
+    int *order = result->order;
+    long blockSums[world->maxThreads];
+    start[0] = 0;
+
+#pragma omp parallel num_threads(world->maxThreads) default(none) \
+    shared(world, queryPoints, worldSize, radii, k, count, start, order, tileCounts, blockSums)
+    {
+        // charged to the next frame, which skips its own build
+        PROFILE_BIND(world->profile, omp_get_thread_num());
+        BoidsWorldIndex(world);
+        PROFILE_BIND(NULL, 0);
+        const QueryIndex index = QueryIndexOf(world);
+        const int *boidIds = BoidsWorldIds(world);
+        const int threadId = omp_get_thread_num();
+        const int threadCount = omp_get_num_threads();
+        const int first = (int) ((long) count * threadId / threadCount);
+        const int last = (int) ((long) count * (threadId + 1) / threadCount);
+        int *counts = tileCounts + (size_t) threadId * QUERY_TILES * QUERY_TILES;
+
+        // tile histogram of a static slice of the queries, then the scatter cursors, tile by tile and
+        // thread by thread inside a tile, so the sort is stable
+        memset(counts, 0, QUERY_TILES * QUERY_TILES * sizeof(int));
+        for (int q = first; q < last; q++) {
+            counts[QueryTile(QueryPointWrap(queryPoints[q], worldSize), worldSize)]++;
+        }
+#pragma omp barrier
+#pragma omp single
+        {
+            int cursor = 0;
+            for (int tile = 0; tile < QUERY_TILES * QUERY_TILES; tile++) {
+                for (int t = 0; t < threadCount; t++) {
+                    const int size = tileCounts[(size_t) t * QUERY_TILES * QUERY_TILES + tile];
+                    tileCounts[(size_t) t * QUERY_TILES * QUERY_TILES + tile] = cursor;
+                    cursor += size;
+                }
+            }
+        } // implicit barrier
+        for (int q = first; q < last; q++) {
+            order[counts[QueryTile(QueryPointWrap(queryPoints[q], worldSize), worldSize)]++] = q;
+        }
+#pragma omp barrier
+
+#pragma omp for schedule(dynamic, 64)
+        for (int i = 0; i < count; i++) {
+            const int q = order[i];
+            if (radii != NULL) {
+                const Vector2 point = QueryPointWrap(queryPoints[q], worldSize);
+                start[q + 1] = QueryRadius(&index, world->boids, boidIds, point, radii[q], NULL, NULL);
+            } else {
+                start[q + 1] = k[q] <= 0 ? 0 : k[q] < world->count ? k[q] : world->count;
+            }
+        } // implicit barrier
+
+        // inclusive scan of the counts, per thread block first
+        long blockSum = 0;
+        for (int q = first + 1; q < last + 1; q++) {
+            blockSum += start[q];
+            start[q] = blockSum;
+        }
+        blockSums[threadId] = blockSum;
+#pragma omp barrier
+        long blockOffset = 0;
+        for (int t = 0; t < threadId; t++) {
+            blockOffset += blockSums[t];
+        }
+        for (int q = first + 1; q < last + 1; q++) {
+            start[q] += blockOffset;
+        }
+    }
+    free(tileCounts);
+
+    if (BoidsQueryResultReserve(result, count, start[count]) < 0) return -1;
+    result->count = count;
+
+    int *ids = result->ids;
+    float *distances = result->distances;
+#pragma omp parallel num_threads(world->maxThreads) default(none) \
+    shared(world, queryPoints, worldSize, radii, count, start, order, ids, distances)
+    {
+        const QueryIndex index = QueryIndexOf(world);
+        const int *boidIds = BoidsWorldIds(world);
+
+#pragma omp for schedule(dynamic, 64)
+        for (int i = 0; i < count; i++) {
+            const int q = order[i];
+            const Vector2 point = QueryPointWrap(queryPoints[q], worldSize);
+            if (radii != NULL) {
+                QueryRadius(&index, world->boids, boidIds, point, radii[q], ids + start[q], distances + start[q]);
+            } else {
+                QueryNearest(&index, world->boids, boidIds, point, (int) (start[q + 1] - start[q]), ids + start[q],
+                             distances + start[q]);
+            }
+        }
+    }
+    return 0;
+}
+
+int BoidsWorldQueryRadius(BoidsWorld *world, const float *points, const float *radii, int count,
+                          BoidsQueryResult *result) {
+    return BoidsWorldQuery(world, points, radii, NULL, count, result);
+}
+
+int BoidsWorldQueryNearest(BoidsWorld *world, const float *points, const int *k, int count,
+                           BoidsQueryResult *result) {
+    return BoidsWorldQuery(world, points, NULL, k, count, result);
+}
+
+void BoidsQueryResultFree(BoidsQueryResult *result) {
+    if (result == NULL) return;
+
+    free(result->start);
+    free(result->order);
+    free(result->ids);
+    free(result->distances);
+    *result = (BoidsQueryResult){.start = NULL};
+}
+
+int BoidsWriteStates(FILE *file, const BoidsFrame *frame) {
+    const Boid *boids = (const Boid *) frame->states;
+    for (int id = 0; id < frame->count; id++) {
+        const Boid *boid = &boids[frame->slots != NULL ? frame->slots[id] : id];
+        const float state[4] = {boid->position.x, boid->position.y, boid->velocity.x, boid->velocity.y};
+        if (fwrite(state, sizeof(state), 1, file) != 1) return -1;
+    }
+    return fflush(file);
+}
+
+static LocalFlock LocalFlockFromBoidsFlock(const BoidsFlock *flock) {
+    return (LocalFlock){
+        .velocitiesSum = {flock->velocitiesSum[0], flock->velocitiesSum[1]},
+        .positionsSum = {flock->positionsSum[0], flock->positionsSum[1]},
+        .oppositeDirectionsSum = {flock->oppositeDirectionsSum[0], flock->oppositeDirectionsSum[1]},
+        .size = flock->size
+    };
+}
+
+void BoidsFlockAccumulate(BoidsFlock *flock, const float *states, int stride, int current, const int *candidates,
+                          int count, float radius) {
+    LocalFlock localFlock = LocalFlockFromBoidsFlock(flock);
+    LocalFlockAccumulateStrided(states, stride, current, candidates, count, &localFlock, radius,
+                                BOIDS_SEPARATION_PARALLEL);
+    *flock = (BoidsFlock){
+        .velocitiesSum = {localFlock.velocitiesSum.x, localFlock.velocitiesSum.y},
+        .positionsSum = {localFlock.positionsSum.x, localFlock.positionsSum.y},
+        .oppositeDirectionsSum = {localFlock.oppositeDirectionsSum.x, localFlock.oppositeDirectionsSum.y},
+        .size = localFlock.size
+    };
+}
+
+void BoidsFlockAcceleration(const SimParams *params, uint64_t seed, const float *state, const BoidsFlock *flock,
+                            int id, int frame, float *acceleration) {
+    Boid boid = {{state[0], state[1]}, {state[2], state[3]}};
+    LocalFlock localFlock = LocalFlockFromBoidsFlock(flock);
+    const Vector2 result = GetBoidAcceleration(params, seed, &boid, &localFlock, id, frame);
+    acceleration[0] = result.x;
+    acceleration[1] = result.y;
+}
+
+void BoidsUpdateState(const SimParams *params, float *state, const float *acceleration) {
+    Boid boid = {{state[0], state[1]}, {state[2], state[3]}};
+    UpdateBoid(params, &boid, (Vector2){acceleration[0], acceleration[1]});
+    state[0] = boid.position.x;
+    state[1] = boid.position.y;
+    state[2] = boid.velocity.x;
+    state[3] = boid.velocity.y;
+}
+
+void BoidsDrawState(const SimParams *params, uint64_t seed, BoidRng rng, int id, float *state) {
+    Boid boid = rng == BOID_RNG_PHILOX ? RandomBoid(params, seed, id) : (Boid){0};
+    if (rng == BOID_RNG_LIBC) {
+        // the position draws come first, as in BoidsWorldCreate
+        boid.position = RandomVector2(0, params->worldSize);
+        boid.velocity = RandomVector2(-params->maxVelocity, params->maxVelocity);
+    }
+    state[0] = boid.position.x;
+    state[1] = boid.position.y;
+    state[2] = boid.velocity.x;
+    state[3] = boid.velocity.y;
+}
+
+void BoidsWorldProfileDump(const BoidsWorld *world, const char *path) {
+    (void) world;
+    (void) path;
+    PROFILE_DUMP(world->profile, path);
+}
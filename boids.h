@@ -0,0 +1,354 @@
+//
+// Created by leonardo on 12/12/25.
+//
+
+#ifndef BOIDS_EXECISE_BOIDS_H
+#define BOIDS_EXECISE_BOIDS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "philox.h"
+#include "simparams.h"
+
+/**
+ * libboids: the simulation of main_omp behind an opaque world handle, so it can be driven from other
+ * programs. A world owns its boids and every index, engine and buffer the options need. Stepping runs
+ * any number of frames inside a single OpenMP parallel region, and the boids can be read in place
+ * between steps.
+ *
+ * Different worlds may be created, stepped and queried on different threads at the same time, each with
+ * its own parameters, as long as one world is only used by one thread at a time. Only drawing a flock
+ * with BOID_RNG_LIBC is not thread-safe, as it seeds rand().
+ */
+
+#if defined(__GNUC__)
+#define BOIDS_API __attribute__((visibility("default")))
+#else
+#define BOIDS_API
+#endif
+
+// x, y, vx, vy: a boid in memory, in a state dump and in a checkpoint
+#define BOIDS_STATE_FLOATS 4
+
+typedef enum {
+    GRID_WRAP_MODULO,  // generic, wraps the neighbour rows and cols with %
+    GRID_WRAP_MASK,    // power of two grid dimensions, wraps with a bit mask
+    GRID_WRAP_TABLE    // looks the 3x3 neighbourhood of a cell up in a table, other ranges fall back to %
+} GridWrap;
+
+typedef enum {
+    FLOCK_KERNEL_SCALAR,  // GetLocalFlock over the Boid array
+    FLOCK_KERNEL_SOA,     // portable loop over the cell ordered BoidSoA
+    FLOCK_KERNEL_SSE,
+    FLOCK_KERNEL_AVX2,
+    FLOCK_KERNEL_AVX512,
+    FLOCK_KERNEL_Q16,     // quantized copy: 16 bit fixed point offsets in the cell, half float velocities
+    FLOCK_KERNEL_Q32      // the same with 32 bit offsets
+} FlockKernel;
+
+typedef enum {
+    FORCE_ENGINE_GATHER,       // every boid gathers its own flock with GetLocalFlock or a FlockKernel
+    FORCE_ENGINE_HALF_STENCIL, // every pair of neighbours is visited once, see HalfStencilAccumulate
+    FORCE_ENGINE_VERLET        // every boid walks a list of candidates only rebuilt when they moved enough
+} ForceEngine;
+
+typedef enum {
+    BOIDS_INDEX_GRID,       // dense grid of cells
+    BOIDS_INDEX_TWO_LEVEL,  // dense grid, crowded cells split into subcells every frame
+    BOIDS_INDEX_HASHED      // only the occupied cells, for huge sparse worlds
+} BoidsIndex;
+
+typedef enum {
+    BOIDS_BACKEND_OPENMP,  // every step is one OpenMP parallel region
+    BOIDS_BACKEND_POOL     // persistent pinned pthreads with spin barriers, see workpool.h
+} BoidsBackend;
+
+/**
+ * How a neighbour pushes a boid away: its opposite direction over their squared distance, so 1 / distance
+ * long. The two rules only differ in rounding and in how close a neighbour may come before it is ignored.
+ */
+typedef enum {
+    BOIDS_SEPARATION_PARALLEL,  // main_omp: scaled in double, ignored within 0.1
+    BOIDS_SEPARATION_SERIAL     // main: scaled in float, ignored within 0.01. Scalar gather on the grid index only
+} BoidsSeparation;
+
+typedef enum {
+    CURVE_MORTON,
+    CURVE_HILBERT
+} SpaceFillingCurve;
+
+/**
+ * Everything a world is created with, the command line options of main_omp. Start from
+ * BoidsConfigDefault and override what is needed.
+ */
+typedef struct {
+    SimParams params;
+    uint64_t seed;             // keys the Philox draws, and seeds rand() when the flock is drawn with libc
+    BoidRng rng;               // how BoidsWorldCreate draws the flock when it isn't given one
+    int threads;               // threads of the step region, 0 for the OpenMP default
+    ForceEngine engine;
+    FlockKernel kernel;        // gather engine only
+    BoidsIndex index;          // gather engine with the scalar kernel only, except BOIDS_INDEX_GRID
+    int splitThreshold;        // BOIDS_INDEX_TWO_LEVEL splits cells with more boids than this
+    int gridWrap;              // a GridWrap, or -1 to pick the fastest the grid allows
+    int incrementalGrid;       // after the first frame only move the boids that changed cell
+    float migrationLimit;      // incremental grid: rebuild instead once more than this fraction of the boids moved
+    int reorderInterval;       // every K frames permute the boids along curve, 0 never
+    SpaceFillingCurve curve;
+    int fusedUpdate;           // integrate in the force loop into a second boid buffer
+    float verletSkin;
+    BoidsSeparation separation;
+    int checkKernel;           // also run the scalar kernel and keep the largest relative difference
+    int deterministic;         // every flock summed in boid order, even on the incremental grid
+    int startFrame;            // frame number of the first step, the wander noise is keyed by it
+    int hugePages;             // a HugePageMode of hugealloc.h for the boid and grid arrays
+    int cellBlocks;            // scalar gather only: schedule the forces over this many blocks of cells per thread
+    BoidsBackend backend;      // BOIDS_BACKEND_POOL: scalar gather on the plain grid only
+} BoidsConfig;
+
+typedef struct BoidsWorld BoidsWorld;
+
+/**
+ * A strided read-only view of a field of every boid, in slot order. x[i * stride] and y[i * stride]
+ * belong to the boid in slot i, BoidsWorldIds tells which boid that is. Valid until the next step,
+ * add or remove.
+ */
+typedef struct {
+    const float *x;
+    const float *y;
+    int stride;    // floats from one boid to the next
+    int count;
+} BoidsView;
+
+/**
+ * Boids a world steps in place instead of copying them, such as a mapped checkpoint. Once handed to
+ * BoidsWorldAdopt they belong to the world until it calls release.
+ */
+typedef struct {
+    float *states;                   // BOIDS_STATE_FLOATS per boid, in slot order
+    void (*release)(void *context);  // called once the world no longer uses states, may be NULL
+    void *context;
+} BoidsStorage;
+
+/**
+ * The sums the forces on a boid are computed from, over its neighbours within the perception radius.
+ * Only for programs that find the neighbours themselves, like main_dist over its strip of the world,
+ * see BoidsFlockAccumulate.
+ */
+typedef struct {
+    float velocitiesSum[2];
+    float positionsSum[2];
+    float oppositeDirectionsSum[2];
+    int size;
+} BoidsFlock;
+
+/**
+ * What a frame hook sees. Every field is private to the calling thread.
+ */
+typedef struct {
+    BoidsWorld *world;
+    int frame;
+    double startTime;      // omp_get_wtime() when the frame started
+    const float *states;   // BOIDS_STATE_FLOATS per boid, in slot order
+    const int *ids;        // id of the boid in each slot, NULL when slots are ids
+    const int *slots;      // slot of each id, NULL when slots are ids
+    int count;
+    int reordered;         // frame end only: the boids were permuted this frame
+    int migrations;        // frame end only: boids that changed cell, -1 unless the grid is incremental
+    float forceImbalance;  // frame end only: force loop time of the slowest thread over the mean of all
+} BoidsFrame;
+
+/**
+ * Called by every thread of the step region, so it may contain orphaned omp for, single, masked and
+ * barrier constructs, as long as every thread reaches them. On BOIDS_BACKEND_POOL only worker 0 calls
+ * it, where those constructs run as a team of one, while the other workers index the next frame.
+ */
+typedef void (*BoidsFrameHook)(const BoidsFrame *frame, void *data);
+
+typedef struct {
+    long frames;
+    long migrations;         // boids that changed cell, incremental grid only
+    long gridUpdates;        // frames the incremental grid was updated rather than built, migrations are over them
+    long fallbackRebuilds;   // frames the incremental grid had to be rebuilt anyway
+    long verletRebuilds;
+    long verletCandidates;   // list entries walked
+    long verletAccepted;     // list entries within the radius
+    long splitCells;         // cells split by the two-level index, summed over the frames
+    long hashedCells;        // occupied cells of the hashed index, summed over the frames
+    size_t hashedBytes;      // memory of the hashed index
+    float kernelError;       // checkKernel only, largest relative difference from the scalar kernel
+    long kernelMismatches;   // checkKernel with q16 or q32 only, flocks whose size differed, summed over the frames
+    double forceImbalance;   // force loop time of the slowest thread over the mean, averaged over the frames
+    float forceImbalanceMax; // the worst frame
+    long steals;             // cellBlocks only, blocks a thread took from the run of another
+} BoidsStats;
+
+/**
+ * The results of a batch of queries in compressed rows: query q found the boids ids[start[q]] to
+ * ids[start[q + 1] - 1], at the wrapped distances in the same places of distances. Start from a zeroed
+ * result and pass it to every batch, its arrays only grow, then free it with BoidsQueryResultFree.
+ */
+typedef struct {
+    long *start;        // count + 1 offsets into ids and distances
+    int *order;         // scratch, the queries in the order they were walked
+    int *ids;
+    float *distances;
+    int count;          // queries of the last batch
+    int startCapacity;
+    long capacity;      // of ids and distances
+} BoidsQueryResult;
+
+BOIDS_API BoidsConfig BoidsConfigDefault(void);
+
+/**
+ * @brief Checks that the options of a config can be combined and its parameters are valid.
+ * @return 0, or -1 after printing what is wrong.
+ */
+BOIDS_API int BoidsConfigCheck(const BoidsConfig *config);
+
+/**
+ * @brief Parses a wrap name, "auto" is -1.
+ * @return the wrap, -1 for auto, or -2 if the name is unknown.
+ */
+BOIDS_API int GridWrapParse(const char *name);
+
+/**
+ * @brief Parses a kernel name, "auto" picks the widest kernel the cpu supports.
+ * @return the kernel, or -1 if the name is unknown or the kernel can't run here.
+ */
+BOIDS_API int FlockKernelParse(const char *name);
+
+BOIDS_API const char *FlockKernelName(FlockKernel kernel);
+
+/**
+ * @brief Creates a world of count boids, copied from states (BOIDS_STATE_FLOATS per boid, boid i has
+ * id i) or drawn with config->rng when states is NULL.
+ * @return the world, or NULL if the config is invalid or the memory could not be allocated.
+ */
+BOIDS_API BoidsWorld *BoidsWorldCreate(const BoidsConfig *config, const float *states, int count);
+
+/**
+ * @brief Creates a world of count boids like BoidsWorldCreate, but steps them in storage.states itself. The
+ * world calls storage.release when it is destroyed, when it outgrows the array or when the creation fails.
+ * A fused world still allocates its second buffer and may end up stepping in either of them.
+ * @return the world, or NULL if the config is invalid, count is not positive or memory ran out.
+ */
+BOIDS_API BoidsWorld *BoidsWorldAdopt(const BoidsConfig *config, BoidsStorage storage, int count);
+
+BOIDS_API void BoidsWorldDestroy(BoidsWorld *world);
+
+/**
+ * @brief Sets the hooks called at the start and at the end of every frame, either may be NULL.
+ */
+BOIDS_API void BoidsWorldSetHooks(BoidsWorld *world, BoidsFrameHook frameStart, BoidsFrameHook frameEnd,
+                                  void *data);
+
+/**
+ * @brief Simulates frames frames in one parallel region.
+ * @return 0, or -1 after reporting an allocation failure. The world then stopped before the forces of the frame
+ * it failed in, BoidsWorldFrame tells which, and the next step retries it.
+ */
+BOIDS_API int BoidsWorldStep(BoidsWorld *world, int frames);
+
+BOIDS_API BoidsView BoidsWorldPositions(const BoidsWorld *world);
+BOIDS_API BoidsView BoidsWorldVelocities(const BoidsWorld *world);
+
+/**
+ * @return the id of the boid in each slot, or NULL when slots are ids, i.e. the world does not reorder.
+ */
+BOIDS_API const int *BoidsWorldIds(const BoidsWorld *world);
+
+/**
+ * @brief Tells a world created from states in slot order, like the frame of a reordering world, which boid
+ * each slot holds: ids[slot] is its id. A reordering world keeps the boids in their slots, any other moves
+ * them into id order.
+ * @return 0, or -1 if ids is not a permutation of the ids of the world or memory ran out, in which case the
+ * world is unchanged.
+ */
+BOIDS_API int BoidsWorldSetIds(BoidsWorld *world, const int *ids);
+
+BOIDS_API int BoidsWorldCount(const BoidsWorld *world);
+
+/**
+ * @return the number of the next frame to simulate.
+ */
+BOIDS_API int BoidsWorldFrame(const BoidsWorld *world);
+
+BOIDS_API BoidsStats BoidsWorldStats(const BoidsWorld *world);
+
+/**
+ * @brief Appends count boids (BOIDS_STATE_FLOATS each) with the next free ids, growing the world if needed.
+ * @return 0, or -1 if the world could not grow, in which case it is unchanged.
+ */
+BOIDS_API int BoidsWorldAdd(BoidsWorld *world, const float *states, int count);
+
+/**
+ * @brief Removes the boids with the given ids. The remaining boids keep their order and are
+ * renumbered so ids stay dense, which changes the wander noise of those after a removed one.
+ * @return 0, or -1 if an id is out of range or memory ran out, in which case the world is unchanged.
+ */
+BOIDS_API int BoidsWorldRemove(BoidsWorld *world, const int *ids, int count);
+
+/**
+ * @brief Finds the boids closer than radii[q] to every point q, given as x, y pairs, in parallel over the
+ * points. The boids of a query come in grid order. The first query after a step indexes the boids, and
+ * the next frame uses that index instead of building its own, so queries never change the simulation.
+ * @return 0, or -1 if the results could not be allocated.
+ */
+BOIDS_API int BoidsWorldQueryRadius(BoidsWorld *world, const float *points, const float *radii, int count,
+                                    BoidsQueryResult *result);
+
+/**
+ * @brief Finds the k[q] boids nearest to every point q like BoidsWorldQueryRadius, closest first and ties
+ * broken by id. A query only finds fewer when the world has fewer boids.
+ * @return 0, or -1 if the results could not be allocated.
+ */
+BOIDS_API int BoidsWorldQueryNearest(BoidsWorld *world, const float *points, const int *k, int count,
+                                     BoidsQueryResult *result);
+
+BOIDS_API void BoidsQueryResultFree(BoidsQueryResult *result);
+
+/**
+ * @brief Appends the boids of a frame to a state dump: x, y, vx, vy of every boid by id as native floats.
+ * @return 0, or -1 if the write failed.
+ */
+BOIDS_API int BoidsWriteStates(FILE *file, const BoidsFrame *frame);
+
+/**
+ * The rules of a single boid, for programs that keep the boids and their index themselves. A state is
+ * BOIDS_STATE_FLOATS floats, and the results are the same as in a world with the same parameters.
+ */
+
+/**
+ * @brief Adds the candidates within radius of boid current to its flock, in candidate order. Boid k is
+ * the state at states + k * stride, candidates may include current itself. Start from a zeroed flock.
+ */
+BOIDS_API void BoidsFlockAccumulate(BoidsFlock *flock, const float *states, int stride, int current,
+                                    const int *candidates, int count, float radius);
+
+/**
+ * @brief Computes the acceleration of the boid with the given id and state from its flock at a frame, the
+ * wander noise is keyed by seed like in a world.
+ */
+BOIDS_API void BoidsFlockAcceleration(const SimParams *params, uint64_t seed, const float *state,
+                                      const BoidsFlock *flock, int id, int frame, float *acceleration);
+
+/**
+ * @brief Moves a boid by its velocity, wrapping around the world, then accelerates it within the speed limits.
+ */
+BOIDS_API void BoidsUpdateState(const SimParams *params, float *state, const float *acceleration);
+
+/**
+ * @brief Draws the initial state of the boid with the given id like BoidsWorldCreate. BOID_RNG_LIBC takes the
+ * next four rand() draws, so seed rand() with seed and draw the boids in id order.
+ */
+BOIDS_API void BoidsDrawState(const SimParams *params, uint64_t seed, BoidRng rng, int id, float *state);
+
+/**
+ * @brief Writes the statistics of the per-phase profiler of the world to path, does nothing unless built
+ * with BOIDS_PROFILE. Every world profiles its own frames, from its creation on.
+ */
+BOIDS_API void BoidsWorldProfileDump(const BoidsWorld *world, const char *path);
+
+#endif //BOIDS_EXECISE_BOIDS_H
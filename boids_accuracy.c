@@ -0,0 +1,225 @@
+#include <math.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "boids.h"
+
+/**
+ * A world stepped next to the full float reference, and how far it drifted from it.
+ */
+typedef struct {
+    FlockKernel kernel;
+    BoidsWorld *world;
+    double seconds;          // in BoidsWorldStep
+    double positionRms;      // wrapped distance to the reference boid, last frame
+    double positionMax;
+    double velocityRms;
+    double polarizationError;
+} AccuracyRun;
+
+/**
+ * @return the length of the mean heading of the boids, as in boids_ensemble.
+ */
+static double Polarization(BoidsView velocities) {
+    double sumX = 0, sumY = 0;
+    for (int i = 0; i < velocities.count; i++) {
+        const double vx = velocities.x[(size_t) i * velocities.stride];
+        const double vy = velocities.y[(size_t) i * velocities.stride];
+        const double speed = hypot(vx, vy);
+        if (speed > 0) {
+            sumX += vx / speed;
+            sumY += vy / speed;
+        }
+    }
+    return velocities.count > 0 ? hypot(sumX, sumY) / velocities.count : 0;
+}
+
+static double WrappedDelta(double a, double b, double worldSize) {
+    const double delta = fabs(a - b);
+    return delta < worldSize - delta ? delta : worldSize - delta;
+}
+
+/**
+ * @brief Compares every boid of run with the same slot of the reference, neither world reorders its boids.
+ */
+static void Measure(AccuracyRun *run, const BoidsWorld *reference, double worldSize, double referencePolarization) {
+    const BoidsView positions = BoidsWorldPositions(run->world), velocities = BoidsWorldVelocities(run->world);
+    const BoidsView referencePositions = BoidsWorldPositions(reference);
+    const BoidsView referenceVelocities = BoidsWorldVelocities(reference);
+    double positionSum = 0, positionMax = 0, velocitySum = 0;
+    for (int i = 0; i < positions.count; i++) {
+        const size_t at = (size_t) i * positions.stride, referenceAt = (size_t) i * referencePositions.stride;
+        const double dx = WrappedDelta(positions.x[at], referencePositions.x[referenceAt], worldSize);
+        const double dy = WrappedDelta(positions.y[at], referencePositions.y[referenceAt], worldSize);
+        const double position = dx * dx + dy * dy;
+        positionSum += position;
+        if (position > positionMax) positionMax = position;
+
+        const size_t velocityAt = (size_t) i * velocities.stride;
+        const size_t referenceVelocityAt = (size_t) i * referenceVelocities.stride;
+        const double dvx = velocities.x[velocityAt] - referenceVelocities.x[referenceVelocityAt];
+        const double dvy = velocities.y[velocityAt] - referenceVelocities.y[referenceVelocityAt];
+        velocitySum += dvx * dvx + dvy * dvy;
+    }
+    const int count = positions.count > 0 ? positions.count : 1;
+    run->positionRms = sqrt(positionSum / count);
+    run->positionMax = sqrt(positionMax);
+    run->velocityRms = sqrt(velocitySum / count);
+    run->polarizationError = fabs(Polarization(velocities) - referencePolarization);
+}
+
+// bytes per boid the kernel reads in the neighbour loop, see BoidSoA
+static int KernelBytes(FlockKernel kernel) {
+    switch (kernel) {
+        case FLOCK_KERNEL_SCALAR:
+            return (int) (BOIDS_STATE_FLOATS * sizeof(float));
+        case FLOCK_KERNEL_Q16:
+            return 4 * sizeof(uint16_t);
+        case FLOCK_KERNEL_Q32:
+            return 2 * sizeof(uint32_t) + 2 * sizeof(uint16_t);
+        default:
+            return 4 * sizeof(float);
+    }
+}
+
+static int Step(AccuracyRun *run) {
+    const double start = omp_get_wtime();
+    const int result = BoidsWorldStep(run->world, 1);
+    run->seconds += omp_get_wtime() - start;
+    return result;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0)) {
+        fprintf(stderr, "USAGE: %s [options]\n"
+                        "  steps the same flock with the quantized kernels and a full float reference, and\n"
+                        "  reports how far they drift apart and how much faster they step\n"
+                        "  --out=PATH             errors of every frame, default accuracy.csv\n"
+                        "  --seed=S               default 1\n"
+                        "  --boids=N              default 20000\n"
+                        "  --frames=F             default 200\n"
+                        "  --threads=N            threads of every world, default the OpenMP default\n"
+                        "  --reference=scalar|soa kernel of the reference, default soa, the same sums in float\n"
+                        "  --kernel=q16|q32       only compare one of them, default both\n"
+                        "  --check-kernel         also report the largest relative flock error of a single step,\n"
+                        "                         which slows the quantized worlds down\n"
+                        SIM_PARAMS_USAGE, argv[0]);
+        return 1;
+    }
+
+    BoidsConfig config = BoidsConfigDefault();
+    config.seed = 1;
+    config.rng = BOID_RNG_PHILOX;
+    const char *outPath = "accuracy.csv";
+    int boidCount = 20000, frames = 200, checkKernel = 0;
+    FlockKernel referenceKernel = FLOCK_KERNEL_SOA;
+    FlockKernel kernels[2] = {FLOCK_KERNEL_Q16, FLOCK_KERNEL_Q32};
+    int kernelCount = 2;
+    for (int arg = 1; arg < argc; arg++) {
+        const int paramOption = SimParamsParseOption(&config.params, argv[arg]);
+        if (paramOption < 0) {
+            return 1;
+        } else if (paramOption > 0) {
+            continue;
+        }
+
+        if (strncmp(argv[arg], "--out=", 6) == 0) {
+            outPath = argv[arg] + 6;
+        } else if (strncmp(argv[arg], "--seed=", 7) == 0) {
+            config.seed = strtoull(argv[arg] + 7, NULL, 10);
+        } else if (strncmp(argv[arg], "--boids=", 8) == 0) {
+            boidCount = (int) strtol(argv[arg] + 8, NULL, 10);
+        } else if (strncmp(argv[arg], "--frames=", 9) == 0) {
+            frames = (int) strtol(argv[arg] + 9, NULL, 10);
+        } else if (strncmp(argv[arg], "--threads=", 10) == 0) {
+            config.threads = (int) strtol(argv[arg] + 10, NULL, 10);
+        } else if (strncmp(argv[arg], "--reference=", 12) == 0) {
+            const int kernel = FlockKernelParse(argv[arg] + 12);
+            if (kernel != FLOCK_KERNEL_SCALAR && kernel != FLOCK_KERNEL_SOA) {
+                fprintf(stderr, "The reference is scalar or soa: %s\n", argv[arg] + 12);
+                return 1;
+            }
+            referenceKernel = (FlockKernel) kernel;
+        } else if (strncmp(argv[arg], "--kernel=", 9) == 0) {
+            const int kernel = FlockKernelParse(argv[arg] + 9);
+            if (kernel != FLOCK_KERNEL_Q16 && kernel != FLOCK_KERNEL_Q32) {
+                fprintf(stderr, "Only the quantized kernels are compared, q16 or q32: %s\n", argv[arg] + 9);
+                return 1;
+            }
+            kernels[0] = (FlockKernel) kernel;
+            kernelCount = 1;
+        } else if (strcmp(argv[arg], "--check-kernel") == 0) {
+            checkKernel = 1;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[arg]);
+            return 1;
+        }
+    }
+    if (boidCount <= 0 || frames <= 0) {
+        fprintf(stderr, "The boid and frame counts must be positive\n");
+        return 1;
+    }
+
+    // every world draws the same flock from the seed and keys its wander noise by it, only the kernel differs
+    AccuracyRun reference = {.kernel = referenceKernel};
+    AccuracyRun runs[2];
+    config.kernel = referenceKernel;
+    reference.world = BoidsWorldCreate(&config, NULL, boidCount);
+    int failed = reference.world == NULL;
+    for (int k = 0; k < kernelCount; k++) {
+        BoidsConfig runConfig = config;
+        runConfig.kernel = kernels[k];
+        runConfig.checkKernel = checkKernel;
+        runs[k] = (AccuracyRun){.kernel = kernels[k], .world = failed ? NULL : BoidsWorldCreate(&runConfig, NULL,
+                                                                                                boidCount)};
+        failed = failed || runs[k].world == NULL;
+    }
+    FILE *out = failed ? NULL : fopen(outPath, "w");
+    if (out == NULL) {
+        if (!failed) perror("Failed to open accuracy file");
+        BoidsWorldDestroy(reference.world);
+        for (int k = 0; k < kernelCount; k++) BoidsWorldDestroy(runs[k].world);
+        return 1;
+    }
+
+    fprintf(out, "frame;kernel;position_rms;position_max;velocity_rms;polarization_error\n");
+    const double worldSize = config.params.worldSize;
+    for (int frame = 0; frame < frames && !failed; frame++) {
+        failed = Step(&reference) < 0;
+        const double referencePolarization = Polarization(BoidsWorldVelocities(reference.world));
+        for (int k = 0; k < kernelCount && !failed; k++) {
+            failed = Step(&runs[k]) < 0;
+            Measure(&runs[k], reference.world, worldSize, referencePolarization);
+            fprintf(out, "%d;%s;%g;%g;%g;%g\n", frame, FlockKernelName(runs[k].kernel), runs[k].positionRms,
+                    runs[k].positionMax, runs[k].velocityRms, runs[k].polarizationError);
+        }
+    }
+    fclose(out);
+    if (failed) {
+        BoidsWorldDestroy(reference.world);
+        for (int k = 0; k < kernelCount; k++) BoidsWorldDestroy(runs[k].world);
+        return 1;
+    }
+
+    printf("Reference %s: %d bytes per boid, %f s per frame\n", FlockKernelName(referenceKernel),
+           KernelBytes(referenceKernel), reference.seconds / frames);
+    for (int k = 0; k < kernelCount; k++) {
+        const AccuracyRun *run = &runs[k];
+        printf("%s: %d bytes per boid, %f s per frame (%.2fx), after %d frames position error %.3g rms %.3g max, "
+               "velocity error %.3g rms, polarization off by %.3g\n", FlockKernelName(run->kernel),
+               KernelBytes(run->kernel), run->seconds / frames, reference.seconds / run->seconds, frames,
+               run->positionRms, run->positionMax, run->velocityRms, run->polarizationError);
+        if (checkKernel) {
+            const BoidsStats stats = BoidsWorldStats(run->world);
+            printf("%s: largest relative flock difference from the scalar kernel %e over the flocks of the same "
+                   "size, %.4f%% of the flocks differed in size\n", FlockKernelName(run->kernel), stats.kernelError,
+                   100.0 * stats.kernelMismatches / ((double) frames * boidCount));
+        }
+    }
+
+    BoidsWorldDestroy(reference.world);
+    for (int k = 0; k < kernelCount; k++) BoidsWorldDestroy(runs[k].world);
+    return 0;
+}
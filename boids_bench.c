@@ -0,0 +1,444 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef BOIDS_MAIN_OMP_PATH
+#define BOIDS_MAIN_OMP_PATH "./main_omp"
+#endif
+
+#define MAX_LIST 32
+#define MAX_EXTRA_ARGS 32
+
+/**
+ * One point of the sweep. Frame times of every repeat are pooled after dropping the warm-up frames.
+ */
+typedef struct {
+    float radius;
+    int resolution;
+    const char *schedule;
+    long boids;
+    int threads;
+    long boidsPerThread;   // > 0 for the weak scaling runs
+    double median;
+    double p95;
+    double p99;
+    double mean;
+    double repeatSpread;   // (slowest - fastest) / median of the per-repeat medians
+    double imbalance;      // mean force loop time of the slowest thread over the mean of all threads
+    long frames;
+} BenchResult;
+
+typedef struct {
+    const char *mainPath;
+    const char *outPrefix;
+    const char *comparePath;
+    double tolerance;
+    long seed;
+    int frames;
+    int warmup;
+    int repeats;
+    char *extraArgs[MAX_EXTRA_ARGS];
+    int extraArgCount;
+} BenchOptions;
+
+static int ParseList(const char *text, char items[MAX_LIST][64]) {
+    // schedules have commas of their own, so a list holding a ':' is split on ':' instead
+    const char separator = strchr(text, ':') != NULL ? ':' : ',';
+    int count = 0;
+    while (*text != '\0' && count < MAX_LIST) {
+        const char *end = strchr(text, separator);
+        if (end == NULL) end = text + strlen(text);
+        const size_t length = end - text < 63 ? (size_t) (end - text) : 63;
+        memcpy(items[count], text, length);
+        items[count][length] = '\0';
+        count++;
+        text = *end != '\0' ? end + 1 : end;
+    }
+    return count;
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+    const double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double Percentile(const double *sorted, long count, double percentile) {
+    // nearest rank
+    long rank = (long) ceil(percentile / 100.0 * count);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+/**
+ * @brief Runs main_omp once and appends the frame times after the warm-up to samples.
+ * @param imbalance adds up the force loop imbalance of the same frames
+ * @return the number of frames read, -1 if the run failed
+ */
+static long RunOnce(const BenchOptions *options, const BenchResult *config, double *samples, double *imbalance) {
+    char csvPath[] = "/tmp/boids_bench_XXXXXX";
+    const int csvFd = mkstemp(csvPath);
+    if (csvFd < 0) {
+        perror("Failed to create temporary file");
+        return -1;
+    }
+    close(csvFd);
+
+    char seed[32], boids[32], frames[32], radius[64], resolution[64], schedule[96], csv[64], threads[16];
+    snprintf(seed, sizeof(seed), "%ld", options->seed);
+    snprintf(boids, sizeof(boids), "%ld", config->boids);
+    snprintf(frames, sizeof(frames), "%d", options->warmup + options->frames);
+    snprintf(radius, sizeof(radius), "--radius=%g", config->radius);
+    snprintf(resolution, sizeof(resolution), "--grid-resolution=%d", config->resolution);
+    snprintf(schedule, sizeof(schedule), "--schedule=%s", config->schedule);
+    snprintf(csv, sizeof(csv), "--csv=%s", csvPath);
+    snprintf(threads, sizeof(threads), "%d", config->threads);
+
+    char *argv[8 + MAX_EXTRA_ARGS + 1] = {
+        (char *) options->mainPath, seed, boids, frames, radius, resolution, schedule, csv
+    };
+    for (int a = 0; a < options->extraArgCount; a++) argv[8 + a] = options->extraArgs[a];
+    argv[8 + options->extraArgCount] = NULL;
+
+    const pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failed to fork");
+        unlink(csvPath);
+        return -1;
+    }
+    if (pid == 0) {
+        setenv("OMP_NUM_THREADS", threads, 1);
+        // pinned threads keep the repeats comparable, unless the caller chose a placement
+        setenv("OMP_PROC_BIND", "close", 0);
+        setenv("OMP_PLACES", "cores", 0);
+        if (freopen("/dev/null", "w", stdout) == NULL) _exit(127);
+        execv(options->mainPath, argv);
+        perror("Failed to run main_omp");
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed for %ld boids on %d threads\n", options->mainPath, config->boids,
+                config->threads);
+        unlink(csvPath);
+        return -1;
+    }
+
+    FILE *file = fopen(csvPath, "r");
+    long count = 0;
+    if (file != NULL) {
+        char line[256];
+        if (fgets(line, sizeof(line), file) != NULL) {  // header
+            while (count < options->frames && fgets(line, sizeof(line), file) != NULL) {
+                int frame;
+                double time, frameImbalance = 1;
+                const int fields = sscanf(line, "%d;%lf;%*d;%*d;%*d;%lf", &frame, &time, &frameImbalance);
+                if (fields >= 2 && frame >= options->warmup) {
+                    samples[count++] = time;
+                    *imbalance += frameImbalance;
+                }
+            }
+        }
+        fclose(file);
+    }
+    unlink(csvPath);
+    return count;
+}
+
+static int RunConfig(const BenchOptions *options, BenchResult *config) {
+    const long perRepeat = options->frames;
+    double *samples = malloc((size_t) perRepeat * options->repeats * sizeof(double));
+    double *repeatMedians = malloc(options->repeats * sizeof(double));
+    if (samples == NULL || repeatMedians == NULL) {
+        perror("Failed to allocate samples");
+        free(samples);
+        free(repeatMedians);
+        return -1;
+    }
+
+    long total = 0;
+    double imbalance = 0;
+    for (int r = 0; r < options->repeats; r++) {
+        const long count = RunOnce(options, config, samples + total, &imbalance);
+        if (count <= 0) {
+            free(samples);
+            free(repeatMedians);
+            return -1;
+        }
+        qsort(samples + total, count, sizeof(double), CompareDoubles);
+        repeatMedians[r] = Percentile(samples + total, count, 50);
+        total += count;
+    }
+
+    double sum = 0;
+    for (long k = 0; k < total; k++) sum += samples[k];
+    qsort(samples, total, sizeof(double), CompareDoubles);
+    qsort(repeatMedians, options->repeats, sizeof(double), CompareDoubles);
+
+    config->frames = total;
+    config->median = Percentile(samples, total, 50);
+    config->p95 = Percentile(samples, total, 95);
+    config->p99 = Percentile(samples, total, 99);
+    config->mean = sum / total;
+    config->repeatSpread = (repeatMedians[options->repeats - 1] - repeatMedians[0]) / config->median;
+    config->imbalance = imbalance / total;
+
+    fprintf(stderr, "radius %g resolution %d schedule %s boids %ld threads %d: median %.6fs p95 %.6fs "
+                    "spread %.1f%% imbalance %.3f\n", config->radius, config->resolution, config->schedule,
+            config->boids, config->threads, config->median, config->p95, 100 * config->repeatSpread,
+            config->imbalance);
+
+    free(samples);
+    free(repeatMedians);
+    return 0;
+}
+
+static int SameGroup(const BenchResult *a, const BenchResult *b) {
+    return a->radius == b->radius && a->resolution == b->resolution && strcmp(a->schedule, b->schedule) == 0 &&
+           a->boidsPerThread == b->boidsPerThread && (a->boidsPerThread > 0 || a->boids == b->boids);
+}
+
+/**
+ * @return the result with the fewest threads of the same group, the reference of the scaling tables
+ */
+static const BenchResult *ScalingBase(const BenchResult *results, int count, const BenchResult *result) {
+    const BenchResult *base = result;
+    for (int k = 0; k < count; k++) {
+        if (SameGroup(&results[k], result) && results[k].threads < base->threads) base = &results[k];
+    }
+    return base;
+}
+
+static void WriteReports(const BenchOptions *options, const BenchResult *results, int count) {
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s.csv", options->outPrefix);
+    FILE *all = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s_strong.csv", options->outPrefix);
+    FILE *strong = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s_weak.csv", options->outPrefix);
+    FILE *weak = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s.json", options->outPrefix);
+    FILE *json = fopen(path, "w");
+    if (all == NULL || strong == NULL || weak == NULL || json == NULL) {
+        perror("Failed to open reports");
+        if (all != NULL) fclose(all);
+        if (strong != NULL) fclose(strong);
+        if (weak != NULL) fclose(weak);
+        if (json != NULL) fclose(json);
+        return;
+    }
+
+    fprintf(all, "radius;resolution;schedule;boids;threads;scaling;frames;median;p95;p99;mean;repeat_spread;"
+                 "updates_per_second;imbalance\n");
+    fprintf(strong, "radius;resolution;schedule;boids;threads;median;speedup;efficiency\n");
+    fprintf(weak, "radius;resolution;schedule;boids_per_thread;threads;boids;median;efficiency\n");
+    fprintf(json, "{\n  \"frames\": %d,\n  \"warmup\": %d,\n  \"repeats\": %d,\n  \"results\": [",
+            options->frames, options->warmup, options->repeats);
+
+    for (int k = 0; k < count; k++) {
+        const BenchResult *r = &results[k];
+        const BenchResult *base = ScalingBase(results, count, r);
+        const double updates = r->boids / r->median;
+        // strong scaling compares against the fewest threads measured, weak scaling expects a flat time
+        const double speedup = base->median / r->median;
+        const double efficiency = r->boidsPerThread > 0 ? speedup : speedup * base->threads / r->threads;
+
+        fprintf(all, "%g;%d;%s;%ld;%d;%s;%ld;%.9f;%.9f;%.9f;%.9f;%.4f;%.0f;%.4f\n", r->radius, r->resolution,
+                r->schedule, r->boids, r->threads, r->boidsPerThread > 0 ? "weak" : "strong", r->frames, r->median,
+                r->p95, r->p99, r->mean, r->repeatSpread, updates, r->imbalance);
+        if (r->boidsPerThread > 0) {
+            fprintf(weak, "%g;%d;%s;%ld;%d;%ld;%.9f;%.4f\n", r->radius, r->resolution, r->schedule,
+                    r->boidsPerThread, r->threads, r->boids, r->median, efficiency);
+        } else {
+            fprintf(strong, "%g;%d;%s;%ld;%d;%.9f;%.4f;%.4f\n", r->radius, r->resolution, r->schedule, r->boids,
+                    r->threads, r->median, speedup, efficiency);
+        }
+        fprintf(json, "%s\n    {\"radius\": %g, \"resolution\": %d, \"schedule\": \"%s\", \"boids\": %ld, "
+                      "\"threads\": %d, \"scaling\": \"%s\", \"frames\": %ld, \"median\": %.9f, \"p95\": %.9f, "
+                      "\"p99\": %.9f, \"mean\": %.9f, \"repeat_spread\": %.4f, \"updates_per_second\": %.0f, "
+                      "\"speedup\": %.4f, \"efficiency\": %.4f, \"imbalance\": %.4f}",
+                k > 0 ? "," : "", r->radius, r->resolution, r->schedule, r->boids, r->threads,
+                r->boidsPerThread > 0 ? "weak" : "strong", r->frames, r->median, r->p95, r->p99, r->mean,
+                r->repeatSpread, updates, speedup, efficiency, r->imbalance);
+    }
+    fprintf(json, "\n  ]\n}\n");
+
+    fclose(all);
+    fclose(strong);
+    fclose(weak);
+    fclose(json);
+}
+
+/**
+ * @brief Compares the medians against a previous boids_bench csv.
+ * @return the number of configurations slower than the tolerance allows
+ */
+static int CompareWithBaseline(const BenchOptions *options, const BenchResult *results, int count) {
+    FILE *file = fopen(options->comparePath, "r");
+    if (file == NULL) {
+        perror("Failed to open baseline");
+        return 0;
+    }
+
+    int regressions = 0, matched = 0;
+    char line[512];
+    if (fgets(line, sizeof(line), file) == NULL) {
+        fclose(file);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        float radius;
+        int resolution, threads;
+        char schedule[64], scaling[16];
+        long boids, frames;
+        double median;
+        if (sscanf(line, "%f;%d;%63[^;];%ld;%d;%15[^;];%ld;%lf", &radius, &resolution, schedule, &boids, &threads,
+                   scaling, &frames, &median) != 8) {
+            continue;
+        }
+        for (int k = 0; k < count; k++) {
+            const BenchResult *r = &results[k];
+            if (r->radius != radius || r->resolution != resolution || strcmp(r->schedule, schedule) != 0 ||
+                r->boids != boids || r->threads != threads ||
+                (r->boidsPerThread > 0) != (strcmp(scaling, "weak") == 0)) {
+                continue;
+            }
+            matched++;
+            const double change = r->median / median - 1;
+            if (change > options->tolerance) {
+                printf("REGRESSION radius %g resolution %d schedule %s boids %ld threads %d: "
+                       "%.6fs -> %.6fs (%+.1f%%)\n", radius, resolution, schedule, boids, threads, median,
+                       r->median, 100 * change);
+                regressions++;
+            }
+        }
+    }
+    fclose(file);
+    printf("Compared %d configurations with %s, %d slower by more than %.1f%%\n", matched, options->comparePath,
+           regressions, 100 * options->tolerance);
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+    char boidItems[MAX_LIST][64] = {"10000"}, threadItems[MAX_LIST][64] = {"1"};
+    char radiusItems[MAX_LIST][64] = {"50"}, resolutionItems[MAX_LIST][64] = {"50"};
+    char scheduleItems[MAX_LIST][64] = {"dynamic"}, weakItems[MAX_LIST][64];
+    int boidCount = 1, threadCount = 1, radiusCount = 1, resolutionCount = 1, scheduleCount = 1, weakCount = 0;
+    char *extraArgs = NULL;
+
+    BenchOptions options = {
+        .mainPath = BOIDS_MAIN_OMP_PATH,
+        .outPrefix = "boids_bench",
+        .tolerance = 0.05,
+        .seed = 1,
+        .frames = 100,
+        .warmup = 10,
+        .repeats = 5
+    };
+
+    for (int arg = 1; arg < argc; arg++) {
+        if (strncmp(argv[arg], "--boids=", 8) == 0) {
+            boidCount = ParseList(argv[arg] + 8, boidItems);
+        } else if (strncmp(argv[arg], "--threads=", 10) == 0) {
+            threadCount = ParseList(argv[arg] + 10, threadItems);
+        } else if (strncmp(argv[arg], "--radius=", 9) == 0) {
+            radiusCount = ParseList(argv[arg] + 9, radiusItems);
+        } else if (strncmp(argv[arg], "--resolution=", 13) == 0) {
+            resolutionCount = ParseList(argv[arg] + 13, resolutionItems);
+        } else if (strncmp(argv[arg], "--schedule=", 11) == 0) {
+            scheduleCount = ParseList(argv[arg] + 11, scheduleItems);
+        } else if (strncmp(argv[arg], "--weak=", 7) == 0) {
+            weakCount = ParseList(argv[arg] + 7, weakItems);
+        } else if (strncmp(argv[arg], "--frames=", 9) == 0) {
+            options.frames = (int) strtol(argv[arg] + 9, NULL, 10);
+        } else if (strncmp(argv[arg], "--warmup=", 9) == 0) {
+            options.warmup = (int) strtol(argv[arg] + 9, NULL, 10);
+        } else if (strncmp(argv[arg], "--repeats=", 10) == 0) {
+            options.repeats = (int) strtol(argv[arg] + 10, NULL, 10);
+        } else if (strncmp(argv[arg], "--seed=", 7) == 0) {
+            options.seed = strtol(argv[arg] + 7, NULL, 10);
+        } else if (strncmp(argv[arg], "--main=", 7) == 0) {
+            options.mainPath = argv[arg] + 7;
+        } else if (strncmp(argv[arg], "--out=", 6) == 0) {
+            options.outPrefix = argv[arg] + 6;
+        } else if (strncmp(argv[arg], "--compare=", 10) == 0) {
+            options.comparePath = argv[arg] + 10;
+        } else if (strncmp(argv[arg], "--tolerance=", 12) == 0) {
+            options.tolerance = strtod(argv[arg] + 12, NULL);
+        } else if (strncmp(argv[arg], "--args=", 7) == 0) {
+            extraArgs = argv[arg] + 7;
+        } else {
+            fprintf(stderr, "USAGE: %s [options]\n"
+                            "  --boids=N,N,...        boid counts of the strong scaling sweep, default 10000\n"
+                            "  --weak=N,N,...         boids per thread of the weak scaling sweep\n"
+                            "  --threads=T,T,...      default 1\n"
+                            "  --radius=R,R,...       perception radius, default 50\n"
+                            "  --resolution=G,G,...   grid resolution, default 50\n"
+                            "  --schedule=S:S:...     force loop schedules, e.g. static:dynamic,64:guided:cells,8\n"
+                            "  --frames=F             measured frames per run, default 100\n"
+                            "  --warmup=W             frames dropped at the start of every run, default 10\n"
+                            "  --repeats=K            runs per configuration, default 5\n"
+                            "  --seed=S               default 1\n"
+                            "  --args=\"...\"           extra main_omp options, e.g. \"--engine=half-stencil\"\n"
+                            "  --main=PATH            main_omp executable, default %s\n"
+                            "  --out=PREFIX           writes PREFIX.csv, PREFIX_strong.csv, PREFIX_weak.csv, "
+                            "PREFIX.json\n"
+                            "  --compare=FILE.csv     flag configurations slower than in a previous PREFIX.csv\n"
+                            "  --tolerance=X          allowed slowdown for --compare, default 0.05\n",
+                    argv[0], BOIDS_MAIN_OMP_PATH);
+            return 1;
+        }
+    }
+    if (options.frames <= 0 || options.warmup < 0 || options.repeats <= 0) {
+        fprintf(stderr, "--frames and --repeats must be positive, --warmup not negative\n");
+        return 1;
+    }
+    for (char *token = extraArgs != NULL ? strtok(extraArgs, " ") : NULL; token != NULL; token = strtok(NULL, " ")) {
+        if (options.extraArgCount == MAX_EXTRA_ARGS) break;
+        options.extraArgs[options.extraArgCount++] = token;
+    }
+
+    const int sweeps = radiusCount * resolutionCount * scheduleCount;
+    BenchResult *results = calloc((size_t) sweeps * (boidCount + weakCount) * threadCount, sizeof(BenchResult));
+    if (results == NULL) {
+        perror("Failed to allocate results");
+        return 1;
+    }
+
+    int count = 0;
+    for (int r = 0; r < radiusCount; r++) {
+        for (int g = 0; g < resolutionCount; g++) {
+            for (int s = 0; s < scheduleCount; s++) {
+                for (int b = 0; b < boidCount + weakCount; b++) {
+                    for (int t = 0; t < threadCount; t++) {
+                        BenchResult *result = &results[count];
+                        const int threads = (int) strtol(threadItems[t], NULL, 10);
+                        const int isWeak = b >= boidCount;
+                        const long boids = strtol(isWeak ? weakItems[b - boidCount] : boidItems[b], NULL, 10);
+                        *result = (BenchResult){
+                            .radius = strtof(radiusItems[r], NULL),
+                            .resolution = (int) strtol(resolutionItems[g], NULL, 10),
+                            .schedule = scheduleItems[s],
+                            .boids = isWeak ? boids * threads : boids,
+                            .threads = threads,
+                            .boidsPerThread = isWeak ? boids : 0
+                        };
+                        if (RunConfig(&options, result) == 0) count++;
+                    }
+                }
+            }
+        }
+    }
+
+    WriteReports(&options, results, count);
+    const int regressions = options.comparePath != NULL ? CompareWithBaseline(&options, results, count) : 0;
+    free(results);
+    return regressions > 0 ? 2 : 0;
+}
@@ -0,0 +1,343 @@
+#include <math.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "boids.h"
+
+#define MAX_NAME 64
+
+/**
+ * One world of the sweep: a line of the manifest, or one of its repeats, and its summary metrics.
+ */
+typedef struct {
+    char name[MAX_NAME];
+    BoidsConfig config;
+    int boidCount;
+    int frames;
+    int failed;
+    double seconds;
+    double polarizationSum;   // over the frames, see FrameEnd
+    float polarization;       // at the last frame
+    float speed;              // mean speed at the last frame
+    float nearest;            // mean distance to the nearest other boid at the last frame
+} EnsembleWorld;
+
+typedef struct {
+    EnsembleWorld *worlds;
+    int count;
+    int capacity;
+} Ensemble;
+
+/**
+ * @return the length of the mean heading of the boids, 1 when they all fly the same way, about 0 when
+ * their headings are random.
+ */
+static float Polarization(const float *vx, const float *vy, int stride, int count) {
+    double sumX = 0, sumY = 0;
+    for (int i = 0; i < count; i++) {
+        const double speed = hypot(vx[(size_t) i * stride], vy[(size_t) i * stride]);
+        if (speed > 0) {
+            sumX += vx[(size_t) i * stride] / speed;
+            sumY += vy[(size_t) i * stride] / speed;
+        }
+    }
+    return count > 0 ? (float) (hypot(sumX, sumY) / count) : 0;
+}
+
+static void FrameEnd(const BoidsFrame *frame, void *data) {
+    EnsembleWorld *world = data;
+    // nobody writes the boids before the next frame's update, so one thread can read them meanwhile
+#pragma omp masked
+    world->polarizationSum += Polarization(frame->states + 2, frame->states + 3, BOIDS_STATE_FLOATS, frame->count);
+}
+
+/**
+ * @brief Fills the metrics of the last frame, the nearest neighbours with a batch query at every boid.
+ * @return 0, or -1 if the query could not be allocated.
+ */
+static int MeasureWorld(EnsembleWorld *world, BoidsWorld *boids) {
+    const BoidsView positions = BoidsWorldPositions(boids);
+    const BoidsView velocities = BoidsWorldVelocities(boids);
+    const int count = positions.count;
+    world->polarization = Polarization(velocities.x, velocities.y, velocities.stride, count);
+
+    double speedSum = 0;
+    for (int i = 0; i < count; i++) {
+        speedSum += hypot(velocities.x[(size_t) i * velocities.stride], velocities.y[(size_t) i * velocities.stride]);
+    }
+    world->speed = count > 0 ? (float) (speedSum / count) : 0;
+
+    // the nearest boid to a boid is itself, so ask for two
+    float *points = malloc((size_t) count * 2 * sizeof(float));
+    int *k = malloc((size_t) count * sizeof(int));
+    BoidsQueryResult result = {.start = NULL};
+    if (points == NULL || k == NULL) {
+        perror("Failed to allocate nearest queries");
+        free(points);
+        free(k);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        points[2 * i] = positions.x[(size_t) i * positions.stride];
+        points[2 * i + 1] = positions.y[(size_t) i * positions.stride];
+        k[i] = 2;
+    }
+    const int failed = BoidsWorldQueryNearest(boids, points, k, count, &result) < 0;
+    double nearestSum = 0;
+    for (int i = 0; !failed && i < count; i++) {
+        if (result.start[i + 1] - result.start[i] == 2) nearestSum += result.distances[result.start[i] + 1];
+    }
+    world->nearest = count > 1 ? (float) (nearestSum / count) : 0;
+
+    BoidsQueryResultFree(&result);
+    free(points);
+    free(k);
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Creates, steps, measures and destroys one world on the calling thread.
+ */
+static void RunWorld(EnsembleWorld *world) {
+    const double start = omp_get_wtime();
+    BoidsWorld *boids;
+    if (world->config.rng == BOID_RNG_LIBC) {
+        // rand() is shared by the whole process
+#pragma omp critical(EnsembleRand)
+        boids = BoidsWorldCreate(&world->config, NULL, world->boidCount);
+    } else {
+        boids = BoidsWorldCreate(&world->config, NULL, world->boidCount);
+    }
+    if (boids == NULL) {
+        world->failed = 1;
+        return;
+    }
+
+    BoidsWorldSetHooks(boids, NULL, FrameEnd, world);
+    world->failed = BoidsWorldStep(boids, world->frames) < 0 || MeasureWorld(world, boids) < 0;
+    world->seconds = omp_get_wtime() - start;
+    BoidsWorldDestroy(boids);
+}
+
+static EnsembleWorld *EnsembleAppend(Ensemble *ensemble) {
+    if (ensemble->count == ensemble->capacity) {
+        const int capacity = ensemble->capacity > 0 ? 2 * ensemble->capacity : 64;
+        EnsembleWorld *worlds = realloc(ensemble->worlds, capacity * sizeof(EnsembleWorld));
+        if (worlds == NULL) {
+            perror("Failed to allocate worlds");
+            return NULL;
+        }
+        ensemble->worlds = worlds;
+        ensemble->capacity = capacity;
+    }
+    return &ensemble->worlds[ensemble->count++];
+}
+
+/**
+ * @brief Reads one world per line, as name=value pairs separated by spaces, # starts a comment. The
+ * names are those of the simulation parameters plus name, seed, boids, frames, rng, and repeat=N, which
+ * adds N worlds with the seeds seed to seed + N - 1. Whatever a line leaves out comes from defaults.
+ * @return 0, or -1 after reporting the first bad line.
+ */
+static int EnsembleLoad(Ensemble *ensemble, const char *path, const EnsembleWorld *defaults) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Failed to open manifest");
+        return -1;
+    }
+
+    char line[1024];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lineNumber++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+
+        EnsembleWorld world = *defaults;
+        snprintf(world.name, MAX_NAME, "line%d", lineNumber);
+        long repeat = 1;
+        int tokens = 0, failed = 0;
+        for (char *token = strtok(line, " \t\r\n"); token != NULL && !failed; token = strtok(NULL, " \t\r\n")) {
+            tokens++;
+            char *equals = strchr(token, '=');
+            if (equals == NULL) {
+                fprintf(stderr, "%s:%d: expected name=value, got %s\n", path, lineNumber, token);
+                failed = 1;
+                break;
+            }
+            const char *value = equals + 1;
+            const size_t nameLength = equals - token;
+            if (nameLength == 4 && strncmp(token, "name", 4) == 0) {
+                snprintf(world.name, MAX_NAME, "%s", value);
+            } else if (nameLength == 4 && strncmp(token, "seed", 4) == 0) {
+                world.config.seed = strtoull(value, NULL, 10);
+            } else if (nameLength == 5 && strncmp(token, "boids", 5) == 0) {
+                world.boidCount = (int) strtol(value, NULL, 10);
+            } else if (nameLength == 6 && strncmp(token, "frames", 6) == 0) {
+                world.frames = (int) strtol(value, NULL, 10);
+            } else if (nameLength == 6 && strncmp(token, "repeat", 6) == 0) {
+                repeat = strtol(value, NULL, 10);
+            } else if (nameLength == 3 && strncmp(token, "rng", 3) == 0) {
+                const int rng = BoidRngParse(value);
+                if (rng < 0) {
+                    fprintf(stderr, "%s:%d: unknown generator %s\n", path, lineNumber, value);
+                    failed = 1;
+                }
+                world.config.rng = (BoidRng) rng;
+            } else if (SimParamsSet(&world.config.params, token, nameLength, value) < 0) {
+                fprintf(stderr, "in %s:%d\n", path, lineNumber);
+                failed = 1;
+            }
+        }
+        if (!failed && tokens > 0 && (world.boidCount <= 0 || world.frames <= 0 || repeat <= 0)) {
+            fprintf(stderr, "%s:%d: boids, frames and repeat must be positive\n", path, lineNumber);
+            failed = 1;
+        }
+        if (!failed && tokens > 0 && BoidsConfigCheck(&world.config) < 0) {
+            fprintf(stderr, "in %s:%d\n", path, lineNumber);
+            failed = 1;
+        }
+        if (failed) {
+            fclose(file);
+            return -1;
+        }
+
+        for (long r = 0; tokens > 0 && r < repeat; r++) {
+            EnsembleWorld *added = EnsembleAppend(ensemble);
+            if (added == NULL) {
+                fclose(file);
+                return -1;
+            }
+            *added = world;
+            added->config.seed = world.config.seed + r;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+// the longest worlds first, so none of them is left running alone at the end of the sweep
+static int CompareCost(const void *a, const void *b) {
+    const EnsembleWorld *x = *(EnsembleWorld *const *) a, *y = *(EnsembleWorld *const *) b;
+    const double costX = (double) x->boidCount * x->frames, costY = (double) y->boidCount * y->frames;
+    return (costX < costY) - (costX > costY);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "USAGE: %s manifest [options]\n"
+                        "  one world per manifest line: name=... seed=S boids=N frames=F rng=libc|philox repeat=R\n"
+                        "  and any simulation parameter, e.g. cohesion-weight=0.05. The options below and the\n"
+                        "  parameter options give the defaults of every line\n"
+                        "  --out=PATH             summary of every world, default ensemble.csv\n"
+                        "  --world-threads=N      threads stepping each world, default 1\n"
+                        "  --seed=S               default 1\n"
+                        "  --boids=N              default 5000\n"
+                        "  --frames=F             default 500\n"
+                        "  --rng=libc|philox      default philox, rand() draws are serialised\n"
+                        SIM_PARAMS_USAGE, argv[0]);
+        return 1;
+    }
+
+    EnsembleWorld defaults = {.boidCount = 5000, .frames = 500};
+    defaults.config = BoidsConfigDefault();
+    defaults.config.seed = 1;
+    defaults.config.rng = BOID_RNG_PHILOX;
+    const char *outPath = "ensemble.csv";
+    int worldThreads = 1;
+    for (int arg = 2; arg < argc; arg++) {
+        const int paramOption = SimParamsParseOption(&defaults.config.params, argv[arg]);
+        if (paramOption < 0) {
+            return 1;
+        } else if (paramOption > 0) {
+            continue;
+        }
+
+        if (strncmp(argv[arg], "--out=", 6) == 0) {
+            outPath = argv[arg] + 6;
+        } else if (strncmp(argv[arg], "--world-threads=", 16) == 0) {
+            worldThreads = (int) strtol(argv[arg] + 16, NULL, 10);
+        } else if (strncmp(argv[arg], "--seed=", 7) == 0) {
+            defaults.config.seed = strtoull(argv[arg] + 7, NULL, 10);
+        } else if (strncmp(argv[arg], "--boids=", 8) == 0) {
+            defaults.boidCount = (int) strtol(argv[arg] + 8, NULL, 10);
+        } else if (strncmp(argv[arg], "--frames=", 9) == 0) {
+            defaults.frames = (int) strtol(argv[arg] + 9, NULL, 10);
+        } else if (strncmp(argv[arg], "--rng=", 6) == 0) {
+            const int rng = BoidRngParse(argv[arg] + 6);
+            if (rng < 0) {
+                fprintf(stderr, "Unknown generator: %s\n", argv[arg] + 6);
+                return 1;
+            }
+            defaults.config.rng = (BoidRng) rng;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[arg]);
+            return 1;
+        }
+    }
+    if (worldThreads <= 0) {
+        fprintf(stderr, "--world-threads must be positive\n");
+        return 1;
+    }
+    defaults.config.threads = worldThreads;
+
+    Ensemble ensemble = {.worlds = NULL};
+    if (EnsembleLoad(&ensemble, argv[1], &defaults) < 0) {
+        free(ensemble.worlds);
+        return 1;
+    }
+    FILE *out = fopen(outPath, "w");
+    if (out == NULL) {
+        perror("Failed to open summary file");
+        free(ensemble.worlds);
+        return 1;
+    }
+
+    EnsembleWorld **order = malloc((ensemble.count > 0 ? ensemble.count : 1) * sizeof(EnsembleWorld *));
+    if (order == NULL) {
+        perror("Failed to allocate worlds");
+        fclose(out);
+        free(ensemble.worlds);
+        return 1;
+    }
+    for (int w = 0; w < ensemble.count; w++) {
+        order[w] = &ensemble.worlds[w];
+    }
+    qsort(order, ensemble.count, sizeof(EnsembleWorld *), CompareCost);
+
+    // a team of world runners, each stepping one world at a time with a team of worldThreads of its own
+    const int runners = omp_get_max_threads() / worldThreads > 0 ? omp_get_max_threads() / worldThreads : 1;
+    if (worldThreads > 1) omp_set_max_active_levels(2);
+    const double start = omp_get_wtime();
+#pragma omp parallel for schedule(dynamic, 1) num_threads(runners)
+    for (int w = 0; w < ensemble.count; w++) {
+        RunWorld(order[w]);
+    }
+    const double seconds = omp_get_wtime() - start;
+
+    fprintf(out, "world;name;seed;boids;frames;seconds;frames_per_second;polarization;polarization_mean;speed_mean;"
+                 "nearest_mean\n");
+    double boidFrames = 0;
+    int failures = 0;
+    for (int w = 0; w < ensemble.count; w++) {
+        const EnsembleWorld *world = &ensemble.worlds[w];
+        if (world->failed) {
+            fprintf(stderr, "World %d (%s) failed\n", w, world->name);
+            failures++;
+            continue;
+        }
+        fprintf(out, "%d;%s;%llu;%d;%d;%f;%f;%f;%f;%f;%f\n", w, world->name, (unsigned long long) world->config.seed,
+                world->boidCount, world->frames, world->seconds, world->frames / world->seconds, world->polarization,
+                world->polarizationSum / world->frames, world->speed, world->nearest);
+        boidFrames += (double) world->boidCount * world->frames;
+    }
+    fclose(out);
+
+    printf("%d worlds on %d runners of %d threads in %f s, %.3g boid frames per second\n", ensemble.count, runners,
+           worldThreads, seconds, boidFrames / seconds);
+    free(order);
+    free(ensemble.worlds);
+    return failures > 0 ? 2 : 0;
+}
@@ -0,0 +1,251 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef BOIDS_MAIN_PATH
+#define BOIDS_MAIN_PATH "./main"
+#endif
+#ifndef BOIDS_MAIN_OMP_PATH
+#define BOIDS_MAIN_OMP_PATH "./main_omp"
+#endif
+
+#define MAX_RUNS 16
+#define MAX_EXTRA_ARGS 32
+
+// main and main_omp default to different worlds, both run in the serial one unless --args overrides it
+#define VERIFY_WORLD_SIZE "--world-size=5000"
+
+/**
+ * A simulation streaming its state dump to us through a pipe, one frame of boidCount x, y, vx, vy floats
+ * at a time. threads is 0 for the serial reference.
+ */
+typedef struct {
+    int threads;
+    pid_t pid;
+    FILE *states;
+    float *frame;
+    long divergentFrame;   // -1 while it matches the reference
+} VerifyRun;
+
+typedef struct {
+    char *extraArgs[MAX_EXTRA_ARGS];
+    int extraArgCount;
+    char *parallelArgs[MAX_EXTRA_ARGS];
+    int parallelArgCount;
+} VerifyArgs;
+
+static int SplitArgs(char *text, char **args) {
+    int count = 0;
+    for (char *token = text != NULL ? strtok(text, " ") : NULL; token != NULL; token = strtok(NULL, " ")) {
+        if (count == MAX_EXTRA_ARGS) break;
+        args[count++] = token;
+    }
+    return count;
+}
+
+/**
+ * @brief Starts path with --deterministic, its state dump going to a pipe we read from.
+ * @return 0, or -1 if the pipe or the process could not be created.
+ */
+static int StartRun(VerifyRun *run, const char *path, char **positional, const VerifyArgs *args, long boidCount) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("Failed to create pipe");
+        return -1;
+    }
+    // no other simulation may inherit the pipe, or we would never see it end
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    run->frame = malloc(boidCount * 4 * sizeof(float));
+    if (run->frame == NULL) {
+        perror("Failed to allocate frame");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    char dump[64], threads[16];
+    snprintf(dump, sizeof(dump), "--dump-states=/dev/fd/%d", fds[1]);
+    snprintf(threads, sizeof(threads), "%d", run->threads);
+    char *argv[8 + 2 * MAX_EXTRA_ARGS + 1] = {
+        (char *) path, positional[0], positional[1], positional[2], "--deterministic", "--csv=/dev/null",
+        VERIFY_WORLD_SIZE, dump
+    };
+    int argc = 8;
+    for (int a = 0; a < args->extraArgCount; a++) argv[argc++] = args->extraArgs[a];
+    for (int a = 0; run->threads > 0 && a < args->parallelArgCount; a++) argv[argc++] = args->parallelArgs[a];
+    argv[argc] = NULL;
+
+    run->pid = fork();
+    if (run->pid < 0) {
+        perror("Failed to fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (run->pid == 0) {
+        // the write end has to survive the exec, every other pipe is closed by it
+        fcntl(fds[1], F_SETFD, 0);
+        if (run->threads > 0) setenv("OMP_NUM_THREADS", threads, 1);
+        if (freopen("/dev/null", "w", stdout) == NULL) _exit(127);
+        execv(path, argv);
+        perror("Failed to run simulation");
+        _exit(127);
+    }
+
+    close(fds[1]);
+    run->states = fdopen(fds[0], "rb");
+    run->divergentFrame = -1;
+    return run->states != NULL ? 0 : -1;
+}
+
+/**
+ * @brief Stops reading a run, killing it if it is still going.
+ * @return 0 if it exited cleanly or we stopped it, -1 if it failed.
+ */
+static int StopRun(VerifyRun *run, int stop) {
+    if (run->pid <= 0) return 0;
+    if (stop) kill(run->pid, SIGTERM);
+    if (run->states != NULL) fclose(run->states);
+    run->states = NULL;
+
+    int status;
+    while (waitpid(run->pid, &status, 0) < 0 && errno == EINTR) {}
+    run->pid = 0;
+    return stop || (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+static void PrintState(const char *label, const float *state) {
+    printf("  %-10s x=%.9g y=%.9g vx=%.9g vy=%.9g\n", label, state[0], state[1], state[2], state[3]);
+}
+
+/**
+ * @brief Reports the first boid of the frame that differs from the reference, how many differ, and by how much.
+ */
+static void ReportDivergence(const VerifyRun *run, const VerifyRun *reference, long frame, long boidCount) {
+    long first = -1, count = 0;
+    float maxDifference = 0;
+    for (long boid = 0; boid < boidCount; boid++) {
+        const float *a = reference->frame + 4 * boid, *b = run->frame + 4 * boid;
+        if (memcmp(a, b, 4 * sizeof(float)) == 0) continue;
+        if (first < 0) first = boid;
+        count++;
+        for (int k = 0; k < 4; k++) maxDifference = fmaxf(maxDifference, fabsf(a[k] - b[k]));
+    }
+
+    printf("%d threads: first divergence at frame %ld, boid %ld (%ld boids differ, by up to %g)\n",
+           run->threads, frame, first, count, maxDifference);
+    PrintState("serial", reference->frame + 4 * first);
+    PrintState("parallel", run->frame + 4 * first);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "USAGE: %s seed num_boids timesteps [options]\n"
+                        "  --threads=T,T,...      main_omp thread counts to check against main, default 1,2,4\n"
+                        "  --args=\"...\"           options for both programs, e.g. \"--radius=40\"\n"
+                        "  --parallel-args=\"...\"  options for main_omp only, e.g. \"--fused --index=hashed\"\n"
+                        "  --serial=PATH          main executable, default %s\n"
+                        "  --parallel=PATH        main_omp executable, default %s\n",
+                argv[0], BOIDS_MAIN_PATH, BOIDS_MAIN_OMP_PATH);
+        return 1;
+    }
+
+    const long boidCount = strtol(argv[2], NULL, 10);
+    const long timesteps = strtol(argv[3], NULL, 10);
+    const char *serialPath = BOIDS_MAIN_PATH;
+    const char *parallelPath = BOIDS_MAIN_OMP_PATH;
+    char threadList[256] = "1,2,4";
+    char *extraArgs = NULL, *parallelArgs = NULL;
+    for (int arg = 4; arg < argc; arg++) {
+        if (strncmp(argv[arg], "--threads=", 10) == 0) {
+            snprintf(threadList, sizeof(threadList), "%s", argv[arg] + 10);
+        } else if (strncmp(argv[arg], "--args=", 7) == 0) {
+            extraArgs = argv[arg] + 7;
+        } else if (strncmp(argv[arg], "--parallel-args=", 16) == 0) {
+            parallelArgs = argv[arg] + 16;
+        } else if (strncmp(argv[arg], "--serial=", 9) == 0) {
+            serialPath = argv[arg] + 9;
+        } else if (strncmp(argv[arg], "--parallel=", 11) == 0) {
+            parallelPath = argv[arg] + 11;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[arg]);
+            return 1;
+        }
+    }
+    if (boidCount <= 0 || timesteps <= 0) {
+        fprintf(stderr, "num_boids and timesteps must be positive\n");
+        return 1;
+    }
+
+    VerifyArgs args = {0};
+    args.extraArgCount = SplitArgs(extraArgs, args.extraArgs);
+    args.parallelArgCount = SplitArgs(parallelArgs, args.parallelArgs);
+
+    // the serial reference first, then one main_omp per thread count, all running side by side
+    VerifyRun runs[MAX_RUNS] = {{.threads = 0}};
+    int runCount = 1;
+    for (char *item = strtok(threadList, ","); item != NULL && runCount < MAX_RUNS; item = strtok(NULL, ",")) {
+        runs[runCount].threads = (int) strtol(item, NULL, 10);
+        if (runs[runCount].threads <= 0) {
+            fprintf(stderr, "Bad thread count: %s\n", item);
+            return 1;
+        }
+        runCount++;
+    }
+    for (int r = 0; r < runCount; r++) {
+        if (StartRun(&runs[r], r == 0 ? serialPath : parallelPath, argv + 1, &args, boidCount) < 0) {
+            for (int s = 0; s < r; s++) StopRun(&runs[s], 1);
+            return 1;
+        }
+    }
+
+    int failed = 0;
+    int pending = runCount - 1;
+    long frame = 0;
+    for (; frame < timesteps && pending > 0 && !failed; frame++) {
+        for (int r = 0; r < runCount; r++) {
+            if (runs[r].states == NULL) continue;
+            if (fread(runs[r].frame, 4 * sizeof(float), boidCount, runs[r].states) != (size_t) boidCount) {
+                fprintf(stderr, "%s stopped before frame %ld\n", r == 0 ? serialPath : parallelPath, frame);
+                failed = 1;
+                break;
+            }
+            if (r == 0 || memcmp(runs[r].frame, runs[0].frame, boidCount * 4 * sizeof(float)) == 0) continue;
+
+            // nothing after the first divergence is worth comparing
+            ReportDivergence(&runs[r], &runs[0], frame, boidCount);
+            runs[r].divergentFrame = frame;
+            StopRun(&runs[r], 1);
+            pending--;
+        }
+    }
+
+    for (int r = 0; r < runCount; r++) {
+        const int running = runs[r].states != NULL;
+        if (StopRun(&runs[r], failed || pending == 0) < 0 && running) {
+            fprintf(stderr, "%s failed\n", r == 0 ? serialPath : parallelPath);
+            failed = 1;
+        }
+        free(runs[r].frame);
+    }
+    if (failed) {
+        return 1;
+    }
+
+    int divergent = 0;
+    for (int r = 1; r < runCount; r++) {
+        if (runs[r].divergentFrame >= 0) {
+            divergent++;
+        } else {
+            printf("%d threads: identical to serial over %ld frames\n", runs[r].threads, frame);
+        }
+    }
+    return divergent > 0 ? 2 : 0;
+}
@@ -0,0 +1,227 @@
+//
+// Created by leonardo on 05/12/25.
+//
+
+#ifndef BOIDS_EXECISE_CHECKPOINT_H
+#define BOIDS_EXECISE_CHECKPOINT_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hugealloc.h"
+
+// the payload is mapped straight into the boid array, so the file has the layout of the machine
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Checkpoints are little-endian and mapped in place, a big-endian host can't use them"
+#endif
+
+#define CHECKPOINT_MAGIC "BOIDCKPT"
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_HEADER_BYTES 4096  // the payload starts on a page, mmap keeps it aligned
+
+/**
+ * Everything that changes the meaning of the stored boids. A checkpoint only resumes with the same
+ * parameters, compared bitwise.
+ */
+typedef struct {
+    float worldSize;
+    float gridResolution;
+    float perceptionRadius;
+    float minVelocity;
+    float maxVelocity;
+    float maxAcceleration;
+    float alignmentWeight;
+    float cohesionWeight;
+    float separationWeight;
+    float wanderWeight;
+} CheckpointParams;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerBytes;
+    uint64_t frame;      // frames already simulated, the resumed run starts here
+    uint64_t boidCount;
+    uint32_t boidBytes;
+    uint32_t rng;        // BoidRng of the initialisation
+    // rand() only runs during the initialisation, the seed and the number of draws reproduce its state.
+    // The seed also keys the wander noise, so a resumed run draws it from here.
+    int64_t randSeed;
+    uint64_t randDraws;
+    CheckpointParams params;
+    // 4 when the boids are followed by the id of the boid in each slot, 0 when slots are ids
+    uint32_t idBytes;
+} CheckpointHeader;
+
+static_assert(sizeof(CheckpointHeader) <= CHECKPOINT_HEADER_BYTES, "checkpoint header outgrew its page");
+
+/**
+ * @brief Writes checkpoints from a snapshot of the boids on a background thread, so the simulation
+ * only pays for the copy into the snapshot.
+ */
+typedef struct {
+    char *path;
+    char *temporaryPath;
+    void *snapshot;
+    size_t payloadBytes;
+    CheckpointHeader header;
+    pthread_t thread;
+    int started;
+    atomic_int busy;
+    long written;
+    long skipped;   // checkpoints dropped because the previous one was still being written
+    long failed;
+} CheckpointWriter;
+
+static CheckpointWriter CheckpointWriterAlloc(const char *path, CheckpointHeader header, size_t payloadBytes,
+                                              HugePageMode *hugePages) {
+    CheckpointWriter writer = {
+        .path = strdup(path),
+        .temporaryPath = malloc(strlen(path) + 5),
+        .snapshot = HugeAlloc(payloadBytes, hugePages),
+        .payloadBytes = payloadBytes,
+        .header = header
+    };
+    if (writer.path == NULL || writer.temporaryPath == NULL || writer.snapshot == NULL) {
+        perror("Failed to allocate checkpoint writer");
+        free(writer.path);
+        free(writer.temporaryPath);
+        HugeFree(writer.snapshot, payloadBytes);
+        writer.path = NULL;
+        return writer;
+    }
+    sprintf(writer.temporaryPath, "%s.tmp", path);
+    memcpy(writer.header.magic, CHECKPOINT_MAGIC, sizeof(writer.header.magic));
+    writer.header.version = CHECKPOINT_VERSION;
+    writer.header.headerBytes = CHECKPOINT_HEADER_BYTES;
+    atomic_init(&writer.busy, 0);
+    return writer;
+}
+
+static int CheckpointWriteAll(int fd, const void *data, size_t bytes) {
+    const char *cursor = data;
+    while (bytes > 0) {
+        const ssize_t written = write(fd, cursor, bytes);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0) return -1;
+        cursor += written;
+        bytes -= written;
+    }
+    return 0;
+}
+
+/**
+ * Writes the temporary file and renames it over the checkpoint, a crash mid-write leaves the previous
+ * checkpoint intact.
+ */
+static void *CheckpointWriterRun(void *argument) {
+    CheckpointWriter *writer = argument;
+    char header[CHECKPOINT_HEADER_BYTES] = {0};
+    memcpy(header, &writer->header, sizeof(writer->header));
+
+    const int fd = open(writer->temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int failed = fd < 0 ||
+                 CheckpointWriteAll(fd, header, sizeof(header)) < 0 ||
+                 CheckpointWriteAll(fd, writer->snapshot, writer->payloadBytes) < 0 ||
+                 fsync(fd) < 0;
+    // close exactly once whatever failed, a second close could hit a descriptor another thread reopened
+    if (fd >= 0 && close(fd) < 0) failed = 1;
+    if (!failed && rename(writer->temporaryPath, writer->path) < 0) failed = 1;
+    if (failed) {
+        perror("Failed to write checkpoint");
+        if (fd >= 0) unlink(writer->temporaryPath);
+        writer->failed++;
+    } else {
+        writer->written++;
+    }
+
+    atomic_store_explicit(&writer->busy, 0, memory_order_release);
+    return NULL;
+}
+
+/**
+ * @return 1 if the previous checkpoint is still being written and the snapshot can't be touched.
+ */
+static int CheckpointWriterBusy(CheckpointWriter *writer) {
+    return atomic_load_explicit(&writer->busy, memory_order_acquire);
+}
+
+/**
+ * @brief Starts writing the snapshot, which must already hold the boids after frame frames.
+ */
+static void CheckpointWriterStart(CheckpointWriter *writer, uint64_t frame) {
+    if (writer->started) pthread_join(writer->thread, NULL);
+
+    writer->header.frame = frame;
+    atomic_store_explicit(&writer->busy, 1, memory_order_relaxed);
+    writer->started = pthread_create(&writer->thread, NULL, CheckpointWriterRun, writer) == 0;
+    if (!writer->started) {
+        perror("Failed to start checkpoint writer");
+        atomic_store(&writer->busy, 0);
+        writer->failed++;
+    }
+}
+
+/**
+ * @brief Waits for the checkpoint in flight and releases the writer.
+ */
+static void CheckpointWriterFree(CheckpointWriter *writer) {
+    if (writer->path == NULL) return;
+    if (writer->started) pthread_join(writer->thread, NULL);
+    HugeFree(writer->snapshot, writer->payloadBytes);
+    free(writer->path);
+    free(writer->temporaryPath);
+    writer->path = NULL;
+}
+
+/**
+ * @brief Maps a checkpoint copy-on-write, the payload is used in place as the boid array and pages
+ * are read in as the first frame touches them.
+ * @return the start of the mapping, NULL if the file is not a checkpoint this build can resume.
+ * The payload starts header->headerBytes into it, followed by the ids if header->idBytes is not 0.
+ * Release it with munmap and *mappingBytes.
+ */
+static void *CheckpointMap(const char *path, CheckpointHeader *header, size_t boidBytes, size_t *mappingBytes) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open checkpoint");
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || pread(fd, header, sizeof(*header), 0) != sizeof(*header)) {
+        fprintf(stderr, "Failed to read checkpoint header\n");
+        close(fd);
+        return NULL;
+    }
+    if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CHECKPOINT_VERSION || header->boidBytes != boidBytes ||
+        (header->idBytes != 0 && header->idBytes != sizeof(int32_t)) ||
+        header->headerBytes % sysconf(_SC_PAGESIZE) != 0 ||
+        (uint64_t) info.st_size != header->headerBytes + header->boidCount * (header->boidBytes + header->idBytes)) {
+        fprintf(stderr, "%s is not a version %d checkpoint of this build\n", path, CHECKPOINT_VERSION);
+        close(fd);
+        return NULL;
+    }
+
+    *mappingBytes = info.st_size;
+    void *mapping = mmap(NULL, *mappingBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("Failed to map checkpoint");
+        return NULL;
+    }
+    madvise(mapping, *mappingBytes, MADV_WILLNEED);
+    return mapping;
+}
+
+#endif //BOIDS_EXECISE_CHECKPOINT_H
@@ -0,0 +1,68 @@
+//
+// Created by leonardo on 02/12/25.
+//
+
+#ifndef BOIDS_EXECISE_HUGEALLOC_H
+#define BOIDS_EXECISE_HUGEALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE ((size_t) 2 << 20)
+
+typedef enum {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_TRANSPARENT,  // madvise(MADV_HUGEPAGE) on a 2 MB aligned mapping
+    HUGE_PAGES_EXPLICIT      // MAP_HUGETLB, needs pages reserved in /proc/sys/vm/nr_hugepages
+} HugePageMode;
+
+static inline size_t HugeAllocSize(size_t bytes) {
+    return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+/**
+ * @brief Maps bytes of zeroed memory backed by huge pages according to mode.
+ *
+ * Pages are not touched here, so on a NUMA machine each page ends up on the node of the
+ * thread that writes it first. Initialise the memory with the same static partition the
+ * loops that use it will have. Falls back to transparent huge pages when no explicit
+ * huge pages are available, and sets mode to them so the next calls don't try again.
+ *
+ * @return the mapping, or NULL on failure. Release with HugeFree and the same size.
+ */
+static void *HugeAlloc(size_t bytes, HugePageMode *mode) {
+    const size_t size = HugeAllocSize(bytes);
+
+    if (*mode == HUGE_PAGES_EXPLICIT) {
+        void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mapping != MAP_FAILED) return mapping;
+
+        perror("No explicit huge pages, falling back to transparent huge pages");
+        *mode = HUGE_PAGES_TRANSPARENT;
+    }
+
+    // over-allocate so the block can start on a huge page boundary, then trim both ends
+    const size_t padded = size + HUGE_PAGE_SIZE;
+    char *raw = mmap(NULL, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        perror("Failed to map memory");
+        return NULL;
+    }
+
+    char *aligned = (char *) (((uintptr_t) raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+    if (aligned > raw) munmap(raw, aligned - raw);
+    if (raw + padded > aligned + size) munmap(aligned + size, raw + padded - (aligned + size));
+
+#ifdef MADV_HUGEPAGE
+    if (*mode == HUGE_PAGES_TRANSPARENT) madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+static void HugeFree(void *ptr, size_t bytes) {
+    if (ptr != NULL) munmap(ptr, HugeAllocSize(bytes));
+}
+
+#endif //BOIDS_EXECISE_HUGEALLOC_H
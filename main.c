@@ -2,15 +2,13 @@
 #include <stdio.h>
 #include <math.h>
 #include "raylib.h"
-#include "raymath.h"
 #include <omp.h>
 #include <string.h>
 
-#include "timeit.h"
+#include "boids.h"
 
 #define WINDOW_WIDTH 2000
 #define WINDOW_HEIGHT 2000
-#define MAX_LOCAL_FLOCK_SIZE 4096
 
 #define WORLD_SIZE 5000
 
@@ -21,205 +19,49 @@
 #define PERCEPTION_RADIUS 50
 #define GRID_RESOLUTION 50
 
-typedef struct {
-    Vector2 position;
-    Vector2 velocity;
-    Vector2 acceleration;
-} Boid;
-
-typedef struct {
-    Vector2 velocitiesSum;
-    Vector2 positionsSum;
-    Vector2 oppositeDirectionsSum;
-    int size;
-} LocalFlock;
-
-typedef struct {
-    Boid **boids;
-    int size;
-} GridCell;
+#define ALIGNMENT_WEIGHT 0.1f
+#define COHESION_WEIGHT 0.03f
+#define SEPARATION_WEIGHT 50
+#define WANDER_WEIGHT 0
 
 typedef struct {
-    GridCell **grid;
-    int gridResolution;
-    int gridHeight;
-    int gridWidth;
-} BoidGrid;
-
-BoidGrid BoidGridAlloc(int resolution, int width, int height, int cellCapacity) {
-    GridCell **cells = malloc(height * sizeof(GridCell *));
-
-    if (cells == NULL) {
-        perror("Failed to allocate grid rows");
-        return (BoidGrid){.grid = NULL};
-    }
-
-    GridCell *data_block = (GridCell *) malloc(height * width * sizeof(GridCell));
-    if (data_block == NULL) {
-        perror("Failed to allocate grid data block");
-        free(cells);
-        return (BoidGrid){.grid = NULL};
-    }
-
-    cells[0] = (GridCell *) cells + height;
-    for (int r = 1; r < height; r++) {
-        cells[r] = cells[r - 1] + width;
-    }
-
-    for (int r = 0; r < height; r++) {
-        cells[r] = data_block + (r * width);
-    }
-
-    for (int i = 0; i < height * width; i++) {
-        data_block[i].boids = (Boid **) malloc(cellCapacity * sizeof(Boid *));
-        data_block[i].size = 0;
-
-        if (data_block[i].boids == NULL) {
-            perror("Failed to allocate internal cell array");
-            for (int j = 0; j < i; j++) {
-                free(data_block[j].boids);
-            }
-            free(data_block);
-            free(cells);
-            return (BoidGrid){.grid = NULL};
-        }
-    }
-
-    return (BoidGrid){
-        .grid = cells,
-        .gridResolution = resolution,
-        .gridHeight = height,
-        .gridWidth = width
-    };
+    FILE *csvFile;
+    FILE *statesFile;
+    double frameTimes;
+    double measurements;
+} FrameOutputs;
+
+void DrawBoid(Vector2 position) {
+    //DrawCircleV(position, 5, RED);
+    DrawRectangle(position.x - 5, position.y - 5, 10, 10, RED);
 }
 
-void BoidGridFree(BoidGrid *grid) {
-    if (grid == NULL || grid->grid == NULL) return;
-
-    GridCell *data_block = grid->grid[0];
-    int totalCells = grid->gridHeight * grid->gridWidth;
-
-    for (int i = 0; i < totalCells; i++) {
-        free(data_block[i].boids);
+/**
+ * @brief Writes the frame time and the state dump, the world runs on a single thread.
+ */
+static void FrameEnd(const BoidsFrame *frame, void *data) {
+    FrameOutputs *outputs = data;
+    double frame_time = omp_get_wtime() - frame->startTime;
+    fprintf(outputs->csvFile, "%d;%f;%d\n", frame->frame, frame_time, frame->migrations);
+    outputs->frameTimes += frame_time;
+    outputs->measurements++;
+
+    if (outputs->statesFile != NULL && BoidsWriteStates(outputs->statesFile, frame) < 0) {
+        perror("Failed to write state dump");
+        fclose(outputs->statesFile);
+        outputs->statesFile = NULL;
     }
-
-    free(data_block);
-
-    free(grid->grid);
-
-    grid->grid = NULL;
-}
-
-void DrawBoid(Boid *boid) {
-    //DrawCircleV(boid->position, 5, RED);
-    DrawRectangle(boid->position.x - 5, boid->position.y - 5, 10, 10, RED);
-}
-
-void UpdateBoid(Boid *boid) {
-    boid->position = Vector2Add(boid->position, boid->velocity);
-    boid->position.x = Wrap(boid->position.x, 0, WORLD_SIZE);
-    boid->position.y = Wrap(boid->position.y, 0, WORLD_SIZE);
-    boid->velocity = Vector2Add(boid->velocity, boid->acceleration);
-    //boid->velocity = Vector2ClampValue(boid->velocity, -MAX_VELOCITY, MAX_VELOCITY);
-    float speedSqr = Vector2LengthSqr(boid->velocity);
-    if (speedSqr > MAX_VELOCITY * MAX_VELOCITY) {
-        boid->velocity = Vector2Scale(Vector2Normalize(boid->velocity), MAX_VELOCITY);
-    } else if (speedSqr < MIN_VELOCITY * MIN_VELOCITY) {
-        boid->velocity = Vector2Scale(Vector2Normalize(boid->velocity), MIN_VELOCITY);
-    }
-}
-
-
-void GetLocalFlock(Boid *current, BoidGrid *grid, int range, LocalFlock *flock, float radius) {
-    const int row = current->position.x / grid->gridResolution;
-    const int col = current->position.y / grid->gridResolution;
-    flock->positionsSum = (Vector2){0, 0};
-    flock->velocitiesSum = (Vector2){0, 0};
-    flock->oppositeDirectionsSum = (Vector2){0, 0};
-    flock->size = 0;
-
-    for (int dcol = -range; dcol <= range; dcol++) {
-        for (int drow = -range; drow <= range; drow++) {
-            // if gridRol > gridHeight we get a segfault, so we wrap the grid
-            int gridRow = (row + drow) % grid->gridHeight;
-            if (gridRow < 0) gridRow += grid->gridHeight;
-
-            int gridCol = (col + dcol) % grid->gridWidth;
-            if (gridCol < 0) gridCol += grid->gridWidth;
-
-            GridCell *cell = &grid->grid[gridRow][gridCol];
-
-            for (int i = 0; i < cell->size; i++) {
-                float dist = Vector2DistanceSqr(cell->boids[i]->position, current->position);
-                if (dist < radius * radius && current != cell->boids[i]) {
-                    flock->velocitiesSum = Vector2Add(flock->velocitiesSum, cell->boids[i]->velocity);
-                    flock->positionsSum = Vector2Add(flock->positionsSum, cell->boids[i]->position);
-                    Vector2 oppositeDirection = Vector2Subtract(current->position, cell->boids[i]->position);
-                    if (dist > 0.0001f) {
-                        oppositeDirection = Vector2Scale(oppositeDirection, 1.0f / dist);
-                        flock->oppositeDirectionsSum = Vector2Add(flock->oppositeDirectionsSum, oppositeDirection);
-                    }
-                    flock->size++;
-                }
-            }
-        }
-    }
-}
-
-Vector2 GetBoidAlignmentForce(Boid *boid, LocalFlock *localFlock, float weight) {
-    Vector2 averageVelocity = localFlock->velocitiesSum;
-    if (localFlock->size > 0) {
-        averageVelocity = Vector2Scale(averageVelocity, 1.0 / localFlock->size);
-        averageVelocity = Vector2Subtract(averageVelocity, boid->velocity);
-        averageVelocity = Vector2Scale(averageVelocity, weight);
-        averageVelocity = Vector2ClampValue(averageVelocity, -MAX_ACCELERATION, MAX_ACCELERATION);
-    }
-    return averageVelocity;
-}
-
-Vector2 GetBoidCohesionForce(Boid *boid, LocalFlock *localFlock, float weight) {
-    Vector2 averagePosition = localFlock->positionsSum;
-    if (localFlock->size > 0) {
-        averagePosition = Vector2Scale(averagePosition, 1.0 / localFlock->size);
-        // get the vector from boid -> averagePosition
-        averagePosition = Vector2Subtract(averagePosition, boid->position);
-        // scale it
-        averagePosition = Vector2Scale(averagePosition, weight);
-        averagePosition = Vector2ClampValue(averagePosition, -MAX_ACCELERATION, MAX_ACCELERATION);
-    }
-    return averagePosition;
-}
-
-Vector2 GetBoidSeparationForce(Boid *boid, LocalFlock *localFlock, float weight) {
-    Vector2 averageOppositeDirection = localFlock->oppositeDirectionsSum;
-    if (localFlock->size > 0) {
-        averageOppositeDirection = Vector2Scale(averageOppositeDirection, 1.0 / localFlock->size);
-        averageOppositeDirection = Vector2Scale(averageOppositeDirection, weight);
-        averageOppositeDirection = Vector2ClampValue(averageOppositeDirection, -MAX_ACCELERATION, MAX_ACCELERATION);
-    }
-    return averageOppositeDirection;
-}
-
-float RandomFloat(float min, float max) {
-    // Calculate the range size
-    float range = max - min;
-
-    // Scale the result of rand() (0 to RAND_MAX) to the desired range (0 to range)
-    // and then offset by min.
-    // We cast rand() to float to ensure floating-point division.
-    return min + ((float) rand() / RAND_MAX) * range;
-}
-
-Vector2 RandomVector2(float min, float max) {
-    return (Vector2){
-        .x = RandomFloat(min, max),
-        .y = RandomFloat(min, max)
-    };
 }
 
 int main(int argc, char** argv) {
     if (argc < 4) {
-        fprintf(stderr, "USAGE: %s seed num_boids timesteps", argv[0]);
+        fprintf(stderr, "USAGE: %s seed num_boids timesteps [options]\n"
+                        "  --incremental-grid     only move the boids that changed cell between frames\n"
+                        "  --deterministic        keep the incremental cells in boid order, see boids_verify\n"
+                        "  --dump-states=PATH     append the boids of every frame to PATH as floats\n"
+                        "  --csv=PATH             frame statistics, default main.csv\n"
+                        "  --rng=libc|philox      draw the initial flock with rand() or with Philox\n"
+                        SIM_PARAMS_USAGE, argv[0]);
         return 1;
     }
 
@@ -227,72 +69,86 @@ int main(int argc, char** argv) {
     const long int boidCount = strtol(argv[2], NULL, 10);
     const long int timesteps = strtol(argv[3], NULL, 10);
 
-    srand(randSeed);
-
-    FILE* csvfile = fopen("main.csv", "w");
-    fprintf(csvfile,"frame_no;time\n");
-
-    Boid boids[boidCount];
-    int cellCapacity = 256;
-    BoidGrid boidGrid = BoidGridAlloc(GRID_RESOLUTION, WORLD_SIZE / GRID_RESOLUTION, WORLD_SIZE / GRID_RESOLUTION,
-                                      cellCapacity);
-
-    for (int i = 0; i < boidCount; i++) {
-        boids[i] = (Boid){
-            .position = RandomVector2(0, WORLD_SIZE),
-            .velocity = RandomVector2(-30, 30),
-            .acceleration = (Vector2){.x = 0, .y = 0}
-        };
-    }
-
-    LocalFlock localFlock;
-
-    double frameTimes = 0;
-    double measurements = 0;
-
-    for (int frame = 0; frame < timesteps; frame++) {
-
-        double frame_time_start = omp_get_wtime();
-
-        for (int row = 0; row < boidGrid.gridHeight; row++) {
-            for (int col = 0; col < boidGrid.gridWidth; col++) {
-                boidGrid.grid[row][col].size = 0;
-            }
+    // the serial version runs the simulation of main_omp on a single thread, with its own separation rule
+    BoidsConfig config = BoidsConfigDefault();
+    config.threads = 1;
+    config.seed = randSeed;
+    config.params = (SimParams){
+        .worldSize = WORLD_SIZE,
+        .gridResolution = GRID_RESOLUTION,
+        .perceptionRadius = PERCEPTION_RADIUS,
+        .minVelocity = MIN_VELOCITY,
+        .maxVelocity = MAX_VELOCITY,
+        .maxAcceleration = MAX_ACCELERATION,
+        .alignmentWeight = ALIGNMENT_WEIGHT,
+        .cohesionWeight = COHESION_WEIGHT,
+        .separationWeight = SEPARATION_WEIGHT,
+        .wanderWeight = WANDER_WEIGHT
+    };
+    const char *statesPath = NULL;
+    const char *csvPath = "main.csv";
+    for (int arg = 4; arg < argc; arg++) {
+        const int paramOption = SimParamsParseOption(&config.params, argv[arg]);
+        if (paramOption < 0) {
+            return 1;
+        } else if (paramOption > 0) {
+            continue;
         }
 
-        for (int i = 0; i < boidCount; i++) {
-            int col = (int) (boids[i].position.y / boidGrid.gridResolution) % boidGrid.gridWidth;
-            int row = (int) (boids[i].position.x / boidGrid.gridResolution) % boidGrid.gridHeight;
-            GridCell *cell = &boidGrid.grid[row][col];
-            if (cell->size < cellCapacity) {
-                cell->boids[cell->size] = &boids[i];
-                cell->size++;
+        if (strcmp(argv[arg], "--incremental-grid") == 0) {
+            // move only the boids that changed cell instead of refilling the whole grid every frame
+            config.incrementalGrid = 1;
+        } else if (strcmp(argv[arg], "--deterministic") == 0) {
+            config.deterministic = 1;
+        } else if (strncmp(argv[arg], "--dump-states=", 14) == 0) {
+            statesPath = argv[arg] + 14;
+        } else if (strncmp(argv[arg], "--csv=", 6) == 0) {
+            csvPath = argv[arg] + 6;
+        } else if (strncmp(argv[arg], "--rng=", 6) == 0) {
+            const int rng = BoidRngParse(argv[arg] + 6);
+            if (rng < 0) {
+                fprintf(stderr, "Unknown generator: %s\n", argv[arg] + 6);
+                return 1;
             }
+            config.rng = (BoidRng) rng;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[arg]);
+            return 1;
         }
+    }
+    // --deterministic takes the rule of main_omp, so boids_verify can compare the two
+    if (!config.deterministic) config.separation = BOIDS_SEPARATION_SERIAL;
 
-        for (int i = 0; i < boidCount; i++) {
-            GetLocalFlock(&boids[i], &boidGrid, 1, &localFlock, PERCEPTION_RADIUS);
-            Vector2 allignmentForce = GetBoidAlignmentForce(&boids[i], &localFlock, 0.1f);
-            Vector2 cohesionForce = GetBoidCohesionForce(&boids[i], &localFlock, 0.03f);
-            Vector2 separationForce = GetBoidSeparationForce(&boids[i], &localFlock, 50);
-            boids[i].acceleration = Vector2Add(allignmentForce, cohesionForce);
-            boids[i].acceleration = Vector2Add(boids[i].acceleration, separationForce);
-        }
-
-        for (int i = 0; i < boidCount; i++) {
-           UpdateBoid(&boids[i]);
-        }
+    FrameOutputs outputs = {.statesFile = NULL};
+    outputs.csvFile = fopen(csvPath, "w");
+    if (outputs.csvFile == NULL) {
+        perror("Failed to open csv file");
+        return 1;
+    }
+    fprintf(outputs.csvFile,"frame_no;time;migrations\n");
+    if (statesPath != NULL && (outputs.statesFile = fopen(statesPath, "wb")) == NULL) {
+        perror("Failed to open state dump");
+        return 1;
+    }
 
-        double frame_time = omp_get_wtime() - frame_time_start;
-        fprintf(csvfile, "%d;%f\n", frame, frame_time);
-        frameTimes += frame_time;
-        measurements++;
+    BoidsWorld *world = BoidsWorldCreate(&config, NULL, (int) boidCount);
+    if (world == NULL) {
+        return 1;
     }
+    BoidsWorldSetHooks(world, NULL, FrameEnd, &outputs);
+    const int stepFailed = BoidsWorldStep(world, (int) timesteps) < 0;
 
-    fclose(csvfile);
+    fclose(outputs.csvFile);
+    if (outputs.statesFile != NULL) fclose(outputs.statesFile);
+    BoidsWorldProfileDump(world, "main_profile.json");
 
-    BoidGridFree(&boidGrid);
+    const BoidsStats stats = BoidsWorldStats(world);
+    BoidsWorldDestroy(world);
 
-    printf("Average frame time: %f\n", frameTimes / measurements);
-    return 0;
+    if (config.incrementalGrid) {
+        printf("Incremental grid: %.1f migrations per frame, %ld fallback rebuilds\n",
+               (double) stats.migrations / fmax(1, stats.gridUpdates), stats.fallbackRebuilds);
+    }
+    printf("Average frame time: %f\n", outputs.frameTimes / outputs.measurements);
+    return stepFailed;
 }
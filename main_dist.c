@@ -0,0 +1,474 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <omp.h>
+#include <string.h>
+
+#include "boids.h"
+#include "simparams.h"
+#include "transport.h"
+
+/**
+ * What travels between ranks. The id is the boid's index in the single process version, cells are kept
+ * in id order so the forces add up in the same order as there.
+ */
+typedef struct {
+    float state[BOIDS_STATE_FLOATS];  // x, y, vx, vy, the rules of libboids work on it in place
+    int id;
+} BoidRecord;
+
+// the records are the states libboids walks, one record apart
+#define BOID_RECORD_STRIDE ((int) (sizeof(BoidRecord) / sizeof(float)))
+static_assert(sizeof(BoidRecord) % sizeof(float) == 0, "records are walked as a stride of floats");
+
+typedef struct {
+    int *boids;
+    int size;
+} GridCell;
+
+/**
+ * @brief The grid of one rank: a strip of whole rows of the world grid plus one ghost row on each side,
+ * filled with copies of the neighbours' boundary rows.
+ *
+ * Local row 0 is the ghost row below firstRow, rows 1..ownedRows are owned and row ownedRows + 1 is the
+ * ghost row after them. Rows and columns still wrap around the world like in the single process grid.
+ */
+typedef struct {
+    int *cellStart;   // (ownedRows + 2) * gridWidth + 1 offsets into cellBoids
+    int *cellCursor;  // scatter cursor per cell
+    int *cellBoids;   // indices into the owned + ghost records, grouped by cell
+    int *boidCell;
+    int boidCapacity;
+    int firstRow;
+    int ownedRows;
+    int gridResolution;
+    int gridHeight;
+    int gridWidth;
+} StripGrid;
+
+StripGrid StripGridAlloc(int resolution, int height, int width, int firstRow, int ownedRows) {
+    StripGrid grid = {
+        .cellStart = calloc((size_t) (ownedRows + 2) * width + 1, sizeof(int)),
+        .cellCursor = calloc((size_t) (ownedRows + 2) * width, sizeof(int)),
+        .firstRow = firstRow,
+        .ownedRows = ownedRows,
+        .gridResolution = resolution,
+        .gridHeight = height,
+        .gridWidth = width
+    };
+    if (grid.cellStart == NULL || grid.cellCursor == NULL) {
+        perror("Failed to allocate grid");
+        free(grid.cellStart);
+        free(grid.cellCursor);
+        grid.cellStart = NULL;
+    }
+    return grid;
+}
+
+void StripGridFree(StripGrid *grid) {
+    free(grid->cellStart);
+    free(grid->cellCursor);
+    free(grid->cellBoids);
+    free(grid->boidCell);
+    grid->cellStart = NULL;
+}
+
+static inline int GridRow(const StripGrid *grid, const float *state) {
+    return (int) (state[0] / grid->gridResolution) % grid->gridHeight;
+}
+
+/**
+ * @return the local row of a world row, -1 if this rank sees nothing of it. Owned rows win over
+ * ghost rows, which only matters when a single rank owns the whole world.
+ */
+static inline int StripGridLocalRow(const StripGrid *grid, int row) {
+    const int owned = (row - grid->firstRow + grid->gridHeight) % grid->gridHeight;
+    if (owned < grid->ownedRows) return owned + 1;
+    if (row == (grid->firstRow - 1 + grid->gridHeight) % grid->gridHeight) return 0;
+    if (row == (grid->firstRow + grid->ownedRows) % grid->gridHeight) return grid->ownedRows + 1;
+    return -1;
+}
+
+static inline GridCell StripGridGetCell(const StripGrid *grid, int row, int col) {
+    const int localRow = StripGridLocalRow(grid, row);
+    if (localRow < 0) return (GridCell){.boids = NULL, .size = 0};
+
+    const int cell = localRow * grid->gridWidth + col;
+    return (GridCell){
+        .boids = grid->cellBoids + grid->cellStart[cell],
+        .size = grid->cellStart[cell + 1] - grid->cellStart[cell]
+    };
+}
+
+/**
+ * @brief Counting sort of the owned boids and ghosts into the strip, then every cell is sorted by id.
+ * Cells hold a handful of boids, so insertion sort is plenty.
+ */
+int StripGridBuild(StripGrid *grid, const BoidRecord *boids, int boidCount) {
+    const int cellCount = (grid->ownedRows + 2) * grid->gridWidth;
+
+    if (boidCount > grid->boidCapacity) {
+        int *cellBoids = realloc(grid->cellBoids, boidCount * sizeof(int));
+        if (cellBoids != NULL) grid->cellBoids = cellBoids;
+        int *boidCell = realloc(grid->boidCell, boidCount * sizeof(int));
+        if (boidCell != NULL) grid->boidCell = boidCell;
+        if (cellBoids == NULL || boidCell == NULL) {
+            perror("Failed to grow grid");
+            return -1;
+        }
+        grid->boidCapacity = boidCount;
+    }
+
+    memset(grid->cellStart, 0, (cellCount + 1) * sizeof(int));
+    for (int i = 0; i < boidCount; i++) {
+        const int localRow = StripGridLocalRow(grid, GridRow(grid, boids[i].state));
+        assert(localRow >= 0);
+        const int col = (int) (boids[i].state[1] / grid->gridResolution) % grid->gridWidth;
+        grid->boidCell[i] = localRow * grid->gridWidth + col;
+        grid->cellStart[grid->boidCell[i] + 1]++;
+    }
+    for (int c = 0; c < cellCount; c++) {
+        grid->cellStart[c + 1] += grid->cellStart[c];
+        grid->cellCursor[c] = grid->cellStart[c];
+    }
+    for (int i = 0; i < boidCount; i++) {
+        grid->cellBoids[grid->cellCursor[grid->boidCell[i]]++] = i;
+    }
+
+    for (int c = 0; c < cellCount; c++) {
+        int *cell = grid->cellBoids + grid->cellStart[c];
+        const int size = grid->cellStart[c + 1] - grid->cellStart[c];
+        for (int i = 1; i < size; i++) {
+            const int index = cell[i];
+            int j = i - 1;
+            for (; j >= 0 && boids[cell[j]].id > boids[index].id; j--) {
+                cell[j + 1] = cell[j];
+            }
+            cell[j + 1] = index;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Same gather as GetLocalFlock in boids.c, over the owned boids and ghosts of this rank: the cells
+ * in the same order, each added by libboids.
+ */
+void GetStripFlock(const BoidRecord *boids, int current, const StripGrid *grid, int range, BoidsFlock *flock,
+                   float radius) {
+    const float *position = boids[current].state;
+    const int row = position[0] / grid->gridResolution;
+    const int col = position[1] / grid->gridResolution;
+    *flock = (BoidsFlock){.size = 0};
+
+    for (int dcol = -range; dcol <= range; dcol++) {
+        for (int drow = -range; drow <= range; drow++) {
+            int gridRow = (row + drow) % grid->gridHeight;
+            if (gridRow < 0) gridRow += grid->gridHeight;
+
+            int gridCol = (col + dcol) % grid->gridWidth;
+            if (gridCol < 0) gridCol += grid->gridWidth;
+
+            GridCell cell = StripGridGetCell(grid, gridRow, gridCol);
+            BoidsFlockAccumulate(flock, (const float *) boids, BOID_RECORD_STRIDE, current, cell.boids, cell.size,
+                                 radius);
+        }
+    }
+}
+
+/**
+ * @brief Appends records to a transport buffer.
+ */
+static int PushRecords(TransportBuffer *buffer, const BoidRecord *records, int count) {
+    if (TransportBufferReserve(buffer, buffer->bytes + count * sizeof(BoidRecord)) < 0) return -1;
+    memcpy((char *) buffer->data + buffer->bytes, records, count * sizeof(BoidRecord));
+    buffer->bytes += count * sizeof(BoidRecord);
+    return 0;
+}
+
+/**
+ * @brief Makes room for count more records after the first used ones.
+ */
+static int ReserveRecords(BoidRecord **records, int *capacity, int count) {
+    if (count <= *capacity) return 0;
+    int grown = *capacity > 0 ? *capacity : 1024;
+    while (grown < count) grown *= 2;
+    BoidRecord *data = realloc(*records, grown * sizeof(BoidRecord));
+    if (data == NULL) {
+        perror("Failed to grow boid array");
+        return -1;
+    }
+    *records = data;
+    *capacity = grown;
+    return 0;
+}
+
+/**
+ * @brief Sends the owned boids of the first owned row to the left neighbour and of the last one to
+ * the right neighbour, the ghosts they send back are appended after the owned boids.
+ * @return the number of ghosts, -1 on failure.
+ */
+int ExchangeHalo(Transport *transport, const StripGrid *grid, BoidRecord **boids, int *capacity, int ownedCount,
+                 TransportBuffer out[2], TransportBuffer in[2]) {
+    const int lastRow = (grid->firstRow + grid->ownedRows - 1) % grid->gridHeight;
+    out[TRANSPORT_LEFT].bytes = 0;
+    out[TRANSPORT_RIGHT].bytes = 0;
+    // a lone rank sees its own rows across the wrap, it has nothing to exchange
+    for (int i = 0; transport->size > 1 && i < ownedCount; i++) {
+        const int row = GridRow(grid, (*boids)[i].state);
+        // with a single owned row the same boids are a ghost on both sides
+        if (row == grid->firstRow && PushRecords(&out[TRANSPORT_LEFT], &(*boids)[i], 1) < 0) return -1;
+        if (row == lastRow && PushRecords(&out[TRANSPORT_RIGHT], &(*boids)[i], 1) < 0) return -1;
+    }
+    if (transport->exchange(transport, out, in) < 0) {
+        fprintf(stderr, "Rank %d lost a neighbour during the halo exchange\n", transport->rank);
+        return -1;
+    }
+
+    const int ghostCount = (int) ((in[TRANSPORT_LEFT].bytes + in[TRANSPORT_RIGHT].bytes) / sizeof(BoidRecord));
+    if (ReserveRecords(boids, capacity, ownedCount + ghostCount) < 0) return -1;
+    memcpy(*boids + ownedCount, in[TRANSPORT_LEFT].data, in[TRANSPORT_LEFT].bytes);
+    memcpy((char *) (*boids + ownedCount) + in[TRANSPORT_LEFT].bytes, in[TRANSPORT_RIGHT].data,
+           in[TRANSPORT_RIGHT].bytes);
+    return ghostCount;
+}
+
+/**
+ * @brief Hands the boids that left the strip to the neighbour they moved into and takes in the ones
+ * that arrived. A boid moves less than a cell per frame, so it can only land in a neighbour's strip.
+ * @return the new number of owned boids, -1 on failure.
+ */
+int ExchangeMigrants(Transport *transport, const StripGrid *grid, BoidRecord **boids, int *capacity,
+                     int ownedCount, TransportBuffer out[2], TransportBuffer in[2]) {
+    const int belowRow = (grid->firstRow - 1 + grid->gridHeight) % grid->gridHeight;
+    out[TRANSPORT_LEFT].bytes = 0;
+    out[TRANSPORT_RIGHT].bytes = 0;
+
+    int kept = 0;
+    for (int i = 0; i < ownedCount; i++) {
+        const int row = GridRow(grid, (*boids)[i].state);
+        const int localRow = StripGridLocalRow(grid, row);
+        if (localRow >= 1 && localRow <= grid->ownedRows) {
+            (*boids)[kept++] = (*boids)[i];
+            continue;
+        }
+        assert(localRow >= 0);
+        const int direction = row == belowRow ? TRANSPORT_LEFT : TRANSPORT_RIGHT;
+        if (PushRecords(&out[direction], &(*boids)[i], 1) < 0) return -1;
+    }
+    if (transport->exchange(transport, out, in) < 0) {
+        fprintf(stderr, "Rank %d lost a neighbour while moving boids\n", transport->rank);
+        return -1;
+    }
+
+    const int arrived = (int) ((in[TRANSPORT_LEFT].bytes + in[TRANSPORT_RIGHT].bytes) / sizeof(BoidRecord));
+    if (ReserveRecords(boids, capacity, kept + arrived) < 0) return -1;
+    memcpy(*boids + kept, in[TRANSPORT_LEFT].data, in[TRANSPORT_LEFT].bytes);
+    memcpy((char *) (*boids + kept) + in[TRANSPORT_LEFT].bytes, in[TRANSPORT_RIGHT].data,
+           in[TRANSPORT_RIGHT].bytes);
+    return kept + arrived;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        fprintf(stderr, "USAGE: %s seed num_boids timesteps [options]\n"
+                        "  --ranks=P              fork P processes that share memory, default 1\n"
+                        "  --transport=shm|mpi    mpi expects to be started by mpirun\n"
+                        "  --dump=PREFIX          write the final boids of each rank to PREFIX.<rank>.csv\n"
+                        "  --rng=libc|philox      draw the initial flock with rand() or with Philox\n"
+                        SIM_PARAMS_USAGE,
+                argv[0]);
+        return 1;
+    }
+
+    const long int randSeed  = strtol(argv[1], NULL, 10);
+    const long int boidCount = strtol(argv[2], NULL, 10);
+    const long int timesteps = strtol(argv[3], NULL, 10);
+
+    int ranks = 1;
+    int useMpi = 0;
+    const char *dumpPrefix = NULL;
+    BoidRng boidRng = BOID_RNG_LIBC;
+    // the parameters go to every call into libboids, the threads of the force loop have no copy of their own
+    SimParams params = BoidsConfigDefault().params;
+    for (int arg = 4; arg < argc; arg++) {
+        const int paramOption = SimParamsParseOption(&params, argv[arg]);
+        if (paramOption < 0) {
+            return 1;
+        } else if (paramOption > 0) {
+            continue;
+        }
+
+        if (strncmp(argv[arg], "--ranks=", 8) == 0) {
+            ranks = (int) strtol(argv[arg] + 8, NULL, 10);
+        } else if (strcmp(argv[arg], "--transport=shm") == 0) {
+            useMpi = 0;
+        } else if (strcmp(argv[arg], "--transport=mpi") == 0) {
+            useMpi = 1;
+        } else if (strncmp(argv[arg], "--dump=", 7) == 0) {
+            dumpPrefix = argv[arg] + 7;
+        } else if (strncmp(argv[arg], "--rng=", 6) == 0) {
+            const int rng = BoidRngParse(argv[arg] + 6);
+            if (rng < 0) {
+                fprintf(stderr, "Unknown generator: %s\n", argv[arg] + 6);
+                return 1;
+            }
+            boidRng = (BoidRng) rng;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[arg]);
+            return 1;
+        }
+    }
+
+    if (SimParamsCheck(&params) < 0) {
+        return 1;
+    }
+    // a boid crosses at most one row per frame, so migrants and ghosts only ever go to a neighbour
+    if (params.maxVelocity >= params.gridResolution) {
+        fprintf(stderr, "The maximum velocity must be below the grid resolution %d\n", params.gridResolution);
+        return 1;
+    }
+    const int gridSize = params.worldSize / params.gridResolution;
+
+    Transport *transport = NULL;
+    if (useMpi) {
+#ifdef BOIDS_WITH_MPI
+        transport = TransportMpiCreate(&argc, &argv);
+#else
+        fprintf(stderr, "Built without MPI\n");
+        return 1;
+#endif
+    } else {
+        if (ranks > gridSize) {
+            fprintf(stderr, "At most %d ranks, one per grid row\n", gridSize);
+            return 1;
+        }
+        transport = TransportShmLaunch(ranks);
+    }
+    if (transport == NULL) {
+        return 1;
+    }
+    const int rank = transport->rank;
+    if (transport->size > gridSize) {
+        if (rank == 0) fprintf(stderr, "At most %d ranks, one per grid row\n", gridSize);
+        transport->destroy(transport);
+        return 1;
+    }
+
+    // strips of whole grid rows, split as evenly as the rows allow
+    const int firstRow = (int) ((long) gridSize * rank / transport->size);
+    const int ownedRows = (int) ((long) gridSize * (rank + 1) / transport->size) - firstRow;
+    StripGrid grid = StripGridAlloc(params.gridResolution, gridSize, gridSize, firstRow, ownedRows);
+    if (grid.cellStart == NULL) {
+        return 1;
+    }
+
+    // every rank draws the whole initial flock like the single process version and keeps its strip
+    srand(randSeed);
+    BoidRecord *boids = NULL;
+    int capacity = 0;
+    int ownedCount = 0;
+    for (int i = 0; i < boidCount; i++) {
+        BoidRecord record = {.id = i};
+        BoidsDrawState(&params, randSeed, boidRng, i, record.state);
+        const int localRow = StripGridLocalRow(&grid, GridRow(&grid, record.state));
+        if (localRow < 1 || localRow > ownedRows) continue;
+        if (ReserveRecords(&boids, &capacity, ownedCount + 1) < 0) return 1;
+        boids[ownedCount++] = record;
+    }
+
+    FILE* csvfile = NULL;
+    if (rank == 0) {
+        csvfile = fopen("main_dist.csv", "w");
+        fprintf(csvfile,"frame_no;time;exchange_time;ghosts;migrants\n");
+    }
+
+    TransportBuffer out[2] = {{0}}, in[2] = {{0}};
+    float *accelerations = NULL;  // x, y of every owned boid
+    int accelerationCapacity = 0;
+    double frameTimes = 0;
+    double measurements = 0;
+
+    for (int frame = 0; frame < timesteps; frame++) {
+        double frame_time_start = omp_get_wtime();
+
+        const int ghostCount = ExchangeHalo(transport, &grid, &boids, &capacity, ownedCount, out, in);
+        if (ghostCount < 0) return 1;
+        double exchange_time = omp_get_wtime() - frame_time_start;
+
+        if (StripGridBuild(&grid, boids, ownedCount + ghostCount) < 0) return 1;
+        if (ownedCount > accelerationCapacity) {
+            accelerationCapacity = capacity;
+            free(accelerations);
+            accelerations = malloc(accelerationCapacity * 2 * sizeof(float));
+            if (accelerations == NULL) {
+                perror("Failed to allocate accelerations");
+                return 1;
+            }
+        }
+
+#pragma omp parallel for schedule(dynamic, 64)
+        for (int i = 0; i < ownedCount; i++) {
+            BoidsFlock flock;
+            GetStripFlock(boids, i, &grid, 1, &flock, params.perceptionRadius);
+            BoidsFlockAcceleration(&params, randSeed, boids[i].state, &flock, boids[i].id, frame,
+                                   accelerations + 2 * i);
+        }
+#pragma omp parallel for schedule(static)
+        for (int i = 0; i < ownedCount; i++) {
+            BoidsUpdateState(&params, boids[i].state, accelerations + 2 * i);
+        }
+
+        const double migration_start = omp_get_wtime();
+        ownedCount = ExchangeMigrants(transport, &grid, &boids, &capacity, ownedCount, out, in);
+        if (ownedCount < 0) return 1;
+        exchange_time += omp_get_wtime() - migration_start;
+        const int migrants = (int) ((in[TRANSPORT_LEFT].bytes + in[TRANSPORT_RIGHT].bytes) / sizeof(BoidRecord));
+
+        // the slowest rank sets the pace
+        const double frame_time = transport->reduce(transport, omp_get_wtime() - frame_time_start, TRANSPORT_MAX);
+        exchange_time = transport->reduce(transport, exchange_time, TRANSPORT_MAX);
+        const double ghosts = transport->reduce(transport, ghostCount, TRANSPORT_SUM);
+        const double moved = transport->reduce(transport, migrants, TRANSPORT_SUM);
+        if (rank == 0) {
+            fprintf(csvfile, "%d;%f;%f;%.0f;%.0f\n", frame, frame_time, exchange_time, ghosts, moved);
+        }
+        frameTimes += frame_time;
+        measurements++;
+    }
+
+    if (dumpPrefix != NULL) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s.%d.csv", dumpPrefix, rank);
+        FILE *dump = fopen(path, "w");
+        if (dump == NULL) {
+            perror("Failed to open dump");
+        } else {
+            for (int i = 0; i < ownedCount; i++) {
+                const float *state = boids[i].state;
+                fprintf(dump, "%d;%.9g;%.9g;%.9g;%.9g\n", boids[i].id, state[0], state[1], state[2], state[3]);
+            }
+            fclose(dump);
+        }
+    }
+
+    const double total = transport->reduce(transport, ownedCount, TRANSPORT_SUM);
+    if (rank == 0) {
+        fclose(csvfile);
+        if (total != boidCount) {
+            fprintf(stderr, "Lost track of boids: %.0f of %ld\n", total, boidCount);
+        }
+        printf("Average frame time: %f\n", frameTimes / measurements);
+    }
+
+    StripGridFree(&grid);
+    free(boids);
+    free(accelerations);
+    for (int d = 0; d < 2; d++) {
+        free(out[d].data);
+        free(in[d].data);
+    }
+    transport->destroy(transport);
+    return 0;
+}
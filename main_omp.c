@@ -2,308 +2,690 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <pthread.h>
 #include "raylib.h"
-#include "raymath.h"
 #include <omp.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
 
-#include "timeit.h"
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "boids.h"
+#include "checkpoint.h"
+#include "hugealloc.h"
+#include "render.h"
+#include "trajectory.h"
 
 #define WINDOW_WIDTH 2000
 #define WINDOW_HEIGHT 2000
-#define MAX_LOCAL_FLOCK_SIZE 4096
-
-#define WORLD_SIZE 10000
-
-#define MIN_VELOCITY 10
-#define MAX_VELOCITY 30
-#define MAX_ACCELERATION 1
-
-#define PERCEPTION_RADIUS 50
-#define GRID_RESOLUTION 50
 
+/**
+ * What the frame hooks write besides the simulation, shared by the threads of the step.
+ */
 typedef struct {
-    Vector2 position;
-    Vector2 velocity;
-    Vector2 acceleration;
-} Boid;
-
-typedef struct {
-    Vector2 velocitiesSum;
-    Vector2 positionsSum;
-    Vector2 oppositeDirectionsSum;
-    int size;
-} LocalFlock;
-
+    FILE *csvFile;
+    FILE *statesFile;
+    TrajectorySink trajectory;
+    TrajectorySlot *trajectorySlot;
+    int trajectoryEvery;
+    int trajectoryStride;
+    CheckpointWriter checkpointWriter;
+    int checkpointEvery;
+    RenderSink render;            // snapshots for the render thread or the window, states NULL without
+    int renderEvery;
+    int takeCheckpoint;
+    int countCacheMisses;
+    int *missCounters;            // per thread, -2 until the first frame opens it
+    long long *lastCacheMisses;   // last read of each thread's counter, the masked thread sums the deltas
+    long long *threadCacheMisses;
+    double frameTimes;
+    double measurements;
+} FrameOutputs;
+
+/**
+ * The simulation of a --window run, stepped on a thread of its own while the main thread draws.
+ */
 typedef struct {
-    Boid **boids;
-    int size;
-} GridCell;
-
+    BoidsWorld *world;
+    int frames;
+    omp_sched_t schedule;   // ICVs of the main thread the new thread doesn't inherit
+    int chunk;
+    int failed;
+    atomic_int done;
+} StepRun;
+
+/**
+ * The mapped checkpoint of a resumed run, the world steps the boids in it and unmaps it when done.
+ */
 typedef struct {
-    GridCell **grid;
-    int gridResolution;
-    int gridHeight;
-    int gridWidth;
-} BoidGrid;
-
-BoidGrid BoidGridAlloc(int resolution, int height, int width, int cellCapacity) {
-    GridCell **cells = malloc(height * sizeof(GridCell *));
-
-    if (cells == NULL) {
-        perror("Failed to allocate grid rows");
-        return (BoidGrid){.grid = NULL};
-    }
+    void *mapping;
+    size_t bytes;
+} ResumeMapping;
 
-    GridCell *data_block = (GridCell *) malloc(height * width * sizeof(GridCell));
-    if (data_block == NULL) {
-        perror("Failed to allocate grid data block");
-        free(cells);
-        return (BoidGrid){.grid = NULL};
-    }
-
-    cells[0] = (GridCell *) cells + height;
-    for (int r = 1; r < height; r++) {
-        cells[r] = cells[r - 1] + width;
-    }
+static void ResumeMappingRelease(void *context) {
+    const ResumeMapping *resume = context;
+    munmap(resume->mapping, resume->bytes);
+}
 
-    for (int r = 0; r < height; r++) {
-        cells[r] = data_block + (r * width);
-    }
+void DrawBoid(Vector2 position) {
+    //DrawCircleV(position, 5, RED);
+    DrawRectangle(position.x - 5, position.y - 5, 10, 10, RED);
+}
 
-    for (int i = 0; i < height * width; i++) {
-        data_block[i].boids = (Boid **) malloc(cellCapacity * sizeof(Boid *));
-        data_block[i].size = 0;
+static void *StepRunThread(void *data) {
+    StepRun *run = data;
+    omp_set_schedule(run->schedule, run->chunk);
+    run->failed = BoidsWorldStep(run->world, run->frames) < 0;
+    atomic_store_explicit(&run->done, 1, memory_order_release);
+    return NULL;
+}
 
-        if (data_block[i].boids == NULL) {
-            perror("Failed to allocate internal cell array");
-            for (int j = 0; j < i; j++) {
-                free(data_block[j].boids);
-            }
-            free(data_block);
-            free(cells);
-            return (BoidGrid){.grid = NULL};
+/**
+ * @brief Draws the latest snapshot of the render sink until the window is closed or the run is done.
+ * A closed window leaves the run going without it.
+ */
+static void ShowWindow(RenderSink *sink, StepRun *run, float worldSize) {
+    InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Boids");
+    SetTargetFPS(60);
+    const RenderSnapshot *shown = NULL;
+    while (!WindowShouldClose() && !atomic_load_explicit(&run->done, memory_order_acquire)) {
+        const RenderSnapshot *latest = RenderSinkTake(sink);
+        if (latest != NULL) shown = latest;
+        BeginDrawing();
+        ClearBackground(RAYWHITE);
+        for (int i = 0; shown != NULL && i < shown->count; i++) {
+            const float *state = shown->states + (size_t) i * BOIDS_STATE_FLOATS;
+            DrawBoid((Vector2){state[0] / worldSize * WINDOW_WIDTH, state[1] / worldSize * WINDOW_HEIGHT});
         }
+        EndDrawing();
     }
+    CloseWindow();
+}
 
-    return (BoidGrid){
-        .grid = cells,
-        .gridResolution = resolution,
-        .gridHeight = height,
-        .gridWidth = width
+/**
+ * @brief Opens a counter of the last level cache misses of the calling thread.
+ * @return the counter file descriptor, or -1 if the kernel or the machine doesn't expose it.
+ */
+int CacheMissCounterOpen(void) {
+#ifdef __linux__
+    struct perf_event_attr attributes = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(struct perf_event_attr),
+        .config = PERF_COUNT_HW_CACHE_MISSES,
+        .exclude_kernel = 1,
+        .exclude_hv = 1
     };
+    return (int) syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
 }
 
-void BoidGridFree(BoidGrid *grid) {
-    if (grid == NULL || grid->grid == NULL) return;
-
-    GridCell *data_block = grid->grid[0];
-    int totalCells = grid->gridHeight * grid->gridWidth;
+long long CacheMissCounterRead(int counter) {
+    long long value;
+    if (counter < 0 || read(counter, &value, sizeof(value)) != sizeof(value)) return -1;
+    return value;
+}
 
-    for (int i = 0; i < totalCells; i++) {
-        free(data_block[i].boids);
+/**
+ * @brief Streams the boids to the trajectory and opens the cache miss counters, on every thread.
+ */
+static void FrameStart(const BoidsFrame *frame, void *data) {
+    FrameOutputs *outputs = data;
+    const int thread = omp_get_thread_num();
+    if (outputs->countCacheMisses && outputs->missCounters[thread] == -2) {
+        outputs->missCounters[thread] = CacheMissCounterOpen();
+        outputs->lastCacheMisses[thread] = CacheMissCounterRead(outputs->missCounters[thread]);
     }
 
-    free(data_block);
-
-    free(grid->grid);
-
-    grid->grid = NULL;
-}
-
-void DrawBoid(Boid *boid) {
-    //DrawCircleV(boid->position, 5, RED);
-    DrawRectangle(boid->position.x - 5, boid->position.y - 5, 10, 10, RED);
-}
+    if (outputs->trajectory.fd >= 0 && frame->frame % outputs->trajectoryEvery == 0) {
+#pragma omp single
+        outputs->trajectorySlot = TrajectorySinkAcquire(&outputs->trajectory); // implicit barrier
+
+        // boids are recorded by id, reordering moves them around the array
+        TrajectorySlot *slot = outputs->trajectorySlot;
+        const float worldSize = outputs->trajectory.header.worldSize;
+        const float velocityScale = outputs->trajectory.header.velocityScale;
+#pragma omp for schedule(static)
+        for (int k = 0; k < (int) outputs->trajectory.header.boidCount; k++) {
+            const int id = k * outputs->trajectoryStride;
+            const float *state = frame->states + BOIDS_STATE_FLOATS * (frame->slots != NULL ? frame->slots[id] : id);
+            slot->positions[2 * k] = TrajectoryQuantizePosition(state[0], worldSize);
+            slot->positions[2 * k + 1] = TrajectoryQuantizePosition(state[1], worldSize);
+            slot->velocities[2 * k] = TrajectoryQuantizeVelocity(state[2], velocityScale);
+            slot->velocities[2 * k + 1] = TrajectoryQuantizeVelocity(state[3], velocityScale);
+        } // implicit barrier
 
-void UpdateBoid(Boid *boid) {
-    boid->position = Vector2Add(boid->position, boid->velocity);
-    boid->position.x = Wrap(boid->position.x, 0, WORLD_SIZE);
-    boid->position.y = Wrap(boid->position.y, 0, WORLD_SIZE);
-    boid->velocity = Vector2Add(boid->velocity, boid->acceleration);
-    //boid->velocity = Vector2ClampValue(boid->velocity, -MAX_VELOCITY, MAX_VELOCITY);
-    float speedSqr = Vector2LengthSqr(boid->velocity);
-    if (speedSqr > MAX_VELOCITY * MAX_VELOCITY) {
-        boid->velocity = Vector2Scale(Vector2Normalize(boid->velocity), MAX_VELOCITY);
-    } else if (speedSqr < MIN_VELOCITY * MIN_VELOCITY) {
-        boid->velocity = Vector2Scale(Vector2Normalize(boid->velocity), MIN_VELOCITY);
+#pragma omp masked
+        TrajectorySinkPublish(&outputs->trajectory, frame->frame);
     }
 }
 
-void GetLocalFlock(Boid *current, BoidGrid *grid, int range, LocalFlock *flock, float radius) {
-    const int row = current->position.x / grid->gridResolution;
-    const int col = current->position.y / grid->gridResolution;
-    flock->positionsSum = (Vector2){0, 0};
-    flock->velocitiesSum = (Vector2){0, 0};
-    flock->oppositeDirectionsSum = (Vector2){0, 0};
-    flock->size = 0;
-
-    for (int dcol = -range; dcol <= range; dcol++) {
-        for (int drow = -range; drow <= range; drow++) {
-            // if gridRol > gridHeight we get a segfault, so we wrap the grid
-            int gridRow = (row + drow) % grid->gridHeight;
-            if (gridRow < 0) gridRow += grid->gridHeight;
-
-            int gridCol = (col + dcol) % grid->gridWidth;
-            if (gridCol < 0) gridCol += grid->gridWidth;
-
-            GridCell *cell = &grid->grid[gridRow][gridCol];
-
-            for (int i = 0; i < cell->size; i++) {
-                float dist = Vector2DistanceSqr(cell->boids[i]->position, current->position);
-                if (dist < radius * radius && current != cell->boids[i]) {
-                    flock->velocitiesSum = Vector2Add(flock->velocitiesSum, cell->boids[i]->velocity);
-                    flock->positionsSum = Vector2Add(flock->positionsSum, cell->boids[i]->position);
-                    Vector2 oppositeDirection = Vector2Subtract(current->position, cell->boids[i]->position);
-                    if (dist > 0.01f) {
-                        oppositeDirection = Vector2Scale(oppositeDirection,
-                                                         1.0 / pow(Vector2Length(oppositeDirection), 2));
-                        flock->oppositeDirectionsSum = Vector2Add(flock->oppositeDirectionsSum, oppositeDirection);
-                    }
-                    flock->size++;
-                }
+/**
+ * @brief Takes the checkpoints, hands the boids to the renderer and writes the statistics and the state dump
+ * of the frame, on every thread.
+ */
+static void FrameEnd(const BoidsFrame *frame, void *data) {
+    FrameOutputs *outputs = data;
+    float *snapshot = outputs->checkpointWriter.snapshot;
+    if (snapshot != NULL && (frame->frame + 1) % outputs->checkpointEvery == 0) {
+#pragma omp single
+        {
+            // rather drop a checkpoint than stall the frame on the disk
+            outputs->takeCheckpoint = !CheckpointWriterBusy(&outputs->checkpointWriter);
+            if (!outputs->takeCheckpoint) outputs->checkpointWriter.skipped++;
+        } // implicit barrier
+
+        if (outputs->takeCheckpoint) {
+            const size_t floats = (size_t) frame->count * BOIDS_STATE_FLOATS;
+#pragma omp for schedule(static)
+            for (size_t k = 0; k < floats; k++) {
+                snapshot[k] = frame->states[k];
+            } // implicit barrier
+            // a reordering world stores which boid each slot holds after them
+            if (outputs->checkpointWriter.header.idBytes != 0) {
+                int32_t *ids = (int32_t *) (snapshot + floats);
+#pragma omp for schedule(static)
+                for (int slot = 0; slot < frame->count; slot++) {
+                    ids[slot] = frame->ids[slot];
+                } // implicit barrier
             }
+#pragma omp masked
+            CheckpointWriterStart(&outputs->checkpointWriter, frame->frame + 1);
         }
     }
-}
 
-Vector2 GetBoidAlignmentForce(Boid *boid, LocalFlock *localFlock, float weight) {
-    Vector2 averageVelocity = localFlock->velocitiesSum;
-    if (localFlock->size > 0) {
-        averageVelocity = Vector2Scale(averageVelocity, 1.0 / localFlock->size);
-        averageVelocity = Vector2Subtract(averageVelocity, boid->velocity);
-        averageVelocity = Vector2Scale(averageVelocity, weight);
-        averageVelocity = Vector2ClampValue(averageVelocity, -MAX_ACCELERATION, MAX_ACCELERATION);
+    if (outputs->render.buffers[0].states != NULL && frame->frame % outputs->renderEvery == 0) {
+        // the back buffer is ours until the publish, the renderer only ever reads the other two
+        float *states = RenderSinkBack(&outputs->render)->states;
+        const size_t floats = (size_t) frame->count * BOIDS_STATE_FLOATS;
+#pragma omp for schedule(static)
+        for (size_t k = 0; k < floats; k++) {
+            states[k] = frame->states[k];
+        } // implicit barrier
+#pragma omp masked
+        RenderSinkPublish(&outputs->render, frame->frame, frame->count);
     }
-    return averageVelocity;
-}
 
-Vector2 GetBoidCohesionForce(Boid *boid, LocalFlock *localFlock, float weight) {
-    Vector2 averagePosition = localFlock->positionsSum;
-    if (localFlock->size > 0) {
-        averagePosition = Vector2Scale(averagePosition, 1.0 / localFlock->size);
-        // get the vector from boid -> averagePosition
-        averagePosition = Vector2Subtract(averagePosition, boid->position);
-        // scale it
-        averagePosition = Vector2Scale(averagePosition, weight);
-        averagePosition = Vector2ClampValue(averagePosition, -MAX_ACCELERATION, MAX_ACCELERATION);
-    }
-    return averagePosition;
-}
-
-Vector2 GetBoidSeparationForce(Boid *boid, LocalFlock *localFlock, float weight) {
-    Vector2 averageOppositeDirection = localFlock->oppositeDirectionsSum;
-    if (localFlock->size > 0) {
-        averageOppositeDirection = Vector2Scale(averageOppositeDirection, 1.0 / localFlock->size);
-        averageOppositeDirection = Vector2Scale(averageOppositeDirection, weight);
-        averageOppositeDirection = Vector2ClampValue(averageOppositeDirection, -MAX_ACCELERATION, MAX_ACCELERATION);
+    if (outputs->countCacheMisses) {
+        const int thread = omp_get_thread_num();
+        long long cacheMisses = CacheMissCounterRead(outputs->missCounters[thread]);
+        outputs->threadCacheMisses[thread] = cacheMisses < 0 ? -1 : cacheMisses - outputs->lastCacheMisses[thread];
+        outputs->lastCacheMisses[thread] = cacheMisses;
+#pragma omp barrier
     }
-    return averageOppositeDirection;
-}
 
-float RandomFloat(float min, float max) {
-    // Calculate the range size
-    float range = max - min;
-
-    // Scale the result of rand() (0 to RAND_MAX) to the desired range (0 to range)
-    // and then offset by min.
-    // We cast rand() to float to ensure floating-point division.
-    return min + ((float) rand() / RAND_MAX) * range;
-}
-
-Vector2 RandomVector2(float min, float max) {
-    return (Vector2){
-        .x = RandomFloat(min, max),
-        .y = RandomFloat(min, max)
-    };
+#pragma omp masked
+    {
+        double frame_time = omp_get_wtime() - frame->startTime;
+        long long cacheMisses = outputs->countCacheMisses ? 0 : -1;
+        for (int t = 0; outputs->countCacheMisses && t < omp_get_num_threads(); t++) {
+            if (outputs->threadCacheMisses[t] < 0) {
+                cacheMisses = -1;
+                break;
+            }
+            cacheMisses += outputs->threadCacheMisses[t];
+        }
+        fprintf(outputs->csvFile, "%d;%f;%lld;%d;%d;%f\n", frame->frame, frame_time, cacheMisses, frame->reordered,
+                frame->migrations, frame->forceImbalance);
+        if (outputs->statesFile != NULL && BoidsWriteStates(outputs->statesFile, frame) < 0) {
+            perror("Failed to write state dump");
+            fclose(outputs->statesFile);
+            outputs->statesFile = NULL;
+        }
+        outputs->frameTimes += frame_time;
+        outputs->measurements++;
+    } // NO implicit barrier, but it's fine i think
 }
 
 int main(int argc, char** argv) {
     if (argc < 4) {
-        fprintf(stderr, "USAGE: %s seed num_boids timesteps", argv[0]);
+        fprintf(stderr, "USAGE: %s seed num_boids timesteps [options]\n"
+                        "  --kernel=scalar|soa|sse|avx2|avx512|q16|q32|auto\n"
+                        "  --check-kernel\n"
+                        "  --reorder=K            reorder the boids along a space-filling curve every K frames\n"
+                        "  --curve=hilbert|morton\n"
+                        "  --cache-misses         count cache misses per frame\n"
+                        "  --huge-pages=off|transparent|explicit\n"
+                        "  --rng=libc|philox      draw the initial flock with rand() or in parallel with Philox\n"
+                        "  --deterministic        only allow engines that sum in the order of main, see boids_verify\n"
+                        "  --dump-states=PATH     append the boids of every frame to PATH as floats\n"
+                        SIM_PARAMS_USAGE
+                        "  --wrap=auto|modulo|mask|table  how the neighbour cells wrap around the world\n"
+                        "  --schedule=static|dynamic|guided[,chunk]  schedule of the force loop, default dynamic\n"
+                        "  --schedule=cells[,K]   K blocks of cells of about the same cost per thread, default 8\n"
+                        "  --backend=openmp|pool  step on OpenMP or on a pool of pinned threads with spin barriers\n"
+                        "  --csv=PATH             frame statistics, default main_omp.csv\n"
+                        "  --fused                integrate in the force loop into a second boid buffer\n"
+                        "  --engine=gather|half-stencil|verlet\n"
+                        "  --skin=S               verlet list skin, default 20\n"
+                        "  --incremental-grid     only move the boids that changed cell between frames\n"
+                        "  --migration-limit=F    rebuild the incremental grid once more than F of the boids\n"
+                        "                         changed cell, default 0.125\n"
+                        "  --index=grid|two-level|hashed  two-level splits cells with more than --split-threshold=N\n"
+                        "                         boids, hashed only stores the occupied cells of huge worlds\n"
+                        "  --checkpoint=PATH      write a checkpoint every --checkpoint-every=N frames, default 1000\n"
+                        "  --resume=PATH          continue from a checkpoint up to frame timesteps\n"
+                        "  --trajectory=PATH      stream quantized boid states to PATH\n"
+                        "  --trajectory-every=N   store every N-th frame, default 1\n"
+                        "  --trajectory-stride=S  store every S-th boid, default 1\n"
+                        "  --trajectory-keyframe=K  a seekable keyframe every K stored frames, default 64\n"
+                        "  --render=boids|density rasterize frames on a thread of their own, the step never waits\n"
+                        "  --render-out=PREFIX    PREFIX_000123.ppm/png per frame or PREFIX.rgb, default frame\n"
+                        "  --render-format=ppm|png|raw  raw appends rgb24 frames for ffmpeg -f rawvideo\n"
+                        "  --render-size=N        N x N pixels, default 1024\n"
+                        "  --render-every=N       render every N-th frame, default 1\n"
+                        "  --render-threads=N     threads rasterizing the tiles of a frame, default 2\n"
+                        "  --window               show the flock in a raylib window while it runs\n",
+                argv[0]);
         return 1;
     }
 
     const long int randSeed  = strtol(argv[1], NULL, 10);
-    const long int boidCount = strtol(argv[2], NULL, 10);
+    long int boidCount = strtol(argv[2], NULL, 10);
     const long int timesteps = strtol(argv[3], NULL, 10);
 
-    srand(randSeed);
+    BoidsConfig config = BoidsConfigDefault();
+    const char *statesPath = NULL;
+    const char *checkpointPath = NULL;
+    int checkpointEvery = 1000;
+    const char *resumePath = NULL;
+    int countCacheMisses = 0;
+    omp_sched_t forceSchedule = omp_sched_dynamic;
+    int forceChunk = 0;
+    const char *csvPath = "main_omp.csv";
+    const char *trajectoryPath = NULL;
+    int trajectoryEvery = 1;
+    int trajectoryStride = 1;
+    int trajectoryKeyframe = 64;
+    int render = -1;
+    const char *renderPrefix = "frame";
+    RenderFormat renderFormat = RENDER_FORMAT_PPM;
+    int renderSize = 1024;
+    int renderEvery = 1;
+    int renderThreads = 2;
+    int window = 0;
+    for (int arg = 4; arg < argc; arg++) {
+        const int paramOption = SimParamsParseOption(&config.params, argv[arg]);
+        if (paramOption < 0) {
+            return 1;
+        } else if (paramOption > 0) {
+            continue;
+        }
 
-    FILE* csvfile = fopen("main_omp.csv", "w");
-    fprintf(csvfile,"frame_no;time\n");
+        if (strncmp(argv[arg], "--kernel=", 9) == 0) {
+            const int kernel = FlockKernelParse(argv[arg] + 9);
+            if (kernel < 0) {
+                fprintf(stderr, "Unknown or unsupported kernel: %s\n", argv[arg] + 9);
+                return 1;
+            }
+            config.kernel = (FlockKernel) kernel;
+        } else if (strcmp(argv[arg], "--check-kernel") == 0) {
+            config.checkKernel = 1;
+        } else if (strncmp(argv[arg], "--reorder=", 10) == 0) {
+            config.reorderInterval = (int) strtol(argv[arg] + 10, NULL, 10);
+        } else if (strcmp(argv[arg], "--curve=hilbert") == 0) {
+            config.curve = CURVE_HILBERT;
+        } else if (strcmp(argv[arg], "--curve=morton") == 0) {
+            config.curve = CURVE_MORTON;
+        } else if (strcmp(argv[arg], "--cache-misses") == 0) {
+            countCacheMisses = 1;
+        } else if (strcmp(argv[arg], "--engine=gather") == 0) {
+            config.engine = FORCE_ENGINE_GATHER;
+        } else if (strcmp(argv[arg], "--engine=half-stencil") == 0) {
+            config.engine = FORCE_ENGINE_HALF_STENCIL;
+        } else if (strcmp(argv[arg], "--engine=verlet") == 0) {
+            config.engine = FORCE_ENGINE_VERLET;
+        } else if (strncmp(argv[arg], "--skin=", 7) == 0) {
+            config.verletSkin = strtof(argv[arg] + 7, NULL);
+        } else if (strcmp(argv[arg], "--incremental-grid") == 0) {
+            config.incrementalGrid = 1;
+        } else if (strncmp(argv[arg], "--migration-limit=", 18) == 0) {
+            config.migrationLimit = strtof(argv[arg] + 18, NULL);
+        } else if (strcmp(argv[arg], "--index=grid") == 0) {
+            config.index = BOIDS_INDEX_GRID;
+        } else if (strcmp(argv[arg], "--index=two-level") == 0) {
+            config.index = BOIDS_INDEX_TWO_LEVEL;
+        } else if (strcmp(argv[arg], "--index=hashed") == 0) {
+            config.index = BOIDS_INDEX_HASHED;
+        } else if (strncmp(argv[arg], "--split-threshold=", 18) == 0) {
+            config.splitThreshold = (int) strtol(argv[arg] + 18, NULL, 10);
+        } else if (strncmp(argv[arg], "--checkpoint=", 13) == 0) {
+            checkpointPath = argv[arg] + 13;
+        } else if (strncmp(argv[arg], "--checkpoint-every=", 19) == 0) {
+            checkpointEvery = (int) strtol(argv[arg] + 19, NULL, 10);
+        } else if (strncmp(argv[arg], "--resume=", 9) == 0) {
+            resumePath = argv[arg] + 9;
+        } else if (strncmp(argv[arg], "--trajectory=", 13) == 0) {
+            trajectoryPath = argv[arg] + 13;
+        } else if (strncmp(argv[arg], "--trajectory-every=", 19) == 0) {
+            trajectoryEvery = (int) strtol(argv[arg] + 19, NULL, 10);
+        } else if (strncmp(argv[arg], "--trajectory-stride=", 20) == 0) {
+            trajectoryStride = (int) strtol(argv[arg] + 20, NULL, 10);
+        } else if (strncmp(argv[arg], "--trajectory-keyframe=", 22) == 0) {
+            trajectoryKeyframe = (int) strtol(argv[arg] + 22, NULL, 10);
+        } else if (strcmp(argv[arg], "--render=boids") == 0) {
+            render = RENDER_BOIDS;
+        } else if (strcmp(argv[arg], "--render=density") == 0) {
+            render = RENDER_DENSITY;
+        } else if (strncmp(argv[arg], "--render-out=", 13) == 0) {
+            renderPrefix = argv[arg] + 13;
+        } else if (strncmp(argv[arg], "--render-format=", 16) == 0) {
+            const int format = RenderFormatParse(argv[arg] + 16);
+            if (format < 0) {
+                fprintf(stderr, "Unknown render format: %s\n", argv[arg] + 16);
+                return 1;
+            }
+            renderFormat = (RenderFormat) format;
+        } else if (strncmp(argv[arg], "--render-size=", 14) == 0) {
+            renderSize = (int) strtol(argv[arg] + 14, NULL, 10);
+        } else if (strncmp(argv[arg], "--render-every=", 15) == 0) {
+            renderEvery = (int) strtol(argv[arg] + 15, NULL, 10);
+        } else if (strncmp(argv[arg], "--render-threads=", 17) == 0) {
+            renderThreads = (int) strtol(argv[arg] + 17, NULL, 10);
+        } else if (strcmp(argv[arg], "--window") == 0) {
+            window = 1;
+        } else if (strncmp(argv[arg], "--wrap=", 7) == 0) {
+            config.gridWrap = GridWrapParse(argv[arg] + 7);
+            if (config.gridWrap < -1) {
+                fprintf(stderr, "Unknown wrap: %s\n", argv[arg] + 7);
+                return 1;
+            }
+        } else if (strncmp(argv[arg], "--schedule=", 11) == 0) {
+            const char *kind = argv[arg] + 11;
+            const char *chunk = strchr(kind, ',');
+            const size_t length = chunk != NULL ? (size_t) (chunk - kind) : strlen(kind);
+            if (length == 6 && strncmp(kind, "static", 6) == 0) {
+                forceSchedule = omp_sched_static;
+            } else if (length == 7 && strncmp(kind, "dynamic", 7) == 0) {
+                forceSchedule = omp_sched_dynamic;
+            } else if (length == 6 && strncmp(kind, "guided", 6) == 0) {
+                forceSchedule = omp_sched_guided;
+            } else if (length == 5 && strncmp(kind, "cells", 5) == 0) {
+                config.cellBlocks = chunk != NULL ? (int) strtol(chunk + 1, NULL, 10) : 8;
+                continue;
+            } else {
+                fprintf(stderr, "Unknown schedule: %s\n", kind);
+                return 1;
+            }
+            forceChunk = chunk != NULL ? (int) strtol(chunk + 1, NULL, 10) : 0;
+        } else if (strncmp(argv[arg], "--csv=", 6) == 0) {
+            csvPath = argv[arg] + 6;
+        } else if (strncmp(argv[arg], "--rng=", 6) == 0) {
+            const int rng = BoidRngParse(argv[arg] + 6);
+            if (rng < 0) {
+                fprintf(stderr, "Unknown generator: %s\n", argv[arg] + 6);
+                return 1;
+            }
+            config.rng = (BoidRng) rng;
+        } else if (strcmp(argv[arg], "--backend=openmp") == 0) {
+            config.backend = BOIDS_BACKEND_OPENMP;
+        } else if (strcmp(argv[arg], "--backend=pool") == 0) {
+            config.backend = BOIDS_BACKEND_POOL;
+        } else if (strcmp(argv[arg], "--deterministic") == 0) {
+            config.deterministic = 1;
+        } else if (strncmp(argv[arg], "--dump-states=", 14) == 0) {
+            statesPath = argv[arg] + 14;
+        } else if (strcmp(argv[arg], "--fused") == 0) {
+            config.fusedUpdate = 1;
+        } else if (strcmp(argv[arg], "--huge-pages=off") == 0) {
+            config.hugePages = HUGE_PAGES_OFF;
+        } else if (strcmp(argv[arg], "--huge-pages=transparent") == 0) {
+            config.hugePages = HUGE_PAGES_TRANSPARENT;
+        } else if (strcmp(argv[arg], "--huge-pages=explicit") == 0) {
+            config.hugePages = HUGE_PAGES_EXPLICIT;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[arg]);
+            return 1;
+        }
+    }
+    if (BoidsConfigCheck(&config) < 0) {
+        return 1;
+    }
+    // the hooks only run on one worker of the pool
+    if (countCacheMisses && config.backend == BOIDS_BACKEND_POOL) {
+        fprintf(stderr, "--cache-misses needs --backend=openmp\n");
+        return 1;
+    }
+    // the dynamic force loops run with schedule(runtime)
+    omp_set_schedule(forceSchedule, forceChunk);
+    if (trajectoryEvery <= 0 || trajectoryStride <= 0 || trajectoryKeyframe <= 0) {
+        fprintf(stderr, "--trajectory-every, --trajectory-stride and --trajectory-keyframe must be positive\n");
+        return 1;
+    }
+    if (renderSize <= 0 || renderEvery <= 0 || renderThreads <= 0) {
+        fprintf(stderr, "--render-size, --render-every and --render-threads must be positive\n");
+        return 1;
+    }
+    // the triple buffer has a single consumer
+    if (render >= 0 && window) {
+        fprintf(stderr, "--render and --window can't be combined\n");
+        return 1;
+    }
+    if (checkpointPath != NULL && checkpointEvery <= 0) {
+        fprintf(stderr, "--checkpoint-every must be positive\n");
+        return 1;
+    }
 
-    Boid boids[boidCount];
-    int cellCapacity = 256;
-    static_assert(WINDOW_WIDTH % GRID_RESOLUTION == 0 && WINDOW_HEIGHT % GRID_RESOLUTION == 0);
-    BoidGrid boidGrid = BoidGridAlloc(GRID_RESOLUTION, WORLD_SIZE / GRID_RESOLUTION, WORLD_SIZE / GRID_RESOLUTION,
-                                      cellCapacity);
+    const SimParams *simulation = &config.params;
+    const CheckpointParams params = {
+        .worldSize = simulation->worldSize,
+        .gridResolution = simulation->gridResolution,
+        .perceptionRadius = simulation->perceptionRadius,
+        .minVelocity = simulation->minVelocity,
+        .maxVelocity = simulation->maxVelocity,
+        .maxAcceleration = simulation->maxAcceleration,
+        .alignmentWeight = simulation->alignmentWeight,
+        .cohesionWeight = simulation->cohesionWeight,
+        .separationWeight = simulation->separationWeight,
+        .wanderWeight = simulation->wanderWeight
+    };
 
-    for (int i = 0; i < boidCount; i++) {
-        boids[i] = (Boid){
-            .position = RandomVector2(0, WORLD_SIZE),
-            .velocity = RandomVector2(-30, 30),
-            .acceleration = (Vector2){.x = 0, .y = 0}
-        };
+    // a resumed run steps the boids in the mapped checkpoint instead of drawing them
+    config.seed = randSeed;
+    ResumeMapping resume = {.mapping = NULL};
+    float *resumedStates = NULL;
+    const int *resumedIds = NULL;
+    if (resumePath != NULL) {
+        CheckpointHeader header;
+        resume.mapping = CheckpointMap(resumePath, &header, BOIDS_STATE_FLOATS * sizeof(float), &resume.bytes);
+        if (resume.mapping == NULL) {
+            return 1;
+        }
+        if (memcmp(&header.params, &params, sizeof(params)) != 0) {
+            fprintf(stderr, "%s was written with different simulation parameters\n", resumePath);
+            return 1;
+        }
+        if (header.boidCount != (uint64_t) boidCount) {
+            fprintf(stderr, "Resuming %llu boids from the checkpoint instead of %ld\n",
+                    (unsigned long long) header.boidCount, boidCount);
+        }
+        boidCount = (long) header.boidCount;
+        config.startFrame = (int) header.frame;
+        // the wander noise continues from the seed of the original run
+        config.seed = header.randSeed;
+        config.rng = (BoidRng) header.rng;
+        resumedStates = (float *) ((char *) resume.mapping + header.headerBytes);
+        if (header.idBytes != 0) resumedIds = (const int *) (resumedStates + boidCount * BOIDS_STATE_FLOATS);
     }
 
-    double frameTimes = 0;
-    double measurements = 0;
+    FrameOutputs outputs = {.trajectory = {.fd = -1}, .checkpointWriter = {.path = NULL}};
+    outputs.csvFile = fopen(csvPath, "w");
+    if (outputs.csvFile == NULL) {
+        perror("Failed to open csv file");
+        return 1;
+    }
+    fprintf(outputs.csvFile,"frame_no;time;cache_misses;reordered;migrations;imbalance\n");
+    if (statesPath != NULL && (outputs.statesFile = fopen(statesPath, "wb")) == NULL) {
+        perror("Failed to open state dump");
+        return 1;
+    }
 
-#pragma omp parallel default(none) shared(boidGrid, boids, frameTimes, measurements) firstprivate(boidCount, cellCapacity, csvfile, timesteps)
-    for (int frame = 0; frame < timesteps; frame++) {
-        double frame_time_start = omp_get_wtime();
+    BoidsWorld *world = resumedStates != NULL
+                        ? BoidsWorldAdopt(&config, (BoidsStorage){resumedStates, ResumeMappingRelease, &resume},
+                                          (int) boidCount)
+                        : BoidsWorldCreate(&config, NULL, (int) boidCount);
+    // the ids are read from the mapping, which the world keeps until it is destroyed
+    if (world == NULL || (resumedIds != NULL && BoidsWorldSetIds(world, resumedIds) < 0)) {
+        return 1;
+    }
 
-#pragma omp for collapse(2)
-        for (int row = 0; row < boidGrid.gridHeight; row++) {
-            for (int col = 0; col < boidGrid.gridWidth; col++) {
-                boidGrid.grid[row][col].size = 0;
-            }
+    const int maxThreads = omp_get_max_threads();
+    int missCounters[maxThreads];
+    long long lastCacheMisses[maxThreads];
+    long long threadCacheMisses[maxThreads];
+    for (int t = 0; t < maxThreads; t++) missCounters[t] = -2;
+    outputs.countCacheMisses = countCacheMisses;
+    outputs.missCounters = missCounters;
+    outputs.lastCacheMisses = lastCacheMisses;
+    outputs.threadCacheMisses = threadCacheMisses;
+
+    outputs.checkpointEvery = checkpointEvery;
+    if (checkpointPath != NULL) {
+        const CheckpointHeader header = {
+            .boidCount = boidCount,
+            .boidBytes = BOIDS_STATE_FLOATS * sizeof(float),
+            .rng = config.rng,
+            .randSeed = (int64_t) config.seed,
+            .randDraws = config.rng == BOID_RNG_LIBC ? 4 * (uint64_t) boidCount : 0,
+            .params = params,
+            .idBytes = config.reorderInterval > 0 ? sizeof(int32_t) : 0
+        };
+        HugePageMode hugePages = (HugePageMode) config.hugePages;
+        outputs.checkpointWriter = CheckpointWriterAlloc(checkpointPath, header,
+                                                         boidCount * (BOIDS_STATE_FLOATS * sizeof(float) +
+                                                                      header.idBytes), &hugePages);
+        if (outputs.checkpointWriter.path == NULL) {
+            return 1;
         }
 
-#pragma omp single
-        for (int i = 0; i < boidCount; i++) {
-            int row = (int) (boids[i].position.x / boidGrid.gridResolution) % boidGrid.gridWidth;
-            int col = (int) (boids[i].position.y / boidGrid.gridResolution) % boidGrid.gridHeight;
-            GridCell *cell = &boidGrid.grid[row][col];
-            if (cell->size < cellCapacity) {
-                cell->boids[cell->size] = &boids[i];
-                cell->size++;
-            }
+        // first touched with the static partition of the copy into it
+        float *snapshot = outputs.checkpointWriter.snapshot;
+#pragma omp parallel for schedule(static)
+        for (size_t k = 0; k < (size_t) boidCount * BOIDS_STATE_FLOATS; k++) {
+            snapshot[k] = 0;
         }
+    }
 
-#pragma omp for schedule(dynamic)
-        for (int i = 0; i < boidCount; i++) {
-            LocalFlock threadLocalFlock;
-
-            GetLocalFlock(&boids[i], &boidGrid, 1, &threadLocalFlock, PERCEPTION_RADIUS);
+    // the simulation threads quantize a frame into a ring slot, a writer thread encodes and writes it
+    outputs.trajectoryEvery = trajectoryEvery;
+    outputs.trajectoryStride = trajectoryStride;
+    if (trajectoryPath != NULL && TrajectorySinkOpen(&outputs.trajectory, trajectoryPath, boidCount, trajectoryStride,
+                                                     trajectoryEvery, trajectoryKeyframe, simulation->worldSize,
+                                                     simulation->maxVelocity) < 0) {
+        return 1;
+    }
 
-            Vector2 allignmentForce = GetBoidAlignmentForce(&boids[i], &threadLocalFlock, 0.1f);
-            Vector2 cohesionForce = GetBoidCohesionForce(&boids[i], &threadLocalFlock, 0.03f);
-            Vector2 separationForce = GetBoidSeparationForce(&boids[i], &threadLocalFlock, 50);
-            boids[i].acceleration = Vector2Add(allignmentForce, cohesionForce);
-            boids[i].acceleration = Vector2Add(boids[i].acceleration, separationForce);
-        } // implicit barrier
+    // the hooks copy every renderEvery-th frame into a triple buffer, the renderer or the window takes the latest
+    outputs.renderEvery = renderEvery;
+    if ((render >= 0 || window) &&
+        RenderSinkOpen(&outputs.render, (int) boidCount, (float) simulation->worldSize, (RenderMode) render,
+                       renderFormat, window ? NULL : renderPrefix, renderSize, renderThreads) < 0) {
+        return 1;
+    }
 
-#pragma omp for schedule(dynamic)
-        for (int i = 0; i < boidCount; i++) {
-            UpdateBoid(&boids[i]);
-        } // implicit barrier
+    BoidsWorldSetHooks(world, FrameStart, FrameEnd, &outputs);
+    int stepFailed = 0;
+    if (timesteps > config.startFrame && window) {
+        StepRun run = {
+            .world = world,
+            .frames = (int) (timesteps - config.startFrame),
+            .schedule = forceSchedule,
+            .chunk = forceChunk
+        };
+        atomic_init(&run.done, 0);
+        pthread_t stepper;
+        if (pthread_create(&stepper, NULL, StepRunThread, &run) != 0) {
+            perror("Failed to start the simulation thread");
+            return 1;
+        }
+        ShowWindow(&outputs.render, &run, (float) simulation->worldSize);
+        pthread_join(stepper, NULL);
+        stepFailed = run.failed;
+    } else if (timesteps > config.startFrame) {
+        stepFailed = BoidsWorldStep(world, (int) (timesteps - config.startFrame)) < 0;
+    }
 
-#pragma omp masked
-        {
-            double frame_time = omp_get_wtime() - frame_time_start;
-            fprintf(csvfile, "%d;%f\n", frame, frame_time);
-            frameTimes += frame_time;
-            measurements++;
-        } // NO implicit barrier, but it's fine i think
+    fclose(outputs.csvFile);
+    if (outputs.statesFile != NULL) fclose(outputs.statesFile);
+    BoidsWorldProfileDump(world, "main_omp_profile.json");
+    for (int t = 0; t < maxThreads; t++) {
+        if (missCounters[t] >= 0) close(missCounters[t]);
     }
 
+    const BoidsStats stats = BoidsWorldStats(world);
+    BoidsWorldDestroy(world);
+    CheckpointWriterFree(&outputs.checkpointWriter);
+    if (trajectoryPath != NULL) {
+        if (TrajectorySinkClose(&outputs.trajectory) < 0) {
+            fprintf(stderr, "Trajectory %s is incomplete\n", trajectoryPath);
+        }
+        printf("Trajectory: %llu frames, waited %.3fs for the writer %ld times\n",
+               (unsigned long long) outputs.trajectory.framesWritten, outputs.trajectory.stallTime,
+               outputs.trajectory.stalls);
+    }
+    if (render >= 0) {
+        const int failed = RenderSinkClose(&outputs.render) < 0;
+        if (failed) fprintf(stderr, "Rendering to %s stopped early\n", renderPrefix);
+        printf("Render: %ld of %ld frames written, %.1f ms each, %ld dropped while the renderer was busy\n",
+               outputs.render.framesWritten, outputs.render.published,
+               1e3 * outputs.render.renderTime / fmax(1, outputs.render.framesWritten),
+               failed ? 0 : RenderSinkDropped(&outputs.render));
+        if (renderFormat == RENDER_FORMAT_RAW) {
+            printf("Play with: ffplay -f rawvideo -pixel_format rgb24 -video_size %dx%d %s.rgb\n", renderSize,
+                   renderSize, renderPrefix);
+        }
+    } else if (window) {
+        RenderSinkClose(&outputs.render);
+    }
+    const CheckpointWriter *checkpointWriter = &outputs.checkpointWriter;
+    if (checkpointWriter->written + checkpointWriter->skipped + checkpointWriter->failed > 0) {
+        printf("Checkpoints: %ld written, %ld skipped while writing, %ld failed\n", checkpointWriter->written,
+               checkpointWriter->skipped, checkpointWriter->failed);
+    }
 
-    fclose(csvfile);
+    if (config.engine == FORCE_ENGINE_VERLET) {
+        printf("Verlet lists: %ld rebuilds in %ld frames (every %.2f frames), %.1f%% of %ld candidates rejected\n",
+               stats.verletRebuilds, stats.frames, (double) stats.frames / fmax(1, stats.verletRebuilds),
+               100.0 * (stats.verletCandidates - stats.verletAccepted) / fmax(1, stats.verletCandidates),
+               stats.verletCandidates);
+    }
+    if (config.incrementalGrid) {
+        printf("Incremental grid: %.1f migrations per frame, %ld fallback rebuilds\n",
+               (double) stats.migrations / fmax(1, stats.gridUpdates), stats.fallbackRebuilds);
+    }
+    if (config.index == BOIDS_INDEX_TWO_LEVEL) {
+        printf("Two-level grid: %.1f cells split per frame\n", (double) stats.splitCells / fmax(1, stats.frames));
+    }
+    if (config.index == BOIDS_INDEX_HASHED) {
+        const int gridSize = simulation->worldSize / simulation->gridResolution;
+        printf("Hashed grid: %.1f occupied cells per frame, %.1f MB instead of %.1f MB for the dense grid\n",
+               (double) stats.hashedCells / fmax(1, stats.frames), stats.hashedBytes / 1e6,
+               (double) gridSize * gridSize * (maxThreads + 2) * sizeof(int) / 1e6);
+    }
+    if (config.checkKernel && config.index == BOIDS_INDEX_TWO_LEVEL) {
+        printf("Two-level grid max relative difference from scalar: %e\n", stats.kernelError);
+    } else if (config.checkKernel && config.engine != FORCE_ENGINE_GATHER) {
+        printf("Engine max relative difference from scalar: %e\n", stats.kernelError);
+    } else if (config.checkKernel && (config.kernel == FLOCK_KERNEL_Q16 || config.kernel == FLOCK_KERNEL_Q32)) {
+        // a boid within a quantization step of the radius may be found by only one of the kernels
+        printf("Kernel %s max relative difference from scalar: %e over the flocks of the same size, "
+               "%.4f%% of the flocks differed in size\n", FlockKernelName(config.kernel), stats.kernelError,
+               100.0 * stats.kernelMismatches / fmax(1, (double) stats.frames * boidCount));
+    } else if (config.checkKernel && config.kernel != FLOCK_KERNEL_SCALAR) {
+        printf("Kernel %s max relative difference from scalar: %e\n", FlockKernelName(config.kernel),
+               stats.kernelError);
+    }
 
-    BoidGridFree(&boidGrid);
+    printf("Force loop imbalance: %.3f mean, %.3f worst frame\n", stats.forceImbalance, stats.forceImbalanceMax);
+    if (config.cellBlocks > 0) {
+        printf("Cell blocks: %.1f stolen per frame\n", (double) stats.steals / fmax(1, stats.frames));
+    }
 
-    printf("Average frame time: %f\n", frameTimes / measurements);
-    return 0;
+    printf("Average frame time: %f\n", outputs.frameTimes / outputs.measurements);
+    return stepFailed;
 }
@@ -0,0 +1,80 @@
+//
+// Created by leonardo on 10/12/25.
+//
+
+#ifndef BOIDS_EXECISE_PHILOX_H
+#define BOIDS_EXECISE_PHILOX_H
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"). A counter-based
+ * generator: the random block is a pure function of the counter and the key, so any thread can draw
+ * the numbers of any boid and frame in any order, without state to share, lock or pass around, and
+ * the result does not depend on the thread count or the C library.
+ */
+typedef struct {
+    uint32_t v[4];
+} PhiloxBlock;
+
+// what a draw is used for, so the streams of one boid and frame never overlap
+typedef enum {
+    PHILOX_STREAM_INIT,     // position and velocity at frame 0
+    PHILOX_STREAM_WANDER    // per-frame wander noise
+} PhiloxStream;
+
+// how the initial flock is drawn
+typedef enum {
+    BOID_RNG_LIBC,     // rand() seeded with srand, serial
+    BOID_RNG_PHILOX    // PhiloxDraw keyed by (seed, boid), parallel
+} BoidRng;
+
+static const char *boidRngNames[] = {"libc", "philox"};
+
+static inline uint32_t PhiloxMulHiLo(uint32_t a, uint32_t b, uint32_t *high) {
+    const uint64_t product = (uint64_t) a * b;
+    *high = (uint32_t) (product >> 32);
+    return (uint32_t) product;
+}
+
+static inline PhiloxBlock Philox4x32(PhiloxBlock counter, uint64_t key) {
+    uint32_t key0 = (uint32_t) key, key1 = (uint32_t) (key >> 32);
+    for (int round = 0; round < 10; round++) {
+        uint32_t high0, high1;
+        const uint32_t low0 = PhiloxMulHiLo(0xD2511F53u, counter.v[0], &high0);
+        const uint32_t low1 = PhiloxMulHiLo(0xCD9E8D57u, counter.v[2], &high1);
+        counter = (PhiloxBlock){{high1 ^ counter.v[1] ^ key0, low1, high0 ^ counter.v[3] ^ key1, low0}};
+        key0 += 0x9E3779B9u;
+        key1 += 0xBB67AE85u;
+    }
+    return counter;
+}
+
+/**
+ * @return 128 random bits for the boid with the given id at a frame, keyed by the seed of the run.
+ */
+static inline PhiloxBlock PhiloxDraw(uint64_t seed, uint64_t id, uint32_t frame, PhiloxStream stream) {
+    const PhiloxBlock counter = {{(uint32_t) id, (uint32_t) (id >> 32), frame, (uint32_t) stream}};
+    return Philox4x32(counter, seed);
+}
+
+/**
+ * @return bits mapped to [min, max), with the 24 bits a float can hold.
+ */
+static inline float PhiloxFloat(uint32_t bits, float min, float max) {
+    return min + (float) (bits >> 8) * 0x1p-24f * (max - min);
+}
+
+/**
+ * @brief Parses --rng=NAME.
+ * @return the generator, or -1 if the name is unknown.
+ */
+static inline int BoidRngParse(const char *name) {
+    for (int rng = BOID_RNG_LIBC; rng <= BOID_RNG_PHILOX; rng++) {
+        if (strcmp(name, boidRngNames[rng]) == 0) return rng;
+    }
+    return -1;
+}
+
+#endif //BOIDS_EXECISE_PHILOX_H
@@ -0,0 +1,551 @@
+//
+// Created by leonardo on 16/12/25.
+//
+
+#ifndef BOIDS_EXECISE_RENDER_H
+#define BOIDS_EXECISE_RENDER_H
+
+#include <math.h>
+#include <omp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "boids.h"
+
+#define RENDER_TILE 64           // pixels on a side of the squares the render threads work on
+#define RENDER_FRESH 4           // flag of the published buffer index: the renderer hasn't taken it yet
+#define RENDER_PNG_BLOCK 65535   // largest stored deflate block
+
+/**
+ * Headless rendering next to the simulation: the frame hooks copy the boids into the back buffer of a
+ * triple buffer and publish it, a render thread takes the latest published snapshot, rasterizes it in
+ * tiles with a team of its own and writes the image. Publishing never waits, a snapshot the renderer
+ * was too slow to take is replaced by the next one and counted as dropped.
+ */
+typedef enum {
+    RENDER_BOIDS,    // a triangle along the velocity of every boid, coloured by heading
+    RENDER_DENSITY   // boids per pixel, on a log scale up to the densest pixel of the frame
+} RenderMode;
+
+typedef enum {
+    RENDER_FORMAT_PPM,  // PREFIX_000123.ppm per frame
+    RENDER_FORMAT_PNG,  // PREFIX_000123.png per frame, stored without compression
+    RENDER_FORMAT_RAW   // every frame appended to PREFIX.rgb as rgb24, for ffmpeg -f rawvideo
+} RenderFormat;
+
+typedef struct {
+    float *states;   // BOIDS_STATE_FLOATS per boid, in slot order
+    int count;
+    int frame;
+} RenderSnapshot;
+
+typedef struct {
+    RenderSnapshot buffers[3];
+    _Alignas(64) atomic_int middle;  // the published buffer, | RENDER_FRESH until taken
+    atomic_int done;
+    int back;                        // owned by the simulation
+    int front;                       // owned by the consumer
+    int capacity;                    // boids of every buffer
+    pthread_t thread;
+    int started;
+    // settings
+    RenderMode mode;
+    RenderFormat format;
+    const char *prefix;
+    int size;                        // the image is size x size pixels
+    int threads;
+    float worldSize;
+    // owned by the render thread
+    unsigned char *image;            // rgb24, row by row
+    uint32_t *density;
+    int *tileStart;                  // tileCount + 1 offsets into tileBoids, the boids of every tile
+    int *threadFill;                 // per render thread and tile, where its next boid of the tile goes
+    int *tileBoids;
+    unsigned char *png;              // the zlib stream of a PNG frame
+    uint32_t crcTable[256];
+    FILE *video;
+    long framesWritten;
+    double renderTime;
+    int failed;
+    // owned by the simulation
+    long published;
+} RenderSink;
+
+static inline int RenderFormatParse(const char *name) {
+    if (strcmp(name, "ppm") == 0) return RENDER_FORMAT_PPM;
+    if (strcmp(name, "png") == 0) return RENDER_FORMAT_PNG;
+    if (strcmp(name, "raw") == 0) return RENDER_FORMAT_RAW;
+    return -1;
+}
+
+static inline int RenderTiles(const RenderSink *sink) {
+    return (sink->size + RENDER_TILE - 1) / RENDER_TILE;
+}
+
+/**
+ * @brief The snapshot to fill for the next publish. Only one thread may publish, but any may fill it.
+ */
+static inline RenderSnapshot *RenderSinkBack(RenderSink *sink) {
+    return &sink->buffers[sink->back];
+}
+
+/**
+ * @brief Swaps the filled back buffer with the middle one, whether or not the consumer took it.
+ */
+static void RenderSinkPublish(RenderSink *sink, int frame, int count) {
+    sink->buffers[sink->back].frame = frame;
+    sink->buffers[sink->back].count = count;
+    const int previous = atomic_exchange_explicit(&sink->middle, sink->back | RENDER_FRESH, memory_order_acq_rel);
+    sink->back = previous & ~RENDER_FRESH;
+    sink->published++;
+}
+
+/**
+ * @brief Swaps the front buffer for the latest published one, if there is one the consumer hasn't seen.
+ * @return the new front snapshot, valid until the next take, or NULL.
+ */
+static const RenderSnapshot *RenderSinkTake(RenderSink *sink) {
+    if (!(atomic_load_explicit(&sink->middle, memory_order_relaxed) & RENDER_FRESH)) return NULL;
+    const int previous = atomic_exchange_explicit(&sink->middle, sink->front, memory_order_acq_rel);
+    sink->front = previous & ~RENDER_FRESH;
+    return &sink->buffers[sink->front];
+}
+
+static inline long RenderSinkDropped(const RenderSink *sink) {
+    return sink->published - sink->framesWritten;
+}
+
+/**
+ * @return the pixel of a world coordinate, the far edge of the world on the last pixel.
+ */
+static inline int RenderPixel(float position, float scale, int size) {
+    const int pixel = (int) (position * scale);
+    return pixel < 0 ? 0 : pixel >= size ? size - 1 : pixel;
+}
+
+/**
+ * @brief Sorts the boids of the snapshot by tile with the render team, a counting sort that keeps them
+ * in slot order, so overlapping triangles are drawn in the same order whatever the threads.
+ */
+static void RenderBin(RenderSink *sink, const RenderSnapshot *snapshot) {
+    const int tiles = RenderTiles(sink), tileCount = tiles * tiles;
+    const float scale = sink->size / sink->worldSize;
+    int *fill = sink->threadFill + (size_t) omp_get_thread_num() * tileCount;
+    memset(fill, 0, tileCount * sizeof(int));
+
+    // both loops see the same static partition of the boids
+#pragma omp for schedule(static)
+    for (int i = 0; i < snapshot->count; i++) {
+        const float *state = snapshot->states + (size_t) i * BOIDS_STATE_FLOATS;
+        fill[RenderPixel(state[1], scale, sink->size) / RENDER_TILE * tiles +
+             RenderPixel(state[0], scale, sink->size) / RENDER_TILE]++;
+    } // implicit barrier
+
+#pragma omp single
+    {
+        const int threads = omp_get_num_threads();
+        int offset = 0;
+        for (int tile = 0; tile < tileCount; tile++) {
+            sink->tileStart[tile] = offset;
+            for (int thread = 0; thread < threads; thread++) {
+                const int count = sink->threadFill[(size_t) thread * tileCount + tile];
+                sink->threadFill[(size_t) thread * tileCount + tile] = offset;
+                offset += count;
+            }
+        }
+        sink->tileStart[tileCount] = offset;
+    } // implicit barrier
+
+#pragma omp for schedule(static)
+    for (int i = 0; i < snapshot->count; i++) {
+        const float *state = snapshot->states + (size_t) i * BOIDS_STATE_FLOATS;
+        sink->tileBoids[fill[RenderPixel(state[1], scale, sink->size) / RENDER_TILE * tiles +
+                             RenderPixel(state[0], scale, sink->size) / RENDER_TILE]++] = i;
+    } // implicit barrier
+}
+
+/**
+ * @brief A colour of the hue wheel, angle in radians.
+ */
+static inline void RenderHue(float angle, unsigned char *rgb) {
+    const float hue = (angle / 6.2831853f + 0.5f) * 6.0f;
+    for (int channel = 0; channel < 3; channel++) {
+        // distance of the hue from the peak of the channel around the wheel, red at 0, green at 2, blue at 4
+        const float distance = fabsf(fmodf(hue - 2.0f * channel + 9.0f, 6.0f) - 3.0f);
+        const float level = distance < 1.0f ? 1.0f : distance > 2.0f ? 0.0f : 2.0f - distance;
+        rgb[channel] = (unsigned char) (40 + 190 * level);
+    }
+}
+
+/**
+ * @brief Draws every boid of the tile and of the tiles around it whose triangle reaches into the tile,
+ * clipped to it. The triangles are shorter than a tile, so the ring of tiles around is enough.
+ */
+static void RenderBoidsTile(RenderSink *sink, const RenderSnapshot *snapshot, int tileRow, int tileCol) {
+    const int tiles = RenderTiles(sink), size = sink->size;
+    const int x0 = tileCol * RENDER_TILE, y0 = tileRow * RENDER_TILE;
+    const int x1 = x0 + RENDER_TILE < size ? x0 + RENDER_TILE : size;
+    const int y1 = y0 + RENDER_TILE < size ? y0 + RENDER_TILE : size;
+    for (int y = y0; y < y1; y++) {
+        memset(sink->image + ((size_t) y * size + x0) * 3, 255, (size_t) (x1 - x0) * 3);
+    }
+
+    const float scale = size / sink->worldSize;
+    const float length = fminf(fmaxf(3.0f, size / 170.0f), RENDER_TILE / 2.0f);
+    for (int row = tileRow - 1; row <= tileRow + 1; row++) {
+        for (int col = tileCol - 1; col <= tileCol + 1; col++) {
+            if (row < 0 || col < 0 || row >= tiles || col >= tiles) continue;
+            const int tile = row * tiles + col;
+            for (int k = sink->tileStart[tile]; k < sink->tileStart[tile + 1]; k++) {
+                const float *state = snapshot->states + (size_t) sink->tileBoids[k] * BOIDS_STATE_FLOATS;
+                const float speed = hypotf(state[2], state[3]);
+                const float dx = speed > 0 ? state[2] / speed : 1.0f, dy = speed > 0 ? state[3] / speed : 0.0f;
+                const float px = state[0] * scale, py = state[1] * scale;
+                const float vx[3] = {
+                    px + dx * length, px - dx * length * 0.5f - dy * length * 0.4f,
+                    px - dx * length * 0.5f + dy * length * 0.4f
+                };
+                const float vy[3] = {
+                    py + dy * length, py - dy * length * 0.5f + dx * length * 0.4f,
+                    py - dy * length * 0.5f - dx * length * 0.4f
+                };
+
+                int minX = (int) floorf(fminf(vx[0], fminf(vx[1], vx[2])));
+                int maxX = (int) ceilf(fmaxf(vx[0], fmaxf(vx[1], vx[2])));
+                int minY = (int) floorf(fminf(vy[0], fminf(vy[1], vy[2])));
+                int maxY = (int) ceilf(fmaxf(vy[0], fmaxf(vy[1], vy[2])));
+                if (minX < x0) minX = x0;
+                if (minY < y0) minY = y0;
+                if (maxX > x1) maxX = x1;
+                if (maxY > y1) maxY = y1;
+                if (minX >= maxX || minY >= maxY) continue;
+
+                unsigned char colour[3];
+                RenderHue(atan2f(dy, dx), colour);
+                // pixel centres on the same side of all three edges, whichever way the triangle winds
+                for (int y = minY; y < maxY; y++) {
+                    for (int x = minX; x < maxX; x++) {
+                        const float cx = x + 0.5f, cy = y + 0.5f;
+                        int positive = 0, negative = 0;
+                        for (int e = 0; e < 3; e++) {
+                            const int f = (e + 1) % 3;
+                            const float edge = (vx[f] - vx[e]) * (cy - vy[e]) - (vy[f] - vy[e]) * (cx - vx[e]);
+                            positive |= edge > 0;
+                            negative |= edge < 0;
+                        }
+                        if (positive && negative) continue;
+                        memcpy(sink->image + ((size_t) y * size + x) * 3, colour, 3);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Counts the boids of the tile per pixel.
+ * @return the largest count of the tile.
+ */
+static uint32_t RenderDensityTile(RenderSink *sink, const RenderSnapshot *snapshot, int tileRow, int tileCol) {
+    const int tiles = RenderTiles(sink), size = sink->size;
+    const int x0 = tileCol * RENDER_TILE, y0 = tileRow * RENDER_TILE;
+    const int x1 = x0 + RENDER_TILE < size ? x0 + RENDER_TILE : size;
+    const int y1 = y0 + RENDER_TILE < size ? y0 + RENDER_TILE : size;
+    for (int y = y0; y < y1; y++) {
+        memset(sink->density + (size_t) y * size + x0, 0, (size_t) (x1 - x0) * sizeof(uint32_t));
+    }
+
+    const float scale = size / sink->worldSize;
+    const int tile = tileRow * tiles + tileCol;
+    uint32_t densest = 0;
+    for (int k = sink->tileStart[tile]; k < sink->tileStart[tile + 1]; k++) {
+        const float *state = snapshot->states + (size_t) sink->tileBoids[k] * BOIDS_STATE_FLOATS;
+        uint32_t *pixel = &sink->density[(size_t) RenderPixel(state[1], scale, size) * size +
+                                         RenderPixel(state[0], scale, size)];
+        if (++*pixel > densest) densest = *pixel;
+    }
+    return densest;
+}
+
+/**
+ * @brief Colours the counts of a tile from black through purple and orange to pale yellow, on a log scale.
+ */
+static void RenderDensityColour(RenderSink *sink, int tileRow, int tileCol, uint32_t densest) {
+    static const float stops[5][3] = {{0, 0, 4}, {87, 16, 110}, {188, 55, 84}, {249, 142, 9}, {252, 255, 164}};
+    const int size = sink->size;
+    const int x0 = tileCol * RENDER_TILE, y0 = tileRow * RENDER_TILE;
+    const int x1 = x0 + RENDER_TILE < size ? x0 + RENDER_TILE : size;
+    const int y1 = y0 + RENDER_TILE < size ? y0 + RENDER_TILE : size;
+    const float scale = densest > 0 ? 1.0f / logf(1.0f + densest) : 0.0f;
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            const float level = logf(1.0f + sink->density[(size_t) y * size + x]) * scale * 4.0f;
+            const int stop = level >= 4.0f ? 3 : (int) level;
+            const float t = level - stop;
+            unsigned char *rgb = sink->image + ((size_t) y * size + x) * 3;
+            for (int channel = 0; channel < 3; channel++) {
+                rgb[channel] = (unsigned char) (stops[stop][channel] +
+                                                (stops[stop + 1][channel] - stops[stop][channel]) * t + 0.5f);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Rasterizes the snapshot into the image with the render team, one tile at a time.
+ */
+static void RenderRasterize(RenderSink *sink, const RenderSnapshot *snapshot) {
+    const int tiles = RenderTiles(sink), tileCount = tiles * tiles;
+    uint32_t densest = 0;
+#pragma omp parallel num_threads(sink->threads)
+    {
+        RenderBin(sink, snapshot);
+        if (sink->mode == RENDER_BOIDS) {
+#pragma omp for schedule(dynamic, 1)
+            for (int tile = 0; tile < tileCount; tile++) {
+                RenderBoidsTile(sink, snapshot, tile / tiles, tile % tiles);
+            }
+        } else {
+#pragma omp for schedule(dynamic, 1) reduction(max:densest)
+            for (int tile = 0; tile < tileCount; tile++) {
+                const uint32_t tileDensest = RenderDensityTile(sink, snapshot, tile / tiles, tile % tiles);
+                if (tileDensest > densest) densest = tileDensest;
+            } // implicit barrier, densest is final
+#pragma omp for schedule(static)
+            for (int tile = 0; tile < tileCount; tile++) {
+                RenderDensityColour(sink, tile / tiles, tile % tiles, densest);
+            }
+        }
+    }
+}
+
+static uint32_t RenderCrc(const RenderSink *sink, uint32_t crc, const unsigned char *data, size_t bytes) {
+    crc = ~crc;
+    for (size_t k = 0; k < bytes; k++) {
+        crc = sink->crcTable[(crc ^ data[k]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static inline void RenderPutBigEndian(unsigned char *out, uint32_t value) {
+    out[0] = (unsigned char) (value >> 24);
+    out[1] = (unsigned char) (value >> 16);
+    out[2] = (unsigned char) (value >> 8);
+    out[3] = (unsigned char) value;
+}
+
+static int RenderPngChunk(const RenderSink *sink, FILE *file, const char *type, const unsigned char *data,
+                          uint32_t bytes) {
+    unsigned char head[8], tail[4];
+    RenderPutBigEndian(head, bytes);
+    memcpy(head + 4, type, 4);
+    RenderPutBigEndian(tail, RenderCrc(sink, RenderCrc(sink, 0, head + 4, 4), data, bytes));
+    return fwrite(head, 1, 8, file) == 8 && (bytes == 0 || fwrite(data, 1, bytes, file) == bytes) &&
+           fwrite(tail, 1, 4, file) == 4 ? 0 : -1;
+}
+
+/**
+ * @return bytes of the zlib stream of an image: the rows, each behind a filter byte, in stored deflate blocks.
+ */
+static inline size_t RenderPngStreamBytes(int size) {
+    const size_t raw = (size_t) size * (1 + (size_t) size * 3);
+    return 2 + raw + (raw + RENDER_PNG_BLOCK - 1) / RENDER_PNG_BLOCK * 5 + 4;
+}
+
+/**
+ * @brief Writes the image as an uncompressed PNG. Deflating would cost more than rasterizing, and the
+ * frames are meant to be turned into a video anyway.
+ */
+static int RenderWritePng(RenderSink *sink, FILE *file) {
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    const int size = sink->size;
+    unsigned char header[13] = {0};
+    RenderPutBigEndian(header, size);
+    RenderPutBigEndian(header + 4, size);
+    header[8] = 8;  // bits per channel
+    header[9] = 2;  // rgb
+
+    // the rows with their filter bytes, cut into stored blocks as they go
+    unsigned char *out = sink->png;
+    *out++ = 0x78;
+    *out++ = 0x01;
+    const size_t raw = (size_t) size * (1 + (size_t) size * 3);
+    uint32_t adlerLow = 1, adlerHigh = 0;
+    size_t left = 0, done = 0;
+    for (int y = 0; y < size; y++) {
+        for (int x = -1; x < size * 3; x++) {
+            if (left == 0) {
+                left = raw - done < RENDER_PNG_BLOCK ? raw - done : RENDER_PNG_BLOCK;
+                *out++ = done + left == raw;  // the last block
+                *out++ = (unsigned char) left;
+                *out++ = (unsigned char) (left >> 8);
+                *out++ = (unsigned char) ~left;
+                *out++ = (unsigned char) (~left >> 8);
+            }
+            const unsigned char byte = x < 0 ? 0 : sink->image[(size_t) y * size * 3 + x];
+            *out++ = byte;
+            adlerLow = (adlerLow + byte) % 65521;
+            adlerHigh = (adlerHigh + adlerLow) % 65521;
+            left--;
+            done++;
+        }
+    }
+    RenderPutBigEndian(out, adlerHigh << 16 | adlerLow);
+    out += 4;
+
+    return fwrite(signature, 1, 8, file) == 8 && RenderPngChunk(sink, file, "IHDR", header, sizeof(header)) == 0 &&
+           RenderPngChunk(sink, file, "IDAT", sink->png, (uint32_t) (out - sink->png)) == 0 &&
+           RenderPngChunk(sink, file, "IEND", NULL, 0) == 0 ? 0 : -1;
+}
+
+static int RenderWrite(RenderSink *sink, int frame) {
+    const size_t imageBytes = (size_t) sink->size * sink->size * 3;
+    if (sink->format == RENDER_FORMAT_RAW) {
+        return fwrite(sink->image, 1, imageBytes, sink->video) == imageBytes ? 0 : -1;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s_%06d.%s", sink->prefix, frame, sink->format == RENDER_FORMAT_PNG ? "png" : "ppm");
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return -1;
+    int failed;
+    if (sink->format == RENDER_FORMAT_PNG) {
+        failed = RenderWritePng(sink, file) < 0;
+    } else {
+        failed = fprintf(file, "P6\n%d %d\n255\n", sink->size, sink->size) < 0 ||
+                 fwrite(sink->image, 1, imageBytes, file) != imageBytes;
+    }
+    return fclose(file) != 0 || failed ? -1 : 0;
+}
+
+static void *RenderRun(void *argument) {
+    RenderSink *sink = argument;
+    const struct timespec nap = {.tv_nsec = 200000};
+
+    for (;;) {
+        const RenderSnapshot *snapshot = RenderSinkTake(sink);
+        if (snapshot == NULL) {
+            // done is set after the last publish, so one more take catches the last frame
+            if (atomic_load_explicit(&sink->done, memory_order_acquire)) {
+                snapshot = RenderSinkTake(sink);
+                if (snapshot == NULL) break;
+            } else {
+                nanosleep(&nap, NULL);
+                continue;
+            }
+        }
+
+        if (sink->failed) continue;
+        const double start = omp_get_wtime();
+        RenderRasterize(sink, snapshot);
+        if (RenderWrite(sink, snapshot->frame) < 0) {
+            perror("Failed to write rendered frame");
+            sink->failed = 1;
+            continue;
+        }
+        sink->renderTime += omp_get_wtime() - start;
+        sink->framesWritten++;
+    }
+    return NULL;
+}
+
+static void RenderSinkFreeBuffers(RenderSink *sink) {
+    for (int b = 0; b < 3; b++) {
+        free(sink->buffers[b].states);
+        sink->buffers[b].states = NULL;
+    }
+    free(sink->image);
+    free(sink->density);
+    free(sink->tileStart);
+    free(sink->threadFill);
+    free(sink->tileBoids);
+    free(sink->png);
+    if (sink->video != NULL) fclose(sink->video);
+}
+
+/**
+ * @brief Allocates the triple buffer for capacity boids and, unless the snapshots are only taken with
+ * RenderSinkTake, opens the output and starts the render thread.
+ * @param prefix of the frame files, NULL for a consumer of its own, such as a window
+ * @return 0 on success, -1 with nothing left to free on failure
+ */
+static int RenderSinkOpen(RenderSink *sink, int capacity, float worldSize, RenderMode mode, RenderFormat format,
+                          const char *prefix, int size, int threads) {
+    *sink = (RenderSink){
+        .back = 0,
+        .front = 1,
+        .capacity = capacity,
+        .mode = mode,
+        .format = format,
+        .prefix = prefix,
+        .size = size,
+        .threads = threads,
+        .worldSize = worldSize
+    };
+    atomic_init(&sink->middle, 2);
+    atomic_init(&sink->done, 0);
+
+    int allocated = 1;
+    for (int b = 0; allocated && b < 3; b++) {
+        sink->buffers[b].states = malloc((size_t) capacity * BOIDS_STATE_FLOATS * sizeof(float));
+        allocated = sink->buffers[b].states != NULL;
+    }
+    if (allocated && prefix != NULL) {
+        const int tiles = RenderTiles(sink);
+        allocated = (sink->image = malloc((size_t) size * size * 3)) != NULL &&
+                    (sink->tileStart = malloc(((size_t) tiles * tiles + 1) * sizeof(int))) != NULL &&
+                    (sink->threadFill = malloc((size_t) threads * tiles * tiles * sizeof(int))) != NULL &&
+                    (sink->tileBoids = malloc((size_t) (capacity > 0 ? capacity : 1) * sizeof(int))) != NULL &&
+                    (mode != RENDER_DENSITY ||
+                     (sink->density = malloc((size_t) size * size * sizeof(uint32_t))) != NULL) &&
+                    (format != RENDER_FORMAT_PNG || (sink->png = malloc(RenderPngStreamBytes(size))) != NULL);
+    }
+    if (!allocated) {
+        perror("Failed to allocate render buffers");
+        RenderSinkFreeBuffers(sink);
+        return -1;
+    }
+    if (prefix == NULL) return 0;
+
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int bit = 0; bit < 8; bit++) crc = crc & 1 ? 0xedb88320u ^ (crc >> 1) : crc >> 1;
+        sink->crcTable[n] = crc;
+    }
+    if (format == RENDER_FORMAT_RAW) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s.rgb", prefix);
+        if ((sink->video = fopen(path, "wb")) == NULL) {
+            perror("Failed to open render output");
+            RenderSinkFreeBuffers(sink);
+            return -1;
+        }
+    }
+    if (pthread_create(&sink->thread, NULL, RenderRun, sink) != 0) {
+        perror("Failed to start render thread");
+        RenderSinkFreeBuffers(sink);
+        return -1;
+    }
+    sink->started = 1;
+    return 0;
+}
+
+/**
+ * @brief Lets the render thread finish the last published frame and frees the buffers.
+ * @return 0 if every frame the render thread took made it to disk
+ */
+static int RenderSinkClose(RenderSink *sink) {
+    atomic_store_explicit(&sink->done, 1, memory_order_release);
+    if (sink->started) pthread_join(sink->thread, NULL);
+    if (sink->video != NULL && fclose(sink->video) != 0) sink->failed = 1;
+    sink->video = NULL;
+    RenderSinkFreeBuffers(sink);
+    return sink->failed ? -1 : 0;
+}
+
+#endif //BOIDS_EXECISE_RENDER_H
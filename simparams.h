@@ -0,0 +1,168 @@
+//
+// Created by leonardo on 08/12/25.
+//
+
+#ifndef BOIDS_EXECISE_SIMPARAMS_H
+#define BOIDS_EXECISE_SIMPARAMS_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The parameters of the simulation. Every executable starts from its own defaults and overrides
+ * them from a config file and the command line, see SimParamsParseOption.
+ */
+typedef struct {
+    int worldSize;
+    int gridResolution;
+    float perceptionRadius;
+    float minVelocity;
+    float maxVelocity;
+    float maxAcceleration;
+    float alignmentWeight;
+    float cohesionWeight;
+    float separationWeight;
+    float wanderWeight;      // random acceleration per axis, drawn with Philox from the seed, boid and frame
+} SimParams;
+
+typedef struct {
+    const char *name;
+    size_t offset;
+    int isInt;
+} SimParamField;
+
+static const SimParamField simParamFields[] = {
+    {"world-size", offsetof(SimParams, worldSize), 1},
+    {"grid-resolution", offsetof(SimParams, gridResolution), 1},
+    {"radius", offsetof(SimParams, perceptionRadius), 0},
+    {"min-velocity", offsetof(SimParams, minVelocity), 0},
+    {"max-velocity", offsetof(SimParams, maxVelocity), 0},
+    {"max-acceleration", offsetof(SimParams, maxAcceleration), 0},
+    {"alignment-weight", offsetof(SimParams, alignmentWeight), 0},
+    {"cohesion-weight", offsetof(SimParams, cohesionWeight), 0},
+    {"separation-weight", offsetof(SimParams, separationWeight), 0},
+    {"wander-weight", offsetof(SimParams, wanderWeight), 0}
+};
+
+#define SIM_PARAM_COUNT (sizeof(simParamFields) / sizeof(simParamFields[0]))
+
+/**
+ * @brief Sets the parameter called name (nameLength bytes, not terminated) from value.
+ * @return 0, or -1 if the name is unknown or value is not a number.
+ */
+static inline int SimParamsSet(SimParams *params, const char *name, size_t nameLength, const char *value) {
+    for (size_t k = 0; k < SIM_PARAM_COUNT; k++) {
+        const SimParamField *field = &simParamFields[k];
+        if (strlen(field->name) != nameLength || strncmp(field->name, name, nameLength) != 0) continue;
+
+        char *end;
+        void *target = (char *) params + field->offset;
+        if (field->isInt) {
+            const long number = strtol(value, &end, 10);
+            *(int *) target = (int) number;
+        } else {
+            *(float *) target = strtof(value, &end);
+        }
+        while (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n') end++;
+        if (end == value || *end != '\0') {
+            fprintf(stderr, "Bad value for %s: %s\n", field->name, value);
+            return -1;
+        }
+        return 0;
+    }
+    fprintf(stderr, "Unknown parameter: %.*s\n", (int) nameLength, name);
+    return -1;
+}
+
+/**
+ * @brief Reads "name = value" lines with the names of the command line options, # starts a comment.
+ * @return 0, or -1 after reporting the first bad line.
+ */
+static inline int SimParamsLoad(SimParams *params, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Failed to open config file");
+        return -1;
+    }
+
+    char line[256];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lineNumber++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+
+        char *name = line + strspn(line, " \t\r\n");
+        if (*name == '\0') continue;
+        char *equals = strchr(name, '=');
+        if (equals == NULL) {
+            fprintf(stderr, "%s:%d: expected name = value\n", path, lineNumber);
+            fclose(file);
+            return -1;
+        }
+        size_t nameLength = equals - name;
+        while (nameLength > 0 && (name[nameLength - 1] == ' ' || name[nameLength - 1] == '\t')) nameLength--;
+        const char *value = equals + 1 + strspn(equals + 1, " \t");
+        if (SimParamsSet(params, name, nameLength, value) < 0) {
+            fprintf(stderr, "in %s:%d\n", path, lineNumber);
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+/**
+ * @brief Handles --config=PATH and --name=value for every parameter. Options are applied in
+ * order, so whatever comes later on the command line wins.
+ * @return 1 if arg was one of these options, 0 if it is some other option, -1 if it was bad.
+ */
+static inline int SimParamsParseOption(SimParams *params, const char *arg) {
+    if (strncmp(arg, "--config=", 9) == 0) {
+        return SimParamsLoad(params, arg + 9) < 0 ? -1 : 1;
+    }
+    if (strncmp(arg, "--", 2) != 0 || strchr(arg, '=') == NULL) return 0;
+
+    const char *name = arg + 2;
+    const size_t nameLength = strchr(name, '=') - name;
+    for (size_t k = 0; k < SIM_PARAM_COUNT; k++) {
+        if (strlen(simParamFields[k].name) == nameLength && strncmp(simParamFields[k].name, name, nameLength) == 0) {
+            return SimParamsSet(params, name, nameLength, name + nameLength + 1) < 0 ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @return 0 if the parameters make a valid simulation, -1 after reporting what is wrong.
+ */
+static inline int SimParamsCheck(const SimParams *params) {
+    if (params->worldSize <= 0 || params->gridResolution <= 0 || params->worldSize % params->gridResolution != 0) {
+        fprintf(stderr, "The grid resolution must be positive and divide the world size %d\n", params->worldSize);
+        return -1;
+    }
+    // the neighbour search only looks one cell away
+    if (params->perceptionRadius <= 0 || params->perceptionRadius > params->gridResolution) {
+        fprintf(stderr, "The perception radius must be positive and at most the grid resolution %d\n",
+                params->gridResolution);
+        return -1;
+    }
+    if (params->minVelocity < 0 || params->minVelocity > params->maxVelocity || params->maxAcceleration < 0 ||
+        params->wanderWeight < 0) {
+        fprintf(stderr, "Velocity limits must satisfy 0 <= min <= max, the acceleration limit and the wander "
+                        "weight can't be negative\n");
+        return -1;
+    }
+    return 0;
+}
+
+#define SIM_PARAMS_USAGE \
+    "  --config=PATH          read parameters from name = value lines, later options override them\n" \
+    "  --world-size=W --grid-resolution=G --radius=R --min-velocity=V --max-velocity=V\n" \
+    "  --max-acceleration=A --alignment-weight=W --cohesion-weight=W --separation-weight=W\n" \
+    "  --wander-weight=W\n"
+
+#endif //BOIDS_EXECISE_SIMPARAMS_H
@@ -29,4 +29,379 @@ printf("\n-> %s took %.6f seconds\n", label, __duration)) \
 /* The user's block becomes the body of this 'if (1)' */ \
 if (1)
 
+/*
+ * Per-phase profiler, compiled in with -DBOIDS_PROFILE (cmake -DBOIDS_PROFILE=ON). Without it every
+ * macro below expands to nothing, or NULL, or to a plain block for PROFILE_SCOPE.
+ *
+ * PROFILE_CREATE(threads)       a Profile with a slot for each of threads threads, NULL if it can't be allocated
+ * PROFILE_BIND(profile, id)     at the start of a parallel region, charges the calling thread's scopes to slot id
+ *                               of profile, PROFILE_BIND(NULL, 0) at its end. Unbound threads record nothing
+ * PROFILE_SCOPE("name") { }     times the block on the calling thread, scopes nest into a tree
+ * PROFILE_COUNT("name", n)      adds n to a counter of the calling thread
+ * PROFILE_FRAME_END(profile)    reached by every thread of the team once per frame, closes a sample
+ * PROFILE_DUMP(profile, "file.json")  outside the parallel regions, writes the statistics as JSON
+ * PROFILE_FREE(profile)
+ *
+ * Every profile has its own slots and samples, so regions working on different profiles can run side by
+ * side. The names of the phases and counters are shared by all of them. Every frame a phase gets one
+ * sample, the longest time any thread spent in it, and an imbalance, the longest over the mean time of the
+ * threads that entered it. Scopes around worksharing loops should not contain the loop's barrier, otherwise
+ * every thread just waits for the slowest. Timestamps come from omp_get_wtime, or from rdtsc with
+ * -DBOIDS_PROFILE_RDTSC on x86.
+ */
+#ifdef BOIDS_PROFILE
+
+#include <omp.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(BOIDS_PROFILE_RDTSC) && defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#define PROFILE_MAX_PHASES 64
+#define PROFILE_MAX_COUNTERS 32
+#define PROFILE_MAX_DEPTH 16
+
+typedef struct {
+    const char *name;
+    int parent;
+} ProfilePhase;
+
+typedef struct {
+    const char *name;
+} ProfileCounter;
+
+// one sample per frame the phase ran in
+typedef struct {
+    double *samples;
+    long sampleCount;
+    long sampleCapacity;
+    double imbalanceSum;
+    double imbalanceMax;
+} ProfileSamples;
+
+typedef struct {
+    long long total;
+    long long frameMax;
+} ProfileTotal;
+
+typedef struct {
+    _Alignas(64) double phaseTime[PROFILE_MAX_PHASES];  // time in each phase during this frame
+    long long counters[PROFILE_MAX_COUNTERS];
+    int stack[PROFILE_MAX_DEPTH];
+    int depth;
+} ProfileThread;
+
+typedef struct Profile {
+    ProfileThread *threads;
+    int threadCount;
+    long frames;
+    ProfileSamples phases[PROFILE_MAX_PHASES];
+    ProfileTotal counters[PROFILE_MAX_COUNTERS];
+} Profile;
+
+// the registry of names, shared by every profile
+static ProfilePhase profilePhases[PROFILE_MAX_PHASES];
+static ProfileCounter profileCounters[PROFILE_MAX_COUNTERS];
+static atomic_int profilePhaseCount;
+static atomic_int profileCounterCount;
+#if defined(BOIDS_PROFILE_RDTSC) && defined(__x86_64__)
+static double profileTickSeconds;
+#endif
+
+// slot of the profile the calling thread is bound to, NULL when its scopes aren't recorded
+static _Thread_local ProfileThread *profileSlot;
+
+static inline double ProfileNow(void) {
+#if defined(BOIDS_PROFILE_RDTSC) && defined(__x86_64__)
+    return (double) __rdtsc() * profileTickSeconds;
+#else
+    return omp_get_wtime();
+#endif
+}
+
+static Profile *ProfileCreate(int threads) {
+    Profile *profile = calloc(1, sizeof(Profile));
+    ProfileThread *slots = aligned_alloc(64, threads * sizeof(ProfileThread));
+    if (profile == NULL || slots == NULL) {
+        perror("Failed to allocate profiler");
+        free(profile);
+        free(slots);
+        return NULL;
+    }
+    memset(slots, 0, threads * sizeof(ProfileThread));
+    for (int t = 0; t < threads; t++) slots[t].stack[0] = -1;
+    profile->threads = slots;
+    profile->threadCount = threads;
+#if defined(BOIDS_PROFILE_RDTSC) && defined(__x86_64__)
+#pragma omp critical(profileRegistry)
+    if (profileTickSeconds == 0) {
+        // calibrate the tick against the wall clock over a short busy wait
+        const double start = omp_get_wtime();
+        const uint64_t ticks = __rdtsc();
+        while (omp_get_wtime() - start < 0.05) {}
+        profileTickSeconds = (omp_get_wtime() - start) / (double) (__rdtsc() - ticks);
+    }
+#endif
+    return profile;
+}
+
+static void ProfileFree(Profile *profile) {
+    if (profile == NULL) return;
+
+    for (int p = 0; p < PROFILE_MAX_PHASES; p++) free(profile->phases[p].samples);
+    free(profile->threads);
+    free(profile);
+}
+
+static inline void ProfileBind(Profile *profile, int id) {
+    profileSlot = profile != NULL ? &profile->threads[id] : NULL;
+}
+
+/**
+ * @brief Finds or registers the phase called name under parent. Call sites are few and entered a handful
+ * of times per frame, a linear scan of the registry is cheaper than hashing.
+ */
+static int ProfilePhaseId(const char *name, int parent) {
+    int count = atomic_load_explicit(&profilePhaseCount, memory_order_acquire);
+    for (int p = 0; p < count; p++) {
+        if (profilePhases[p].parent == parent && strcmp(profilePhases[p].name, name) == 0) return p;
+    }
+
+    int id = -1;
+#pragma omp critical(profileRegistry)
+    {
+        count = atomic_load_explicit(&profilePhaseCount, memory_order_relaxed);
+        for (int p = 0; p < count && id < 0; p++) {
+            if (profilePhases[p].parent == parent && strcmp(profilePhases[p].name, name) == 0) id = p;
+        }
+        if (id < 0 && count < PROFILE_MAX_PHASES) {
+            profilePhases[count] = (ProfilePhase){.name = name, .parent = parent};
+            atomic_store_explicit(&profilePhaseCount, count + 1, memory_order_release);
+            id = count;
+        }
+    }
+    return id;
+}
+
+static int ProfileCounterId(const char *name) {
+    int count = atomic_load_explicit(&profileCounterCount, memory_order_acquire);
+    for (int c = 0; c < count; c++) {
+        if (strcmp(profileCounters[c].name, name) == 0) return c;
+    }
+
+    int id = -1;
+#pragma omp critical(profileRegistry)
+    {
+        count = atomic_load_explicit(&profileCounterCount, memory_order_relaxed);
+        for (int c = 0; c < count && id < 0; c++) {
+            if (strcmp(profileCounters[c].name, name) == 0) id = c;
+        }
+        if (id < 0 && count < PROFILE_MAX_COUNTERS) {
+            profileCounters[count] = (ProfileCounter){.name = name};
+            atomic_store_explicit(&profileCounterCount, count + 1, memory_order_release);
+            id = count;
+        }
+    }
+    return id;
+}
+
+typedef struct {
+    int phase;
+    double start;
+} ProfileScope;
+
+static inline ProfileScope ProfileEnter(const char *name) {
+    ProfileThread *thread = profileSlot;
+    if (thread == NULL) return (ProfileScope){.phase = -1};
+    const int phase = ProfilePhaseId(name, thread->stack[thread->depth]);
+    if (phase >= 0 && thread->depth + 1 < PROFILE_MAX_DEPTH) {
+        thread->stack[++thread->depth] = phase;
+    }
+    return (ProfileScope){.phase = phase, .start = ProfileNow()};
+}
+
+static inline void ProfileExit(ProfileScope scope) {
+    if (scope.phase < 0) return;
+    const double end = ProfileNow();
+    ProfileThread *thread = profileSlot;
+    thread->phaseTime[scope.phase] += end - scope.start;
+    if (thread->stack[thread->depth] == scope.phase) thread->depth--;
+}
+
+static inline void ProfileCount(int counter, long long amount) {
+    if (counter >= 0 && profileSlot != NULL) profileSlot->counters[counter] += amount;
+}
+
+/**
+ * @brief Turns the per-thread times and counters of the frame into samples and clears them. Only one
+ * thread may run it, after every thread is done with the frame. Does nothing without a profile.
+ */
+static void ProfileFrameEnd(Profile *profile) {
+    if (profile == NULL) return;
+    const int phases = atomic_load(&profilePhaseCount);
+    const int counters = atomic_load(&profileCounterCount);
+
+    for (int p = 0; p < phases; p++) {
+        ProfileSamples *phase = &profile->phases[p];
+        double max = 0, sum = 0;
+        int entered = 0;
+        for (int t = 0; t < profile->threadCount; t++) {
+            const double time = profile->threads[t].phaseTime[p];
+            profile->threads[t].phaseTime[p] = 0;
+            if (time <= 0) continue;
+            entered++;
+            sum += time;
+            if (time > max) max = time;
+        }
+        if (entered == 0) continue;
+
+        if (phase->sampleCount == phase->sampleCapacity) {
+            const long capacity = phase->sampleCapacity > 0 ? phase->sampleCapacity * 2 : 1024;
+            double *samples = realloc(phase->samples, capacity * sizeof(double));
+            if (samples == NULL) continue;
+            phase->samples = samples;
+            phase->sampleCapacity = capacity;
+        }
+        phase->samples[phase->sampleCount++] = max;
+        const double imbalance = max / (sum / entered);
+        phase->imbalanceSum += imbalance;
+        if (imbalance > phase->imbalanceMax) phase->imbalanceMax = imbalance;
+    }
+
+    for (int c = 0; c < counters; c++) {
+        long long frame = 0;
+        for (int t = 0; t < profile->threadCount; t++) {
+            frame += profile->threads[t].counters[c];
+            profile->threads[t].counters[c] = 0;
+        }
+        profile->counters[c].total += frame;
+        if (frame > profile->counters[c].frameMax) profile->counters[c].frameMax = frame;
+    }
+    profile->frames++;
+}
+
+static int ProfileCompareDoubles(const void *a, const void *b) {
+    const double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double ProfilePercentile(const double *sorted, long count, double percentile) {
+    // nearest rank
+    long rank = (long) (percentile / 100.0 * count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+static void ProfilePrintPath(FILE *file, int phase) {
+    if (profilePhases[phase].parent >= 0) {
+        ProfilePrintPath(file, profilePhases[phase].parent);
+        fputc('/', file);
+    }
+    fputs(profilePhases[phase].name, file);
+}
+
+/**
+ * @brief Writes the statistics of profile to path, does nothing without a profile. Sorts the samples.
+ */
+static void ProfileDump(Profile *profile, const char *path) {
+    if (profile == NULL) return;
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("Failed to write profile");
+        return;
+    }
+
+    fprintf(file, "{\n  \"clock\": \"%s\",\n  \"threads\": %d,\n  \"frames\": %ld,\n  \"phases\": [",
+#if defined(BOIDS_PROFILE_RDTSC) && defined(__x86_64__)
+            "rdtsc",
+#else
+            "omp_get_wtime",
+#endif
+            profile->threadCount, profile->frames);
+
+    const int phases = atomic_load(&profilePhaseCount);
+    for (int p = 0; p < phases; p++) {
+        ProfileSamples *phase = &profile->phases[p];
+        const long n = phase->sampleCount;
+        double total = 0;
+        for (long k = 0; k < n; k++) total += phase->samples[k];
+        if (n > 0) qsort(phase->samples, n, sizeof(double), ProfileCompareDoubles);
+
+        fprintf(file, "%s\n    {\"path\": \"", p > 0 ? "," : "");
+        ProfilePrintPath(file, p);
+        fprintf(file, "\", \"name\": \"%s\", \"parent\": %d, \"frames\": %ld, \"total\": %.9f, "
+                      "\"mean\": %.9f, \"p50\": %.9f, \"p95\": %.9f, \"p99\": %.9f, \"max\": %.9f, "
+                      "\"imbalance_mean\": %.4f, \"imbalance_max\": %.4f}",
+                profilePhases[p].name, profilePhases[p].parent, n, total, n > 0 ? total / n : 0,
+                n > 0 ? ProfilePercentile(phase->samples, n, 50) : 0,
+                n > 0 ? ProfilePercentile(phase->samples, n, 95) : 0,
+                n > 0 ? ProfilePercentile(phase->samples, n, 99) : 0,
+                n > 0 ? phase->samples[n - 1] : 0,
+                n > 0 ? phase->imbalanceSum / n : 0, phase->imbalanceMax);
+    }
+
+    fprintf(file, "\n  ],\n  \"counters\": [");
+    const int counters = atomic_load(&profileCounterCount);
+    for (int c = 0; c < counters; c++) {
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"total\": %lld, \"per_frame_mean\": %.3f, "
+                      "\"per_frame_max\": %lld}",
+                c > 0 ? "," : "", profileCounters[c].name, profile->counters[c].total,
+                (double) profile->counters[c].total / (profile->frames > 0 ? profile->frames : 1),
+                profile->counters[c].frameMax);
+    }
+    fprintf(file, "\n  ]\n}\n");
+    fclose(file);
+}
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#define PROFILE_CREATE(threads) ProfileCreate(threads)
+#define PROFILE_FREE(profile) ProfileFree(profile)
+#define PROFILE_BIND(profile, id) ProfileBind(profile, id)
+#define PROFILE_DUMP(profile, path) ProfileDump(profile, path)
+
+#define PROFILE_SCOPE(name) \
+for (ProfileScope PROFILE_CONCAT(__scope, __LINE__) = ProfileEnter(name), *PROFILE_CONCAT(__once, __LINE__) = &PROFILE_CONCAT(__scope, __LINE__); \
+PROFILE_CONCAT(__once, __LINE__) != NULL; \
+ProfileExit(PROFILE_CONCAT(__scope, __LINE__)), PROFILE_CONCAT(__once, __LINE__) = NULL)
+
+// the id is looked up once per call site, counters sit in hot loops
+#define PROFILE_COUNT(name, amount) \
+do { \
+    static atomic_int PROFILE_CONCAT(__counter, __LINE__) = -2; \
+    int __id = atomic_load_explicit(&PROFILE_CONCAT(__counter, __LINE__), memory_order_relaxed); \
+    if (__id == -2) { \
+        __id = ProfileCounterId(name); \
+        atomic_store_explicit(&PROFILE_CONCAT(__counter, __LINE__), __id, memory_order_relaxed); \
+    } \
+    ProfileCount(__id, amount); \
+} while (0)
+
+#define PROFILE_FRAME_END(profile) \
+_Pragma("omp barrier") \
+_Pragma("omp single") \
+ProfileFrameEnd(profile);
+
+#else
+
+// only ever a NULL pointer without the profiler
+typedef struct Profile Profile;
+
+#define PROFILE_CREATE(threads) ((Profile *) NULL)
+#define PROFILE_FREE(profile) ((void) 0)
+#define PROFILE_BIND(profile, id) ((void) 0)
+#define PROFILE_DUMP(profile, path) ((void) 0)
+#define PROFILE_SCOPE(name) if (1)
+#define PROFILE_COUNT(name, amount) ((void) 0)
+#define PROFILE_FRAME_END(profile)
+
+#endif //BOIDS_PROFILE
+
 #endif //BOIDS_EXECISE_TIMEIT_H
\ No newline at end of file
@@ -0,0 +1,362 @@
+//
+// Created by leonardo on 06/12/25.
+//
+
+#ifndef BOIDS_EXECISE_TRAJECTORY_H
+#define BOIDS_EXECISE_TRAJECTORY_H
+
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Trajectory streams are written little-endian straight from memory"
+#endif
+
+#define TRAJECTORY_MAGIC "BOIDTRAJ"
+#define TRAJECTORY_INDEX_MAGIC "TRAJINDX"
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_FRAME_SYNC 0x4d415246u  // "FRAM", lets a reader resync on a truncated stream
+#define TRAJECTORY_SLOTS 8
+#define TRAJECTORY_VELOCITY_SCALE 1000.0f  // velocities are stored in thousandths when they fit an int16
+#define TRAJECTORY_BATCH_BYTES ((size_t) 1 << 20)
+
+/**
+ * Stream layout, all little-endian:
+ *  - TrajectoryHeader
+ *  - one TrajectoryFrame per recorded frame, followed by payloadBytes of payload: the positions as
+ *    (x, y) pairs of uint16 fixed point fractions of worldSize, then the velocities as zigzag varints
+ *    of the difference from the previous recorded frame, or from 0 on a keyframe
+ *  - the index, a (frame, offset) pair of uint64 for every keyframe, and a TrajectoryTrailer
+ * A reader seeks to a frame by finding the keyframe before it in the index and decoding forward.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t boidCount;       // boids in every frame
+    uint32_t boidStride;      // the k-th stored boid has id k * boidStride
+    uint32_t frameEvery;      // every how many simulation frames one is stored
+    uint32_t keyframeInterval;
+    float worldSize;
+    float velocityScale;
+    uint32_t unused;
+} TrajectoryHeader;
+
+typedef struct {
+    uint32_t sync;
+    uint32_t frame;
+    uint32_t keyframe;
+    uint32_t payloadBytes;
+} TrajectoryFrame;
+
+typedef struct {
+    uint64_t indexOffset;
+    uint64_t indexEntries;
+    char magic[8];
+} TrajectoryTrailer;
+
+/**
+ * One frame waiting for the writer, already quantized by the simulation threads.
+ */
+typedef struct {
+    uint32_t frame;
+    uint16_t *positions;
+    int16_t *velocities;
+} TrajectorySlot;
+
+/**
+ * @brief Single producer, single consumer ring of frames between the simulation and a writer
+ * thread that encodes them and batches the write() calls.
+ */
+typedef struct {
+    int fd;
+    TrajectoryHeader header;
+    TrajectorySlot slots[TRAJECTORY_SLOTS];
+    _Alignas(64) atomic_ulong head;   // frames published by the simulation
+    _Alignas(64) atomic_ulong tail;   // frames consumed by the writer
+    atomic_int done;
+    pthread_t thread;
+    // owned by the writer thread
+    int16_t *previousVelocities;
+    unsigned char *batch;
+    size_t batchBytes;
+    size_t batchCapacity;
+    uint64_t offset;
+    uint64_t *index;
+    uint64_t indexEntries;
+    uint64_t indexCapacity;
+    uint64_t framesWritten;
+    int failed;
+    // owned by the simulation
+    long stalls;       // times the ring was full and the simulation had to wait
+    double stallTime;
+} TrajectorySink;
+
+static inline uint16_t TrajectoryQuantizePosition(float position, float worldSize) {
+    return (uint16_t) ((uint32_t) (position / worldSize * 65536.0f) & 0xffff);
+}
+
+/**
+ * @return the scale velocities are stored with, thousandths unless components of up to maxVelocity would
+ * not fit an int16 that way.
+ */
+static inline float TrajectoryVelocityScale(float maxVelocity) {
+    return maxVelocity * TRAJECTORY_VELOCITY_SCALE <= INT16_MAX ? TRAJECTORY_VELOCITY_SCALE
+                                                                 : INT16_MAX / maxVelocity;
+}
+
+static inline int16_t TrajectoryQuantizeVelocity(float velocity, float velocityScale) {
+    float scaled = velocity * velocityScale;
+    if (scaled > INT16_MAX) scaled = INT16_MAX;
+    if (scaled < INT16_MIN) scaled = INT16_MIN;
+    return (int16_t) lrintf(scaled);
+}
+
+static int TrajectoryReserve(TrajectorySink *sink, size_t bytes) {
+    if (sink->batchBytes + bytes <= sink->batchCapacity) return 0;
+    size_t capacity = sink->batchCapacity * 2;
+    while (capacity < sink->batchBytes + bytes) capacity *= 2;
+    unsigned char *batch = realloc(sink->batch, capacity);
+    if (batch == NULL) return -1;
+    sink->batch = batch;
+    sink->batchCapacity = capacity;
+    return 0;
+}
+
+static int TrajectoryFlush(TrajectorySink *sink) {
+    const unsigned char *cursor = sink->batch;
+    size_t left = sink->batchBytes;
+    while (left > 0) {
+        const ssize_t written = write(sink->fd, cursor, left);
+        if (written < 0) return -1;
+        cursor += written;
+        left -= written;
+    }
+    sink->batchBytes = 0;
+    return 0;
+}
+
+static inline unsigned char *TrajectoryPutVarint(unsigned char *out, int value) {
+    uint32_t zigzag = ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+    while (zigzag >= 0x80) {
+        *out++ = (unsigned char) (zigzag | 0x80);
+        zigzag >>= 7;
+    }
+    *out++ = (unsigned char) zigzag;
+    return out;
+}
+
+static int TrajectoryEncode(TrajectorySink *sink, const TrajectorySlot *slot) {
+    const uint32_t count = sink->header.boidCount;
+    const int keyframe = sink->framesWritten % sink->header.keyframeInterval == 0;
+    const size_t positionBytes = (size_t) count * 2 * sizeof(uint16_t);
+
+    // a varint of a 16 bit difference takes at most 3 bytes
+    if (TrajectoryReserve(sink, sizeof(TrajectoryFrame) + positionBytes + (size_t) count * 2 * 3) < 0) return -1;
+
+    if (keyframe) {
+        if (sink->indexEntries == sink->indexCapacity) {
+            const uint64_t capacity = sink->indexCapacity > 0 ? sink->indexCapacity * 2 : 256;
+            uint64_t *index = realloc(sink->index, capacity * 2 * sizeof(uint64_t));
+            if (index == NULL) return -1;
+            sink->index = index;
+            sink->indexCapacity = capacity;
+        }
+        sink->index[2 * sink->indexEntries] = slot->frame;
+        sink->index[2 * sink->indexEntries + 1] = sink->offset + sink->batchBytes;
+        sink->indexEntries++;
+        memset(sink->previousVelocities, 0, (size_t) count * 2 * sizeof(int16_t));
+    }
+
+    unsigned char *record = sink->batch + sink->batchBytes;
+    unsigned char *payload = record + sizeof(TrajectoryFrame);
+    memcpy(payload, slot->positions, positionBytes);
+
+    unsigned char *out = payload + positionBytes;
+    for (uint32_t k = 0; k < count * 2; k++) {
+        out = TrajectoryPutVarint(out, slot->velocities[k] - sink->previousVelocities[k]);
+        sink->previousVelocities[k] = slot->velocities[k];
+    }
+
+    const TrajectoryFrame frame = {
+        .sync = TRAJECTORY_FRAME_SYNC,
+        .frame = slot->frame,
+        .keyframe = keyframe,
+        .payloadBytes = (uint32_t) (out - payload)
+    };
+    memcpy(record, &frame, sizeof(frame));
+    sink->batchBytes = out - sink->batch;
+    sink->framesWritten++;
+
+    if (sink->batchBytes >= TRAJECTORY_BATCH_BYTES) {
+        sink->offset += sink->batchBytes;
+        return TrajectoryFlush(sink);
+    }
+    return 0;
+}
+
+static void *TrajectoryWriterRun(void *argument) {
+    TrajectorySink *sink = argument;
+    const struct timespec nap = {.tv_nsec = 100000};
+
+    for (;;) {
+        const unsigned long tail = atomic_load_explicit(&sink->tail, memory_order_relaxed);
+        if (tail == atomic_load_explicit(&sink->head, memory_order_acquire)) {
+            // done is set after the last publish, so one more look at head catches the last frames
+            if (atomic_load_explicit(&sink->done, memory_order_acquire) &&
+                tail == atomic_load_explicit(&sink->head, memory_order_acquire)) {
+                break;
+            }
+            nanosleep(&nap, NULL);
+            continue;
+        }
+
+        if (!sink->failed && TrajectoryEncode(sink, &sink->slots[tail % TRAJECTORY_SLOTS]) < 0) {
+            perror("Failed to write trajectory");
+            sink->failed = 1;
+        }
+        atomic_store_explicit(&sink->tail, tail + 1, memory_order_release);
+    }
+
+    if (!sink->failed) {
+        sink->offset += sink->batchBytes;
+        const TrajectoryTrailer trailer = {
+            .indexOffset = sink->offset,
+            .indexEntries = sink->indexEntries
+        };
+        if (TrajectoryFlush(sink) < 0 ||
+            TrajectoryReserve(sink, sink->indexEntries * 2 * sizeof(uint64_t) + sizeof(trailer)) < 0) {
+            perror("Failed to write trajectory index");
+            sink->failed = 1;
+            return NULL;
+        }
+        memcpy(sink->batch, sink->index, sink->indexEntries * 2 * sizeof(uint64_t));
+        sink->batchBytes = sink->indexEntries * 2 * sizeof(uint64_t);
+        memcpy(sink->batch + sink->batchBytes, &trailer, sizeof(trailer));
+        memcpy(sink->batch + sink->batchBytes + offsetof(TrajectoryTrailer, magic), TRAJECTORY_INDEX_MAGIC, 8);
+        sink->batchBytes += sizeof(trailer);
+        if (TrajectoryFlush(sink) < 0) {
+            perror("Failed to write trajectory index");
+            sink->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+static void TrajectorySinkFreeBuffers(TrajectorySink *sink) {
+    for (int s = 0; s < TRAJECTORY_SLOTS; s++) {
+        free(sink->slots[s].positions);
+        free(sink->slots[s].velocities);
+    }
+    free(sink->previousVelocities);
+    free(sink->batch);
+    free(sink->index);
+}
+
+/**
+ * @brief Opens the stream, writes its header and starts the writer thread.
+ * @param boidCount number of boids in the simulation, every boidStride-th of them is stored
+ * @param maxVelocity largest velocity component the simulation produces, it picks the velocity scale
+ * @return 0 on success, -1 with nothing left to free on failure
+ */
+static int TrajectorySinkOpen(TrajectorySink *sink, const char *path, int boidCount, int boidStride,
+                              int frameEvery, int keyframeInterval, float worldSize, float maxVelocity) {
+    *sink = (TrajectorySink){
+        .header = {
+            .version = TRAJECTORY_VERSION,
+            .boidCount = (boidCount + boidStride - 1) / boidStride,
+            .boidStride = boidStride,
+            .frameEvery = frameEvery,
+            .keyframeInterval = keyframeInterval,
+            .worldSize = worldSize,
+            .velocityScale = TrajectoryVelocityScale(maxVelocity)
+        },
+        .batchCapacity = 2 * TRAJECTORY_BATCH_BYTES
+    };
+    memcpy(sink->header.magic, TRAJECTORY_MAGIC, sizeof(sink->header.magic));
+    atomic_init(&sink->head, 0);
+    atomic_init(&sink->tail, 0);
+    atomic_init(&sink->done, 0);
+
+    const size_t components = (size_t) sink->header.boidCount * 2;
+    int allocated = (sink->previousVelocities = malloc(components * sizeof(int16_t))) != NULL &&
+                    (sink->batch = malloc(sink->batchCapacity)) != NULL;
+    for (int s = 0; allocated && s < TRAJECTORY_SLOTS; s++) {
+        sink->slots[s].positions = malloc(components * sizeof(uint16_t));
+        sink->slots[s].velocities = malloc(components * sizeof(int16_t));
+        allocated = sink->slots[s].positions != NULL && sink->slots[s].velocities != NULL;
+    }
+    if (!allocated) {
+        perror("Failed to allocate trajectory buffers");
+        TrajectorySinkFreeBuffers(sink);
+        return -1;
+    }
+
+    sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (sink->fd < 0) {
+        perror("Failed to open trajectory");
+        TrajectorySinkFreeBuffers(sink);
+        return -1;
+    }
+    memcpy(sink->batch, &sink->header, sizeof(sink->header));
+    sink->batchBytes = sizeof(sink->header);
+
+    if (pthread_create(&sink->thread, NULL, TrajectoryWriterRun, sink) != 0) {
+        perror("Failed to start trajectory writer");
+        close(sink->fd);
+        TrajectorySinkFreeBuffers(sink);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the slot for the next frame, waiting for the writer if the ring is full.
+ * Only one thread may produce.
+ */
+static TrajectorySlot *TrajectorySinkAcquire(TrajectorySink *sink) {
+    const unsigned long head = atomic_load_explicit(&sink->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&sink->tail, memory_order_acquire) == TRAJECTORY_SLOTS) {
+        struct timespec start, now;
+        const struct timespec nap = {.tv_nsec = 50000};
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (head - atomic_load_explicit(&sink->tail, memory_order_acquire) == TRAJECTORY_SLOTS) {
+            nanosleep(&nap, NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        sink->stalls++;
+        sink->stallTime += (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) * 1e-9;
+    }
+    return &sink->slots[head % TRAJECTORY_SLOTS];
+}
+
+/**
+ * @brief Hands the slot returned by the last TrajectorySinkAcquire to the writer.
+ */
+static void TrajectorySinkPublish(TrajectorySink *sink, uint32_t frame) {
+    const unsigned long head = atomic_load_explicit(&sink->head, memory_order_relaxed);
+    sink->slots[head % TRAJECTORY_SLOTS].frame = frame;
+    atomic_store_explicit(&sink->head, head + 1, memory_order_release);
+}
+
+/**
+ * @brief Lets the writer drain the ring, writes the index and closes the stream.
+ * @return 0 if every frame made it to the file
+ */
+static int TrajectorySinkClose(TrajectorySink *sink) {
+    atomic_store_explicit(&sink->done, 1, memory_order_release);
+    pthread_join(sink->thread, NULL);
+    if (close(sink->fd) < 0) sink->failed = 1;
+    TrajectorySinkFreeBuffers(sink);
+    return sink->failed ? -1 : 0;
+}
+
+#endif //BOIDS_EXECISE_TRAJECTORY_H
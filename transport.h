@@ -0,0 +1,76 @@
+//
+// Created by leonardo on 04/12/25.
+//
+
+#ifndef BOIDS_EXECISE_TRANSPORT_H
+#define BOIDS_EXECISE_TRANSPORT_H
+
+#include <stddef.h>
+
+/**
+ * Neighbour directions in the ring of processes, rank r talks to r - 1 (left) and r + 1 (right),
+ * both modulo the number of ranks, like the grid wraps around the world.
+ */
+enum {
+    TRANSPORT_LEFT = 0,
+    TRANSPORT_RIGHT = 1
+};
+
+typedef enum {
+    TRANSPORT_SUM,
+    TRANSPORT_MAX
+} TransportOp;
+
+/**
+ * @brief A growable byte buffer, the transport reallocates data when a message doesn't fit.
+ */
+typedef struct {
+    void *data;
+    size_t bytes;
+    size_t capacity;
+} TransportBuffer;
+
+typedef struct Transport Transport;
+
+struct Transport {
+    int rank;
+    int size;
+
+    /**
+     * @brief Sends out[d] to the neighbour in direction d and receives what that neighbour sent
+     * towards us into in[d]. Collective, every rank must call it.
+     * @return 0 on success, -1 if a neighbour went away.
+     */
+    int (*exchange)(Transport *transport, const TransportBuffer out[2], TransportBuffer in[2]);
+
+    /**
+     * @brief Combines one value from every rank, everyone gets the result. Collective.
+     */
+    double (*reduce)(Transport *transport, double value, TransportOp op);
+
+    /**
+     * @brief Releases the transport. The process that launched the others waits for them here.
+     */
+    void (*destroy)(Transport *transport);
+
+    void *impl;
+};
+
+/**
+ * @brief Forks size - 1 processes that talk through POSIX shared memory mailboxes, with Unix
+ * sockets to signal when a mailbox is full or drained. Returns in every process with its rank,
+ * the caller is rank 0.
+ * @return NULL on failure, in the calling process only.
+ */
+Transport *TransportShmLaunch(int size);
+
+#ifdef BOIDS_WITH_MPI
+/**
+ * @brief Wraps MPI_COMM_WORLD, the processes are started by mpirun.
+ */
+Transport *TransportMpiCreate(int *argc, char ***argv);
+#endif
+
+int TransportBufferReserve(TransportBuffer *buffer, size_t bytes);
+
+#endif //BOIDS_EXECISE_TRANSPORT_H
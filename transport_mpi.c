@@ -0,0 +1,79 @@
+//
+// Created by leonardo on 04/12/25.
+//
+
+#include "transport.h"
+
+#include <limits.h>
+#include <mpi.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int MpiNeighbour(const Transport *transport, const int direction) {
+    const int step = direction == TRANSPORT_LEFT ? -1 : 1;
+    return (transport->rank + step + transport->size) % transport->size;
+}
+
+/**
+ * Messages are tagged with the direction they travel in, so with two ranks, where the left and right
+ * neighbour are the same process, the two halves of the exchange don't get mixed up.
+ */
+static int MpiExchange(Transport *transport, const TransportBuffer out[2], TransportBuffer in[2]) {
+    MPI_Request requests[4];
+    uint64_t outBytes[2] = {out[0].bytes, out[1].bytes};
+    uint64_t inBytes[2];
+
+    for (int d = 0; d < 2; d++) {
+        MPI_Irecv(&inBytes[d], 1, MPI_UINT64_T, MpiNeighbour(transport, d), 1 - d, MPI_COMM_WORLD, &requests[d]);
+        MPI_Isend(&outBytes[d], 1, MPI_UINT64_T, MpiNeighbour(transport, d), d, MPI_COMM_WORLD, &requests[2 + d]);
+    }
+    if (MPI_Waitall(4, requests, MPI_STATUSES_IGNORE) != MPI_SUCCESS) return -1;
+
+    for (int d = 0; d < 2; d++) {
+        if (inBytes[d] > INT_MAX || outBytes[d] > INT_MAX) {
+            fprintf(stderr, "Halo message too large for MPI\n");
+            return -1;
+        }
+        if (TransportBufferReserve(&in[d], inBytes[d]) < 0) return -1;
+        in[d].bytes = inBytes[d];
+    }
+
+    for (int d = 0; d < 2; d++) {
+        MPI_Irecv(in[d].data, (int) inBytes[d], MPI_BYTE, MpiNeighbour(transport, d), 1 - d, MPI_COMM_WORLD,
+                  &requests[d]);
+        MPI_Isend(out[d].data, (int) outBytes[d], MPI_BYTE, MpiNeighbour(transport, d), d, MPI_COMM_WORLD,
+                  &requests[2 + d]);
+    }
+    return MPI_Waitall(4, requests, MPI_STATUSES_IGNORE) == MPI_SUCCESS ? 0 : -1;
+}
+
+static double MpiReduce(Transport *transport, const double value, const TransportOp op) {
+    (void) transport;
+    double result;
+    MPI_Allreduce(&value, &result, 1, MPI_DOUBLE, op == TRANSPORT_SUM ? MPI_SUM : MPI_MAX, MPI_COMM_WORLD);
+    return result;
+}
+
+static void MpiDestroy(Transport *transport) {
+    MPI_Finalize();
+    free(transport);
+}
+
+Transport *TransportMpiCreate(int *argc, char ***argv) {
+    Transport *transport = calloc(1, sizeof(Transport));
+    if (transport == NULL) {
+        perror("Failed to allocate transport");
+        return NULL;
+    }
+
+    int provided;
+    MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &transport->rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &transport->size);
+
+    transport->exchange = MpiExchange;
+    transport->reduce = MpiReduce;
+    transport->destroy = MpiDestroy;
+    return transport;
+}
@@ -0,0 +1,314 @@
+//
+// Created by leonardo on 04/12/25.
+//
+
+#define _GNU_SOURCE
+
+#include "transport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAILBOX_BYTES ((size_t) 1 << 20)
+#define MAX_RANKS 256
+
+/**
+ * Shared between all ranks. Every rank owns two mailboxes, one per direction, and only ever writes
+ * into its own. The reader is told over the socket of that link when a chunk is ready and answers
+ * with an ack once it copied it out, so the mailbox can be refilled.
+ */
+typedef struct {
+    pthread_barrier_t barrier;
+    double values[MAX_RANKS];
+} ShmHeader;
+
+typedef enum {
+    MESSAGE_SIZE,
+    MESSAGE_CHUNK,
+    MESSAGE_ACK
+} MessageType;
+
+typedef struct {
+    uint32_t type;
+    uint32_t unused;
+    uint64_t bytes;
+} Message;
+
+typedef struct {
+    ShmHeader *header;
+    char *mailboxes;
+    size_t mappingBytes;
+    int links[2];      // socket to the left and right neighbour
+    pid_t *children;   // only on rank 0
+} ShmTransport;
+
+int TransportBufferReserve(TransportBuffer *buffer, const size_t bytes) {
+    if (bytes <= buffer->capacity) return 0;
+
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (capacity < bytes) capacity *= 2;
+
+    void *data = realloc(buffer->data, capacity);
+    if (data == NULL) {
+        perror("Failed to grow transport buffer");
+        return -1;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+static char *Mailbox(const ShmTransport *shm, const int rank, const int direction) {
+    return shm->mailboxes + ((size_t) rank * 2 + direction) * MAILBOX_BYTES;
+}
+
+static int Neighbour(const Transport *transport, const int direction) {
+    const int step = direction == TRANSPORT_LEFT ? -1 : 1;
+    return (transport->rank + step + transport->size) % transport->size;
+}
+
+static int SendMessage(const int fd, const MessageType type, const uint64_t bytes) {
+    const Message message = {.type = type, .bytes = bytes};
+    const char *cursor = (const char *) &message;
+    size_t left = sizeof(message);
+    while (left > 0) {
+        const ssize_t sent = send(fd, cursor, left, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return -1;
+        cursor += sent;
+        left -= sent;
+    }
+    return 0;
+}
+
+static int ReceiveMessage(const int fd, const MessageType type, uint64_t *bytes) {
+    Message message;
+    char *cursor = (char *) &message;
+    size_t left = sizeof(message);
+    while (left > 0) {
+        const ssize_t received = recv(fd, cursor, left, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return -1;
+        cursor += received;
+        left -= received;
+    }
+    if (message.type != type) return -1;
+    if (bytes != NULL) *bytes = message.bytes;
+    return 0;
+}
+
+static size_t ChunkCount(const size_t bytes) {
+    return (bytes + MAILBOX_BYTES - 1) / MAILBOX_BYTES;
+}
+
+/**
+ * Every link runs the same lock step on both ends: in round k each side posts its k-th chunk if it has
+ * one, copies out and acks the peer's k-th chunk, then waits for the ack of its own. Posting never
+ * blocks, so a rank only ever waits on a neighbour that is at most one round behind.
+ */
+static int ShmExchange(Transport *transport, const TransportBuffer out[2], TransportBuffer in[2]) {
+    ShmTransport *shm = transport->impl;
+    size_t outChunks[2], inChunks[2];
+    size_t rounds = 0;
+
+    for (int d = 0; d < 2; d++) {
+        if (SendMessage(shm->links[d], MESSAGE_SIZE, out[d].bytes) < 0) return -1;
+    }
+    for (int d = 0; d < 2; d++) {
+        uint64_t bytes;
+        if (ReceiveMessage(shm->links[d], MESSAGE_SIZE, &bytes) < 0) return -1;
+        if (TransportBufferReserve(&in[d], bytes) < 0) return -1;
+        in[d].bytes = bytes;
+
+        outChunks[d] = ChunkCount(out[d].bytes);
+        inChunks[d] = ChunkCount(in[d].bytes);
+        if (outChunks[d] > rounds) rounds = outChunks[d];
+        if (inChunks[d] > rounds) rounds = inChunks[d];
+    }
+
+    for (size_t k = 0; k < rounds; k++) {
+        const size_t offset = k * MAILBOX_BYTES;
+
+        for (int d = 0; d < 2; d++) {
+            if (k >= outChunks[d]) continue;
+            const size_t bytes = out[d].bytes - offset < MAILBOX_BYTES ? out[d].bytes - offset : MAILBOX_BYTES;
+            memcpy(Mailbox(shm, transport->rank, d), (const char *) out[d].data + offset, bytes);
+            if (SendMessage(shm->links[d], MESSAGE_CHUNK, bytes) < 0) return -1;
+        }
+
+        for (int d = 0; d < 2; d++) {
+            if (k >= inChunks[d]) continue;
+            uint64_t bytes;
+            if (ReceiveMessage(shm->links[d], MESSAGE_CHUNK, &bytes) < 0) return -1;
+            // the neighbour on our left sent this through its right mailbox and vice versa
+            memcpy((char *) in[d].data + offset, Mailbox(shm, Neighbour(transport, d), 1 - d), bytes);
+            if (SendMessage(shm->links[d], MESSAGE_ACK, 0) < 0) return -1;
+        }
+
+        for (int d = 0; d < 2; d++) {
+            if (k >= outChunks[d]) continue;
+            if (ReceiveMessage(shm->links[d], MESSAGE_ACK, NULL) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+static double ShmReduce(Transport *transport, const double value, const TransportOp op) {
+    ShmTransport *shm = transport->impl;
+
+    shm->header->values[transport->rank] = value;
+    pthread_barrier_wait(&shm->header->barrier);
+
+    double result = shm->header->values[0];
+    for (int r = 1; r < transport->size; r++) {
+        const double v = shm->header->values[r];
+        result = op == TRANSPORT_SUM ? result + v : (v > result ? v : result);
+    }
+
+    // nobody may overwrite its slot before everyone read it
+    pthread_barrier_wait(&shm->header->barrier);
+    return result;
+}
+
+static void ShmDestroy(Transport *transport) {
+    ShmTransport *shm = transport->impl;
+
+    close(shm->links[TRANSPORT_LEFT]);
+    close(shm->links[TRANSPORT_RIGHT]);
+
+    if (shm->children != NULL) {
+        for (int r = 1; r < transport->size; r++) {
+            int status;
+            if (waitpid(shm->children[r], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "Rank %d did not exit cleanly\n", r);
+            }
+        }
+        pthread_barrier_destroy(&shm->header->barrier);
+        free(shm->children);
+    }
+
+    munmap(shm->header, shm->mappingBytes);
+    free(shm);
+    free(transport);
+}
+
+Transport *TransportShmLaunch(const int size) {
+    if (size < 1 || size > MAX_RANKS) {
+        fprintf(stderr, "Number of ranks must be between 1 and %d\n", MAX_RANKS);
+        return NULL;
+    }
+
+    Transport *transport = calloc(1, sizeof(Transport));
+    ShmTransport *shm = calloc(1, sizeof(ShmTransport));
+    pid_t *children = calloc(size, sizeof(pid_t));
+    int (*edges)[2] = calloc(size, sizeof(int[2]));
+    if (transport == NULL || shm == NULL || children == NULL || edges == NULL) {
+        perror("Failed to allocate transport");
+        goto fail;
+    }
+
+    // the name is only needed until every rank inherited the mapping
+    char name[64];
+    snprintf(name, sizeof(name), "/boids-%d", (int) getpid());
+    const int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        perror("Failed to create shared memory");
+        goto fail;
+    }
+    shm_unlink(name);
+
+    const size_t headerBytes = (sizeof(ShmHeader) + 4095) / 4096 * 4096;
+    shm->mappingBytes = headerBytes + (size_t) size * 2 * MAILBOX_BYTES;
+    if (ftruncate(fd, (off_t) shm->mappingBytes) < 0) {
+        perror("Failed to size shared memory");
+        close(fd);
+        goto fail;
+    }
+    void *mapping = mmap(NULL, shm->mappingBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("Failed to map shared memory");
+        goto fail;
+    }
+    shm->header = mapping;
+    shm->mailboxes = (char *) mapping + headerBytes;
+
+    pthread_barrierattr_t attributes;
+    pthread_barrierattr_init(&attributes);
+    pthread_barrierattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&shm->header->barrier, &attributes, size);
+    pthread_barrierattr_destroy(&attributes);
+
+    // edge e joins the right end of rank e with the left end of rank e + 1
+    for (int e = 0; e < size; e++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, edges[e]) < 0) {
+            perror("Failed to create socket pair");
+            for (int k = 0; k < e; k++) {
+                close(edges[k][0]);
+                close(edges[k][1]);
+            }
+            munmap(mapping, shm->mappingBytes);
+            goto fail;
+        }
+    }
+
+    int rank = 0;
+    for (int r = 1; r < size; r++) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            // the ranks already started will see their links close and bail out
+            perror("Failed to fork rank");
+            for (int e = 0; e < size; e++) {
+                close(edges[e][0]);
+                close(edges[e][1]);
+            }
+            for (int k = 1; k < r; k++) waitpid(children[k], NULL, 0);
+            munmap(mapping, shm->mappingBytes);
+            goto fail;
+        }
+        if (pid == 0) {
+            rank = r;
+            break;
+        }
+        children[r] = pid;
+    }
+
+    const int leftEdge = (rank - 1 + size) % size;
+    shm->links[TRANSPORT_RIGHT] = edges[rank][0];
+    shm->links[TRANSPORT_LEFT] = edges[leftEdge][1];
+    for (int e = 0; e < size; e++) {
+        if (edges[e][0] != shm->links[TRANSPORT_RIGHT]) close(edges[e][0]);
+        if (edges[e][1] != shm->links[TRANSPORT_LEFT]) close(edges[e][1]);
+    }
+    free(edges);
+
+    if (rank == 0) {
+        shm->children = children;
+    } else {
+        free(children);
+    }
+
+    transport->rank = rank;
+    transport->size = size;
+    transport->exchange = ShmExchange;
+    transport->reduce = ShmReduce;
+    transport->destroy = ShmDestroy;
+    transport->impl = shm;
+    return transport;
+
+fail:
+    free(edges);
+    free(children);
+    free(shm);
+    free(transport);
+    return NULL;
+}
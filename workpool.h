@@ -0,0 +1,237 @@
+//
+// Created by leonardo on 14/12/25.
+//
+
+#ifndef BOIDS_EXECISE_WORKPOOL_H
+#define BOIDS_EXECISE_WORKPOOL_H
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <omp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * A persistent pool of pinned pthreads, the alternative to the OpenMP runtime for stepping small flocks
+ * at high frame rates, where the barriers of a frame cost as much as its work. The calling thread is
+ * worker 0, the others are started once and sleep in the pool's barrier between runs.
+ *
+ * Code shared with the OpenMP path asks for its thread and synchronises through TeamThreadNum,
+ * TeamNumThreads and TeamBarrier, which pick the pool a thread is working for, or else OpenMP.
+ */
+
+// spins before a waiting thread parks in the futex, about 10 us of pause instructions
+#define SPIN_BARRIER_SPINS 4000
+// ints between the senses of two threads, one cache line each
+#define SPIN_BARRIER_STRIDE 16
+
+/**
+ * Sense-reversing barrier: the last thread to arrive resets the count and flips the sense, the others
+ * spin on the sense for a while and then sleep on it with a futex. The last thread only calls into the
+ * kernel when somebody is asleep.
+ */
+typedef struct {
+    int arrived;    // threads at the barrier in the current episode
+    int sense;      // flips every time the barrier opens, also the futex word
+    int sleepers;   // threads parked in the futex
+    int threads;
+    int spins;      // 0 when there are more threads than cpus, spinning would only delay the last one
+} SpinBarrier;
+
+static inline void SpinPause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * @param localSense the sense of the calling thread, private to it and to this barrier, starts at 0
+ */
+static void SpinBarrierWait(SpinBarrier *barrier, int *localSense) {
+    const int sense = !*localSense;
+    *localSense = sense;
+
+    if (__atomic_add_fetch(&barrier->arrived, 1, __ATOMIC_ACQ_REL) == barrier->threads) {
+        // nobody arrives for the next episode before seeing the flip, which publishes the reset
+        __atomic_store_n(&barrier->arrived, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&barrier->sense, sense, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&barrier->sleepers, __ATOMIC_SEQ_CST) > 0) {
+            syscall(SYS_futex, &barrier->sense, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+        }
+        return;
+    }
+
+    for (int spin = 0; spin < barrier->spins; spin++) {
+        if (__atomic_load_n(&barrier->sense, __ATOMIC_ACQUIRE) == sense) return;
+        SpinPause();
+    }
+
+    // either the last thread sees us asleep, or we see its flip before sleeping
+    __atomic_add_fetch(&barrier->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&barrier->sense, __ATOMIC_SEQ_CST) != sense) {
+        syscall(SYS_futex, &barrier->sense, FUTEX_WAIT_PRIVATE, !sense, NULL, NULL, 0);
+    }
+    __atomic_sub_fetch(&barrier->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+typedef void (*WorkPoolTask)(void *data);
+
+typedef struct WorkPool WorkPool;
+
+typedef struct {
+    WorkPool *pool;
+    int threadId;
+} WorkPoolWorker;
+
+struct WorkPool {
+    pthread_t *threads;        // threadCount - 1 started threads, worker 0 is whoever calls WorkPoolRun
+    WorkPoolWorker *workers;
+    int *senses;               // per thread, SPIN_BARRIER_STRIDE apart
+    SpinBarrier barrier;
+    WorkPoolTask task;
+    void *taskData;
+    int threadCount;
+    int stop;
+};
+
+// the pool the calling thread works for, NULL on OpenMP threads and outside of WorkPoolRun
+static _Thread_local WorkPool *teamPool;
+static _Thread_local int teamThreadId;
+
+static inline int TeamThreadNum(void) {
+    return teamPool != NULL ? teamThreadId : omp_get_thread_num();
+}
+
+static inline int TeamNumThreads(void) {
+    return teamPool != NULL ? teamPool->threadCount : omp_get_num_threads();
+}
+
+/**
+ * @brief A barrier of the pool the calling thread works for, or an orphaned OpenMP barrier.
+ */
+static inline void TeamBarrier(void) {
+    if (teamPool != NULL) {
+        SpinBarrierWait(&teamPool->barrier, &teamPool->senses[teamThreadId * SPIN_BARRIER_STRIDE]);
+    } else {
+#pragma omp barrier
+    }
+}
+
+static void *WorkPoolThread(void *data) {
+    const WorkPoolWorker *worker = data;
+    teamPool = worker->pool;
+    teamThreadId = worker->threadId;
+    for (;;) {
+        TeamBarrier();  // start of a run
+        if (__atomic_load_n(&teamPool->stop, __ATOMIC_ACQUIRE)) break;
+        teamPool->task(teamPool->taskData);
+        TeamBarrier();  // end of the run
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts threadCount - 1 threads, each pinned to one of the cpus the process may run on, in order
+ * from the second one, so worker 0 can keep the first.
+ * @return the pool, or NULL after printing why it could not be started.
+ */
+static WorkPool *WorkPoolCreate(int threadCount) {
+    WorkPool *pool = calloc(1, sizeof(WorkPool));
+    if (pool == NULL) {
+        perror("Failed to allocate worker pool");
+        return NULL;
+    }
+    pool->threads = malloc(threadCount * sizeof(pthread_t));
+    pool->workers = malloc(threadCount * sizeof(WorkPoolWorker));
+    pool->senses = calloc((size_t) threadCount * SPIN_BARRIER_STRIDE, sizeof(int));
+    if (pool->threads == NULL || pool->workers == NULL || pool->senses == NULL) {
+        perror("Failed to allocate worker pool");
+        free(pool->threads);
+        free(pool->workers);
+        free(pool->senses);
+        free(pool);
+        return NULL;
+    }
+
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int cpuCount = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) cpus[cpuCount++] = cpu;
+        }
+    }
+    pool->threadCount = threadCount;
+    pool->barrier = (SpinBarrier){
+        .threads = threadCount,
+        .spins = threadCount <= cpuCount ? SPIN_BARRIER_SPINS : 0
+    };
+
+    for (int t = 1; t < threadCount; t++) {
+        pool->workers[t] = (WorkPoolWorker){.pool = pool, .threadId = t};
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+        if (cpuCount > 0) {
+            cpu_set_t cpu;
+            CPU_ZERO(&cpu);
+            CPU_SET(cpus[t % cpuCount], &cpu);
+            pthread_attr_setaffinity_np(&attributes, sizeof(cpu), &cpu);
+        }
+        const int error = pthread_create(&pool->threads[t], &attributes, WorkPoolThread, &pool->workers[t]);
+        pthread_attr_destroy(&attributes);
+        if (error != 0) {
+            fprintf(stderr, "Failed to start worker %d of %d\n", t, threadCount);
+            // the started ones wait for a run with the full count, shrink the barrier to release them
+            pool->threadCount = t;
+            pool->barrier.threads = t;
+            pool->stop = 1;
+            int sense = 0;
+            SpinBarrierWait(&pool->barrier, &sense);
+            for (int s = 1; s < t; s++) pthread_join(pool->threads[s], NULL);
+            free(pool->threads);
+            free(pool->workers);
+            free(pool->senses);
+            free(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/**
+ * @brief Runs task(data) on every worker, the calling thread being worker 0, and returns once all of
+ * them finished. The task may call TeamBarrier, as long as every worker reaches it.
+ */
+static void WorkPoolRun(WorkPool *pool, WorkPoolTask task, void *data) {
+    WorkPool *outer = teamPool;
+    const int outerThreadId = teamThreadId;
+    pool->task = task;
+    pool->taskData = data;
+    teamPool = pool;
+    teamThreadId = 0;
+
+    TeamBarrier();  // releases the workers, the barrier publishes the task
+    task(data);
+    TeamBarrier();
+
+    teamPool = outer;
+    teamThreadId = outerThreadId;
+}
+
+static void WorkPoolFree(WorkPool *pool) {
+    if (pool == NULL) return;
+
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+    SpinBarrierWait(&pool->barrier, &pool->senses[0]);
+    for (int t = 1; t < pool->threadCount; t++) pthread_join(pool->threads[t], NULL);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->senses);
+    free(pool);
+}
+
+#endif //BOIDS_EXECISE_WORKPOOL_H